@@ -58,6 +58,28 @@ TEST_F(AhTest, CreateAh) {
   EXPECT_THAT(ah, NotNull());
 }
 
+TEST_F(AhTest, GetOrCreateAhReusesAh) {
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  ibv_ah* ah = ibv_.GetOrCreateAh(setup.pd, setup.port_gid.gid);
+  ASSERT_THAT(ah, NotNull());
+  EXPECT_EQ(ibv_.GetOrCreateAh(setup.pd, setup.port_gid.gid), ah);
+  ibv_pd* other_pd = ibv_.AllocPd(setup.context);
+  ASSERT_THAT(other_pd, NotNull());
+  ibv_ah* other_ah = ibv_.GetOrCreateAh(other_pd, setup.port_gid.gid);
+  ASSERT_THAT(other_ah, NotNull());
+  EXPECT_NE(other_ah, ah);
+}
+
+TEST_F(AhTest, GetOrCreateAhAfterDestroy) {
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  ibv_ah* ah = ibv_.GetOrCreateAh(setup.pd, setup.port_gid.gid);
+  ASSERT_THAT(ah, NotNull());
+  ASSERT_EQ(ibv_.DestroyAh(ah), 0);
+  ah = ibv_.GetOrCreateAh(setup.pd, setup.port_gid.gid);
+  ASSERT_THAT(ah, NotNull());
+  EXPECT_EQ(ibv_.DestroyAh(ah), 0);
+}
+
 TEST_F(AhTest, DeregInvalidAh) {
   if (Introspection().ShouldDeviateForCurrentTest()) {
     GTEST_SKIP() << "transport handling of unknown AH will crash.";
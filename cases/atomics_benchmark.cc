@@ -0,0 +1,400 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+enum class Workload {
+  // Pipelined fetch-and-adds of one, as a sequencer issues them.
+  kFetchAdd,
+  // Increments by compare-and-swap against the last value seen of the word,
+  // retried with the returned value until they succeed.
+  kCasIncrement,
+  // Spin lock acquisitions by compare-and-swap from zero to a token, each
+  // followed by a release swapping the token back to zero.
+  kCasLock,
+};
+
+constexpr std::array<Workload, 3> kWorkloads = {
+    Workload::kFetchAdd, Workload::kCasIncrement, Workload::kCasLock};
+
+absl::string_view WorkloadName(Workload workload) {
+  switch (workload) {
+    case Workload::kFetchAdd:
+      return "fetch_add";
+    case Workload::kCasIncrement:
+      return "cas_increment";
+    case Workload::kCasLock:
+      return "cas_lock";
+  }
+  return "unknown";
+}
+
+// The words targeted by a run, picked uniformly at random for every
+// operation.
+struct Layout {
+  absl::string_view name;
+  uint32_t words;
+  // Bytes between consecutive words.
+  uint32_t stride;
+};
+
+constexpr std::array<Layout, 3> kLayouts = {{
+    {"hot", 1, sizeof(uint64_t)},
+    // Separate cache lines of one page.
+    {"few", 8, 64},
+    // Separate pages.
+    {"spread", 4096, 4096},
+}};
+
+// Drives remote atomics against a single target MR from threads which each
+// own several QPs, for every workload and layout. Reports operations per
+// second and latency percentiles, and for the compare-and-swap workloads the
+// retries per successful operation. The results are checked against the
+// target words after every run: the words add up to the successful increments
+// and every lock is free.
+class AtomicsBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kQpsPerThread = 4;
+  // Outstanding fetch-and-adds per QP, within the default max_rd_atomic.
+  // Compare-and-swaps keep one in flight per QP since each depends on the
+  // previous result.
+  static constexpr int kFetchAddDepth = 4;
+  static constexpr int kSlotsPerThread = kQpsPerThread * kFetchAddDepth;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(100);
+  static constexpr size_t kTargetSize = 4096 * 4096;
+
+  struct Worker {
+    ibv_cq* cq;
+    std::array<ibv_qp*, kQpsPerThread> qps;
+    // One result word per slot.
+    RdmaMemBlock results;
+    ibv_mr* results_mr;
+  };
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock target;
+    ibv_mr* target_mr;
+    ibv_cq* responder_cq;
+    std::vector<Worker> workers;
+  };
+
+  struct Result {
+    uint64_t ops = 0;
+    uint64_t retries = 0;
+    LatencySamples latency;
+    // From the start of the workers until the last outstanding operation
+    // completed, the time over which |ops| were counted.
+    absl::Duration elapsed;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup(int threads) {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.target = ibv_.AllocAlignedBufferByBytes(kTargetSize, 4096);
+    setup.target_mr = ibv_.RegMr(setup.pd, setup.target);
+    if (!setup.target_mr) {
+      return absl::InternalError("Failed to register target mr.");
+    }
+    setup.responder_cq = ibv_.CreateCq(setup.context);
+    if (!setup.responder_cq) {
+      return absl::InternalError("Failed to create responder cq.");
+    }
+    setup.workers.resize(threads);
+    for (Worker& worker : setup.workers) {
+      worker.cq = ibv_.CreateCq(setup.context, kSlotsPerThread);
+      if (!worker.cq) {
+        return absl::InternalError("Failed to create cq.");
+      }
+      worker.results =
+          ibv_.AllocAlignedBufferByBytes(kSlotsPerThread * sizeof(uint64_t));
+      worker.results_mr = ibv_.RegMr(setup.pd, worker.results);
+      if (!worker.results_mr) {
+        return absl::InternalError("Failed to register results mr.");
+      }
+      for (ibv_qp*& qp : worker.qps) {
+        qp = ibv_.CreateQp(setup.pd, worker.cq, worker.cq, nullptr,
+                           kFetchAddDepth, /*max_recv_wr=*/1, IBV_QPT_RC,
+                           /*sig_all=*/0);
+        ibv_qp* responder =
+            ibv_.CreateQp(setup.pd, setup.responder_cq, setup.responder_cq,
+                          nullptr, /*max_send_wr=*/1, /*max_recv_wr=*/1,
+                          IBV_QPT_RC, /*sig_all=*/0);
+        if (!qp || !responder) {
+          return absl::InternalError("Failed to create qps.");
+        }
+        ibv_.SetUpLoopbackRcQps(qp, responder, setup.port_gid);
+      }
+    }
+    return setup;
+  }
+
+  // Runs |workload| on every worker thread for kRunTime and checks the
+  // target words afterwards.
+  absl::StatusOr<Result> Run(BasicSetup& setup, Workload workload,
+                             const Layout& layout) {
+    std::memset(setup.target.data(), 0, setup.target.size());
+    std::vector<Result> results(setup.workers.size());
+    std::vector<absl::Status> statuses(setup.workers.size());
+    std::vector<std::thread> threads;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    for (size_t i = 0; i < setup.workers.size(); ++i) {
+      threads.emplace_back([&, i]() {
+        statuses[i] = RunWorker(setup, setup.workers[i], i, workload, layout,
+                                stop, results[i]);
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    Result total;
+    total.elapsed = absl::Now() - start;
+    for (size_t i = 0; i < setup.workers.size(); ++i) {
+      RETURN_IF_ERROR(statuses[i]);
+      total.ops += results[i].ops;
+      total.retries += results[i].retries;
+      total.latency.Add(results[i].latency);
+    }
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < layout.words; ++i) {
+      sum += *Word(setup, layout, i);
+    }
+    if (workload == Workload::kCasLock ? sum != 0 : sum != total.ops) {
+      return absl::InternalError(
+          absl::StrCat("Target words sum to ", sum, " after ", total.ops,
+                       " operations."));
+    }
+    return total;
+  }
+
+  void ReportResult(absl::string_view name, Workload workload, Result& result) {
+    Report(name, result.ops / absl::ToDoubleSeconds(result.elapsed) / 1e3,
+           "kops");
+    Report(absl::StrCat(name, "_p50"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(50)), "us");
+    Report(absl::StrCat(name, "_p99"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(99)), "us");
+    if (workload != Workload::kFetchAdd) {
+      Report(absl::StrCat(name, "_retries"),
+             result.ops == 0 ? 0 : static_cast<double>(result.retries) /
+                                       result.ops,
+             "per_op");
+    }
+  }
+
+ private:
+  // The state of the operation in flight in a slot.
+  struct Operation {
+    uint32_t word;
+    uint64_t compare;
+    bool releasing;
+    // The first attempt, for latency.
+    absl::Time start;
+  };
+
+  static uint64_t* Word(const BasicSetup& setup, const Layout& layout,
+                        uint32_t index) {
+    return reinterpret_cast<uint64_t*>(setup.target.data() +
+                                       index * layout.stride);
+  }
+
+  static absl::Status Post(const BasicSetup& setup, const Worker& worker,
+                           const Layout& layout, int slot,
+                           const Operation& operation, uint64_t swap_or_add,
+                           bool compare_swap) {
+    ibv_sge sge = verbs_util::CreateSge(
+        worker.results.subspan(slot * sizeof(uint64_t), sizeof(uint64_t)),
+        worker.results_mr);
+    uint64_t* word = Word(setup, layout, operation.word);
+    ibv_send_wr wr =
+        compare_swap
+            ? verbs_util::CreateCompSwapWr(slot, &sge, /*num_sge=*/1, word,
+                                           setup.target_mr->rkey,
+                                           operation.compare, swap_or_add)
+            : verbs_util::CreateFetchAddWr(slot, &sge, /*num_sge=*/1, word,
+                                           setup.target_mr->rkey,
+                                           swap_or_add);
+    ibv_send_wr* bad_wr;
+    if (ibv_post_send(worker.qps[slot / kFetchAddDepth], &wr, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post atomic.");
+    }
+    return absl::OkStatus();
+  }
+
+  static absl::Status RunWorker(const BasicSetup& setup, const Worker& worker,
+                                int thread, Workload workload,
+                                const Layout& layout, absl::Time stop,
+                                Result& result) {
+    absl::BitGen bitgen;
+    // The last value seen of every word, the guess of increments.
+    std::vector<uint64_t> seen(layout.words, 0);
+    std::array<Operation, kSlotsPerThread> operations;
+    auto token = [thread](int slot) -> uint64_t {
+      return (static_cast<uint64_t>(thread) + 1) << 32 | (slot + 1);
+    };
+    // Starts a new operation in |slot|.
+    auto start = [&](int slot) -> absl::Status {
+      Operation& operation = operations[slot];
+      operation.word = absl::Uniform<uint32_t>(bitgen, 0, layout.words);
+      operation.releasing = false;
+      operation.start = absl::Now();
+      switch (workload) {
+        case Workload::kFetchAdd:
+          return Post(setup, worker, layout, slot, operation, /*add=*/1,
+                      /*compare_swap=*/false);
+        case Workload::kCasIncrement:
+          operation.compare = seen[operation.word];
+          return Post(setup, worker, layout, slot, operation,
+                      operation.compare + 1, /*compare_swap=*/true);
+        case Workload::kCasLock:
+          operation.compare = 0;
+          return Post(setup, worker, layout, slot, operation, token(slot),
+                      /*compare_swap=*/true);
+      }
+      return absl::InternalError("Unknown workload.");
+    };
+
+    int depth = workload == Workload::kFetchAdd ? kFetchAddDepth : 1;
+    int outstanding = 0;
+    for (int qp = 0; qp < kQpsPerThread; ++qp) {
+      for (int i = 0; i < depth; ++i) {
+        RETURN_IF_ERROR(start(qp * kFetchAddDepth + i));
+        ++outstanding;
+      }
+    }
+    std::array<ibv_wc, kSlotsPerThread> completions;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (outstanding > 0) {
+      int count = ibv_poll_cq(worker.cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll cq.");
+      }
+      absl::Time now = absl::Now();
+      if (count == 0 && now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Atomic failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        int slot = completions[i].wr_id;
+        Operation& operation = operations[slot];
+        uint64_t value;
+        std::memcpy(&value, worker.results.data() + slot * sizeof(uint64_t),
+                    sizeof(value));
+        bool done = true;
+        switch (workload) {
+          case Workload::kFetchAdd:
+            break;
+          case Workload::kCasIncrement:
+            seen[operation.word] = value == operation.compare ? value + 1
+                                                              : value;
+            if (value != operation.compare) {
+              ++result.retries;
+              operation.compare = value;
+              RETURN_IF_ERROR(Post(setup, worker, layout, slot, operation,
+                                   value + 1, /*compare_swap=*/true));
+              done = false;
+            }
+            break;
+          case Workload::kCasLock:
+            if (operation.releasing) {
+              if (value != token(slot)) {
+                return absl::InternalError(
+                    absl::StrCat("Lock ", operation.word, " held by ", value,
+                                 " on release."));
+              }
+              break;
+            }
+            if (value != 0) {
+              // Spin on the held lock.
+              ++result.retries;
+            } else {
+              operation.releasing = true;
+              operation.compare = token(slot);
+            }
+            RETURN_IF_ERROR(Post(setup, worker, layout, slot, operation,
+                                 operation.releasing ? 0 : token(slot),
+                                 /*compare_swap=*/true));
+            done = false;
+            break;
+        }
+        if (!done) {
+          continue;
+        }
+        ++result.ops;
+        result.latency.Add(now - operation.start);
+        if (now < stop) {
+          RETURN_IF_ERROR(start(slot));
+        } else {
+          --outstanding;
+        }
+      }
+    }
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(AtomicsBenchmark, Sweep) {
+  for (int threads : {1, 4}) {
+    ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup(threads));
+    for (Workload workload : kWorkloads) {
+      for (const Layout& layout : kLayouts) {
+        ASSERT_OK_AND_ASSIGN(Result result, Run(setup, workload, layout));
+        EXPECT_GT(result.ops, 0);
+        ReportResult(absl::StrCat(WorkloadName(workload), "_", layout.name,
+                                  "_threads_", threads),
+                     workload, result);
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cases/benchmark_fixture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+
+namespace rdma_unit_test {
+
+void BenchmarkFixture::Report(absl::string_view name, double value,
+                              absl::string_view unit) {
+  LOG(INFO) << name << ": " << absl::StrFormat("%.3f", value) << " " << unit;
+  RecordProperty(absl::StrCat(name, "_", unit), absl::StrFormat("%.3f", value));
+}
+
+void LatencySamples::Add(absl::Duration latency) {
+  sorted_ = sorted_ && (samples_.empty() || samples_.back() <= latency);
+  samples_.push_back(latency);
+}
+
+void LatencySamples::Add(const LatencySamples& other) {
+  samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+  sorted_ = false;
+}
+
+absl::Duration LatencySamples::Percentile(double percentile) {
+  if (samples_.empty()) {
+    return absl::ZeroDuration();
+  }
+  if (!sorted_) {
+    std::sort(samples_.begin(), samples_.end());
+    sorted_ = true;
+  }
+  double rank = std::ceil(percentile / 100 * samples_.size());
+  size_t index = rank < 1 ? 0 : static_cast<size_t>(rank) - 1;
+  return samples_[std::min(index, samples_.size() - 1)];
+}
+
+}  // namespace rdma_unit_test
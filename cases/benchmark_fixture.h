@@ -0,0 +1,60 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_CASES_BENCHMARK_FIXTURE_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_CASES_BENCHMARK_FIXTURE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "cases/basic_fixture.h"
+
+namespace rdma_unit_test {
+
+// A fixture for benchmarks which run as ordinary tests, so that every device
+// under test gets its numbers without extra tooling. Runs are kept short so the
+// benchmarks also serve as functional tests of the paths they measure.
+class BenchmarkFixture : public BasicFixture {
+ protected:
+  // Logs |value| and records it as the test property "<name>_<unit>", which
+  // ends up in the XML test report. |name| and |unit| must be usable in an XML
+  // attribute name, e.g. "read_4096" and "us".
+  void Report(absl::string_view name, double value, absl::string_view unit);
+};
+
+// Collects latency samples and computes percentiles.
+class LatencySamples {
+ public:
+  void Add(absl::Duration latency);
+  // Adds all samples of |other|, e.g. those collected by another thread.
+  void Add(const LatencySamples& other);
+
+  // Returns the sample at |percentile|, from 0 to 100, or zero without
+  // samples.
+  absl::Duration Percentile(double percentile);
+
+  size_t size() const { return samples_.size(); }
+
+ private:
+  std::vector<absl::Duration> samples_;
+  bool sorted_ = true;
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_CASES_BENCHMARK_FIXTURE_H_
@@ -0,0 +1,151 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "public/buffer_pattern.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+
+namespace rdma_unit_test {
+namespace {
+
+using buffer_pattern::internal::Isa;
+
+// A 64-bit seed, so that both halves feed the pattern.
+constexpr uint64_t kSeed = 0x0123456789abcdef;
+// Spans several AVX-512 iterations of 64 bytes plus an odd tail.
+constexpr size_t kSize = 4 * 64 + 7;
+
+std::string IsaName(Isa isa) {
+  switch (isa) {
+    case Isa::kScalar:
+      return "scalar";
+    case Isa::kAvx2:
+      return "avx2";
+    case Isa::kAvx512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+class BufferPatternTest : public testing::TestWithParam<Isa> {
+ protected:
+  void SetUp() override {
+    if (!buffer_pattern::internal::IsaSupported(GetParam())) {
+      GTEST_SKIP() << "The CPU does not support " << IsaName(GetParam());
+    }
+  }
+
+  // The pattern of kSeed from |offset|, one ExpectedByte() at a time.
+  static std::vector<uint8_t> Reference(size_t size, uint64_t offset) {
+    std::vector<uint8_t> expected(size);
+    for (size_t i = 0; i < size; ++i) {
+      expected[i] = buffer_pattern::ExpectedByte(kSeed, offset + i);
+    }
+    return expected;
+  }
+};
+
+TEST_P(BufferPatternTest, FillMatchesReference) {
+  // Offsets off the word boundary exercise the scalar head and tail around
+  // the vector loop.
+  for (uint64_t offset : {0, 1, 3, 4, 61, 64, 1000}) {
+    for (size_t size : {size_t{0}, size_t{1}, size_t{5}, size_t{31},
+                        size_t{32}, size_t{64}, size_t{65}, kSize}) {
+      std::vector<uint8_t> buffer(size);
+      buffer_pattern::internal::FillWithIsa(GetParam(), absl::MakeSpan(buffer),
+                                            kSeed, offset);
+      EXPECT_EQ(buffer, Reference(size, offset))
+          << "offset " << offset << ", size " << size;
+    }
+  }
+}
+
+TEST_P(BufferPatternTest, FillMatchesScalar) {
+  std::vector<uint8_t> scalar(kSize);
+  buffer_pattern::internal::FillWithIsa(Isa::kScalar, absl::MakeSpan(scalar),
+                                        kSeed, /*offset=*/12);
+  std::vector<uint8_t> buffer(kSize);
+  buffer_pattern::internal::FillWithIsa(GetParam(), absl::MakeSpan(buffer),
+                                        kSeed, /*offset=*/12);
+  EXPECT_EQ(buffer, scalar);
+}
+
+TEST_P(BufferPatternTest, FindMismatchOfIntactBuffer) {
+  for (uint64_t offset : {0, 2, 64}) {
+    std::vector<uint8_t> buffer = Reference(kSize, offset);
+    EXPECT_EQ(buffer_pattern::internal::FindMismatchWithIsa(
+                  GetParam(), absl::MakeConstSpan(buffer), kSeed, offset),
+              absl::nullopt)
+        << "offset " << offset;
+  }
+}
+
+TEST_P(BufferPatternTest, FindMismatchReturnsFirstDifferingByte) {
+  // Every byte of the first lanes, of the last lane of a vector and of the
+  // first lane of the next, for both vector widths, and of the tail.
+  std::vector<size_t> positions;
+  for (size_t position = 0; position < kSize; ++position) {
+    size_t in_vector = position % 32;
+    if (position < 8 || in_vector < 4 || in_vector >= 28 ||
+        position >= kSize - 8) {
+      positions.push_back(position);
+    }
+  }
+  for (uint64_t offset : {0, 1, 4}) {
+    for (size_t position : positions) {
+      std::vector<uint8_t> buffer = Reference(kSize, offset);
+      buffer[position] ^= 0x10;
+      EXPECT_EQ(buffer_pattern::internal::FindMismatchWithIsa(
+                    GetParam(), absl::MakeConstSpan(buffer), kSeed, offset),
+                position)
+          << "offset " << offset;
+      // A later difference does not hide the first one.
+      if (position + 1 < kSize) {
+        buffer[kSize - 1] ^= 0x01;
+        EXPECT_EQ(buffer_pattern::internal::FindMismatchWithIsa(
+                      GetParam(), absl::MakeConstSpan(buffer), kSeed, offset),
+                  position)
+            << "offset " << offset;
+      }
+    }
+  }
+}
+
+TEST_P(BufferPatternTest, FindMismatchOfOtherSeedMatchesScalar) {
+  std::vector<uint8_t> buffer = Reference(kSize, /*offset=*/0);
+  absl::optional<size_t> mismatch =
+      buffer_pattern::internal::FindMismatchWithIsa(
+          GetParam(), absl::MakeConstSpan(buffer), kSeed + 1);
+  ASSERT_NE(mismatch, absl::nullopt);
+  EXPECT_EQ(mismatch,
+            buffer_pattern::internal::FindMismatchWithIsa(
+                Isa::kScalar, absl::MakeConstSpan(buffer), kSeed + 1));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Isas, BufferPatternTest,
+    testing::Values(Isa::kScalar, Isa::kAvx2, Isa::kAvx512),
+    [](const testing::TestParamInfo<Isa>& info) {
+      return IsaName(info.param);
+    });
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -22,6 +22,7 @@
 #include "glog/logging.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/time/clock.h"
@@ -29,6 +30,7 @@
 #include "infiniband/verbs.h"
 #include "cases/basic_fixture.h"
 #include "internal/handle_garble.h"
+#include "public/completion_multiplexer.h"
 #include "public/introspection.h"
 #include "public/rdma_memblock.h"
 #include "public/status_matchers.h"
@@ -407,6 +409,56 @@ TEST_F(CompChannelTest, MuxOntoSingleChannel) {
   }
 }
 
+TEST_F(CompChannelTest, Multiplexer) {
+  static constexpr int kNumberOfPairs = 8;
+  static constexpr int kRounds = 3;
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  // Half of the CQs share a channel, the others have one each.
+  ibv_comp_channel* shared_channel = ibv_.CreateChannel(setup.context);
+  ASSERT_THAT(shared_channel, NotNull());
+  CompletionMultiplexer multiplexer;
+  absl::flat_hash_map<ibv_cq*, int> completions;
+  std::vector<ibv_qp*> qps;
+  for (int i = 0; i < kNumberOfPairs; ++i) {
+    ibv_comp_channel* channel =
+        i % 2 == 0 ? shared_channel : ibv_.CreateChannel(setup.context);
+    ASSERT_THAT(channel, NotNull());
+    ibv_cq* cq = ibv_.CreateCq(setup.context, kCqMaxWr, channel);
+    ASSERT_THAT(cq, NotNull());
+    ibv_qp* qp = ibv_.CreateQp(setup.pd, cq);
+    ibv_qp* remote_qp = ibv_.CreateQp(setup.pd, setup.remote.cq);
+    ASSERT_THAT(qp, NotNull());
+    ASSERT_THAT(remote_qp, NotNull());
+    ibv_.SetUpLoopbackRcQps(qp, remote_qp, setup.port_gid);
+    multiplexer.Add(cq, [&completions](ibv_cq* cq) {
+      ibv_wc completion;
+      while (ibv_poll_cq(cq, 1, &completion) > 0) {
+        EXPECT_EQ(completion.status, IBV_WC_SUCCESS);
+        ++completions[cq];
+      }
+    });
+    qps.push_back(qp);
+  }
+  for (int round = 1; round <= kRounds; ++round) {
+    for (ibv_qp* qp : qps) {
+      DoWrite(setup, qp);
+    }
+    absl::Time deadline = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+    int done = 0;
+    while (done < kNumberOfPairs && absl::Now() < deadline) {
+      multiplexer.Poll(absl::Milliseconds(10));
+      done = 0;
+      for (ibv_qp* qp : qps) {
+        done += completions[qp->send_cq] == round;
+      }
+    }
+    ASSERT_EQ(done, kNumberOfPairs) << "Round " << round;
+  }
+  for (ibv_qp* qp : qps) {
+    multiplexer.Remove(qp->send_cq);
+  }
+}
+
 TEST_F(CompChannelTest, ManyOutstanding) {
   static constexpr int kTargetOutstanding = 1000;
   ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
@@ -0,0 +1,313 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/completion_multiplexer.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Scales the number of event driven CQs served by one thread through a
+// CompletionMultiplexer. Every CQ belongs to the send side of a loopback RC
+// QP pair. The CQs either have a completion channel each or share
+// kSharedChannels channels round robin.
+//
+// All active: each QP keeps one 8 byte inline RDMA WRITE in flight, reposted
+// from the callback of its CQ. Reports the completion rate and the callbacks
+// handled per wakeup of the thread.
+// One active: a single WRITE at a time on one QP after another, while all
+// other CQs stay armed and idle. Reports the p50 latency from posting to the
+// callback.
+class CompletionMultiplexerBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kMaxCqs = 4096;
+  static constexpr int kSharedChannels = 16;
+  // File descriptors left for everything but the channels.
+  static constexpr int kReservedFds = 128;
+  static constexpr int kLatencySamples = 1000;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(100);
+  static constexpr absl::Duration kPollTimeout = absl::Milliseconds(10);
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock buffer;
+    ibv_mr* mr;
+    ibv_cq* responder_cq;
+    std::vector<ibv_comp_channel*> channels;
+    std::vector<ibv_cq*> cqs;
+    std::vector<ibv_qp*> qps;
+    std::vector<ibv_qp*> responders;
+  };
+
+  struct Result {
+    double kops;
+    double callbacks_per_wakeup;
+  };
+
+  // Creates |cqs| QP pairs on |context| whose send CQs use |channels|
+  // channels round robin.
+  absl::StatusOr<BasicSetup> CreateBasicSetup(ibv_context* context, int cqs,
+                                              int channels) {
+    BasicSetup setup;
+    setup.context = context;
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.buffer = ibv_.AllocAlignedBufferByBytes(2 * sizeof(uint64_t));
+    setup.mr = ibv_.RegMr(setup.pd, setup.buffer);
+    if (!setup.mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    // RDMA WRITEs complete on the requester only.
+    setup.responder_cq = ibv_.CreateCq(setup.context, /*cqe=*/1);
+    if (!setup.responder_cq) {
+      return absl::InternalError("Failed to create responder cq.");
+    }
+    for (int i = 0; i < channels; ++i) {
+      ibv_comp_channel* channel = ibv_.CreateChannel(setup.context);
+      if (!channel) {
+        return absl::InternalError("Failed to create channel.");
+      }
+      setup.channels.push_back(channel);
+    }
+    for (int i = 0; i < cqs; ++i) {
+      ibv_cq* cq =
+          ibv_.CreateCq(setup.context, /*cqe=*/2, setup.channels[i % channels]);
+      if (!cq) {
+        return absl::InternalError("Failed to create cq.");
+      }
+      ibv_qp* qp = ibv_.CreateQp(setup.pd, cq, cq, nullptr,
+                                 /*max_send_wr=*/1, /*max_recv_wr=*/1,
+                                 IBV_QPT_RC, /*sig_all=*/0);
+      ibv_qp* responder = ibv_.CreateQp(
+          setup.pd, setup.responder_cq, setup.responder_cq, nullptr,
+          /*max_send_wr=*/1, /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+      if (!qp || !responder) {
+        return absl::InternalError("Failed to create qps.");
+      }
+      ibv_.SetUpLoopbackRcQps(qp, responder, setup.port_gid);
+      setup.cqs.push_back(cq);
+      setup.qps.push_back(qp);
+      setup.responders.push_back(responder);
+    }
+    return setup;
+  }
+
+  // Destroys everything CreateBasicSetup() created but the context, so that
+  // the sweep stays within the device limits of its largest step.
+  absl::Status DestroyBasicSetup(const BasicSetup& setup) {
+    for (size_t i = 0; i < setup.qps.size(); ++i) {
+      if (ibv_.DestroyQp(setup.qps[i]) != 0 ||
+          ibv_.DestroyQp(setup.responders[i]) != 0) {
+        return absl::InternalError("Failed to destroy qps.");
+      }
+    }
+    for (ibv_cq* cq : setup.cqs) {
+      if (ibv_.DestroyCq(cq) != 0) {
+        return absl::InternalError("Failed to destroy cq.");
+      }
+    }
+    if (ibv_.DestroyCq(setup.responder_cq) != 0) {
+      return absl::InternalError("Failed to destroy responder cq.");
+    }
+    for (ibv_comp_channel* channel : setup.channels) {
+      if (ibv_.DestroyChannel(channel) != 0) {
+        return absl::InternalError("Failed to destroy channel.");
+      }
+    }
+    if (ibv_.DeregMr(setup.mr) != 0) {
+      return absl::InternalError("Failed to deregister mr.");
+    }
+    if (ibv_.DeallocPd(setup.pd) != 0) {
+      return absl::InternalError("Failed to deallocate pd.");
+    }
+    return absl::OkStatus();
+  }
+
+  static absl::StatusOr<Result> RunAllActive(const BasicSetup& setup) {
+    CompletionMultiplexer multiplexer;
+    absl::Status status;
+    uint64_t completed = 0;
+    bool stopping = false;
+    int outstanding = 0;
+    int callbacks = 0;
+    for (size_t i = 0; i < setup.cqs.size(); ++i) {
+      ibv_qp* qp = setup.qps[i];
+      multiplexer.Add(setup.cqs[i], [&, qp](ibv_cq* cq) {
+        ibv_wc completion;
+        while (ibv_poll_cq(cq, 1, &completion) > 0) {
+          if (completion.status != IBV_WC_SUCCESS) {
+            status = absl::InternalError(absl::StrCat(
+                "Write failed: ", ibv_wc_status_str(completion.status)));
+          }
+          ++completed;
+          if (stopping) {
+            --outstanding;
+          } else {
+            status.Update(PostWrite(setup, qp));
+          }
+        }
+      });
+    }
+    for (ibv_qp* qp : setup.qps) {
+      RETURN_IF_ERROR(PostWrite(setup, qp));
+      ++outstanding;
+    }
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (absl::Now() < stop) {
+      callbacks += multiplexer.Poll(kPollTimeout);
+      RETURN_IF_ERROR(status);
+    }
+    absl::Duration elapsed = absl::Now() - start;
+    uint64_t measured = completed;
+    uint64_t wakeups = multiplexer.wakeups();
+    stopping = true;
+    while (outstanding > 0) {
+      multiplexer.Poll(kPollTimeout);
+      RETURN_IF_ERROR(status);
+      if (absl::Now() > deadline) {
+        return absl::DeadlineExceededError("Timed out draining writes.");
+      }
+    }
+    for (ibv_cq* cq : setup.cqs) {
+      multiplexer.Remove(cq);
+    }
+    return Result{
+        .kops = measured / absl::ToDoubleSeconds(elapsed) / 1e3,
+        .callbacks_per_wakeup =
+            wakeups > 0 ? static_cast<double>(callbacks) / wakeups : 0,
+    };
+  }
+
+  static absl::StatusOr<absl::Duration> RunOneActive(const BasicSetup& setup) {
+    CompletionMultiplexer multiplexer;
+    absl::Status status;
+    bool done = false;
+    for (ibv_cq* registered : setup.cqs) {
+      multiplexer.Add(registered, [&](ibv_cq* cq) {
+        ibv_wc completion;
+        while (ibv_poll_cq(cq, 1, &completion) > 0) {
+          if (completion.status != IBV_WC_SUCCESS) {
+            status = absl::InternalError(absl::StrCat(
+                "Write failed: ", ibv_wc_status_str(completion.status)));
+          }
+          done = true;
+        }
+      });
+    }
+    LatencySamples latency;
+    for (int i = 0; i < kLatencySamples; ++i) {
+      done = false;
+      absl::Time start = absl::Now();
+      RETURN_IF_ERROR(PostWrite(setup, setup.qps[i % setup.qps.size()]));
+      absl::Time deadline = start + verbs_util::kDefaultCompletionTimeout;
+      while (!done) {
+        multiplexer.Poll(kPollTimeout);
+        RETURN_IF_ERROR(status);
+        if (absl::Now() > deadline) {
+          return absl::DeadlineExceededError("Timed out waiting for write.");
+        }
+      }
+      latency.Add(absl::Now() - start);
+    }
+    for (ibv_cq* cq : setup.cqs) {
+      multiplexer.Remove(cq);
+    }
+    return latency.Percentile(50);
+  }
+
+  // The most channels the process can open, leaving kReservedFds spare.
+  static int MaxChannels() {
+    rlimit limit;
+    CHECK_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);  // Crash ok
+    return std::max<int>(limit.rlim_cur - kReservedFds, 1);
+  }
+
+ private:
+  static absl::Status PostWrite(const BasicSetup& setup, ibv_qp* qp) {
+    ibv_sge sge = verbs_util::CreateSge(
+        setup.buffer.subspan(0, sizeof(uint64_t)), setup.mr);
+    ibv_send_wr write = verbs_util::CreateWriteWr(
+        /*wr_id=*/0, &sge, /*num_sge=*/1,
+        setup.buffer.data() + sizeof(uint64_t), setup.mr->rkey);
+    write.send_flags |= IBV_SEND_INLINE;
+    ibv_send_wr* bad_wr;
+    if (ibv_post_send(qp, &write, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post write.");
+    }
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(CompletionMultiplexerBenchmark, Sweep) {
+  const ibv_device_attr& device_attr = Introspection().device_attr();
+  const int max_cqs = std::min(
+      {kMaxCqs, device_attr.max_cq - 1, device_attr.max_qp / 2 - 1});
+  const int max_channels = MaxChannels();
+  ASSERT_OK_AND_ASSIGN(ibv_context * context, ibv_.OpenDevice());
+  for (int cqs = 1; cqs <= max_cqs; cqs *= 4) {
+    for (bool shared : {false, true}) {
+      if (shared && cqs <= kSharedChannels) {
+        continue;
+      }
+      int channels = shared ? kSharedChannels : cqs;
+      if (channels > max_channels) {
+        LOG(INFO) << "Skipping " << cqs
+                  << " channels, above the file descriptor limit.";
+        continue;
+      }
+      ASSERT_OK_AND_ASSIGN(BasicSetup setup,
+                           CreateBasicSetup(context, cqs, channels));
+      std::string name = absl::StrCat(
+          cqs, shared ? "_cqs_shared_channels" : "_cqs_own_channels");
+      ASSERT_OK_AND_ASSIGN(Result result, RunAllActive(setup));
+      Report(name, result.kops, "kops");
+      Report(absl::StrCat(name, "_callbacks_per_wakeup"),
+             result.callbacks_per_wakeup, "count");
+      ASSERT_OK_AND_ASSIGN(absl::Duration p50, RunOneActive(setup));
+      Report(absl::StrCat(name, "_one_active_p50"),
+             absl::ToDoubleMicroseconds(p50), "us");
+      ASSERT_OK(DestroyBasicSetup(setup));
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
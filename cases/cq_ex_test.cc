@@ -123,6 +123,19 @@ TEST_F(CqExTest, ShareChannel) {
   ASSERT_EQ(ibv_destroy_cq(ibv_cq_ex_to_cq(cq2)), 0);
 }
 
+TEST_F(CqExTest, Moderation) {
+  if (!Introspection().SupportsCqModeration()) {
+    GTEST_SKIP() << "NIC does not support CQ moderation.";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  const ibv_cq_moderation_caps& caps = Introspection().cq_moderation_caps();
+  ibv_cq_init_attr_ex cq_attr{.cqe = 10, .channel = setup.channel};
+  ibv_cq_ex* cq = ibv_.CreateCqEx(
+      setup.context, cq_attr,
+      {.cq_count = caps.max_cq_count, .cq_period = caps.max_cq_period});
+  ASSERT_THAT(cq, NotNull());
+}
+
 TEST_F(CqExTest, ZeroCompVector) {
   ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
   ibv_cq_init_attr_ex cq_attr{.cqe = 10};
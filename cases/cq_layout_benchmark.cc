@@ -0,0 +1,306 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/barrier.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Compares CQ layouts as the number of threads grows: one CQ shared by all
+// QPs and threads, one CQ per thread, and one CQ per QP. Like
+// BatchOpFixture::ThreadedSubmission, every thread owns its QPs and starts
+// behind a barrier. Each thread keeps kDepth 8 byte inline RDMA WRITEs in
+// flight on each of its kQpsPerThread QPs and polls the CQs of its layout:
+// the shared CQ, its own CQ or the CQs of its QPs. With a shared CQ a thread
+// reaps completions of other threads' QPs and returns their credits.
+//
+// Reports the completion rate, the mean duration of an ibv_poll_cq call and
+// the share of thread time spent polling. Provider CQ locks show up as the
+// growth of both with threads on a shared CQ. Timing every poll adds the cost
+// of two clock reads to each.
+class CqLayoutBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kMaxThreads = 16;
+  static constexpr int kQpsPerThread = 4;
+  static constexpr int kDepth = 8;
+  static constexpr int kPollBatch = 16;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(100);
+
+  enum class Layout { kShared, kPerThread, kPerQp };
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock buffer;
+    ibv_mr* mr;
+    // QP i belongs to thread i / kQpsPerThread and posts with wr_id i.
+    std::vector<ibv_qp*> qps;
+    // The CQs thread i polls.
+    std::vector<std::vector<ibv_cq*>> poll_cqs;
+  };
+
+  struct ThreadStats {
+    uint64_t completed = 0;
+    uint64_t polls = 0;
+    absl::Duration poll_time;
+    absl::Duration elapsed;
+  };
+
+  struct Result {
+    double kops;
+    double poll_ns;
+    double poll_percent;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup(Layout layout, int threads) {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.buffer = ibv_.AllocAlignedBufferByBytes(2 * sizeof(uint64_t));
+    setup.mr = ibv_.RegMr(setup.pd, setup.buffer);
+    if (!setup.mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    // RDMA WRITEs complete on the requester only.
+    ibv_cq* responder_cq = ibv_.CreateCq(setup.context, /*cqe=*/1);
+    ibv_cq* shared_cq = nullptr;
+    if (layout == Layout::kShared) {
+      shared_cq =
+          ibv_.CreateCq(setup.context, threads * kQpsPerThread * kDepth);
+    }
+    if (!responder_cq || (layout == Layout::kShared && !shared_cq)) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    setup.poll_cqs.resize(threads);
+    for (int thread = 0; thread < threads; ++thread) {
+      ibv_cq* thread_cq = nullptr;
+      switch (layout) {
+        case Layout::kShared:
+          setup.poll_cqs[thread].push_back(shared_cq);
+          break;
+        case Layout::kPerThread:
+          thread_cq = ibv_.CreateCq(setup.context, kQpsPerThread * kDepth);
+          if (!thread_cq) {
+            return absl::InternalError("Failed to create cq.");
+          }
+          setup.poll_cqs[thread].push_back(thread_cq);
+          break;
+        case Layout::kPerQp:
+          break;
+      }
+      for (int i = 0; i < kQpsPerThread; ++i) {
+        ibv_cq* cq = layout == Layout::kShared      ? shared_cq
+                     : layout == Layout::kPerThread ? thread_cq
+                                                    : nullptr;
+        if (layout == Layout::kPerQp) {
+          cq = ibv_.CreateCq(setup.context, kDepth);
+          if (!cq) {
+            return absl::InternalError("Failed to create cq.");
+          }
+          setup.poll_cqs[thread].push_back(cq);
+        }
+        ibv_qp* qp = ibv_.CreateQp(setup.pd, cq, cq, nullptr, kDepth,
+                                   /*max_recv_wr=*/1, IBV_QPT_RC,
+                                   /*sig_all=*/0);
+        ibv_qp* responder =
+            ibv_.CreateQp(setup.pd, responder_cq, responder_cq, nullptr,
+                          /*max_send_wr=*/1, /*max_recv_wr=*/1, IBV_QPT_RC,
+                          /*sig_all=*/0);
+        if (!qp || !responder) {
+          return absl::InternalError("Failed to create qps.");
+        }
+        ibv_.SetUpLoopbackRcQps(qp, responder, setup.port_gid);
+        setup.qps.push_back(qp);
+      }
+    }
+    return setup;
+  }
+
+  static absl::StatusOr<Result> Run(const BasicSetup& setup) {
+    const int threads = setup.poll_cqs.size();
+    std::vector<std::atomic<int>> credits(setup.qps.size());
+    for (std::atomic<int>& credit : credits) {
+      credit.store(kDepth, std::memory_order_relaxed);
+    }
+    std::atomic<int64_t> outstanding = 0;
+    std::vector<ThreadStats> stats(threads);
+    std::vector<absl::Status> statuses(threads);
+    absl::Barrier* barrier = new absl::Barrier(threads);
+    std::vector<std::thread> workers;
+    for (int thread = 0; thread < threads; ++thread) {
+      workers.push_back(std::thread([&, thread]() {
+        if (barrier->Block()) {
+          delete barrier;
+        }
+        statuses[thread] = Drive(setup, thread, absl::MakeSpan(credits),
+                                 outstanding, stats[thread]);
+      }));
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    Result result = {};
+    uint64_t polls = 0;
+    absl::Duration poll_time;
+    absl::Duration elapsed;
+    for (int thread = 0; thread < threads; ++thread) {
+      RETURN_IF_ERROR(statuses[thread]);
+      result.kops += stats[thread].completed /
+                     absl::ToDoubleSeconds(stats[thread].elapsed) / 1e3;
+      polls += stats[thread].polls;
+      poll_time += stats[thread].poll_time;
+      elapsed += stats[thread].elapsed;
+    }
+    result.poll_ns = absl::ToDoubleNanoseconds(poll_time) / polls;
+    result.poll_percent = 100 * absl::FDivDuration(poll_time, elapsed);
+    return result;
+  }
+
+ private:
+  static absl::Status PostWrite(const BasicSetup& setup, int qp) {
+    ibv_sge sge = verbs_util::CreateSge(
+        setup.buffer.subspan(0, sizeof(uint64_t)), setup.mr);
+    ibv_send_wr write = verbs_util::CreateWriteWr(
+        qp, &sge, /*num_sge=*/1, setup.buffer.data() + sizeof(uint64_t),
+        setup.mr->rkey);
+    write.send_flags |= IBV_SEND_INLINE;
+    ibv_send_wr* bad_wr;
+    if (ibv_post_send(setup.qps[qp], &write, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post write.");
+    }
+    return absl::OkStatus();
+  }
+
+  // The body of worker |thread|: keeps its QPs busy for kRunTime, then polls
+  // until no WRITE of any thread is outstanding, since a shared CQ may hold
+  // completions of other threads.
+  static absl::Status Drive(const BasicSetup& setup, int thread,
+                            absl::Span<std::atomic<int>> credits,
+                            std::atomic<int64_t>& outstanding,
+                            ThreadStats& stats) {
+    std::array<ibv_wc, kPollBatch> completions;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (true) {
+      absl::Time now = absl::Now();
+      bool running = now < stop;
+      if (!running && outstanding.load(std::memory_order_acquire) == 0) {
+        break;
+      }
+      if (now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling writes.");
+      }
+      if (running) {
+        for (int i = 0; i < kQpsPerThread; ++i) {
+          int qp = thread * kQpsPerThread + i;
+          int available = credits[qp].exchange(0, std::memory_order_acquire);
+          outstanding.fetch_add(available, std::memory_order_relaxed);
+          for (int j = 0; j < available; ++j) {
+            RETURN_IF_ERROR(PostWrite(setup, qp));
+          }
+        }
+      }
+      for (ibv_cq* cq : setup.poll_cqs[thread]) {
+        absl::Time poll_start = absl::Now();
+        int count = ibv_poll_cq(cq, completions.size(), completions.data());
+        absl::Time poll_end = absl::Now();
+        if (count < 0) {
+          return absl::InternalError("Failed to poll cq.");
+        }
+        if (running) {
+          ++stats.polls;
+          stats.poll_time += poll_end - poll_start;
+          stats.completed += count;
+        }
+        for (int i = 0; i < count; ++i) {
+          if (completions[i].status != IBV_WC_SUCCESS) {
+            return absl::InternalError(absl::StrCat(
+                "Write failed: ", ibv_wc_status_str(completions[i].status)));
+          }
+          credits[completions[i].wr_id].fetch_add(1,
+                                                  std::memory_order_release);
+        }
+        outstanding.fetch_sub(count, std::memory_order_release);
+      }
+      if (running) {
+        stats.elapsed = absl::Now() - start;
+      }
+    }
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(CqLayoutBenchmark, Sweep) {
+  const ibv_device_attr& device_attr = Introspection().device_attr();
+  const int max_threads =
+      std::min({kMaxThreads,
+                static_cast<int>(std::thread::hardware_concurrency()),
+                device_attr.max_qp / (2 * kQpsPerThread) - 1});
+  ASSERT_GT(max_threads, 0);
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
+  const std::array<std::pair<Layout, absl::string_view>, 3> layouts = {{
+      {Layout::kShared, "shared_cq"},
+      {Layout::kPerThread, "cq_per_thread"},
+      {Layout::kPerQp, "cq_per_qp"},
+  }};
+  for (const auto& [layout, layout_name] : layouts) {
+    for (int threads : thread_counts) {
+      ASSERT_OK_AND_ASSIGN(BasicSetup setup,
+                           CreateBasicSetup(layout, threads));
+      ASSERT_OK_AND_ASSIGN(Result result, Run(setup));
+      std::string name = absl::StrCat(layout_name, "_", threads);
+      Report(name, result.kops, "kops");
+      Report(absl::StrCat(name, "_poll"), result.poll_ns, "ns");
+      Report(absl::StrCat(name, "_poll_time"), result.poll_percent,
+             "percent");
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -0,0 +1,302 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>  // NOLINT
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Sweeps the completion event moderation of a CQ read through a completion
+// channel. A producer thread sends small messages at a fixed rate while the
+// test thread sleeps on the channel, wakes, drains the CQ and rearms it, the
+// way an interrupt driven server runs. For every cq_count x cq_period point it
+// reports events (interrupts) per second, the CPU utilization of the consumer
+// thread and the p99 latency from posting a message to the consumer handling
+// it after its wake-up.
+class CqModerationBenchmark : public BenchmarkFixture {
+ public:
+  void SetUp() override {
+    if (!Introspection().SupportsCqModeration()) {
+      GTEST_SKIP() << "NIC does not support CQ moderation.";
+    }
+  }
+
+ protected:
+  static constexpr int kMessages = 20000;
+  // The offered load, one message per interval.
+  static constexpr absl::Duration kInterval = absl::Microseconds(5);
+  static constexpr int kRecvs = 256;
+  static constexpr int kSignalInterval = 16;
+  static constexpr absl::Duration kEventTimeout = absl::Milliseconds(100);
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    // One recv slot per recv, each holding the send time of its message.
+    RdmaMemBlock buffer;
+    ibv_mr* mr;
+    ibv_comp_channel* channel;
+    ibv_cq* send_cq;
+    ibv_cq* recv_cq;
+    ibv_qp* sender;
+    ibv_qp* receiver;
+  };
+
+  struct Result {
+    uint64_t events = 0;
+    absl::Duration elapsed;
+    absl::Duration cpu;
+    LatencySamples latency;
+  };
+
+  // Without |moderation| the recv CQ keeps the device default.
+  absl::StatusOr<BasicSetup> CreateBasicSetup(
+      absl::optional<ibv_moderate_cq> moderation) {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.buffer = ibv_.AllocAlignedBufferByBytes(kRecvs * sizeof(int64_t));
+    setup.mr = ibv_.RegMr(setup.pd, setup.buffer);
+    if (!setup.mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    setup.channel = ibv_.CreateChannel(setup.context);
+    if (!setup.channel) {
+      return absl::InternalError("Failed to create channel.");
+    }
+    setup.send_cq = ibv_.CreateCq(setup.context, kRecvs);
+    setup.recv_cq =
+        moderation.has_value()
+            ? ibv_.CreateCq(setup.context, kRecvs, setup.channel, *moderation)
+            : ibv_.CreateCq(setup.context, kRecvs, setup.channel);
+    if (!setup.send_cq || !setup.recv_cq) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    setup.sender =
+        ibv_.CreateQp(setup.pd, setup.send_cq, setup.send_cq, nullptr, kRecvs,
+                      /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+    setup.receiver =
+        ibv_.CreateQp(setup.pd, setup.recv_cq, setup.recv_cq, nullptr,
+                      /*max_send_wr=*/1, kRecvs, IBV_QPT_RC, /*sig_all=*/0);
+    if (!setup.sender || !setup.receiver) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv_.SetUpLoopbackRcQps(setup.sender, setup.receiver, setup.port_gid);
+    return setup;
+  }
+
+  absl::StatusOr<Result> Run(BasicSetup& setup) {
+    for (int i = 0; i < kRecvs; ++i) {
+      RETURN_IF_ERROR(PostRecv(setup, i));
+    }
+    std::atomic<int> handled = 0;
+    absl::Status producer_status;
+    absl::Time start = absl::Now();
+    std::thread producer([&]() {
+      producer_status = Produce(setup, start, handled);
+    });
+    absl::StatusOr<Result> result = Consume(setup, handled);
+    producer.join();
+    RETURN_IF_ERROR(producer_status);
+    if (result.ok()) {
+      result->elapsed = absl::Now() - start;
+    }
+    return result;
+  }
+
+  void ReportResult(absl::string_view name, Result& result) {
+    double seconds = absl::ToDoubleSeconds(result.elapsed);
+    Report(absl::StrCat(name, "_interrupts"), result.events / seconds,
+           "per_s");
+    Report(absl::StrCat(name, "_cpu"),
+           100 * absl::FDivDuration(result.cpu, result.elapsed), "percent");
+    Report(absl::StrCat(name, "_p99"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(99)), "us");
+  }
+
+ private:
+  static absl::Duration ThreadCpuTime() {
+    timespec now;
+    CHECK_EQ(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now), 0);  // Crash ok
+    return absl::DurationFromTimespec(now);
+  }
+
+  static absl::Status PostRecv(const BasicSetup& setup, int slot) {
+    ibv_sge sge = verbs_util::CreateSge(
+        setup.buffer.subspan(slot * sizeof(int64_t), sizeof(int64_t)),
+        setup.mr);
+    ibv_recv_wr recv = verbs_util::CreateRecvWr(slot, &sge, /*num_sge=*/1);
+    ibv_recv_wr* bad_wr;
+    if (ibv_post_recv(setup.receiver, &recv, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post recv.");
+    }
+    return absl::OkStatus();
+  }
+
+  // Sends kMessages inline messages holding their send time, paced at
+  // kInterval from |start| and never more than kRecvs ahead of |handled|.
+  static absl::Status Produce(const BasicSetup& setup, absl::Time start,
+                              const std::atomic<int>& handled) {
+    int completed = 0;
+    for (int i = 0; i < kMessages; ++i) {
+      absl::Time next = start + i * kInterval;
+      // Unsignaled sends hold their send queue slots until a later signaled
+      // send completes.
+      while (absl::Now() < next ||
+             i - handled.load(std::memory_order_acquire) >= kRecvs ||
+             i - completed >= kRecvs - kSignalInterval) {
+        ibv_wc completion;
+        int count = ibv_poll_cq(setup.send_cq, 1, &completion);
+        if (count < 0) {
+          return absl::InternalError("Failed to poll send cq.");
+        }
+        if (count == 1) {
+          if (completion.status != IBV_WC_SUCCESS) {
+            return absl::InternalError(absl::StrCat(
+                "Send failed: ", ibv_wc_status_str(completion.status)));
+          }
+          completed = completion.wr_id;
+        }
+        if (absl::Now() > next + verbs_util::kDefaultCompletionTimeout) {
+          return absl::DeadlineExceededError("Consumer stalled.");
+        }
+      }
+      int64_t now = absl::GetCurrentTimeNanos();
+      ibv_sge sge = {.addr = reinterpret_cast<uint64_t>(&now),
+                     .length = sizeof(now),
+                     .lkey = 0};
+      ibv_send_wr send = verbs_util::CreateSendWr(i + 1, &sge, /*num_sge=*/1);
+      send.send_flags = IBV_SEND_INLINE;
+      if ((i + 1) % kSignalInterval == 0) {
+        send.send_flags |= IBV_SEND_SIGNALED;
+      }
+      ibv_send_wr* bad_wr;
+      if (ibv_post_send(setup.sender, &send, &bad_wr) != 0) {
+        return absl::InternalError("Failed to post send.");
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  // Handles kMessages, sleeping on the completion channel whenever the recv
+  // CQ is empty.
+  static absl::StatusOr<Result> Consume(const BasicSetup& setup,
+                                        std::atomic<int>& handled) {
+    Result result;
+    absl::Duration cpu_start = ThreadCpuTime();
+    ibv_wc completions[kSignalInterval];
+    bool armed = false;
+    while (handled.load(std::memory_order_relaxed) < kMessages) {
+      int count = ibv_poll_cq(setup.recv_cq, kSignalInterval, completions);
+      if (count < 0) {
+        return absl::InternalError("Failed to poll recv cq.");
+      }
+      absl::Time now = absl::Now();
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Recv failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        int slot = completions[i].wr_id;
+        int64_t sent;
+        std::memcpy(&sent, setup.buffer.data() + slot * sizeof(int64_t),
+                    sizeof(sent));
+        result.latency.Add(now - absl::FromUnixNanos(sent));
+        RETURN_IF_ERROR(PostRecv(setup, slot));
+      }
+      handled.fetch_add(count, std::memory_order_release);
+      if (count > 0) {
+        continue;
+      }
+      // Arm, then poll once more to catch completions which arrived before
+      // arming, and only then sleep.
+      if (!armed) {
+        if (ibv_req_notify_cq(setup.recv_cq, /*solicited_only=*/0) != 0) {
+          return absl::InternalError("Failed to arm recv cq.");
+        }
+        armed = true;
+        continue;
+      }
+      pollfd fd = {.fd = setup.channel->fd, .events = POLLIN};
+      int ready = poll(&fd, 1, absl::ToInt64Milliseconds(kEventTimeout));
+      if (ready <= 0) {
+        return absl::DeadlineExceededError("Timed out waiting for an event.");
+      }
+      ibv_cq* cq;
+      void* cq_context;
+      if (ibv_get_cq_event(setup.channel, &cq, &cq_context) != 0) {
+        return absl::InternalError("Failed to get cq event.");
+      }
+      ibv_ack_cq_events(cq, 1);
+      ++result.events;
+      armed = false;
+    }
+    result.cpu = ThreadCpuTime() - cpu_start;
+    return result;
+  }
+};
+
+TEST_F(CqModerationBenchmark, Sweep) {
+  {
+    ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup(absl::nullopt));
+    ASSERT_OK_AND_ASSIGN(Result result, Run(setup));
+    ReportResult("unmoderated", result);
+  }
+  const ibv_cq_moderation_caps& caps = Introspection().cq_moderation_caps();
+  for (uint16_t count : {1, 4, 16, 64}) {
+    for (uint16_t period : {1, 8, 32, 128}) {
+      if (count > caps.max_cq_count || period > caps.max_cq_period) {
+        continue;
+      }
+      ASSERT_OK_AND_ASSIGN(
+          BasicSetup setup,
+          CreateBasicSetup(ibv_moderate_cq{.cq_count = count,
+                                           .cq_period = period}));
+      ASSERT_OK_AND_ASSIGN(Result result, Run(setup));
+      ReportResult(absl::StrCat("count_", count, "_period_", period), result);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -158,6 +158,42 @@ TEST_F(CqTest, AboveMaxCompVector) {
               IsNull());
 }
 
+TEST_F(CqTest, Moderation) {
+  if (!Introspection().SupportsCqModeration()) {
+    GTEST_SKIP() << "NIC does not support CQ moderation.";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  const ibv_cq_moderation_caps& caps = Introspection().cq_moderation_caps();
+  ibv_cq* cq = ibv_.CreateCq(
+      setup.context, 10, setup.channel,
+      {.cq_count = caps.max_cq_count, .cq_period = caps.max_cq_period});
+  ASSERT_THAT(cq, NotNull());
+  EXPECT_EQ(ibv_.ModerateCq(cq, {.cq_count = 1, .cq_period = 1}), 0);
+}
+
+TEST_F(CqTest, AboveMaxModeration) {
+  if (!Introspection().SupportsCqModeration()) {
+    GTEST_SKIP() << "NIC does not support CQ moderation.";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  const ibv_cq_moderation_caps& caps = Introspection().cq_moderation_caps();
+  ibv_cq* cq = ibv_.CreateCq(setup.context, 10, setup.channel);
+  ASSERT_THAT(cq, NotNull());
+  if (caps.max_cq_count < std::numeric_limits<uint16_t>::max()) {
+    EXPECT_NE(ibv_.ModerateCq(
+                  cq, {.cq_count = static_cast<uint16_t>(caps.max_cq_count + 1),
+                       .cq_period = 1}),
+              0);
+  }
+  if (caps.max_cq_period < std::numeric_limits<uint16_t>::max()) {
+    EXPECT_NE(ibv_.ModerateCq(
+                  cq, {.cq_count = 1,
+                       .cq_period =
+                           static_cast<uint16_t>(caps.max_cq_period + 1)}),
+              0);
+  }
+}
+
 // TODO(author1): Many/Max channels
 // TODO(author1): Test lookup/delete with a different kind of object.
 // TODO(author1): (likely in a different test) messing with comp vectors.
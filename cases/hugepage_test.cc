@@ -1,7 +1,3 @@
-#include <mntent.h>
-#include <paths.h>
-#include <stdio.h>
-
 #include <cstdint>
 #include <cstring>
 #include <string>
@@ -14,8 +10,10 @@
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
+#include "absl/types/optional.h"
 #include "infiniband/verbs.h"
 #include "cases/basic_fixture.h"
+#include "public/buffer_pattern.h"
 #include "public/introspection.h"
 #include "public/page_size.h"
 #include "public/rdma_memblock.h"
@@ -26,13 +24,12 @@
 namespace rdma_unit_test {
 namespace {
 
-using ::testing::Each;
 using ::testing::NotNull;
 
 class HugePageTest : public BasicFixture {
  public:
   void SetUp() override {
-    if (!HugepageEnabled()) {
+    if (!verbs_util::HugepageEnabled()) {
       GTEST_SKIP() << "hugetlbfs is not mounted";
     }
     if (!Introspection().SupportsRcQp()) {
@@ -43,6 +40,7 @@ class HugePageTest : public BasicFixture {
  protected:
   static constexpr int kBufferMemoryPages = 1;
   static constexpr int kQueueSize = 200;
+  static constexpr uint64_t kPatternSeed = 0x5eed;
 
   struct Client {
     ibv_context* context = nullptr;
@@ -148,21 +146,6 @@ class HugePageTest : public BasicFixture {
     ibv_.SetUpLoopbackRcQps(local.qp, remote.qp, remote.port_gid);
     return absl::OkStatus();
   }
-
-  static bool HugepageEnabled() {
-    struct mntent* mnt;
-    FILE* f;
-    f = setmntent(_PATH_MOUNTED, "r");
-    bool hugetlbfs_mounted = false;
-    while ((mnt = getmntent(f))) {
-      if (!strcmp(mnt->mnt_type, "hugetlbfs")) {
-        hugetlbfs_mounted = true;
-        break;
-      }
-    }
-    endmntent(f);
-    return hugetlbfs_mounted;
-  }
 };
 
 // Send a 1GB chunk from local to remote
@@ -171,7 +154,7 @@ TEST_F(HugePageTest, SendLargeChunk) {
   ASSERT_OK_AND_ASSIGN(std::tie(local, remote), CreateConnectedClientsPair());
   // prepare buffer
   RdmaMemBlock send_buf = ibv_.AllocHugepageBuffer(/*pages=*/512);
-  memset(send_buf.data(), 'a', send_buf.size());
+  buffer_pattern::Fill(send_buf.span(), kPatternSeed);
   RdmaMemBlock recv_buf = ibv_.AllocHugepageBuffer(/*pages=*/512);
   memset(recv_buf.data(), 'b', recv_buf.size());
   ibv_mr* send_mr = ibv_.RegMr(local.pd, send_buf);
@@ -200,7 +183,8 @@ TEST_F(HugePageTest, SendLargeChunk) {
   EXPECT_EQ(completion.opcode, IBV_WC_RECV);
   EXPECT_EQ(completion.qp_num, remote.qp->qp_num);
   EXPECT_EQ(completion.wr_id, 0);
-  EXPECT_THAT(recv_buf.span(), Each('a'));
+  EXPECT_EQ(buffer_pattern::FindMismatch(recv_buf.span(), kPatternSeed),
+            absl::nullopt);
 }
 
 // Send with mutiple SGEs
@@ -209,7 +193,7 @@ TEST_F(HugePageTest, SendMultipleSge) {
   ASSERT_OK_AND_ASSIGN(std::tie(local, remote), CreateConnectedClientsPair());
   // prepare buffer
   RdmaMemBlock send_buf = ibv_.AllocHugepageBuffer(/*pages=*/512);
-  memset(send_buf.data(), 'a', send_buf.size());
+  buffer_pattern::Fill(send_buf.span(), kPatternSeed);
   RdmaMemBlock recv_buf = ibv_.AllocHugepageBuffer(/*pages=*/512);
   memset(recv_buf.data(), 'b', recv_buf.size());
   ibv_mr* send_mr = ibv_.RegMr(local.pd, send_buf);
@@ -244,7 +228,8 @@ TEST_F(HugePageTest, SendMultipleSge) {
   EXPECT_EQ(completion.opcode, IBV_WC_RECV);
   EXPECT_EQ(completion.qp_num, remote.qp->qp_num);
   EXPECT_EQ(completion.wr_id, 0);
-  EXPECT_THAT(recv_buf.span(), Each('a'));
+  EXPECT_EQ(buffer_pattern::FindMismatch(recv_buf.span(), kPatternSeed),
+            absl::nullopt);
 }
 
 }  // namespace
@@ -0,0 +1,232 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/page_size.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Carves a fixed backing buffer into N MRs of equal size and issues small
+// RDMA READs and WRITEs at uniformly random (MR, offset) targets, sweeping N
+// and the MR size. Throughput falls once the keys and translations of the MR
+// set outgrow the translation cache of the NIC. The sweep runs over regular
+// pages and, where hugetlbfs is mounted, over hugepages, which need fewer
+// translation entries for the same memory. Also reports the registration
+// time per MR.
+class MrScalingBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr size_t kBackingSize = 128 * 1024 * 1024;
+  static constexpr int kMaxMrs = 16 * 1024;
+  static constexpr uint32_t kMessageSize = 64;
+  static constexpr int kOutstanding = 16;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(50);
+  static constexpr std::array<size_t, 3> kMrSizes = {4 * 1024, 64 * 1024,
+                                                     2 * 1024 * 1024};
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock backing;
+    // One message slot per outstanding operation.
+    RdmaMemBlock local;
+    ibv_mr* local_mr;
+    ibv_cq* cq;
+    ibv_qp* requester;
+    ibv_qp* responder;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup(bool hugepages) {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.backing =
+        hugepages ? ibv_.AllocHugepageBuffer(kBackingSize / kHugepageSize)
+                  : ibv_.AllocAlignedBufferByBytes(kBackingSize, kPageSize);
+    setup.local = ibv_.AllocAlignedBufferByBytes(kOutstanding * kMessageSize);
+    setup.local_mr = ibv_.RegMr(setup.pd, setup.local);
+    if (!setup.local_mr) {
+      return absl::InternalError("Failed to register local mr.");
+    }
+    setup.cq = ibv_.CreateCq(setup.context, kOutstanding);
+    if (!setup.cq) {
+      return absl::InternalError("Failed to create cq.");
+    }
+    setup.requester =
+        ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr, kOutstanding,
+                      /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+    setup.responder =
+        ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr,
+                      /*max_send_wr=*/1, /*max_recv_wr=*/1, IBV_QPT_RC,
+                      /*sig_all=*/0);
+    if (!setup.requester || !setup.responder) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    // Enough READs in flight to keep the responder busy.
+    ibv_.SetUpLoopbackRcQps(setup.requester, setup.responder, setup.port_gid,
+                            {.max_rd_atomic = kOutstanding,
+                             .max_dest_rd_atomic = kOutstanding});
+    return setup;
+  }
+
+  // Registers |count| MRs of |size| bytes each, back to back from the start
+  // of the backing buffer.
+  absl::StatusOr<std::vector<ibv_mr*>> RegisterMrs(const BasicSetup& setup,
+                                                   size_t size, int count) {
+    std::vector<ibv_mr*> mrs;
+    mrs.reserve(count);
+    for (int i = 0; i < count; ++i) {
+      ibv_mr* mr = ibv_.RegMr(setup.pd, setup.backing.subblock(i * size, size));
+      if (!mr) {
+        return absl::InternalError(absl::StrCat("Failed to register mr ", i));
+      }
+      mrs.push_back(mr);
+    }
+    return mrs;
+  }
+
+  absl::Status DeregisterMrs(std::vector<ibv_mr*>& mrs) {
+    for (ibv_mr* mr : mrs) {
+      if (ibv_.DeregMr(mr) != 0) {
+        return absl::InternalError("Failed to deregister mr.");
+      }
+    }
+    mrs.clear();
+    return absl::OkStatus();
+  }
+
+  // Keeps kOutstanding |opcode| operations at random targets in |mrs| in
+  // flight for kRunTime and returns the operations per second.
+  absl::StatusOr<double> Run(const BasicSetup& setup,
+                             const std::vector<ibv_mr*>& mrs, size_t size,
+                             ibv_wr_opcode opcode) {
+    absl::BitGen bitgen;
+    uint32_t messages_per_mr = size / kMessageSize;
+    auto post = [&](int slot) -> absl::Status {
+      ibv_mr* mr = mrs[absl::Uniform<size_t>(bitgen, 0, mrs.size())];
+      uint8_t* remote = static_cast<uint8_t*>(mr->addr) +
+                        absl::Uniform<uint32_t>(bitgen, 0, messages_per_mr) *
+                            kMessageSize;
+      ibv_sge sge = verbs_util::CreateSge(
+          setup.local.subspan(slot * kMessageSize, kMessageSize),
+          setup.local_mr);
+      ibv_send_wr wr = verbs_util::CreateReadWr(slot, &sge, /*num_sge=*/1,
+                                                remote, mr->rkey);
+      wr.opcode = opcode;
+      ibv_send_wr* bad_wr;
+      if (ibv_post_send(setup.requester, &wr, &bad_wr) != 0) {
+        return absl::InternalError("Failed to post.");
+      }
+      return absl::OkStatus();
+    };
+
+    for (int slot = 0; slot < kOutstanding; ++slot) {
+      RETURN_IF_ERROR(post(slot));
+    }
+    int outstanding = kOutstanding;
+    uint64_t completed = 0;
+    std::array<ibv_wc, kOutstanding> completions;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (outstanding > 0) {
+      int count =
+          ibv_poll_cq(setup.cq, completions.size(), completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll cq.");
+      }
+      absl::Time now = absl::Now();
+      if (count == 0 && now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Operation failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        ++completed;
+        if (now < stop) {
+          RETURN_IF_ERROR(post(completions[i].wr_id));
+        } else {
+          --outstanding;
+        }
+      }
+    }
+    return completed / absl::ToDoubleSeconds(absl::Now() - start);
+  }
+
+  void Sweep(absl::string_view backing) {
+    ASSERT_OK_AND_ASSIGN(BasicSetup setup,
+                         CreateBasicSetup(backing == "hugepage"));
+    int max_mrs = std::min(Introspection().device_attr().max_mr, kMaxMrs);
+    for (size_t size : kMrSizes) {
+      int limit = std::min<size_t>(max_mrs, kBackingSize / size);
+      for (int count = 1; count <= limit; count *= 4) {
+        std::string name = absl::StrCat(backing, "_", size, "_", count);
+        absl::Time start = absl::Now();
+        ASSERT_OK_AND_ASSIGN(std::vector<ibv_mr*> mrs,
+                             RegisterMrs(setup, size, count));
+        Report(absl::StrCat(name, "_reg"),
+               absl::ToDoubleMicroseconds(absl::Now() - start) / count, "us");
+        ASSERT_OK_AND_ASSIGN(double reads,
+                             Run(setup, mrs, size, IBV_WR_RDMA_READ));
+        Report(absl::StrCat(name, "_read"), reads / 1e3, "kops");
+        ASSERT_OK_AND_ASSIGN(double writes,
+                             Run(setup, mrs, size, IBV_WR_RDMA_WRITE));
+        Report(absl::StrCat(name, "_write"), writes / 1e3, "kops");
+        ASSERT_OK(DeregisterMrs(mrs));
+      }
+    }
+  }
+};
+
+TEST_F(MrScalingBenchmark, RegularPages) { Sweep("regular"); }
+
+TEST_F(MrScalingBenchmark, Hugepages) {
+  if (!verbs_util::HugepageEnabled()) {
+    GTEST_SKIP() << "hugetlbfs is not mounted";
+  }
+  Sweep("hugepage");
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -0,0 +1,380 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Measures sustained memory window operation rates: type 1 binds through
+// ibv_bind_mw, type 2 bind WRs and local invalidates posted in chains, and
+// remote invalidation by SEND_WITH_INV. Each operation runs alone and
+// interleaved with one 64 byte RDMA WRITE per operation on the same QP. Only
+// window operations count towards the rates.
+//
+// A round posts one operation on each of kWindows windows and waits for all
+// of them, so up to kWindows operations are in flight. Rounds repeat until
+// kRunTime of timed work has accumulated. Work which only prepares a round,
+// such as binding the windows that a round invalidates, is not timed.
+class MwBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kWindows = 64;
+  static constexpr uint32_t kWindowSize = 4096;
+  static constexpr uint32_t kWriteSize = 64;
+  static constexpr int kWindowAccess =
+      IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(50);
+  // Operations per ibv_post_send for the chained operations.
+  static constexpr std::array<int, 3> kChains = {1, 8, kWindows};
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    // One slot per window, followed by the source and sink of the WRITEs.
+    RdmaMemBlock buffer;
+    ibv_mr* mr;
+    // Shared by both QPs.
+    ibv_cq* cq;
+    // Binds windows, invalidates them locally and receives SEND_WITH_INVs.
+    ibv_qp* qp;
+    // Sends the SEND_WITH_INVs.
+    ibv_qp* remote_qp;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup() {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.buffer =
+        ibv_.AllocAlignedBufferByBytes((kWindows + 1) * kWindowSize);
+    setup.mr = ibv_.RegMr(setup.pd, setup.buffer);
+    if (!setup.mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    // A SEND_WITH_INV round has a send, a WRITE and a recv per window.
+    setup.cq = ibv_.CreateCq(setup.context, 4 * kWindows);
+    if (!setup.cq) {
+      return absl::InternalError("Failed to create cq.");
+    }
+    setup.qp = ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr,
+                             2 * kWindows, kWindows, IBV_QPT_RC,
+                             /*sig_all=*/0);
+    setup.remote_qp = ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr,
+                                    2 * kWindows, kWindows, IBV_QPT_RC,
+                                    /*sig_all=*/0);
+    if (!setup.qp || !setup.remote_qp) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv_.SetUpLoopbackRcQps(setup.qp, setup.remote_qp, setup.port_gid);
+    return setup;
+  }
+
+  absl::StatusOr<std::vector<ibv_mw*>> AllocMws(const BasicSetup& setup,
+                                                ibv_mw_type type) {
+    std::vector<ibv_mw*> mws;
+    for (int i = 0; i < kWindows; ++i) {
+      ibv_mw* mw = ibv_.AllocMw(setup.pd, type);
+      if (!mw) {
+        return absl::InternalError("Failed to allocate mw.");
+      }
+      mws.push_back(mw);
+    }
+    return mws;
+  }
+
+  static absl::Span<uint8_t> WindowSlot(const BasicSetup& setup, int index) {
+    return setup.buffer.subspan(index * kWindowSize, kWindowSize);
+  }
+
+  // Returns a WRITE of kWriteSize bytes within the tail of the buffer. |sge|
+  // must outlive the WR.
+  static ibv_send_wr CreateDataWr(const BasicSetup& setup, ibv_sge* sge) {
+    absl::Span<uint8_t> data = setup.buffer.subspan(kWindows * kWindowSize);
+    *sge = verbs_util::CreateSge(data.subspan(0, kWriteSize), setup.mr);
+    return verbs_util::CreateWriteWr(/*wr_id=*/0, sge, /*num_sge=*/1,
+                                     data.data() + kWriteSize,
+                                     setup.mr->rkey);
+  }
+
+  // Posts |ops| to |qp| in chains of |chain| operations. With |interleave|
+  // every operation is followed by a WRITE within the same chain. Returns
+  // the number of WRs posted.
+  static absl::StatusOr<int> PostChains(const BasicSetup& setup, ibv_qp* qp,
+                                        absl::Span<const ibv_send_wr> ops,
+                                        int chain, bool interleave) {
+    ibv_sge sge;
+    ibv_send_wr data = CreateDataWr(setup, &sge);
+    std::vector<ibv_send_wr> wrs;
+    wrs.reserve(2 * ops.size());
+    for (const ibv_send_wr& op : ops) {
+      wrs.push_back(op);
+      if (interleave) {
+        wrs.push_back(data);
+      }
+    }
+    const int stride = interleave ? 2 * chain : chain;
+    for (size_t head = 0; head < wrs.size(); head += stride) {
+      size_t end = std::min(head + stride, wrs.size());
+      for (size_t i = head; i + 1 < end; ++i) {
+        wrs[i].next = &wrs[i + 1];
+      }
+      wrs[end - 1].next = nullptr;
+      ibv_send_wr* bad_wr;
+      if (ibv_post_send(qp, &wrs[head], &bad_wr) != 0) {
+        return absl::InternalError("Failed to post send.");
+      }
+    }
+    return wrs.size();
+  }
+
+  // Waits for |count| successful completions.
+  static absl::Status WaitForCompletions(ibv_cq* cq, int count) {
+    std::array<ibv_wc, 32> completions;
+    absl::Time deadline = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+    while (count > 0) {
+      int polled = ibv_poll_cq(cq, completions.size(), completions.data());
+      if (polled < 0) {
+        return absl::InternalError("Failed to poll cq.");
+      }
+      if (polled == 0 && absl::Now() > deadline) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (int i = 0; i < polled; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(
+              absl::StrCat("Completion failed: ",
+                           ibv_wc_status_str(completions[i].status)));
+        }
+      }
+      count -= polled;
+    }
+    return absl::OkStatus();
+  }
+
+  // Runs |round| until kRunTime of timed work has accumulated and returns
+  // the window operation rate in kops. |round| returns its timed part.
+  static absl::StatusOr<double> Rate(
+      absl::FunctionRef<absl::StatusOr<absl::Duration>()> round) {
+    absl::Duration elapsed;
+    int64_t ops = 0;
+    while (elapsed < kRunTime) {
+      ASSIGN_OR_RETURN(absl::Duration timed, round());
+      elapsed += timed;
+      ops += kWindows;
+    }
+    return ops / absl::ToDoubleSeconds(elapsed) / 1e3;
+  }
+
+  // Binds every type 1 window to its slot through ibv_bind_mw, which posts a
+  // WR of its own per call.
+  static absl::StatusOr<absl::Duration> BindType1(
+      const BasicSetup& setup, absl::Span<ibv_mw* const> mws,
+      bool interleave) {
+    ibv_sge sge;
+    ibv_send_wr data = CreateDataWr(setup, &sge);
+    absl::Time start = absl::Now();
+    for (int i = 0; i < kWindows; ++i) {
+      ibv_mw_bind bind = verbs_util::CreateType1MwBind(
+          i, WindowSlot(setup, i), setup.mr, kWindowAccess);
+      if (ibv_bind_mw(setup.qp, mws[i], &bind) != 0) {
+        return absl::InternalError("Failed to bind mw.");
+      }
+      if (interleave) {
+        ibv_send_wr* bad_wr;
+        if (ibv_post_send(setup.qp, &data, &bad_wr) != 0) {
+          return absl::InternalError("Failed to post write.");
+        }
+      }
+    }
+    RETURN_IF_ERROR(
+        WaitForCompletions(setup.cq, interleave ? 2 * kWindows : kWindows));
+    return absl::Now() - start;
+  }
+
+  // Binds every unbound type 2 window to its slot under a fresh rkey.
+  static absl::StatusOr<absl::Duration> BindType2(
+      const BasicSetup& setup, absl::Span<ibv_mw* const> mws, int chain,
+      bool interleave) {
+    std::vector<ibv_send_wr> binds;
+    std::vector<uint32_t> rkeys;
+    for (int i = 0; i < kWindows; ++i) {
+      rkeys.push_back(ibv_inc_rkey(mws[i]->rkey));
+      binds.push_back(verbs_util::CreateType2BindWr(
+          i, mws[i], WindowSlot(setup, i), rkeys.back(), setup.mr,
+          kWindowAccess));
+    }
+    absl::Time start = absl::Now();
+    ASSIGN_OR_RETURN(int posted,
+                     PostChains(setup, setup.qp, binds, chain, interleave));
+    RETURN_IF_ERROR(WaitForCompletions(setup.cq, posted));
+    absl::Duration elapsed = absl::Now() - start;
+    for (int i = 0; i < kWindows; ++i) {
+      mws[i]->rkey = rkeys[i];
+    }
+    return elapsed;
+  }
+
+  // Invalidates every bound type 2 window with LOCAL_INV.
+  static absl::StatusOr<absl::Duration> InvalidateLocal(
+      const BasicSetup& setup, absl::Span<ibv_mw* const> mws, int chain,
+      bool interleave) {
+    std::vector<ibv_send_wr> invalidates;
+    for (int i = 0; i < kWindows; ++i) {
+      invalidates.push_back(verbs_util::CreateInvalidateWr(i, mws[i]->rkey));
+    }
+    absl::Time start = absl::Now();
+    ASSIGN_OR_RETURN(int posted, PostChains(setup, setup.qp, invalidates,
+                                            chain, interleave));
+    RETURN_IF_ERROR(WaitForCompletions(setup.cq, posted));
+    return absl::Now() - start;
+  }
+
+  // Invalidates every bound type 2 window with a zero length SEND_WITH_INV
+  // from the remote QP. The WRITEs of |interleave| share the remote QP.
+  static absl::StatusOr<absl::Duration> InvalidateRemote(
+      const BasicSetup& setup, absl::Span<ibv_mw* const> mws, int chain,
+      bool interleave) {
+    std::vector<ibv_recv_wr> recvs;
+    std::vector<ibv_send_wr> sends;
+    for (int i = 0; i < kWindows; ++i) {
+      recvs.push_back(verbs_util::CreateRecvWr(i, nullptr, /*num_sge=*/0));
+      ibv_send_wr send = verbs_util::CreateSendWr(i, nullptr, /*num_sge=*/0);
+      send.opcode = IBV_WR_SEND_WITH_INV;
+      send.invalidate_rkey = mws[i]->rkey;
+      sends.push_back(send);
+    }
+    for (int i = 0; i + 1 < kWindows; ++i) {
+      recvs[i].next = &recvs[i + 1];
+    }
+    ibv_recv_wr* bad_recv;
+    if (ibv_post_recv(setup.qp, recvs.data(), &bad_recv) != 0) {
+      return absl::InternalError("Failed to post recvs.");
+    }
+    absl::Time start = absl::Now();
+    ASSIGN_OR_RETURN(int posted, PostChains(setup, setup.remote_qp, sends,
+                                            chain, interleave));
+    RETURN_IF_ERROR(WaitForCompletions(setup.cq, posted + kWindows));
+    return absl::Now() - start;
+  }
+
+  static std::string Name(absl::string_view operation, int chain,
+                          bool interleave) {
+    return absl::StrCat(operation, "_chain_", chain,
+                        interleave ? "_interleaved" : "");
+  }
+};
+
+TEST_F(MwBenchmark, Type1Bind) {
+  if (!Introspection().SupportsType1()) {
+    GTEST_SKIP() << "Nic does not support Type1 MW";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  ASSERT_OK_AND_ASSIGN(std::vector<ibv_mw*> mws,
+                       AllocMws(setup, IBV_MW_TYPE_1));
+  for (bool interleave : {false, true}) {
+    ASSERT_OK_AND_ASSIGN(double kops, Rate([&]() {
+                           return BindType1(setup, mws, interleave);
+                         }));
+    Report(absl::StrCat("type1_bind", interleave ? "_interleaved" : ""), kops,
+           "kops");
+  }
+}
+
+TEST_F(MwBenchmark, Type2BindAndLocalInvalidate) {
+  if (!Introspection().SupportsType2()) {
+    GTEST_SKIP() << "Nic does not support Type2 MW";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  ASSERT_OK_AND_ASSIGN(std::vector<ibv_mw*> mws,
+                       AllocMws(setup, IBV_MW_TYPE_2));
+  for (int chain : kChains) {
+    for (bool interleave : {false, true}) {
+      ASSERT_OK_AND_ASSIGN(
+          double bind_kops,
+          Rate([&]() -> absl::StatusOr<absl::Duration> {
+            ASSIGN_OR_RETURN(absl::Duration timed,
+                             BindType2(setup, mws, chain, interleave));
+            RETURN_IF_ERROR(InvalidateLocal(setup, mws, kWindows,
+                                            /*interleave=*/false)
+                                .status());
+            return timed;
+          }));
+      Report(Name("type2_bind", chain, interleave), bind_kops, "kops");
+      ASSERT_OK_AND_ASSIGN(
+          double invalidate_kops,
+          Rate([&]() -> absl::StatusOr<absl::Duration> {
+            RETURN_IF_ERROR(
+                BindType2(setup, mws, kWindows, /*interleave=*/false)
+                    .status());
+            return InvalidateLocal(setup, mws, chain, interleave);
+          }));
+      Report(Name("local_invalidate", chain, interleave), invalidate_kops,
+             "kops");
+    }
+  }
+}
+
+TEST_F(MwBenchmark, SendWithInvalidate) {
+  if (!Introspection().SupportsType2()) {
+    GTEST_SKIP() << "Nic does not support Type2 MW";
+  }
+  if (!Introspection().SupportsRcSendWithInvalidate()) {
+    GTEST_SKIP() << "Nic does not support SendWithInvalidate";
+  }
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  ASSERT_OK_AND_ASSIGN(std::vector<ibv_mw*> mws,
+                       AllocMws(setup, IBV_MW_TYPE_2));
+  for (int chain : kChains) {
+    for (bool interleave : {false, true}) {
+      ASSERT_OK_AND_ASSIGN(
+          double kops, Rate([&]() -> absl::StatusOr<absl::Duration> {
+            RETURN_IF_ERROR(
+                BindType2(setup, mws, kWindows, /*interleave=*/false)
+                    .status());
+            return InvalidateRemote(setup, mws, chain, interleave);
+          }));
+      Report(Name("send_with_invalidate", chain, interleave), kops, "kops");
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -0,0 +1,439 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// The ways to move a payload from an initiator into an application buffer of a
+// target, and notify the target.
+enum class Protocol {
+  // SEND into a pre-posted bounce buffer, then copy.
+  kEager,
+  // SEND a request; the target RDMA READs the payload.
+  kRendezvousRead,
+  // SEND a request; the target SENDs back a clear-to-send; the initiator RDMA
+  // WRITEs the payload followed by a SEND to finish.
+  kRendezvousWrite,
+  // RDMA WRITE WITH IMM into a buffer advertised ahead of time.
+  kWriteWithImm,
+};
+
+constexpr std::array<Protocol, 4> kProtocols = {
+    Protocol::kEager, Protocol::kRendezvousRead, Protocol::kRendezvousWrite,
+    Protocol::kWriteWithImm};
+
+absl::string_view ProtocolName(Protocol protocol) {
+  switch (protocol) {
+    case Protocol::kEager:
+      return "eager";
+    case Protocol::kRendezvousRead:
+      return "rendezvous_read";
+    case Protocol::kRendezvousWrite:
+      return "rendezvous_write";
+    case Protocol::kWriteWithImm:
+      return "write_with_imm";
+  }
+  return "unknown";
+}
+
+// Sweeps payload sizes over the four protocols, measuring the latency of
+// single transfers and the throughput of batches of transfers, and reports
+// where each rendezvous protocol overtakes eager send/recv. The latency
+// crossover is the eager_threshold of RpcEngineOptions for the device.
+// Initiator and target share a thread, so the numbers include the processing of
+// both sides. Recvs for each batch are posted before it starts, as a steady
+// state engine keeps them posted ahead.
+class ProtocolCrossoverBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr uint32_t kMinSize = 64;
+  static constexpr uint32_t kMaxSize = 256 * 1024;
+  // Transfers per batch in the throughput runs.
+  static constexpr int kMaxDepth = 16;
+  static constexpr int kLatencyIterations = 200;
+  static constexpr int kThroughputBatches = 20;
+  // The size of the requests, clear-to-sends and finishes of rendezvous.
+  static constexpr uint32_t kControlSize = 16;
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    // Transfer i moves slot i of |source| to slot i of |sink|. Eager transfers
+    // land in slot i of |bounce| first.
+    RdmaMemBlock source;
+    RdmaMemBlock sink;
+    RdmaMemBlock bounce;
+    // Target recv slots, initiator recv slots and one shared send slot.
+    RdmaMemBlock control;
+    ibv_mr* source_mr;
+    ibv_mr* sink_mr;
+    ibv_mr* bounce_mr;
+    ibv_mr* control_mr;
+    ibv_cq* initiator_cq;
+    ibv_cq* target_cq;
+    ibv_qp* initiator;
+    ibv_qp* target;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup() {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.source = ibv_.AllocAlignedBufferByBytes(kMaxDepth * kMaxSize);
+    setup.sink = ibv_.AllocAlignedBufferByBytes(kMaxDepth * kMaxSize);
+    setup.bounce = ibv_.AllocAlignedBufferByBytes(kMaxDepth * kMaxSize);
+    setup.control =
+        ibv_.AllocAlignedBufferByBytes((3 * kMaxDepth + 1) * kControlSize);
+    setup.source_mr = ibv_.RegMr(setup.pd, setup.source);
+    setup.sink_mr = ibv_.RegMr(setup.pd, setup.sink);
+    setup.bounce_mr = ibv_.RegMr(setup.pd, setup.bounce);
+    setup.control_mr = ibv_.RegMr(setup.pd, setup.control);
+    if (!setup.source_mr || !setup.sink_mr || !setup.bounce_mr ||
+        !setup.control_mr) {
+      return absl::InternalError("Failed to register mrs.");
+    }
+    setup.initiator_cq = ibv_.CreateCq(setup.context, 4 * kMaxDepth);
+    setup.target_cq = ibv_.CreateCq(setup.context, 4 * kMaxDepth);
+    if (!setup.initiator_cq || !setup.target_cq) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    setup.initiator = ibv_.CreateQp(
+        setup.pd, setup.initiator_cq, setup.initiator_cq, nullptr,
+        3 * kMaxDepth, 2 * kMaxDepth, IBV_QPT_RC, /*sig_all=*/0);
+    setup.target =
+        ibv_.CreateQp(setup.pd, setup.target_cq, setup.target_cq, nullptr,
+                      3 * kMaxDepth, 2 * kMaxDepth, IBV_QPT_RC,
+                      /*sig_all=*/0);
+    if (!setup.initiator || !setup.target) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv_.SetUpLoopbackRcQps(setup.initiator, setup.target, setup.port_gid);
+    return setup;
+  }
+
+  // Runs |depth| concurrent transfers of |size| bytes and returns the time
+  // until the target holds all payloads in its sink slots.
+  absl::StatusOr<absl::Duration> RunBatch(BasicSetup& setup, Protocol protocol,
+                                          uint32_t size, int depth) {
+    switch (protocol) {
+      case Protocol::kEager:
+        RETURN_IF_ERROR(PostRecvs(setup.target, setup.bounce.data(),
+                                  setup.bounce_mr, kMaxSize, size, depth));
+        break;
+      case Protocol::kRendezvousRead:
+        RETURN_IF_ERROR(PostRecvs(setup.target, TargetControl(setup),
+                                  setup.control_mr, kControlSize, kControlSize,
+                                  depth));
+        break;
+      case Protocol::kRendezvousWrite:
+        // Requests, then finishes.
+        RETURN_IF_ERROR(PostRecvs(setup.target, TargetControl(setup),
+                                  setup.control_mr, kControlSize, kControlSize,
+                                  2 * depth));
+        RETURN_IF_ERROR(PostRecvs(setup.initiator, InitiatorControl(setup),
+                                  setup.control_mr, kControlSize, kControlSize,
+                                  depth));
+        break;
+      case Protocol::kWriteWithImm:
+        RETURN_IF_ERROR(PostRecvs(setup.target, nullptr, nullptr, 0, 0, depth));
+        break;
+    }
+
+    absl::Time start = absl::Now();
+    // Signaled sends not yet completed, on each side.
+    int initiator_sends = 0;
+    int target_sends = 0;
+    for (int i = 0; i < depth; ++i) {
+      switch (protocol) {
+        case Protocol::kEager:
+          RETURN_IF_ERROR(Send(setup.initiator, Slot(setup.source, i), size,
+                               setup.source_mr));
+          break;
+        case Protocol::kRendezvousRead:
+        case Protocol::kRendezvousWrite:
+          RETURN_IF_ERROR(SendControl(setup, setup.initiator));
+          break;
+        case Protocol::kWriteWithImm: {
+          ibv_sge sge = verbs_util::CreateSge(
+              absl::MakeSpan(Slot(setup.source, i), size), setup.source_mr);
+          ibv_send_wr write = verbs_util::CreateWriteWr(
+              i, &sge, /*num_sge=*/1, Slot(setup.sink, i), setup.sink_mr->rkey);
+          write.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+          write.imm_data = i;
+          RETURN_IF_ERROR(Post(setup.initiator, write));
+          break;
+        }
+      }
+      ++initiator_sends;
+    }
+
+    int requests = 0;
+    int clear_to_sends = 0;
+    int delivered = 0;
+    RETURN_IF_ERROR(PollUntil(
+        setup,
+        [&](bool at_target, const ibv_wc& completion) -> absl::Status {
+          if (!at_target) {
+            if (completion.opcode != IBV_WC_RECV) {
+              --initiator_sends;
+              return absl::OkStatus();
+            }
+            // A clear-to-send: write the payload, then finish.
+            int i = clear_to_sends++;
+            ibv_sge sge = verbs_util::CreateSge(
+                absl::MakeSpan(Slot(setup.source, i), size), setup.source_mr);
+            ibv_send_wr write =
+                verbs_util::CreateWriteWr(i, &sge, /*num_sge=*/1,
+                                          Slot(setup.sink, i),
+                                          setup.sink_mr->rkey);
+            write.send_flags = 0;
+            RETURN_IF_ERROR(Post(setup.initiator, write));
+            ++initiator_sends;
+            return SendControl(setup, setup.initiator);
+          }
+          switch (completion.opcode) {
+            case IBV_WC_RECV:
+              break;
+            case IBV_WC_RDMA_READ:
+            case IBV_WC_RECV_RDMA_WITH_IMM:
+              ++delivered;
+              return absl::OkStatus();
+            default:
+              --target_sends;
+              return absl::OkStatus();
+          }
+          switch (protocol) {
+            case Protocol::kEager: {
+              int i = completion.wr_id;
+              memcpy(Slot(setup.sink, i), Slot(setup.bounce, i), size);
+              ++delivered;
+              return absl::OkStatus();
+            }
+            case Protocol::kRendezvousRead: {
+              int i = requests++;
+              ibv_sge sge = verbs_util::CreateSge(
+                  absl::MakeSpan(Slot(setup.sink, i), size), setup.sink_mr);
+              ibv_send_wr read = verbs_util::CreateReadWr(
+                  i, &sge, /*num_sge=*/1, Slot(setup.source, i),
+                  setup.source_mr->rkey);
+              return Post(setup.target, read);
+            }
+            case Protocol::kRendezvousWrite:
+              // All requests precede all finishes in the initiator send queue.
+              if (requests < depth) {
+                ++requests;
+                ++target_sends;
+                return SendControl(setup, setup.target);
+              }
+              ++delivered;
+              return absl::OkStatus();
+            case Protocol::kWriteWithImm:
+              break;
+          }
+          return absl::InternalError("Unexpected recv completion.");
+        },
+        [&]() { return delivered == depth; }));
+    absl::Duration elapsed = absl::Now() - start;
+
+    // Start the next batch from empty CQs.
+    RETURN_IF_ERROR(PollUntil(
+        setup,
+        [&](bool at_target, const ibv_wc& completion) -> absl::Status {
+          --(at_target ? target_sends : initiator_sends);
+          return absl::OkStatus();
+        },
+        [&]() { return initiator_sends == 0 && target_sends == 0; }));
+    return elapsed;
+  }
+
+ private:
+  static uint8_t* Slot(const RdmaMemBlock& buffer, int index) {
+    return buffer.data() + index * kMaxSize;
+  }
+
+  static uint8_t* TargetControl(const BasicSetup& setup) {
+    return setup.control.data();
+  }
+
+  static uint8_t* InitiatorControl(const BasicSetup& setup) {
+    return setup.control.data() + 2 * kMaxDepth * kControlSize;
+  }
+
+  static absl::Status Post(ibv_qp* qp, ibv_send_wr& wr) {
+    ibv_send_wr* bad_wr;
+    if (ibv_post_send(qp, &wr, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post send.");
+    }
+    return absl::OkStatus();
+  }
+
+  static absl::Status Send(ibv_qp* qp, uint8_t* buffer, uint32_t size,
+                           ibv_mr* mr) {
+    ibv_sge sge = verbs_util::CreateSge(absl::MakeSpan(buffer, size), mr);
+    ibv_send_wr send = verbs_util::CreateSendWr(0, &sge, /*num_sge=*/1);
+    return Post(qp, send);
+  }
+
+  static absl::Status SendControl(const BasicSetup& setup, ibv_qp* qp) {
+    return Send(qp, setup.control.data() + 3 * kMaxDepth * kControlSize,
+                kControlSize, setup.control_mr);
+  }
+
+  // Posts |count| recvs with wr_ids 0 to count - 1, into slots of |stride|
+  // bytes at |base|. A null |base| posts recvs without buffers.
+  static absl::Status PostRecvs(ibv_qp* qp, uint8_t* base, ibv_mr* mr,
+                                uint32_t stride, uint32_t size, int count) {
+    for (int i = 0; i < count; ++i) {
+      ibv_sge sge;
+      ibv_recv_wr recv = verbs_util::CreateRecvWr(i, &sge, /*num_sge=*/0);
+      if (base != nullptr) {
+        sge = verbs_util::CreateSge(absl::MakeSpan(base + i * stride, size),
+                                    mr);
+        recv.num_sge = 1;
+      }
+      ibv_recv_wr* bad_wr;
+      if (ibv_post_recv(qp, &recv, &bad_wr) != 0) {
+        return absl::InternalError("Failed to post recv.");
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  // Drains both CQs into |handle| until |done| returns true.
+  static absl::Status PollUntil(
+      const BasicSetup& setup,
+      absl::FunctionRef<absl::Status(bool at_target, const ibv_wc&)> handle,
+      absl::FunctionRef<bool()> done) {
+    std::array<ibv_wc, kMaxDepth> completions;
+    absl::Time stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+    while (!done()) {
+      if (absl::Now() > stop) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (bool at_target : {false, true}) {
+        ibv_cq* cq = at_target ? setup.target_cq : setup.initiator_cq;
+        int count = ibv_poll_cq(cq, completions.size(), completions.data());
+        if (count < 0) {
+          return absl::InternalError("Failed to poll cq.");
+        }
+        for (int i = 0; i < count; ++i) {
+          if (completions[i].status != IBV_WC_SUCCESS) {
+            return absl::InternalError(absl::StrCat(
+                "Completion failed: ",
+                ibv_wc_status_str(completions[i].status)));
+          }
+          RETURN_IF_ERROR(handle(at_target, completions[i]));
+        }
+      }
+    }
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(ProtocolCrossoverBenchmark, Sweep) {
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  std::vector<uint32_t> sizes;
+  for (uint32_t size = kMinSize; size <= kMaxSize; size *= 2) {
+    sizes.push_back(size);
+  }
+  // Median latency in microseconds and throughput in Gbps, by protocol and
+  // size.
+  std::array<std::vector<double>, kProtocols.size()> latency;
+  std::array<std::vector<double>, kProtocols.size()> throughput;
+  for (uint32_t size : sizes) {
+    for (size_t p = 0; p < kProtocols.size(); ++p) {
+      Protocol protocol = kProtocols[p];
+      std::string name = absl::StrCat(ProtocolName(protocol), "_", size);
+      // Warm up.
+      ASSERT_OK(RunBatch(setup, protocol, size, kMaxDepth).status());
+
+      LatencySamples samples;
+      for (int i = 0; i < kLatencyIterations; ++i) {
+        ASSERT_OK_AND_ASSIGN(absl::Duration elapsed,
+                             RunBatch(setup, protocol, size, /*depth=*/1));
+        samples.Add(elapsed);
+      }
+      latency[p].push_back(absl::ToDoubleMicroseconds(samples.Percentile(50)));
+      Report(absl::StrCat(name, "_p50"), latency[p].back(), "us");
+
+      absl::Duration total;
+      for (int i = 0; i < kThroughputBatches; ++i) {
+        ASSERT_OK_AND_ASSIGN(absl::Duration elapsed,
+                             RunBatch(setup, protocol, size, kMaxDepth));
+        total += elapsed;
+      }
+      throughput[p].push_back(8.0 * size * kMaxDepth * kThroughputBatches /
+                              absl::ToDoubleNanoseconds(total));
+      Report(name, throughput[p].back(), "gbps");
+    }
+  }
+
+  // The crossover of a protocol is the smallest size from which on it is at
+  // least as good as eager.
+  auto report_crossover = [&](absl::string_view name,
+                              const std::vector<double>& eager,
+                              const std::vector<double>& other,
+                              bool lower_is_better) {
+    size_t first = sizes.size();
+    while (first > 0) {
+      double difference = other[first - 1] - eager[first - 1];
+      if (lower_is_better ? difference > 0 : difference < 0) {
+        break;
+      }
+      --first;
+    }
+    if (first == sizes.size()) {
+      LOG(INFO) << name << ": eager is better up to " << kMaxSize << " bytes.";
+      return;
+    }
+    Report(name, sizes[first], "bytes");
+  };
+  for (size_t p = 1; p < kProtocols.size(); ++p) {
+    absl::string_view protocol = ProtocolName(kProtocols[p]);
+    report_crossover(absl::StrCat(protocol, "_latency_crossover"), latency[0],
+                     latency[p], /*lower_is_better=*/true);
+    report_crossover(absl::StrCat(protocol, "_throughput_crossover"),
+                     throughput[0], throughput[p], /*lower_is_better=*/false);
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
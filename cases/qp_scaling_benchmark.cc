@@ -0,0 +1,232 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Spreads a fixed load of small RDMA WRITEs over a growing number of loopback
+// RC QP pairs, from one pair up to the device max_qp, to find where the QP
+// context cache of the NIC stops covering the working set. Each step reports
+// throughput and latency with the QP of every WRITE picked uniformly and
+// Zipf distributed, which keeps a hot set cached however many QPs exist.
+class QpScalingBenchmark : public BenchmarkFixture {
+ protected:
+  // The aggregate load: WRITEs kept in flight over all QPs.
+  static constexpr int kOutstanding = 64;
+  // WRITEs in flight on any one QP. A QP already this busy is picked again.
+  static constexpr int kQpDepth = 4;
+  static constexpr uint32_t kMessageSize = 64;
+  static constexpr int kMaxPairs = 32 * 1024;
+  static constexpr double kZipfExponent = 1.1;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(100);
+
+  enum class Distribution { kUniform, kZipf };
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock buffer;
+    ibv_mr* mr;
+    ibv_cq* requester_cq;
+    ibv_cq* responder_cq;
+    // The requesters of the pairs set up so far.
+    std::vector<ibv_qp*> qps;
+  };
+
+  struct Result {
+    uint64_t writes = 0;
+    absl::Duration elapsed;
+    LatencySamples latency;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup() {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.buffer = ibv_.AllocAlignedBufferByBytes(2 * kMessageSize);
+    setup.mr = ibv_.RegMr(setup.pd, setup.buffer);
+    if (!setup.mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    setup.requester_cq = ibv_.CreateCq(setup.context, kOutstanding);
+    setup.responder_cq = ibv_.CreateCq(setup.context);
+    if (!setup.requester_cq || !setup.responder_cq) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    return setup;
+  }
+
+  // Sets up loopback pairs until there are |pairs|. Returns false if the
+  // device runs out of QPs first.
+  bool GrowTo(BasicSetup& setup, int pairs) {
+    while (setup.qps.size() < static_cast<size_t>(pairs)) {
+      // WRITEs are posted inline, which takes more than the default
+      // max_inline_data.
+      ibv_qp_cap cap = verbs_util::DefaultQpCap();
+      cap.max_send_wr = kQpDepth;
+      cap.max_recv_wr = 1;
+      cap.max_inline_data = kMessageSize;
+      ibv_qp_init_attr attr = {.send_cq = setup.requester_cq,
+                               .recv_cq = setup.requester_cq,
+                               .srq = nullptr,
+                               .cap = cap,
+                               .qp_type = IBV_QPT_RC,
+                               .sq_sig_all = 0};
+      ibv_qp* requester = ibv_.CreateQp(setup.pd, attr);
+      if (!requester) {
+        return false;
+      }
+      ibv_qp* responder = ibv_.CreateQp(
+          setup.pd, setup.responder_cq, setup.responder_cq, nullptr,
+          /*max_send_wr=*/1, /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+      if (!responder) {
+        return false;
+      }
+      ibv_.SetUpLoopbackRcQps(requester, responder, setup.port_gid);
+      setup.qps.push_back(requester);
+    }
+    return true;
+  }
+
+  // Keeps kOutstanding WRITEs in flight over all QPs of |setup| for kRunTime.
+  absl::StatusOr<Result> Run(const BasicSetup& setup,
+                             Distribution distribution) {
+    absl::BitGen bitgen;
+    uint32_t last = setup.qps.size() - 1;
+    std::vector<uint8_t> depths(setup.qps.size(), 0);
+    std::array<absl::Time, kOutstanding> starts;
+    std::array<uint32_t, kOutstanding> qp_of_slot;
+    ibv_sge sge = verbs_util::CreateSge(
+        setup.buffer.subspan(0, kMessageSize), setup.mr);
+    auto post = [&](int slot) -> absl::Status {
+      uint32_t qp;
+      do {
+        qp = distribution == Distribution::kUniform
+                 ? absl::Uniform<uint32_t>(absl::IntervalClosed, bitgen, 0,
+                                           last)
+                 : absl::Zipf<uint32_t>(bitgen, last, kZipfExponent);
+      } while (depths[qp] >= kQpDepth);
+      ++depths[qp];
+      qp_of_slot[slot] = qp;
+      ibv_send_wr write = verbs_util::CreateWriteWr(
+          slot, &sge, /*num_sge=*/1, setup.buffer.data() + kMessageSize,
+          setup.mr->rkey);
+      write.send_flags |= IBV_SEND_INLINE;
+      starts[slot] = absl::Now();
+      ibv_send_wr* bad_wr;
+      if (ibv_post_send(setup.qps[qp], &write, &bad_wr) != 0) {
+        return absl::InternalError("Failed to post write.");
+      }
+      return absl::OkStatus();
+    };
+
+    Result result;
+    // Fewer pairs than kOutstanding cannot take the whole load.
+    int outstanding = std::min<int>(kOutstanding, setup.qps.size() * kQpDepth);
+    for (int slot = 0; slot < outstanding; ++slot) {
+      RETURN_IF_ERROR(post(slot));
+    }
+    std::array<ibv_wc, kOutstanding> completions;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (outstanding > 0) {
+      int count = ibv_poll_cq(setup.requester_cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll cq.");
+      }
+      absl::Time now = absl::Now();
+      if (count == 0 && now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Write failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        int slot = completions[i].wr_id;
+        --depths[qp_of_slot[slot]];
+        ++result.writes;
+        result.latency.Add(now - starts[slot]);
+        if (now < stop) {
+          RETURN_IF_ERROR(post(slot));
+        } else {
+          --outstanding;
+        }
+      }
+    }
+    result.elapsed = absl::Now() - start;
+    return result;
+  }
+
+  void ReportResult(absl::string_view name, Result& result) {
+    Report(name, result.writes / absl::ToDoubleSeconds(result.elapsed) / 1e3,
+           "kops");
+    Report(absl::StrCat(name, "_p50"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(50)), "us");
+    Report(absl::StrCat(name, "_p99"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(99)), "us");
+  }
+};
+
+TEST_F(QpScalingBenchmark, Sweep) {
+  int max_pairs =
+      std::min(Introspection().device_attr().max_qp / 2, kMaxPairs);
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  for (int pairs = 1; pairs <= max_pairs; pairs *= 2) {
+    if (!GrowTo(setup, pairs)) {
+      LOG(INFO) << "Ran out of QPs after " << setup.qps.size() << " pairs.";
+      break;
+    }
+    int qps = 2 * pairs;
+    ASSERT_OK_AND_ASSIGN(Result uniform, Run(setup, Distribution::kUniform));
+    ReportResult(absl::StrCat("uniform_", qps), uniform);
+    ASSERT_OK_AND_ASSIGN(Result zipf, Run(setup, Distribution::kZipf));
+    ReportResult(absl::StrCat("zipf_", qps), zipf);
+  }
+  EXPECT_FALSE(setup.qps.empty());
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -684,6 +684,25 @@ TEST_F(QpStateTest, ModRtsToError) {
   ASSERT_EQ(verbs_util::GetQpState(setup.local_qp), IBV_QPS_ERR);
 }
 
+TEST_F(QpStateTest, RdAtomicDepthClampedToDevice) {
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  const ibv_device_attr& device_attr = Introspection().device_attr();
+  verbs_util::RcConnectionParams params{.max_rd_atomic = 255,
+                                        .max_dest_rd_atomic = 255};
+  ibv_.SetUpLoopbackRcQps(setup.local_qp, setup.remote_qp, setup.port_gid,
+                          params);
+  ibv_qp_attr attr;
+  ibv_qp_init_attr init_attr;
+  ASSERT_EQ(ibv_query_qp(setup.local_qp, &attr,
+                         IBV_QP_MAX_QP_RD_ATOMIC | IBV_QP_MAX_DEST_RD_ATOMIC,
+                         &init_attr),
+            0);
+  EXPECT_GT(attr.max_rd_atomic, 0);
+  EXPECT_LE(attr.max_rd_atomic, device_attr.max_qp_init_rd_atom);
+  EXPECT_GT(attr.max_dest_rd_atomic, 0);
+  EXPECT_LE(attr.max_dest_rd_atomic, device_attr.max_qp_rd_atom);
+}
+
 // This is a set of test that test the response (in particular error code) of
 // the QP when posting.
 class QpPostTest : public BasicFixture {
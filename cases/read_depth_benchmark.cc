@@ -0,0 +1,181 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Sweeps RDMA READ bandwidth over the initiator depth, the max_rd_atomic of
+// the requester and max_dest_rd_atomic of the responder, and the message
+// size. The send queue always holds more READs than the deepest setting, so
+// the depth alone bounds the READs in flight. Also reports the device limits
+// on both depths, the ceiling of the sweep.
+class ReadDepthBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kQueueDepth = 256;
+  static constexpr uint32_t kMaxSize = 1024 * 1024;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(50);
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    // Every READ copies the start of |source| to the start of |sink|.
+    RdmaMemBlock source;
+    RdmaMemBlock sink;
+    ibv_mr* source_mr;
+    ibv_mr* sink_mr;
+    ibv_cq* cq;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup() {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.source = ibv_.AllocAlignedBufferByBytes(kMaxSize);
+    setup.sink = ibv_.AllocAlignedBufferByBytes(kMaxSize);
+    setup.source_mr = ibv_.RegMr(setup.pd, setup.source);
+    setup.sink_mr = ibv_.RegMr(setup.pd, setup.sink);
+    if (!setup.source_mr || !setup.sink_mr) {
+      return absl::InternalError("Failed to register mrs.");
+    }
+    setup.cq = ibv_.CreateCq(setup.context, kQueueDepth);
+    if (!setup.cq) {
+      return absl::InternalError("Failed to create cq.");
+    }
+    return setup;
+  }
+
+  // Creates a loopback QP pair connected with |depth| as both limits, and
+  // returns the requester.
+  absl::StatusOr<ibv_qp*> CreateQps(const BasicSetup& setup, uint8_t depth) {
+    ibv_qp* requester =
+        ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr, kQueueDepth,
+                      /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+    ibv_qp* responder =
+        ibv_.CreateQp(setup.pd, setup.cq, setup.cq, nullptr,
+                      /*max_send_wr=*/1, /*max_recv_wr=*/1, IBV_QPT_RC,
+                      /*sig_all=*/0);
+    if (!requester || !responder) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv_.SetUpLoopbackRcQps(
+        requester, responder, setup.port_gid,
+        {.max_rd_atomic = depth, .max_dest_rd_atomic = depth});
+    return requester;
+  }
+
+  // Keeps kQueueDepth READs of |size| bytes posted for kRunTime and returns
+  // the bandwidth in Gbps.
+  absl::StatusOr<double> Run(const BasicSetup& setup, ibv_qp* qp,
+                             uint32_t size) {
+    ibv_sge sge = verbs_util::CreateSge(setup.sink.subspan(0, size),
+                                        setup.sink_mr);
+    ibv_send_wr read =
+        verbs_util::CreateReadWr(/*wr_id=*/0, &sge, /*num_sge=*/1,
+                                 setup.source.data(), setup.source_mr->rkey);
+    auto post = [&]() -> absl::Status {
+      ibv_send_wr* bad_wr;
+      if (ibv_post_send(qp, &read, &bad_wr) != 0) {
+        return absl::InternalError("Failed to post read.");
+      }
+      return absl::OkStatus();
+    };
+    for (int i = 0; i < kQueueDepth; ++i) {
+      RETURN_IF_ERROR(post());
+    }
+    int outstanding = kQueueDepth;
+    uint64_t completed = 0;
+    std::array<ibv_wc, 32> completions;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (outstanding > 0) {
+      int count = ibv_poll_cq(setup.cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll cq.");
+      }
+      absl::Time now = absl::Now();
+      if (count == 0 && now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling completions.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Read failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        ++completed;
+        if (now < stop) {
+          RETURN_IF_ERROR(post());
+        } else {
+          --outstanding;
+        }
+      }
+    }
+    absl::Duration elapsed = absl::Now() - start;
+    return completed * size * 8 / absl::ToDoubleSeconds(elapsed) / 1e9;
+  }
+};
+
+TEST_F(ReadDepthBenchmark, Sweep) {
+  const ibv_device_attr& device_attr = Introspection().device_attr();
+  Report("max_qp_init_rd_atom", device_attr.max_qp_init_rd_atom, "count");
+  Report("max_qp_rd_atom", device_attr.max_qp_rd_atom, "count");
+  int ceiling =
+      std::min(device_attr.max_qp_init_rd_atom, device_attr.max_qp_rd_atom);
+  ASSERT_GT(ceiling, 0);
+  ceiling = std::min(ceiling, kQueueDepth - 1);
+  std::vector<int> depths;
+  for (int depth = 1; depth < ceiling; depth *= 2) {
+    depths.push_back(depth);
+  }
+  depths.push_back(ceiling);
+
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  for (int depth : depths) {
+    ASSERT_OK_AND_ASSIGN(ibv_qp * qp, CreateQps(setup, depth));
+    for (uint32_t size = 256; size <= kMaxSize; size *= 16) {
+      ASSERT_OK_AND_ASSIGN(double gbps, Run(setup, qp, size));
+      Report(absl::StrCat("depth_", depth, "_", size), gbps, "gbps");
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
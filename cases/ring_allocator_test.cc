@@ -0,0 +1,184 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "public/ring_allocator.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+
+namespace rdma_unit_test {
+namespace {
+
+using Reservation = RingAllocator::Reservation;
+
+// The allocator only reads the address range and lkey of its MR, so the tests
+// run without a device.
+class RingAllocatorTest : public testing::Test {
+ protected:
+  static constexpr size_t kCapacity = 64;
+  static constexpr uint32_t kLkey = 0x1234;
+
+  RingAllocatorTest() : memory_(kCapacity) {
+    mr_.addr = memory_.data();
+    mr_.length = memory_.size();
+    mr_.lkey = kLkey;
+  }
+
+  absl::Span<uint8_t> buffer() { return absl::MakeSpan(memory_); }
+
+  std::vector<uint8_t> memory_;
+  ibv_mr mr_ = {};
+};
+
+TEST_F(RingAllocatorTest, ReservesInRingOrder) {
+  RingAllocator allocator(buffer(), &mr_);
+  EXPECT_EQ(allocator.capacity(), kCapacity);
+  for (uint64_t position = 0; position < kCapacity; position += 16) {
+    absl::optional<Reservation> reservation = allocator.Reserve(16);
+    ASSERT_TRUE(reservation.has_value());
+    EXPECT_EQ(reservation->position, position);
+    EXPECT_EQ(reservation->length, 16);
+    EXPECT_EQ(allocator.Data(*reservation).data(), memory_.data() + position);
+    ibv_sge sge = allocator.Sge(*reservation);
+    EXPECT_EQ(sge.addr, reinterpret_cast<uint64_t>(memory_.data() + position));
+    EXPECT_EQ(sge.length, 16);
+    EXPECT_EQ(sge.lkey, kLkey);
+  }
+  EXPECT_EQ(allocator.used(), kCapacity);
+  EXPECT_FALSE(allocator.Reserve(1).has_value());
+  EXPECT_FALSE(allocator.Reserve(kCapacity + 1).has_value());
+}
+
+TEST_F(RingAllocatorTest, WrapSkipsTail) {
+  RingAllocator allocator(buffer(), &mr_);
+  absl::optional<Reservation> first = allocator.Reserve(24);
+  absl::optional<Reservation> second = allocator.Reserve(24);
+  ASSERT_TRUE(first.has_value() && second.has_value());
+  allocator.Release(*first);
+  EXPECT_EQ(allocator.used(), 24);
+
+  // 24 bytes do not fit in the 16 left before the end, so the reservation
+  // skips them and starts at the beginning of the buffer.
+  absl::optional<Reservation> wrapped = allocator.Reserve(24);
+  ASSERT_TRUE(wrapped.has_value());
+  EXPECT_EQ(wrapped->position, kCapacity);
+  EXPECT_EQ(allocator.Data(*wrapped).data(), memory_.data());
+  // The skipped bytes count as used until the wrapped reservation is released.
+  EXPECT_EQ(allocator.used(), kCapacity);
+  EXPECT_FALSE(allocator.Reserve(1).has_value());
+
+  allocator.Release(*second);
+  EXPECT_EQ(allocator.used(), 40);
+  absl::optional<Reservation> next = allocator.Reserve(16);
+  ASSERT_TRUE(next.has_value());
+  EXPECT_EQ(next->position, kCapacity + 24);
+  allocator.Release(*next);
+  EXPECT_EQ(allocator.used(), 0);
+}
+
+TEST_F(RingAllocatorTest, ReserveBulk) {
+  RingAllocator allocator(buffer(), &mr_);
+  std::array<Reservation, 3> reservations;
+  ASSERT_TRUE(allocator.ReserveBulk(16, absl::MakeSpan(reservations)));
+  for (size_t i = 0; i < reservations.size(); ++i) {
+    EXPECT_EQ(reservations[i].position, 16 * i);
+    EXPECT_EQ(reservations[i].length, 16);
+  }
+  EXPECT_EQ(allocator.used(), 48);
+
+  // Two more do not fit, and neither is reserved.
+  std::array<Reservation, 2> too_many;
+  EXPECT_FALSE(allocator.ReserveBulk(16, absl::MakeSpan(too_many)));
+  EXPECT_EQ(allocator.used(), 48);
+
+  // A bulk reservation wraps like single ones.
+  allocator.Release(reservations.back());
+  std::array<Reservation, 2> wrapping;
+  ASSERT_TRUE(allocator.ReserveBulk(24, absl::MakeSpan(wrapping)));
+  EXPECT_EQ(wrapping[0].position, kCapacity);
+  EXPECT_EQ(wrapping[1].position, kCapacity + 24);
+  EXPECT_EQ(allocator.used(), 64);
+}
+
+TEST_F(RingAllocatorTest, ReleaseRetiresOlderReservations) {
+  RingAllocator allocator(buffer(), &mr_);
+  std::array<Reservation, 3> reservations;
+  ASSERT_TRUE(allocator.ReserveBulk(16, absl::MakeSpan(reservations)));
+  allocator.Release(reservations[1]);
+  EXPECT_EQ(allocator.used(), 16);
+  // The first reservation was retired with the second.
+  allocator.Release(reservations[0]);
+  EXPECT_EQ(allocator.used(), 16);
+  // Its space is reused in ring order, after the last reservation.
+  absl::optional<Reservation> next = allocator.Reserve(16);
+  ASSERT_TRUE(next.has_value());
+  EXPECT_EQ(next->position, 48);
+  EXPECT_EQ(allocator.used(), 32);
+}
+
+TEST_F(RingAllocatorTest, MultiProducerReservesDisjointSpace) {
+  constexpr int kThreads = 4;
+  constexpr int kPerThread = 1000;
+  constexpr uint64_t kLength = 8;
+  std::vector<uint8_t> memory(kThreads * kPerThread * kLength);
+  ibv_mr mr = {};
+  mr.addr = memory.data();
+  mr.length = memory.size();
+  RingAllocator allocator(absl::MakeSpan(memory), &mr,
+                          RingAllocator::Mode::kMultiProducer);
+  std::vector<std::vector<uint64_t>> positions(kThreads);
+  std::vector<std::thread> producers;
+  for (int thread = 0; thread < kThreads; ++thread) {
+    producers.emplace_back([&, thread]() {
+      for (int i = 0; i < kPerThread; ++i) {
+        absl::optional<Reservation> reservation = allocator.Reserve(kLength);
+        if (!reservation.has_value()) {
+          return;
+        }
+        positions[thread].push_back(reservation->position);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  // Every slot was handed out exactly once.
+  std::vector<uint64_t> all;
+  for (const std::vector<uint64_t>& thread_positions : positions) {
+    EXPECT_EQ(thread_positions.size(), kPerThread);
+    // Each producer sees the ring advance.
+    EXPECT_TRUE(
+        std::is_sorted(thread_positions.begin(), thread_positions.end()));
+    all.insert(all.end(), thread_positions.begin(), thread_positions.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), kThreads * kPerThread);
+  for (size_t i = 0; i < all.size(); ++i) {
+    ASSERT_EQ(all[i], i * kLength);
+  }
+  EXPECT_EQ(allocator.used(), memory.size());
+  EXPECT_FALSE(allocator.Reserve(kLength).has_value());
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
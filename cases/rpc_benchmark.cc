@@ -0,0 +1,162 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <cstdint>
+#include <thread>  // NOLINT
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rpc_engine.h"
+#include "public/status_matchers.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+absl::string_view OperationName(RpcOperation operation) {
+  return operation == RpcOperation::kRead ? "read" : "write";
+}
+
+// Throughput and latency of the RPC engine with the server polling on a thread
+// of its own, the way a storage service runs it.
+class RpcBenchmark : public BenchmarkFixture {
+ public:
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(250);
+
+  void SetUp() override {
+    if (!Introspection().SupportsType2()) {
+      GTEST_SKIP() << "Skipping due to lack of Type2 MW support.";
+    }
+  }
+
+ protected:
+  struct Result {
+    uint64_t rpcs = 0;
+    uint64_t bytes = 0;
+    absl::Duration elapsed;
+    LatencySamples latency;
+  };
+
+  // Keeps the client pipeline full of |operation| RPCs of |size| bytes for
+  // kRunTime.
+  absl::StatusOr<Result> Run(const RpcEngineOptions& options,
+                             RpcOperation operation, uint32_t size) {
+    RpcClient client(ibv_, options);
+    RpcServer server(ibv_, options);
+    client.Connect(ibv_, server);
+    server.Connect(ibv_, client);
+    std::atomic<bool> done = false;
+    std::thread server_thread([&server, &done]() {
+      while (!done.load(std::memory_order_relaxed)) {
+        server.Poll();
+      }
+    });
+
+    Result result;
+    uint64_t seed = 0;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    absl::Status status = absl::OkStatus();
+    while (absl::Now() < stop || client.outstanding() > 0) {
+      absl::Time now = absl::Now();
+      if (now > deadline) {
+        status = absl::DeadlineExceededError("Timed out draining RPCs.");
+        break;
+      }
+      if (now < stop) {
+        while (client.StartRpc(operation, size, seed).has_value()) {
+          ++seed;
+        }
+      }
+      client.Poll();
+      while (absl::optional<RpcCompletion> completion =
+                 client.NextCompletion()) {
+        EXPECT_EQ(completion->result, RpcResult::kSuccess);
+        ++result.rpcs;
+        result.bytes += completion->length;
+        result.latency.Add(completion->latency);
+      }
+    }
+    result.elapsed = absl::Now() - start;
+    done.store(true, std::memory_order_relaxed);
+    server_thread.join();
+    RETURN_IF_ERROR(status);
+    return result;
+  }
+
+  void ReportResult(absl::string_view name, Result& result) {
+    double seconds = absl::ToDoubleSeconds(result.elapsed);
+    Report(name, result.rpcs / seconds / 1e3, "krps");
+    Report(name, result.bytes * 8 / seconds / 1e9, "gbps");
+    Report(absl::StrCat(name, "_p50"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(50)), "us");
+    Report(absl::StrCat(name, "_p99"),
+           absl::ToDoubleMicroseconds(result.latency.Percentile(99)), "us");
+  }
+};
+
+TEST_F(RpcBenchmark, LatencyBySize) {
+  RpcEngineOptions options;
+  options.max_outstanding = 1;
+  options.validate = false;
+  for (RpcOperation operation : {RpcOperation::kRead, RpcOperation::kWrite}) {
+    for (uint32_t size = 64; size <= options.max_rpc_size; size *= 4) {
+      ASSERT_OK_AND_ASSIGN(Result result, Run(options, operation, size));
+      ASSERT_GT(result.rpcs, 0);
+      ReportResult(absl::StrCat(OperationName(operation), "_", size), result);
+    }
+  }
+}
+
+TEST_F(RpcBenchmark, ThroughputByDepth) {
+  constexpr uint32_t kSize = 64 * 1024;
+  for (uint32_t depth : {1, 4, 16, 64}) {
+    RpcEngineOptions options;
+    options.max_outstanding = depth;
+    options.max_rpc_size = kSize;
+    options.validate = false;
+    for (RpcOperation operation :
+         {RpcOperation::kRead, RpcOperation::kWrite}) {
+      ASSERT_OK_AND_ASSIGN(Result result, Run(options, operation, kSize));
+      ASSERT_GT(result.rpcs, 0);
+      ReportResult(absl::StrCat(OperationName(operation), "_depth_", depth),
+                   result);
+    }
+  }
+}
+
+TEST_F(RpcBenchmark, ValidatedThroughput) {
+  // The cost of filling and checking every payload.
+  RpcEngineOptions options;
+  for (RpcOperation operation : {RpcOperation::kRead, RpcOperation::kWrite}) {
+    ASSERT_OK_AND_ASSIGN(Result result,
+                         Run(options, operation, options.max_rpc_size));
+    ASSERT_GT(result.rpcs, 0);
+    ReportResult(absl::StrCat(OperationName(operation), "_validated"), result);
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
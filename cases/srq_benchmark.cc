@@ -0,0 +1,293 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/srq_replenisher.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Measures SEND throughput into many RC QPs sharing one SRQ, for several ways
+// of keeping the SRQ stocked: reposting each receive as it is consumed, the
+// way SrqMultiThreadTest posts, and SrqReplenisher with batched polling and
+// with SRQ limit events. A sender thread keeps kSendDepth 64 byte SENDs in
+// flight on every QP, which exceeds the SRQ depth at high QP counts. Senders
+// retry RNR NAKs forever, so starvation costs throughput rather than failing
+// WRs. Also reports the change of every RNR related port counter the driver
+// exposes in sysfs.
+class SrqBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr uint32_t kBuffers = 256;
+  static constexpr uint32_t kMessageSize = 64;
+  static constexpr int kSendDepth = 4;
+  static constexpr int kPollBatch = 32;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(100);
+
+  // mlx5 counts RNR NAKs received in rnr_nak_retry_err and SENDs dropped for
+  // lack of a receive in out_of_buffer. rxe counts RNR NAKs sent and received.
+  static constexpr std::array<absl::string_view, 4> kRnrCounters = {
+      "rnr_nak_retry_err", "out_of_buffer", "send_rnr_err", "rcvd_rnr_err"};
+
+  struct Mode {
+    absl::string_view name;
+    SrqReplenisherOptions options;
+  };
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    RdmaMemBlock send_buffer;
+    ibv_mr* send_mr;
+    ibv_cq* send_cq;
+    ibv_cq* recv_cq;
+    std::vector<ibv_qp*> send_qps;
+  };
+
+  // Creates |qps| QP pairs whose receiving sides share the SRQ of
+  // |replenisher|.
+  absl::StatusOr<BasicSetup> CreateBasicSetup(ibv_context* context,
+                                              ibv_pd* pd,
+                                              const SrqReplenisher& replenisher,
+                                              int qps) {
+    BasicSetup setup;
+    setup.context = context;
+    setup.port_gid = ibv_.GetLocalPortGid(context);
+    setup.pd = pd;
+    setup.send_buffer = ibv_.AllocAlignedBufferByBytes(kMessageSize);
+    setup.send_mr = ibv_.RegMr(setup.pd, setup.send_buffer);
+    if (!setup.send_mr) {
+      return absl::InternalError("Failed to register mr.");
+    }
+    setup.send_cq = ibv_.CreateCq(context, qps * kSendDepth);
+    setup.recv_cq = ibv_.CreateCq(context, kBuffers);
+    if (!setup.send_cq || !setup.recv_cq) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    for (int i = 0; i < qps; ++i) {
+      ibv_qp* send_qp = ibv_.CreateQp(setup.pd, setup.send_cq, setup.send_cq,
+                                      nullptr, kSendDepth,
+                                      /*max_recv_wr=*/1, IBV_QPT_RC,
+                                      /*sig_all=*/0);
+      ibv_qp* recv_qp =
+          ibv_.CreateQp(setup.pd, setup.recv_cq, setup.recv_cq,
+                        replenisher.srq(), /*max_send_wr=*/1,
+                        /*max_recv_wr=*/1, IBV_QPT_RC, /*sig_all=*/0);
+      if (!send_qp || !recv_qp) {
+        return absl::InternalError("Failed to create qps.");
+      }
+      ibv_.SetUpLoopbackRcQps(send_qp, recv_qp, setup.port_gid,
+                              {.rnr_retry = 7});
+      setup.send_qps.push_back(send_qp);
+    }
+    return setup;
+  }
+
+  // Sends on every QP for kRunTime and returns the rate at which the test
+  // thread received messages, in kmps.
+  absl::StatusOr<double> Run(const BasicSetup& setup,
+                             SrqReplenisher& replenisher) {
+    std::atomic<bool> sender_done = false;
+    std::atomic<uint64_t> sent = 0;
+    absl::Status sender_status;
+    absl::Time start = absl::Now();
+    std::thread sender([&]() {
+      sender_status = Send(setup, start + kRunTime, sent);
+      sender_done.store(true, std::memory_order_release);
+    });
+    absl::Status receive_status =
+        Receive(setup, replenisher, start, sender_done, sent);
+    absl::Duration elapsed = absl::Now() - start;
+    sender.join();
+    RETURN_IF_ERROR(sender_status);
+    RETURN_IF_ERROR(receive_status);
+    return sent.load() / absl::ToDoubleSeconds(elapsed) / 1e3;
+  }
+
+  // Returns the RNR counters of |port| which the driver of |context| exposes.
+  static absl::flat_hash_map<absl::string_view, uint64_t> ReadRnrCounters(
+      ibv_context* context, uint8_t port) {
+    absl::flat_hash_map<absl::string_view, uint64_t> counters;
+    for (absl::string_view name : kRnrCounters) {
+      std::ifstream file(absl::StrCat(
+          "/sys/class/infiniband/", ibv_get_device_name(context->device),
+          "/ports/", port, "/hw_counters/", name));
+      uint64_t value;
+      if (file >> value) {
+        counters[name] = value;
+      }
+    }
+    return counters;
+  }
+
+ private:
+  // Keeps kSendDepth SENDs posted on every QP until |stop|, then waits for
+  // the outstanding ones. Stores the number of SENDs in |sent| once done.
+  static absl::Status Send(const BasicSetup& setup, absl::Time stop,
+                           std::atomic<uint64_t>& sent) {
+    ibv_sge sge = verbs_util::CreateSge(setup.send_buffer.span(),
+                                        setup.send_mr);
+    std::vector<int> outstanding(setup.send_qps.size(), 0);
+    uint64_t posted = 0;
+    uint64_t completed = 0;
+    std::array<ibv_wc, kPollBatch> completions;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    while (true) {
+      absl::Time now = absl::Now();
+      if (now < stop) {
+        for (size_t qp = 0; qp < setup.send_qps.size(); ++qp) {
+          ibv_send_wr send =
+              verbs_util::CreateSendWr(qp, &sge, /*num_sge=*/1);
+          for (; outstanding[qp] < kSendDepth; ++outstanding[qp]) {
+            ibv_send_wr* bad_wr;
+            if (ibv_post_send(setup.send_qps[qp], &send, &bad_wr) != 0) {
+              return absl::InternalError("Failed to post send.");
+            }
+            ++posted;
+          }
+        }
+      } else if (completed == posted) {
+        break;
+      } else if (now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling sends.");
+      }
+      int count = ibv_poll_cq(setup.send_cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll send cq.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Send failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        --outstanding[completions[i].wr_id];
+      }
+      completed += count;
+    }
+    sent.store(posted, std::memory_order_relaxed);
+    return absl::OkStatus();
+  }
+
+  // Consumes messages until the sender is done and every SEND has arrived,
+  // releasing each buffer and replenishing after every poll.
+  static absl::Status Receive(const BasicSetup& setup,
+                              SrqReplenisher& replenisher, absl::Time start,
+                              const std::atomic<bool>& sender_done,
+                              const std::atomic<uint64_t>& sent) {
+    uint64_t received = 0;
+    std::array<ibv_wc, kPollBatch> completions;
+    absl::Time deadline =
+        start + kRunTime + verbs_util::kDefaultCompletionTimeout;
+    while (!sender_done.load(std::memory_order_acquire) ||
+           received < sent.load(std::memory_order_relaxed)) {
+      int count = ibv_poll_cq(setup.recv_cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll recv cq.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Recv failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        replenisher.Release(completions[i].wr_id);
+      }
+      received += count;
+      replenisher.Replenish();
+      if (count == 0 && absl::Now() > deadline) {
+        return absl::DeadlineExceededError("Timed out polling recvs.");
+      }
+    }
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(SrqBenchmark, ManyQpsPerSrq) {
+  const std::array<Mode, 3> modes = {
+      Mode{.name = "per_recv",
+           .options = {.buffers = kBuffers,
+                       .buffer_size = kMessageSize,
+                       .batch = 1,
+                       .mode = SrqRefillMode::kPolling}},
+      Mode{.name = "batched",
+           .options = {.buffers = kBuffers,
+                       .buffer_size = kMessageSize,
+                       .batch = 32,
+                       .mode = SrqRefillMode::kPolling}},
+      Mode{.name = "limit_event",
+           .options = {.buffers = kBuffers,
+                       .buffer_size = kMessageSize,
+                       .batch = 32,
+                       .mode = SrqRefillMode::kLimitEvent,
+                       .limit = kBuffers / 4}},
+  };
+  const int max_qps = std::min(Introspection().device_attr().max_qp / 2, 256);
+  for (const Mode& mode : modes) {
+    for (int qps = 1; qps <= max_qps; qps *= 4) {
+      // A context of its own per run, since limit events consume the async
+      // events of the context.
+      ASSERT_OK_AND_ASSIGN(ibv_context * context, ibv_.OpenDevice());
+      ibv_pd* pd = ibv_.AllocPd(context);
+      ASSERT_NE(pd, nullptr);
+      SrqReplenisher replenisher(ibv_, context, pd, mode.options);
+      ASSERT_OK_AND_ASSIGN(BasicSetup setup,
+                           CreateBasicSetup(context, pd, replenisher, qps));
+      absl::flat_hash_map<absl::string_view, uint64_t> before =
+          ReadRnrCounters(context, setup.port_gid.port);
+      ASSERT_OK_AND_ASSIGN(double kmps, Run(setup, replenisher));
+      absl::flat_hash_map<absl::string_view, uint64_t> after =
+          ReadRnrCounters(context, setup.port_gid.port);
+      std::string name = absl::StrCat(mode.name, "_", qps);
+      Report(name, kmps, "kmps");
+      for (absl::string_view counter : kRnrCounters) {
+        if (before.contains(counter) && after.contains(counter)) {
+          Report(absl::StrCat(name, "_", counter),
+                 after[counter] - before[counter], "count");
+        }
+      }
+      if (mode.options.mode == SrqRefillMode::kLimitEvent) {
+        Report(absl::StrCat(name, "_limit_events"),
+               replenisher.limit_events(), "count");
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
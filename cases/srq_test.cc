@@ -23,12 +23,15 @@
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "infiniband/verbs.h"
 #include "cases/basic_fixture.h"
 #include "internal/handle_garble.h"
 #include "public/introspection.h"
 #include "public/page_size.h"
 #include "public/rdma_memblock.h"
+#include "public/srq_replenisher.h"
 #include "public/status_matchers.h"
 #include "public/verbs_helper_suite.h"
 #include "public/verbs_util.h"
@@ -440,4 +443,167 @@ TEST_F(SrqMultiThreadTest, MultiThreadedSrqLoopback) {
   EXPECT_THAT(setup.recv_buffer.subspan(0, kTotalWr), Each(kSendContent));
 }
 
+class SrqReplenisherTest : public BasicFixture {
+ protected:
+  static constexpr uint32_t kBuffers = 16;
+  static constexpr uint32_t kBatch = 4;
+
+  struct BasicSetup {
+    ibv_context* context = nullptr;
+    ibv_pd* pd = nullptr;
+    RdmaMemBlock send_buffer;
+    ibv_mr* send_mr = nullptr;
+    ibv_cq* send_cq = nullptr;
+    ibv_cq* recv_cq = nullptr;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup() {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    setup.send_buffer = ibv_.AllocBuffer(/*pages=*/1);
+    setup.send_mr = ibv_.RegMr(setup.pd, setup.send_buffer);
+    if (!setup.send_mr) {
+      return absl::InternalError("Failed to register send mr.");
+    }
+    setup.send_cq = ibv_.CreateCq(setup.context);
+    if (!setup.send_cq) {
+      return absl::InternalError("Failed to create send cq.");
+    }
+    setup.recv_cq = ibv_.CreateCq(setup.context);
+    if (!setup.recv_cq) {
+      return absl::InternalError("Failed to create recv cq.");
+    }
+    return setup;
+  }
+
+  // Connects a sending QP to a receiving QP on |srq| and returns the former.
+  absl::StatusOr<ibv_qp*> CreateQps(const BasicSetup& setup, ibv_srq* srq) {
+    ibv_qp* send_qp = ibv_.CreateQp(setup.pd, setup.send_cq);
+    ibv_qp* recv_qp = ibv_.CreateQp(setup.pd, setup.recv_cq, srq);
+    if (!send_qp || !recv_qp) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv_.SetUpLoopbackRcQps(send_qp, recv_qp,
+                            ibv_.GetLocalPortGid(setup.context));
+    return send_qp;
+  }
+
+  // Sends a one byte message of |value| on |qp|, checks that it lands in a
+  // buffer of |replenisher| and returns the wr_id of the buffer.
+  static absl::StatusOr<uint64_t> SendAndReceive(const BasicSetup& setup,
+                                                 ibv_qp* qp,
+                                                 SrqReplenisher& replenisher,
+                                                 uint8_t value) {
+    setup.send_buffer.data()[0] = value;
+    ibv_sge sge = verbs_util::CreateSge(setup.send_buffer.subspan(0, 1),
+                                        setup.send_mr);
+    ibv_send_wr send =
+        verbs_util::CreateSendWr(/*wr_id=*/0, &sge, /*num_sge=*/1);
+    verbs_util::PostSend(qp, send);
+    ASSIGN_OR_RETURN(ibv_wc completion,
+                     verbs_util::WaitForCompletion(setup.send_cq));
+    if (completion.status != IBV_WC_SUCCESS) {
+      return absl::InternalError("Send failed.");
+    }
+    ASSIGN_OR_RETURN(completion, verbs_util::WaitForCompletion(setup.recv_cq));
+    if (completion.status != IBV_WC_SUCCESS) {
+      return absl::InternalError("Recv failed.");
+    }
+    if (replenisher.buffer(completion.wr_id)[0] != value) {
+      return absl::InternalError("Unexpected message content.");
+    }
+    return completion.wr_id;
+  }
+
+  // SendAndReceive(), then releases the buffer.
+  static absl::Status SendAndConsume(const BasicSetup& setup, ibv_qp* qp,
+                                     SrqReplenisher& replenisher,
+                                     uint8_t value) {
+    ASSIGN_OR_RETURN(uint64_t wr_id,
+                     SendAndReceive(setup, qp, replenisher, value));
+    replenisher.Release(wr_id);
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(SrqReplenisherTest, PollingRefillsInBatches) {
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  SrqReplenisher replenisher(ibv_, setup.context, setup.pd,
+                             {.buffers = kBuffers,
+                              .batch = kBatch,
+                              .mode = SrqRefillMode::kPolling});
+  ASSERT_OK_AND_ASSIGN(ibv_qp * qp, CreateQps(setup, replenisher.srq()));
+  // Cycles through the pool several times.
+  for (uint32_t i = 1; i <= 4 * kBuffers; ++i) {
+    ASSERT_OK(SendAndConsume(setup, qp, replenisher, i));
+    int expected = i % kBatch == 0 ? kBatch : 0;
+    EXPECT_EQ(replenisher.Replenish(), expected);
+  }
+  EXPECT_EQ(replenisher.free_buffers(), 0u);
+}
+
+TEST_F(SrqReplenisherTest, LimitEventRefills) {
+  static constexpr uint32_t kLimit = 4;
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  SrqReplenisher replenisher(ibv_, setup.context, setup.pd,
+                             {.buffers = kBuffers,
+                              .batch = kBatch,
+                              .mode = SrqRefillMode::kLimitEvent,
+                              .limit = kLimit});
+  ASSERT_OK_AND_ASSIGN(ibv_qp * qp, CreateQps(setup, replenisher.srq()));
+  // The event fires once fewer than kLimit receives remain posted.
+  constexpr int kConsumedPerEvent = kBuffers - kLimit + 1;
+  for (uint64_t round = 1; round <= 3; ++round) {
+    for (int i = 0; i < kConsumedPerEvent; ++i) {
+      ASSERT_OK(SendAndConsume(setup, qp, replenisher, i));
+      if (i + 1 < kConsumedPerEvent) {
+        EXPECT_EQ(replenisher.Replenish(), 0);
+      }
+    }
+    int posted = 0;
+    absl::Time deadline = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+    while (posted == 0 && absl::Now() < deadline) {
+      posted = replenisher.Replenish();
+    }
+    EXPECT_EQ(posted, kConsumedPerEvent);
+    EXPECT_EQ(replenisher.limit_events(), round);
+    EXPECT_EQ(replenisher.free_buffers(), 0u);
+  }
+}
+
+TEST_F(SrqReplenisherTest, LimitEventWithoutFreeBuffersRefillsOnRelease) {
+  static constexpr uint32_t kLimit = 4;
+  ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup());
+  SrqReplenisher replenisher(ibv_, setup.context, setup.pd,
+                             {.buffers = kBuffers,
+                              .batch = kBatch,
+                              .mode = SrqRefillMode::kLimitEvent,
+                              .limit = kLimit});
+  ASSERT_OK_AND_ASSIGN(ibv_qp * qp, CreateQps(setup, replenisher.srq()));
+  // Holds on to every buffer past the limit, so the event finds none free.
+  constexpr int kConsumed = kBuffers - kLimit + 1;
+  std::vector<uint64_t> held;
+  for (int i = 0; i < kConsumed; ++i) {
+    ASSERT_OK_AND_ASSIGN(uint64_t wr_id,
+                         SendAndReceive(setup, qp, replenisher, i));
+    held.push_back(wr_id);
+  }
+  absl::Time deadline = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+  while (replenisher.limit_events() == 0 && absl::Now() < deadline) {
+    EXPECT_EQ(replenisher.Replenish(), 0);
+  }
+  ASSERT_EQ(replenisher.limit_events(), 1u);
+  // The event is not raised again, but the refill still happens.
+  for (uint64_t wr_id : held) {
+    replenisher.Release(wr_id);
+  }
+  EXPECT_EQ(replenisher.Replenish(), kConsumed);
+  EXPECT_EQ(replenisher.free_buffers(), 0u);
+  EXPECT_EQ(replenisher.Replenish(), 0);
+}
+
 }  // namespace rdma_unit_test
@@ -0,0 +1,362 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/introspection.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace {
+
+// Measures UD fan-out: one QP sends small and MTU sized datagrams round robin
+// to many destination QPs, with kSendDepth datagrams in flight. The AH of
+// each datagram comes from a pool of a given size created up front, from
+// VerbsHelperSuite::GetOrCreateAh(), or from an AH created for the datagram
+// and destroyed once it completes, as ud_test and the random walk do. Reports
+// the send rate in kpps and the share of datagrams delivered. Also reports
+// the cost of creating, destroying and looking up AHs.
+class UdBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr uint32_t kQKey = 200;
+  static constexpr int kSendDepth = 64;
+  static constexpr int kRecvDepth = 32;
+  static constexpr uint32_t kSmallSize = 64;
+  static constexpr int kMaxDestinations = 256;
+  static constexpr absl::Duration kRunTime = absl::Milliseconds(50);
+  // How long to wait for the last datagrams to arrive after the last send
+  // completes.
+  static constexpr absl::Duration kDrainTime = absl::Milliseconds(10);
+
+  enum class AhPolicy {
+    // Destination i uses AH i modulo the pool size.
+    kPool,
+    // Every datagram looks its AH up with GetOrCreateAh().
+    kCached,
+    // Every datagram creates an AH and destroys it once it completes.
+    kPerSend,
+  };
+
+  struct BasicSetup {
+    ibv_context* context;
+    verbs_util::PortGid port_gid;
+    ibv_pd* pd;
+    // The active MTU of the port in bytes, the largest UD payload.
+    uint32_t mtu;
+    RdmaMemBlock send_buffer;
+    // kRecvDepth slots per destination, each with room for the GRH.
+    RdmaMemBlock recv_buffer;
+    ibv_mr* send_mr;
+    ibv_mr* recv_mr;
+    ibv_cq* send_cq;
+    ibv_cq* recv_cq;
+    ibv_qp* sender;
+    std::vector<ibv_qp*> destinations;
+  };
+
+  struct Result {
+    double kpps;
+    double delivered_percent;
+  };
+
+  absl::StatusOr<BasicSetup> CreateBasicSetup(int destinations) {
+    BasicSetup setup;
+    ASSIGN_OR_RETURN(setup.context, ibv_.OpenDevice());
+    setup.port_gid = ibv_.GetLocalPortGid(setup.context);
+    setup.pd = ibv_.AllocPd(setup.context);
+    if (!setup.pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    ibv_port_attr port_attr;
+    if (ibv_query_port(setup.context, setup.port_gid.port, &port_attr) != 0) {
+      return absl::InternalError("Failed to query port.");
+    }
+    setup.mtu = 128u << port_attr.active_mtu;
+    setup.send_buffer = ibv_.AllocAlignedBufferByBytes(setup.mtu);
+    setup.recv_buffer = ibv_.AllocAlignedBufferByBytes(
+        destinations * kRecvDepth * RecvSlotSize(setup));
+    setup.send_mr = ibv_.RegMr(setup.pd, setup.send_buffer);
+    setup.recv_mr = ibv_.RegMr(setup.pd, setup.recv_buffer);
+    if (!setup.send_mr || !setup.recv_mr) {
+      return absl::InternalError("Failed to register mrs.");
+    }
+    setup.send_cq = ibv_.CreateCq(setup.context, kSendDepth);
+    setup.recv_cq = ibv_.CreateCq(setup.context, destinations * kRecvDepth);
+    if (!setup.send_cq || !setup.recv_cq) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    setup.sender = ibv_.CreateQp(setup.pd, setup.send_cq, setup.send_cq,
+                                 nullptr, kSendDepth, /*max_recv_wr=*/1,
+                                 IBV_QPT_UD, /*sig_all=*/0);
+    if (!setup.sender) {
+      return absl::InternalError("Failed to create sender qp.");
+    }
+    RETURN_IF_ERROR(ibv_.SetUpUdQp(setup.sender, setup.port_gid, kQKey));
+    for (int i = 0; i < destinations; ++i) {
+      ibv_qp* qp = ibv_.CreateQp(setup.pd, setup.recv_cq, setup.recv_cq,
+                                 nullptr, /*max_send_wr=*/1, kRecvDepth,
+                                 IBV_QPT_UD, /*sig_all=*/0);
+      if (!qp) {
+        return absl::InternalError("Failed to create destination qp.");
+      }
+      RETURN_IF_ERROR(ibv_.SetUpUdQp(qp, setup.port_gid, kQKey));
+      setup.destinations.push_back(qp);
+    }
+    for (int slot = 0; slot < destinations * kRecvDepth; ++slot) {
+      RETURN_IF_ERROR(PostRecv(setup, slot));
+    }
+    return setup;
+  }
+
+  // Sends datagrams of |size| bytes for kRunTime, taking AHs as |policy|
+  // dictates. Only kPool uses |pool_size|.
+  absl::StatusOr<Result> Run(const BasicSetup& setup, uint32_t size,
+                             AhPolicy policy, int pool_size) {
+    std::vector<ibv_ah*> pool;
+    if (policy == AhPolicy::kPool) {
+      for (int i = 0; i < pool_size; ++i) {
+        ibv_ah* ah = ibv_.CreateAh(setup.pd, setup.port_gid.gid);
+        if (!ah) {
+          return absl::InternalError("Failed to create ah.");
+        }
+        pool.push_back(ah);
+      }
+    }
+    ibv_sge sge = verbs_util::CreateSge(setup.send_buffer.subspan(0, size),
+                                        setup.send_mr);
+    // Per send slot, the AH of kPerSend datagrams.
+    std::array<ibv_ah*, kSendDepth> slot_ahs = {};
+    std::vector<int> free_slots;
+    for (int slot = 0; slot < kSendDepth; ++slot) {
+      free_slots.push_back(slot);
+    }
+    const int destinations = setup.destinations.size();
+    int next_destination = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    std::array<ibv_wc, 32> completions;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + kRunTime;
+    absl::Time deadline = stop + verbs_util::kDefaultCompletionTimeout;
+    absl::Time now = start;
+    while (now < stop || static_cast<int>(free_slots.size()) < kSendDepth) {
+      while (now < stop && !free_slots.empty()) {
+        int slot = free_slots.back();
+        int destination = next_destination;
+        next_destination = (next_destination + 1) % destinations;
+        ibv_ah* ah = nullptr;
+        switch (policy) {
+          case AhPolicy::kPool:
+            ah = pool[destination % pool.size()];
+            break;
+          case AhPolicy::kCached:
+            ah = ibv_.GetOrCreateAh(setup.pd, setup.port_gid.gid);
+            break;
+          case AhPolicy::kPerSend:
+            ah = ibv_.CreateAh(setup.pd, setup.port_gid.gid);
+            slot_ahs[slot] = ah;
+            break;
+        }
+        if (!ah) {
+          return absl::InternalError("Failed to get ah.");
+        }
+        ibv_send_wr send = verbs_util::CreateSendWr(slot, &sge, /*num_sge=*/1);
+        send.wr.ud.ah = ah;
+        send.wr.ud.remote_qpn = setup.destinations[destination]->qp_num;
+        send.wr.ud.remote_qkey = kQKey;
+        ibv_send_wr* bad_wr;
+        if (ibv_post_send(setup.sender, &send, &bad_wr) != 0) {
+          return absl::InternalError("Failed to post send.");
+        }
+        free_slots.pop_back();
+      }
+      int count = ibv_poll_cq(setup.send_cq, completions.size(),
+                              completions.data());
+      if (count < 0) {
+        return absl::InternalError("Failed to poll send cq.");
+      }
+      for (int i = 0; i < count; ++i) {
+        if (completions[i].status != IBV_WC_SUCCESS) {
+          return absl::InternalError(absl::StrCat(
+              "Send failed: ", ibv_wc_status_str(completions[i].status)));
+        }
+        int slot = completions[i].wr_id;
+        if (slot_ahs[slot]) {
+          if (ibv_.DestroyAh(slot_ahs[slot]) != 0) {
+            return absl::InternalError("Failed to destroy ah.");
+          }
+          slot_ahs[slot] = nullptr;
+        }
+        free_slots.push_back(slot);
+      }
+      sent += count;
+      ASSIGN_OR_RETURN(int arrived,
+                       PollRecvs(setup, absl::MakeSpan(completions)));
+      received += arrived;
+      now = absl::Now();
+      if (now > deadline) {
+        return absl::DeadlineExceededError("Timed out polling sends.");
+      }
+    }
+    absl::Duration elapsed = now - start;
+    // Datagrams may still be on their way; lost ones never arrive.
+    absl::Time drain_end = now + kDrainTime;
+    while (received < sent && absl::Now() < drain_end) {
+      ASSIGN_OR_RETURN(int arrived,
+                       PollRecvs(setup, absl::MakeSpan(completions)));
+      received += arrived;
+    }
+    for (ibv_ah* ah : pool) {
+      if (ibv_.DestroyAh(ah) != 0) {
+        return absl::InternalError("Failed to destroy ah.");
+      }
+    }
+    return Result{
+        .kpps = sent / absl::ToDoubleSeconds(elapsed) / 1e3,
+        .delivered_percent = 100.0 * received / sent,
+    };
+  }
+
+ private:
+  static uint32_t RecvSlotSize(const BasicSetup& setup) {
+    return sizeof(ibv_grh) + setup.mtu;
+  }
+
+  // Posts recv slot |slot|, which belongs to destination slot / kRecvDepth.
+  static absl::Status PostRecv(const BasicSetup& setup, int slot) {
+    ibv_sge sge = verbs_util::CreateSge(
+        setup.recv_buffer.subspan(slot * RecvSlotSize(setup),
+                                  RecvSlotSize(setup)),
+        setup.recv_mr);
+    ibv_recv_wr recv = verbs_util::CreateRecvWr(slot, &sge, /*num_sge=*/1);
+    ibv_recv_wr* bad_wr;
+    if (ibv_post_recv(setup.destinations[slot / kRecvDepth], &recv,
+                      &bad_wr) != 0) {
+      return absl::InternalError("Failed to post recv.");
+    }
+    return absl::OkStatus();
+  }
+
+  // Reposts the recvs of arrived datagrams and returns how many arrived.
+  static absl::StatusOr<int> PollRecvs(const BasicSetup& setup,
+                                       absl::Span<ibv_wc> completions) {
+    int count = ibv_poll_cq(setup.recv_cq, completions.size(),
+                            completions.data());
+    if (count < 0) {
+      return absl::InternalError("Failed to poll recv cq.");
+    }
+    for (int i = 0; i < count; ++i) {
+      if (completions[i].status != IBV_WC_SUCCESS) {
+        return absl::InternalError(absl::StrCat(
+            "Recv failed: ", ibv_wc_status_str(completions[i].status)));
+      }
+      RETURN_IF_ERROR(PostRecv(setup, completions[i].wr_id));
+    }
+    return count;
+  }
+};
+
+TEST_F(UdBenchmark, FanOut) {
+  if (!Introspection().SupportsUdQp()) {
+    GTEST_SKIP() << "Nic does not support UD QP";
+  }
+  const int max_destinations =
+      std::min(Introspection().device_attr().max_qp - 1, kMaxDestinations);
+  for (int destinations = 1; destinations <= max_destinations;
+       destinations *= 16) {
+    ASSERT_OK_AND_ASSIGN(BasicSetup setup, CreateBasicSetup(destinations));
+    for (uint32_t size : {kSmallSize, setup.mtu}) {
+      std::string prefix = absl::StrCat(size, "_", destinations);
+      auto report = [&](absl::string_view policy, const Result& result) {
+        Report(absl::StrCat(prefix, "_", policy), result.kpps, "kpps");
+        Report(absl::StrCat(prefix, "_", policy, "_delivered"),
+               result.delivered_percent, "percent");
+      };
+      ASSERT_OK_AND_ASSIGN(Result result,
+                           Run(setup, size, AhPolicy::kPool, 1));
+      report("shared_ah", result);
+      if (destinations > 1) {
+        ASSERT_OK_AND_ASSIGN(
+            result, Run(setup, size, AhPolicy::kPool, destinations));
+        report("ah_per_destination", result);
+      }
+      ASSERT_OK_AND_ASSIGN(result,
+                           Run(setup, size, AhPolicy::kCached, 0));
+      report("cached_ah", result);
+      ASSERT_OK_AND_ASSIGN(result,
+                           Run(setup, size, AhPolicy::kPerSend, 0));
+      report("ah_per_send", result);
+    }
+  }
+}
+
+TEST_F(UdBenchmark, AhCost) {
+  static constexpr int kAhs = 256;
+  static constexpr int kLookups = 100000;
+  ASSERT_OK_AND_ASSIGN(ibv_context * context, ibv_.OpenDevice());
+  verbs_util::PortGid port_gid = ibv_.GetLocalPortGid(context);
+  ibv_pd* pd = ibv_.AllocPd(context);
+  ASSERT_NE(pd, nullptr);
+
+  LatencySamples create;
+  LatencySamples destroy;
+  std::vector<ibv_ah*> ahs;
+  for (int i = 0; i < kAhs; ++i) {
+    absl::Time start = absl::Now();
+    ibv_ah* ah = ibv_.CreateAh(pd, port_gid.gid);
+    create.Add(absl::Now() - start);
+    ASSERT_NE(ah, nullptr);
+    ahs.push_back(ah);
+  }
+  for (ibv_ah* ah : ahs) {
+    absl::Time start = absl::Now();
+    ASSERT_EQ(ibv_.DestroyAh(ah), 0);
+    destroy.Add(absl::Now() - start);
+  }
+  Report("ah_create_p50", absl::ToDoubleMicroseconds(create.Percentile(50)),
+         "us");
+  Report("ah_create_p99", absl::ToDoubleMicroseconds(create.Percentile(99)),
+         "us");
+  Report("ah_destroy_p50",
+         absl::ToDoubleMicroseconds(destroy.Percentile(50)), "us");
+
+  ASSERT_NE(ibv_.GetOrCreateAh(pd, port_gid.gid), nullptr);
+  absl::Time start = absl::Now();
+  for (int i = 0; i < kLookups; ++i) {
+    ibv_.GetOrCreateAh(pd, port_gid.gid);
+  }
+  Report("ah_cache_hit",
+         absl::ToDoubleMicroseconds((absl::Now() - start) / kLookups), "us");
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
@@ -0,0 +1,318 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "cases/benchmark_fixture.h"
+#include "public/rdma_memblock.h"
+#include "public/status_matchers.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+#include "public/write_ring_channel.h"
+
+namespace rdma_unit_test {
+namespace {
+
+constexpr uint32_t kSlots = 64;
+constexpr uint32_t kSignalInterval = 16;
+
+// The conventional channel WriteRingChannel competes with: SENDs into recvs
+// the consumer reposts as it consumes them. The producer sees the reposts
+// directly instead of through credit messages, which flatters the baseline.
+class SendRecvChannel {
+ public:
+  static absl::StatusOr<std::unique_ptr<SendRecvChannel>> Create(
+      VerbsHelperSuite& ibv, uint32_t slot_size) {
+    auto channel = std::unique_ptr<SendRecvChannel>(new SendRecvChannel());
+    channel->slot_size_ = slot_size;
+    ASSIGN_OR_RETURN(ibv_context * context, ibv.OpenDevice());
+    ibv_pd* pd = ibv.AllocPd(context);
+    if (!pd) {
+      return absl::InternalError("Failed to allocate pd.");
+    }
+    channel->send_buffer_ = ibv.AllocAlignedBufferByBytes(kSlots * slot_size);
+    channel->recv_buffer_ = ibv.AllocAlignedBufferByBytes(kSlots * slot_size);
+    channel->send_mr_ = ibv.RegMr(pd, channel->send_buffer_);
+    channel->recv_mr_ = ibv.RegMr(pd, channel->recv_buffer_);
+    if (!channel->send_mr_ || !channel->recv_mr_) {
+      return absl::InternalError("Failed to register mrs.");
+    }
+    channel->send_cq_ = ibv.CreateCq(context, kSlots + kSignalInterval);
+    channel->recv_cq_ = ibv.CreateCq(context, kSlots);
+    if (!channel->send_cq_ || !channel->recv_cq_) {
+      return absl::InternalError("Failed to create cqs.");
+    }
+    channel->producer_ = ibv.CreateQp(
+        pd, channel->send_cq_, channel->send_cq_, nullptr,
+        kSlots + kSignalInterval, /*max_recv_wr=*/1, IBV_QPT_RC,
+        /*sig_all=*/0);
+    channel->consumer_ =
+        ibv.CreateQp(pd, channel->recv_cq_, channel->recv_cq_, nullptr,
+                     /*max_send_wr=*/1, kSlots, IBV_QPT_RC, /*sig_all=*/0);
+    if (!channel->producer_ || !channel->consumer_) {
+      return absl::InternalError("Failed to create qps.");
+    }
+    ibv.SetUpLoopbackRcQps(channel->producer_, channel->consumer_,
+                           ibv.GetLocalPortGid(context));
+    for (uint32_t i = 0; i < kSlots; ++i) {
+      RETURN_IF_ERROR(channel->PostRecv(i));
+    }
+    return channel;
+  }
+
+  bool TrySend(absl::Span<const uint8_t> payload) {
+    if (sent_ - reposted_ >= kSlots) {
+      return false;
+    }
+    // A full send queue waits for a signaled send to complete. If none does
+    // in time the channel reports no room, which fails the caller. The clock
+    // is only read once the queue is full.
+    if (sent_ - sends_completed_ >= kSlots + kSignalInterval) {
+      absl::Time stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+      for (int spins = 1; sent_ - sends_completed_ >= kSlots + kSignalInterval;
+           ++spins) {
+        ibv_wc completion;
+        int count = ibv_poll_cq(send_cq_, 1, &completion);
+        CHECK_GE(count, 0);  // Crash ok
+        if (count == 1) {
+          CHECK_EQ(completion.status, IBV_WC_SUCCESS);  // Crash ok
+          sends_completed_ = completion.wr_id;
+        } else if (spins % 1024 == 0 && absl::Now() > stop) {
+          LOG(ERROR) << "Timed out polling sends.";
+          return false;
+        }
+      }
+    }
+    uint8_t* slot = Slot(send_buffer_, sent_);
+    std::memcpy(slot, payload.data(), payload.size());
+    ++sent_;
+    ibv_sge sge = verbs_util::CreateSge(absl::MakeSpan(slot, payload.size()),
+                                        send_mr_);
+    ibv_send_wr send = verbs_util::CreateSendWr(sent_, &sge, /*num_sge=*/1);
+    send.send_flags = sent_ % kSignalInterval == 0 ? IBV_SEND_SIGNALED : 0;
+    if (payload.size() <= verbs_util::kDefaultMaxInlineSize) {
+      send.send_flags |= IBV_SEND_INLINE;
+    }
+    ibv_send_wr* bad_wr;
+    CHECK_EQ(ibv_post_send(producer_, &send, &bad_wr), 0);  // Crash ok
+    return true;
+  }
+
+  absl::optional<absl::Span<const uint8_t>> TryReceive() {
+    // The message returned by the previous call is consumed now.
+    if (reposted_ < received_) {
+      CHECK_OK(PostRecv(reposted_));  // Crash ok
+      ++reposted_;
+    }
+    ibv_wc completion;
+    int count = ibv_poll_cq(recv_cq_, 1, &completion);
+    CHECK_GE(count, 0);  // Crash ok
+    if (count == 0) {
+      return absl::nullopt;
+    }
+    CHECK_EQ(completion.status, IBV_WC_SUCCESS);  // Crash ok
+    return absl::Span<const uint8_t>(Slot(recv_buffer_, received_++),
+                                     completion.byte_len);
+  }
+
+ private:
+  SendRecvChannel() = default;
+
+  uint8_t* Slot(const RdmaMemBlock& buffer, uint64_t index) const {
+    return buffer.data() + index % kSlots * slot_size_;
+  }
+
+  absl::Status PostRecv(uint64_t index) {
+    ibv_sge sge = verbs_util::CreateSge(
+        absl::MakeSpan(Slot(recv_buffer_, index), slot_size_), recv_mr_);
+    ibv_recv_wr recv = verbs_util::CreateRecvWr(index, &sge, /*num_sge=*/1);
+    ibv_recv_wr* bad_wr;
+    if (ibv_post_recv(consumer_, &recv, &bad_wr) != 0) {
+      return absl::InternalError("Failed to post recv.");
+    }
+    return absl::OkStatus();
+  }
+
+  uint32_t slot_size_;
+  RdmaMemBlock send_buffer_;
+  RdmaMemBlock recv_buffer_;
+  ibv_mr* send_mr_;
+  ibv_mr* recv_mr_;
+  ibv_cq* send_cq_;
+  ibv_cq* recv_cq_;
+  ibv_qp* producer_;
+  ibv_qp* consumer_;
+  uint64_t sent_ = 0;
+  uint64_t sends_completed_ = 0;
+  uint64_t received_ = 0;
+  uint64_t reposted_ = 0;
+};
+
+// Compares WriteRingChannel, where the consumer polls memory, with
+// send/recv, where it polls a CQ and reposts recvs, for small messages: the
+// round trip latency of ping-pong over two channels and the rate of a
+// pipelined stream over one. Producer and consumer share a thread. Each
+// message carries its index in its first byte, which the consumer checks.
+class WriteRingBenchmark : public BenchmarkFixture {
+ protected:
+  static constexpr int kPingPongIterations = 10000;
+  static constexpr int kStreamMessages = 100000;
+
+  // Payload sizes: two which are written inline and one which is not.
+  static constexpr uint32_t kSizes[] = {8, 24, 248};
+
+  static std::unique_ptr<WriteRingChannel> CreateWriteRingChannel(
+      VerbsHelperSuite& ibv, uint32_t size) {
+    WriteRingChannelOptions options;
+    options.slots = kSlots;
+    options.slot_size = SlotSize(size);
+    options.signal_interval = kSignalInterval;
+    return std::make_unique<WriteRingChannel>(ibv, options);
+  }
+
+  // The slot size of WriteRingChannel, which the baseline matches.
+  static uint32_t SlotSize(uint32_t size) {
+    return (size + 2 * sizeof(uint64_t) - 1) / sizeof(uint64_t) *
+           sizeof(uint64_t);
+  }
+
+  // Spins until |channel| holds a message, checks it and returns.
+  template <typename Channel>
+  static absl::Status Receive(Channel& channel, uint32_t size,
+                              uint64_t index) {
+    absl::Time stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+    for (int spins = 0;; ++spins) {
+      absl::optional<absl::Span<const uint8_t>> message = channel.TryReceive();
+      if (message.has_value()) {
+        if (message->size() != size ||
+            message->front() != static_cast<uint8_t>(index)) {
+          return absl::InternalError(
+              absl::StrCat("Bad message ", index, " of size ",
+                           message->size()));
+        }
+        return absl::OkStatus();
+      }
+      if (spins % 1024 == 0 && absl::Now() > stop) {
+        return absl::DeadlineExceededError("Timed out receiving.");
+      }
+    }
+  }
+
+  // Bounces a message between |ping| and |pong| kPingPongIterations times and
+  // reports the round trip percentiles under |name|.
+  template <typename Channel>
+  absl::Status PingPong(absl::string_view name, Channel& ping, Channel& pong,
+                        uint32_t size) {
+    std::vector<uint8_t> payload(size);
+    LatencySamples samples;
+    for (int i = 0; i < kPingPongIterations; ++i) {
+      payload[0] = i;
+      absl::Time start = absl::Now();
+      if (!ping.TrySend(absl::MakeConstSpan(payload))) {
+        return absl::InternalError("Ping has no room.");
+      }
+      RETURN_IF_ERROR(Receive(ping, size, i));
+      if (!pong.TrySend(absl::MakeConstSpan(payload))) {
+        return absl::InternalError("Pong has no room.");
+      }
+      RETURN_IF_ERROR(Receive(pong, size, i));
+      samples.Add(absl::Now() - start);
+    }
+    Report(absl::StrCat(name, "_", size, "_p50"),
+           absl::ToDoubleMicroseconds(samples.Percentile(50)), "us");
+    Report(absl::StrCat(name, "_", size, "_p99"),
+           absl::ToDoubleMicroseconds(samples.Percentile(99)), "us");
+    return absl::OkStatus();
+  }
+
+  // Streams kStreamMessages through |channel|, producing until the channel is
+  // full and then consuming whatever arrived, and reports the message rate.
+  template <typename Channel>
+  absl::Status Stream(absl::string_view name, Channel& channel,
+                      uint32_t size) {
+    std::vector<uint8_t> payload(size);
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    absl::Time start = absl::Now();
+    absl::Time stop = start + verbs_util::kDefaultCompletionTimeout;
+    while (received < kStreamMessages) {
+      payload[0] = sent;
+      while (sent < kStreamMessages &&
+             channel.TrySend(absl::MakeConstSpan(payload))) {
+        payload[0] = ++sent;
+      }
+      absl::optional<absl::Span<const uint8_t>> message;
+      while ((message = channel.TryReceive()).has_value()) {
+        if (message->size() != size ||
+            message->front() != static_cast<uint8_t>(received)) {
+          return absl::InternalError(
+              absl::StrCat("Bad message ", received));
+        }
+        ++received;
+        stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+      }
+      if (absl::Now() > stop) {
+        return absl::DeadlineExceededError("Timed out streaming.");
+      }
+    }
+    absl::Duration elapsed = absl::Now() - start;
+    Report(absl::StrCat(name, "_", size),
+           kStreamMessages / absl::ToDoubleSeconds(elapsed) / 1e3, "kmps");
+    return absl::OkStatus();
+  }
+};
+
+TEST_F(WriteRingBenchmark, PingPongLatency) {
+  for (uint32_t size : kSizes) {
+    std::unique_ptr<WriteRingChannel> ping = CreateWriteRingChannel(ibv_, size);
+    std::unique_ptr<WriteRingChannel> pong = CreateWriteRingChannel(ibv_, size);
+    ASSERT_OK(PingPong("write_ring", *ping, *pong, size));
+
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<SendRecvChannel> send_ping,
+                         SendRecvChannel::Create(ibv_, SlotSize(size)));
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<SendRecvChannel> send_pong,
+                         SendRecvChannel::Create(ibv_, SlotSize(size)));
+    ASSERT_OK(PingPong("send_recv", *send_ping, *send_pong, size));
+  }
+}
+
+TEST_F(WriteRingBenchmark, MessageRate) {
+  for (uint32_t size : kSizes) {
+    std::unique_ptr<WriteRingChannel> channel =
+        CreateWriteRingChannel(ibv_, size);
+    ASSERT_OK(Stream("write_ring", *channel, size));
+
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<SendRecvChannel> send_channel,
+                         SendRecvChannel::Create(ibv_, SlotSize(size)));
+    ASSERT_OK(Stream("send_recv", *send_channel, size));
+  }
+}
+
+}  // namespace
+}  // namespace rdma_unit_test
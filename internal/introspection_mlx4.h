@@ -32,7 +32,7 @@ class IntrospectionMlx4 : public NicIntrospection {
   // Register MLX4 NIC with the Introspection Registrar.
   static void Register() {
     IntrospectionRegistrar::GetInstance().Register(
-        "mlx4", [](const ibv_device_attr& attr) {
+        "mlx4", [](const ibv_device_attr_ex& attr) {
           return new IntrospectionMlx4(attr);
         });
   }
@@ -88,7 +88,7 @@ class IntrospectionMlx4 : public NicIntrospection {
  private:
   IntrospectionMlx4() = delete;
   ~IntrospectionMlx4() = default;
-  explicit IntrospectionMlx4(const ibv_device_attr& attr)
+  explicit IntrospectionMlx4(const ibv_device_attr_ex& attr)
       : NicIntrospection(attr) {
     // ibv_query_device may report the incorrect capabilities for some cards.
     // Override result when checking for Type2 support.
@@ -19,7 +19,7 @@ class IntrospectionMlx5 : public NicIntrospection {
   // Register MLX5 NIC with the Introspection Registrar.
   static void Register() {
     IntrospectionRegistrar::GetInstance().Register(
-        "mlx5", [](const ibv_device_attr& attr) {
+        "mlx5", [](const ibv_device_attr_ex& attr) {
           return new IntrospectionMlx5(attr);
         });
   }
@@ -85,7 +85,7 @@ class IntrospectionMlx5 : public NicIntrospection {
  private:
   IntrospectionMlx5() = delete;
   ~IntrospectionMlx5() = default;
-  explicit IntrospectionMlx5(const ibv_device_attr& attr)
+  explicit IntrospectionMlx5(const ibv_device_attr_ex& attr)
       : NicIntrospection(attr) {
     // ibv_queury_device incorrectly reports max_qp_wr as 32768.
     // Unable to create RC qp above 8192, and UD qp above 16384
@@ -32,7 +32,8 @@ class NicIntrospection;
 
 class IntrospectionRegistrar {
  public:
-  using Factory = std::function<NicIntrospection*(const ibv_device_attr& attr)>;
+  using Factory =
+      std::function<NicIntrospection*(const ibv_device_attr_ex& attr)>;
 
   static IntrospectionRegistrar& GetInstance();
   Factory GetFactory(std::string_view device);
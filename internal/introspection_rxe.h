@@ -30,8 +30,9 @@ class IntrospectionRxe : public NicIntrospection {
   // Register SoftROCE NIC with the Introspection Registrar.
   static void Register() {
     IntrospectionRegistrar::GetInstance().Register(
-        "rxe",
-        [](const ibv_device_attr& attr) { return new IntrospectionRxe(attr); });
+        "rxe", [](const ibv_device_attr_ex& attr) {
+          return new IntrospectionRxe(attr);
+        });
   }
 
   bool SupportsIpV6() const override { return false; }
@@ -79,7 +80,7 @@ class IntrospectionRxe : public NicIntrospection {
  private:
   IntrospectionRxe() = delete;
   ~IntrospectionRxe() = default;
-  explicit IntrospectionRxe(const ibv_device_attr& attr)
+  explicit IntrospectionRxe(const ibv_device_attr_ex& attr)
       : NicIntrospection(attr) {}
 };
 
@@ -27,8 +27,9 @@
 
 namespace rdma_unit_test {
 
-absl::Status RoceBackend::SetQpRtr(ibv_qp* qp, const verbs_util::PortGid& local,
-                                   ibv_gid remote_gid, uint32_t remote_qpn) {
+absl::Status RoceBackend::SetQpRtr(
+    ibv_qp* qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+    uint32_t remote_qpn, const verbs_util::RcConnectionParams& params) {
   ibv_qp_attr mod_rtr = {};
   mod_rtr.qp_state = IBV_QPS_RTR;
   mod_rtr.path_mtu = verbs_util::ToVerbsMtu(absl::GetFlag(FLAGS_verbs_mtu));
@@ -36,7 +37,7 @@ absl::Status RoceBackend::SetQpRtr(ibv_qp* qp, const verbs_util::PortGid& local,
   static unsigned int psn = 1225;
   mod_rtr.rq_psn = psn;
   // 1225;  // TODO(author1): Eventually randomize for reality.
-  mod_rtr.max_dest_rd_atomic = 10;
+  mod_rtr.max_dest_rd_atomic = params.max_dest_rd_atomic;
   mod_rtr.min_rnr_timer = 26;  // 82us delay
   mod_rtr.ah_attr.grh.dgid = remote_gid;
   mod_rtr.ah_attr.grh.flow_label = 0;
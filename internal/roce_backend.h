@@ -36,8 +36,10 @@ class RoceBackend : public VerbsBackend {
   RoceBackend& operator=(const RoceBackend& backend) = delete;
   ~RoceBackend() override = default;
 
-  absl::Status SetQpRtr(ibv_qp* qp, const verbs_util::PortGid& local,
-                        ibv_gid remote_gid, uint32_t remote_qpn) override;
+  absl::Status SetQpRtr(
+      ibv_qp* qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+      uint32_t remote_qpn,
+      const verbs_util::RcConnectionParams& params) override;
 };
 
 }  // namespace rdma_unit_test
@@ -14,6 +14,7 @@
 
 #include "internal/verbs_backend.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 
@@ -21,30 +22,44 @@
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "infiniband/verbs.h"
+#include "public/introspection.h"
 #include "public/status_matchers.h"
 #include "public/verbs_util.h"
 
 namespace rdma_unit_test {
 
-absl::Status VerbsBackend::SetUpRcQp(ibv_qp* qp,
-                                     const verbs_util::PortGid& local,
-                                     ibv_gid remote_gid, uint32_t remote_qpn) {
+absl::Status VerbsBackend::SetUpRcQp(
+    ibv_qp* qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+    uint32_t remote_qpn, const verbs_util::RcConnectionParams& params) {
+  // Cached, rather than a device query on every connect.
+  const ibv_device_attr& device_attr = Introspection().device_attr();
+  verbs_util::RcConnectionParams clamped = params;
+  clamped.max_rd_atomic = std::min<int>(clamped.max_rd_atomic,
+                                        device_attr.max_qp_init_rd_atom);
+  clamped.max_dest_rd_atomic =
+      std::min<int>(clamped.max_dest_rd_atomic, device_attr.max_qp_rd_atom);
+
   RETURN_IF_ERROR(SetQpInit(qp, local.port));
-  RETURN_IF_ERROR(SetQpRtr(qp, local, remote_gid, remote_qpn));
-  return SetQpRts(qp);
+  RETURN_IF_ERROR(SetQpRtr(qp, local, remote_gid, remote_qpn, clamped));
+  ibv_qp_attr rts_attr = {};
+  rts_attr.max_rd_atomic = clamped.max_rd_atomic;
+  rts_attr.rnr_retry = clamped.rnr_retry;
+  return SetQpRts(qp, rts_attr, IBV_QP_MAX_QP_RD_ATOMIC | IBV_QP_RNR_RETRY);
 }
 
-void VerbsBackend::SetUpSelfConnectedRcQp(ibv_qp* qp,
-                                          const verbs_util::PortGid& local) {
-  absl::Status result = SetUpRcQp(qp, local, local.gid, qp->qp_num);
+void VerbsBackend::SetUpSelfConnectedRcQp(
+    ibv_qp* qp, const verbs_util::PortGid& local,
+    const verbs_util::RcConnectionParams& params) {
+  absl::Status result = SetUpRcQp(qp, local, local.gid, qp->qp_num, params);
   CHECK(result.ok());  // Crash ok
 }
 
-void VerbsBackend::SetUpLoopbackRcQps(ibv_qp* qp1, ibv_qp* qp2,
-                                      const verbs_util::PortGid& local) {
-  absl::Status result = SetUpRcQp(qp1, local, local.gid, qp2->qp_num);
+void VerbsBackend::SetUpLoopbackRcQps(
+    ibv_qp* qp1, ibv_qp* qp2, const verbs_util::PortGid& local,
+    const verbs_util::RcConnectionParams& params) {
+  absl::Status result = SetUpRcQp(qp1, local, local.gid, qp2->qp_num, params);
   CHECK(result.ok());  // Crash ok
-  result = SetUpRcQp(qp2, local, local.gid, qp1->qp_num);
+  result = SetUpRcQp(qp2, local, local.gid, qp1->qp_num, params);
   CHECK(result.ok());  // Crash ok
 }
 
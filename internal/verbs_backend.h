@@ -41,17 +41,23 @@ class VerbsBackend {
   VerbsBackend& operator=(const VerbsBackend& transport) = delete;
   virtual ~VerbsBackend() = default;
 
-  // Sets up a reliable connection queue pair to RTS (ready to send).
+  // Sets up a reliable connection queue pair to RTS (ready to send). |params|
+  // are clamped to the limits of the device under test, as cached by
+  // Introspection().
   absl::Status SetUpRcQp(ibv_qp* qp, const verbs_util::PortGid& local,
-                         ibv_gid remote_gid, uint32_t remote_qpn);
+                         ibv_gid remote_gid, uint32_t remote_qpn,
+                         const verbs_util::RcConnectionParams& params = {});
 
   // Set up a QP that is connected to itself. Succeed or crash.
-  void SetUpSelfConnectedRcQp(ibv_qp* qp, const verbs_util::PortGid& local);
+  void SetUpSelfConnectedRcQp(
+      ibv_qp* qp, const verbs_util::PortGid& local,
+      const verbs_util::RcConnectionParams& params = {});
 
   // Set up a pair of interconnected RC QPs on loopback port. Both QPs share the
   // same NIC and thus same verbs_util::VerbsAddress.
   void SetUpLoopbackRcQps(ibv_qp* qp1, ibv_qp* qp2,
-                          const verbs_util::PortGid& local);
+                          const verbs_util::PortGid& local,
+                          const verbs_util::RcConnectionParams& params = {});
 
   // Sets up a unreliable datagram queue pair to RTS (ready to send).
   absl::Status SetUpUdQp(ibv_qp* qp, verbs_util::PortGid local, uint32_t qkey);
@@ -59,9 +65,11 @@ class VerbsBackend {
   // Modify the QP to Init state.
   absl::Status SetQpInit(ibv_qp* qp, uint8_t port);
 
-  // Modify the QP to RTR(ready to receive) state.
-  virtual absl::Status SetQpRtr(ibv_qp* qp, const verbs_util::PortGid& local,
-                                ibv_gid remote_gid, uint32_t remote_qpn) = 0;
+  // Modify the QP to RTR(ready to receive) state. Of |params| only
+  // max_dest_rd_atomic applies, as is.
+  virtual absl::Status SetQpRtr(
+      ibv_qp* qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+      uint32_t remote_qpn, const verbs_util::RcConnectionParams& params) = 0;
 
   // Modify the QP to RTS(ready to send) state. We can set a set of custom
   // attributes specified using [attr] and [mask]. The set of attributes
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/buffer_pattern.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "glog/logging.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+
+namespace rdma_unit_test {
+namespace buffer_pattern {
+
+namespace {
+
+constexpr size_t kWordSize = sizeof(uint32_t);
+constexpr uint32_t kGolden = 0x9e3779b1;
+constexpr uint32_t kMix1 = 0x85ebca6b;
+constexpr uint32_t kMix2 = 0xc2b2ae35;
+
+// The pattern word at word index |word|. The finalizer of MurmurHash3, which
+// only needs 32-bit multiplies, so all of AVX2 and AVX-512 can vectorize it.
+uint32_t PatternWord(uint64_t seed, uint64_t word) {
+  uint32_t seed_lo = static_cast<uint32_t>(seed);
+  uint32_t seed_hi = static_cast<uint32_t>(seed >> 32);
+  uint32_t x = (static_cast<uint32_t>(word) ^ seed_hi) * kGolden + seed_lo;
+  x ^= x >> 16;
+  x *= kMix1;
+  x ^= x >> 13;
+  x *= kMix2;
+  x ^= x >> 16;
+  return x;
+}
+
+void StoreWord(uint8_t* out, uint32_t word) {
+  out[0] = word;
+  out[1] = word >> 8;
+  out[2] = word >> 16;
+  out[3] = word >> 24;
+}
+
+uint32_t LoadWord(const uint8_t* in) {
+  return in[0] | in[1] << 8 | in[2] << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+// Kernels over |words| whole pattern words starting at word index |first|.
+// FindWordMismatch returns the index of the first differing word, or |words|.
+using FillWordsFn = void (*)(uint64_t seed, uint64_t first, size_t words,
+                             uint8_t* out);
+using FindWordMismatchFn = size_t (*)(uint64_t seed, uint64_t first,
+                                      size_t words, const uint8_t* in);
+
+void FillWordsScalar(uint64_t seed, uint64_t first, size_t words,
+                     uint8_t* out) {
+  for (size_t i = 0; i < words; ++i) {
+    StoreWord(out + i * kWordSize, PatternWord(seed, first + i));
+  }
+}
+
+size_t FindWordMismatchScalar(uint64_t seed, uint64_t first, size_t words,
+                              const uint8_t* in) {
+  for (size_t i = 0; i < words; ++i) {
+    if (LoadWord(in + i * kWordSize) != PatternWord(seed, first + i)) {
+      return i;
+    }
+  }
+  return words;
+}
+
+#if defined(__x86_64__)
+
+// The vector kernels store and load little endian words directly.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+#define RDMA_UNIT_TEST_AVX2 __attribute__((target("avx2")))
+#define RDMA_UNIT_TEST_AVX512 __attribute__((target("avx512f")))
+
+RDMA_UNIT_TEST_AVX2 __m256i PatternWordsAvx2(__m256i seed_lo, __m256i seed_hi,
+                                             __m256i index) {
+  __m256i x = _mm256_add_epi32(
+      _mm256_mullo_epi32(_mm256_xor_si256(index, seed_hi),
+                         _mm256_set1_epi32(kGolden)),
+      seed_lo);
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32(kMix1));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 13));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32(kMix2));
+  return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+RDMA_UNIT_TEST_AVX2 void FillWordsAvx2(uint64_t seed, uint64_t first,
+                                       size_t words, uint8_t* out) {
+  constexpr size_t kLanes = 8;
+  const __m256i seed_lo = _mm256_set1_epi32(static_cast<uint32_t>(seed));
+  const __m256i seed_hi = _mm256_set1_epi32(static_cast<uint32_t>(seed >> 32));
+  const __m256i step = _mm256_set1_epi32(kLanes);
+  __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first),
+                                   _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  size_t i = 0;
+  for (; i + kLanes <= words; i += kLanes) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * kWordSize),
+                        PatternWordsAvx2(seed_lo, seed_hi, index));
+    index = _mm256_add_epi32(index, step);
+  }
+  FillWordsScalar(seed, first + i, words - i, out + i * kWordSize);
+}
+
+RDMA_UNIT_TEST_AVX2 size_t FindWordMismatchAvx2(uint64_t seed, uint64_t first,
+                                                size_t words,
+                                                const uint8_t* in) {
+  constexpr size_t kLanes = 8;
+  const __m256i seed_lo = _mm256_set1_epi32(static_cast<uint32_t>(seed));
+  const __m256i seed_hi = _mm256_set1_epi32(static_cast<uint32_t>(seed >> 32));
+  const __m256i step = _mm256_set1_epi32(kLanes);
+  __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first),
+                                   _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  size_t i = 0;
+  for (; i + kLanes <= words; i += kLanes) {
+    __m256i actual = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(in + i * kWordSize));
+    __m256i equal = _mm256_cmpeq_epi32(
+        actual, PatternWordsAvx2(seed_lo, seed_hi, index));
+    if (_mm256_movemask_epi8(equal) != -1) {
+      break;
+    }
+    index = _mm256_add_epi32(index, step);
+  }
+  return i + FindWordMismatchScalar(seed, first + i, words - i,
+                                    in + i * kWordSize);
+}
+
+RDMA_UNIT_TEST_AVX512 __m512i PatternWordsAvx512(__m512i seed_lo,
+                                                 __m512i seed_hi,
+                                                 __m512i index) {
+  __m512i x = _mm512_add_epi32(
+      _mm512_mullo_epi32(_mm512_xor_si512(index, seed_hi),
+                         _mm512_set1_epi32(kGolden)),
+      seed_lo);
+  x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+  x = _mm512_mullo_epi32(x, _mm512_set1_epi32(kMix1));
+  x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 13));
+  x = _mm512_mullo_epi32(x, _mm512_set1_epi32(kMix2));
+  return _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+}
+
+RDMA_UNIT_TEST_AVX512 __m512i FirstIndicesAvx512(uint64_t first) {
+  return _mm512_add_epi32(
+      _mm512_set1_epi32(first),
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+RDMA_UNIT_TEST_AVX512 void FillWordsAvx512(uint64_t seed, uint64_t first,
+                                           size_t words, uint8_t* out) {
+  constexpr size_t kLanes = 16;
+  const __m512i seed_lo = _mm512_set1_epi32(static_cast<uint32_t>(seed));
+  const __m512i seed_hi = _mm512_set1_epi32(static_cast<uint32_t>(seed >> 32));
+  const __m512i step = _mm512_set1_epi32(kLanes);
+  __m512i index = FirstIndicesAvx512(first);
+  size_t i = 0;
+  for (; i + kLanes <= words; i += kLanes) {
+    _mm512_storeu_si512(out + i * kWordSize,
+                        PatternWordsAvx512(seed_lo, seed_hi, index));
+    index = _mm512_add_epi32(index, step);
+  }
+  FillWordsScalar(seed, first + i, words - i, out + i * kWordSize);
+}
+
+RDMA_UNIT_TEST_AVX512 size_t FindWordMismatchAvx512(uint64_t seed,
+                                                    uint64_t first,
+                                                    size_t words,
+                                                    const uint8_t* in) {
+  constexpr size_t kLanes = 16;
+  const __m512i seed_lo = _mm512_set1_epi32(static_cast<uint32_t>(seed));
+  const __m512i seed_hi = _mm512_set1_epi32(static_cast<uint32_t>(seed >> 32));
+  const __m512i step = _mm512_set1_epi32(kLanes);
+  __m512i index = FirstIndicesAvx512(first);
+  size_t i = 0;
+  for (; i + kLanes <= words; i += kLanes) {
+    __m512i actual = _mm512_loadu_si512(in + i * kWordSize);
+    if (_mm512_cmpneq_epi32_mask(
+            actual, PatternWordsAvx512(seed_lo, seed_hi, index)) != 0) {
+      break;
+    }
+    index = _mm512_add_epi32(index, step);
+  }
+  return i + FindWordMismatchScalar(seed, first + i, words - i,
+                                    in + i * kWordSize);
+}
+
+#undef RDMA_UNIT_TEST_AVX2
+#undef RDMA_UNIT_TEST_AVX512
+
+#endif  // defined(__x86_64__)
+
+struct Kernels {
+  FillWordsFn fill;
+  FindWordMismatchFn find_mismatch;
+};
+
+bool Supported(internal::Isa isa) {
+  switch (isa) {
+    case internal::Isa::kScalar:
+      return true;
+#if defined(__x86_64__)
+    case internal::Isa::kAvx2:
+      return __builtin_cpu_supports("avx2");
+    case internal::Isa::kAvx512:
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+  }
+}
+
+Kernels KernelsFor(internal::Isa isa) {
+  CHECK(Supported(isa)) << "Unsupported isa "  // Crash ok
+                        << static_cast<int>(isa);
+  switch (isa) {
+#if defined(__x86_64__)
+    case internal::Isa::kAvx512:
+      return {&FillWordsAvx512, &FindWordMismatchAvx512};
+    case internal::Isa::kAvx2:
+      return {&FillWordsAvx2, &FindWordMismatchAvx2};
+#endif
+    default:
+      return {&FillWordsScalar, &FindWordMismatchScalar};
+  }
+}
+
+const Kernels& BestKernels() {
+  static const Kernels kKernels = []() -> Kernels {
+    for (internal::Isa isa : {internal::Isa::kAvx512, internal::Isa::kAvx2}) {
+      if (Supported(isa)) {
+        return KernelsFor(isa);
+      }
+    }
+    return KernelsFor(internal::Isa::kScalar);
+  }();
+  return kKernels;
+}
+
+// The number of bytes before the first word boundary at or after |offset|,
+// capped at |size|.
+size_t HeadSize(uint64_t offset, size_t size) {
+  size_t head = (kWordSize - offset % kWordSize) % kWordSize;
+  return head < size ? head : size;
+}
+
+void FillWithKernels(const Kernels& kernels, absl::Span<uint8_t> buffer,
+                     uint64_t seed, uint64_t offset) {
+  size_t head = HeadSize(offset, buffer.size());
+  for (size_t i = 0; i < head; ++i) {
+    buffer[i] = ExpectedByte(seed, offset + i);
+  }
+  size_t words = (buffer.size() - head) / kWordSize;
+  kernels.fill(seed, (offset + head) / kWordSize, words, buffer.data() + head);
+  for (size_t i = head + words * kWordSize; i < buffer.size(); ++i) {
+    buffer[i] = ExpectedByte(seed, offset + i);
+  }
+}
+
+absl::optional<size_t> FindMismatchWithKernels(
+    const Kernels& kernels, absl::Span<const uint8_t> buffer, uint64_t seed,
+    uint64_t offset) {
+  size_t head = HeadSize(offset, buffer.size());
+  for (size_t i = 0; i < head; ++i) {
+    if (buffer[i] != ExpectedByte(seed, offset + i)) {
+      return i;
+    }
+  }
+  size_t words = (buffer.size() - head) / kWordSize;
+  size_t word = kernels.find_mismatch(seed, (offset + head) / kWordSize, words,
+                                      buffer.data() + head);
+  // Past the last whole word, or to the differing byte of a differing word.
+  for (size_t i = head + word * kWordSize; i < buffer.size(); ++i) {
+    if (buffer[i] != ExpectedByte(seed, offset + i)) {
+      return i;
+    }
+  }
+  return absl::nullopt;
+}
+
+}  // namespace
+
+uint8_t ExpectedByte(uint64_t seed, uint64_t position) {
+  return PatternWord(seed, position / kWordSize) >>
+         (8 * (position % kWordSize));
+}
+
+void Fill(absl::Span<uint8_t> buffer, uint64_t seed, uint64_t offset) {
+  FillWithKernels(BestKernels(), buffer, seed, offset);
+}
+
+absl::optional<size_t> FindMismatch(absl::Span<const uint8_t> buffer,
+                                    uint64_t seed, uint64_t offset) {
+  return FindMismatchWithKernels(BestKernels(), buffer, seed, offset);
+}
+
+namespace internal {
+
+bool IsaSupported(Isa isa) { return Supported(isa); }
+
+void FillWithIsa(Isa isa, absl::Span<uint8_t> buffer, uint64_t seed,
+                 uint64_t offset) {
+  FillWithKernels(KernelsFor(isa), buffer, seed, offset);
+}
+
+absl::optional<size_t> FindMismatchWithIsa(Isa isa,
+                                           absl::Span<const uint8_t> buffer,
+                                           uint64_t seed, uint64_t offset) {
+  return FindMismatchWithKernels(KernelsFor(isa), buffer, seed, offset);
+}
+
+}  // namespace internal
+
+}  // namespace buffer_pattern
+}  // namespace rdma_unit_test
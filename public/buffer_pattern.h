@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_BUFFER_PATTERN_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_BUFFER_PATTERN_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+
+namespace rdma_unit_test {
+namespace buffer_pattern {
+
+// Seeded pseudo-random buffer contents for checking data movement.
+//
+// The pattern is a function of the seed and of the position of each byte: byte
+// p of the pattern is byte p % 4 (little endian) of a 32-bit hash of the seed
+// and p / 4. Unlike a constant fill, the pattern catches misplaced, reordered
+// and stale data, e.g. SGEs gathered in the wrong order or a write landing at
+// the wrong offset. Since every position is independent, a buffer can be filled
+// or checked in pieces by passing the position of the first byte as |offset|.
+// Positions wrap every 16 GiB.
+//
+// Both functions use AVX-512 or AVX2 when the CPU supports them, and run at
+// close to memory bandwidth.
+
+// Fills |buffer| with the pattern of |seed|, starting at position |offset|.
+void Fill(absl::Span<uint8_t> buffer, uint64_t seed, uint64_t offset = 0);
+
+// Returns the index in |buffer| of the first byte which differs from the
+// pattern of |seed| starting at position |offset|, or nullopt if the buffer
+// matches the pattern.
+absl::optional<size_t> FindMismatch(absl::Span<const uint8_t> buffer,
+                                    uint64_t seed, uint64_t offset = 0);
+
+// Returns the byte at position |position| of the pattern of |seed|.
+uint8_t ExpectedByte(uint64_t seed, uint64_t position);
+
+namespace internal {
+
+// The instruction sets Fill() and FindMismatch() pick from, best last.
+enum class Isa { kScalar, kAvx2, kAvx512 };
+
+// Returns whether the CPU runs the kernels of |isa|.
+bool IsaSupported(Isa isa);
+
+// Fill() and FindMismatch() with the kernels of |isa|, which must be
+// supported. For tests comparing the kernels.
+void FillWithIsa(Isa isa, absl::Span<uint8_t> buffer, uint64_t seed,
+                 uint64_t offset = 0);
+absl::optional<size_t> FindMismatchWithIsa(Isa isa,
+                                           absl::Span<const uint8_t> buffer,
+                                           uint64_t seed, uint64_t offset = 0);
+
+}  // namespace internal
+
+}  // namespace buffer_pattern
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_BUFFER_PATTERN_H_
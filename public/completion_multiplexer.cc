@@ -0,0 +1,146 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/completion_multiplexer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+
+namespace rdma_unit_test {
+
+CompletionMultiplexer::CompletionMultiplexer(
+    const CompletionMultiplexerOptions& options)
+    : options_(options),
+      epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      ready_(options.max_ready_channels) {
+  CHECK_GE(epoll_fd_, 0);  // Crash ok
+  CHECK_GT(options_.ack_batch, 0u);  // Crash ok
+  CHECK_GT(options_.max_ready_channels, 0);  // Crash ok
+}
+
+CompletionMultiplexer::~CompletionMultiplexer() {
+  for (auto& [cq, state] : cqs_) {
+    if (state.unacked_events > 0) {
+      ibv_ack_cq_events(cq, state.unacked_events);
+    }
+  }
+  close(epoll_fd_);
+}
+
+void CompletionMultiplexer::Add(ibv_cq* cq, Callback callback) {
+  CHECK(cq->channel != nullptr);  // Crash ok
+  bool inserted = cqs_.emplace(cq, Cq{.callback = std::move(callback)}).second;
+  CHECK(inserted) << "CQ added twice.";  // Crash ok
+  Channel& channel = channels_[cq->channel];
+  if (channel.cqs++ == 0) {
+    int fd = cq->channel->fd;
+    int flags = fcntl(fd, F_GETFL);
+    CHECK_GE(flags, 0);  // Crash ok
+    CHECK_EQ(fcntl(fd, F_SETFL, flags | O_NONBLOCK), 0);  // Crash ok
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = cq->channel;
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event),
+             0);  // Crash ok
+  }
+  CHECK_EQ(ibv_req_notify_cq(cq, /*solicited_only=*/0), 0);  // Crash ok
+}
+
+void CompletionMultiplexer::Remove(ibv_cq* cq) {
+  auto iter = cqs_.find(cq);
+  CHECK(iter != cqs_.end()) << "Unknown CQ.";  // Crash ok
+  if (iter->second.unacked_events > 0) {
+    ibv_ack_cq_events(cq, iter->second.unacked_events);
+  }
+  cqs_.erase(iter);
+  // Acknowledges the queued events of |cq|, which is no longer registered.
+  ReadEvents(cq->channel);
+  pending_.erase(std::remove(pending_.begin(), pending_.end(), cq),
+                 pending_.end());
+  auto channel = channels_.find(cq->channel);
+  if (--channel->second.cqs == 0) {
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, cq->channel->fd, nullptr),
+             0);  // Crash ok
+    channels_.erase(channel);
+  }
+}
+
+int CompletionMultiplexer::Poll(absl::Duration timeout) {
+  int timeout_ms = !pending_.empty() ? 0
+                   : timeout == absl::InfiniteDuration()
+                       ? -1
+                       : absl::ToInt64Milliseconds(timeout);
+  int ready = epoll_wait(epoll_fd_, ready_.data(), ready_.size(), timeout_ms);
+  if (ready < 0) {
+    CHECK_EQ(errno, EINTR);  // Crash ok
+    ready = 0;
+  }
+  if (ready > 0) {
+    ++wakeups_;
+  }
+  for (int i = 0; i < ready; ++i) {
+    ReadEvents(static_cast<ibv_comp_channel*>(ready_[i].data.ptr));
+  }
+  // Callbacks may Remove() CQs, which reads more events into |pending_|.
+  std::vector<ibv_cq*> pending;
+  pending.swap(pending_);
+  int dispatched = 0;
+  for (ibv_cq* cq : pending) {
+    auto iter = cqs_.find(cq);
+    if (iter == cqs_.end()) {
+      // Removed by an earlier callback.
+      continue;
+    }
+    iter->second.callback(cq);
+    ++dispatched;
+  }
+  return dispatched;
+}
+
+void CompletionMultiplexer::ReadEvents(ibv_comp_channel* channel) {
+  ibv_cq* cq;
+  void* cq_context;
+  while (ibv_get_cq_event(channel, &cq, &cq_context) == 0) {
+    auto iter = cqs_.find(cq);
+    if (iter == cqs_.end()) {
+      // Raised before the CQ was removed.
+      ibv_ack_cq_events(cq, 1);
+      continue;
+    }
+    Cq& state = iter->second;
+    if (++state.unacked_events >= options_.ack_batch) {
+      ibv_ack_cq_events(cq, state.unacked_events);
+      state.unacked_events = 0;
+    }
+    CHECK_EQ(ibv_req_notify_cq(cq, /*solicited_only=*/0),
+             0);  // Crash ok
+    pending_.push_back(cq);
+  }
+  CHECK(errno == EAGAIN || errno == EWOULDBLOCK);  // Crash ok
+}
+
+}  // namespace rdma_unit_test
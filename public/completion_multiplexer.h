@@ -0,0 +1,113 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_COMPLETION_MULTIPLEXER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_COMPLETION_MULTIPLEXER_H_
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+
+namespace rdma_unit_test {
+
+struct CompletionMultiplexerOptions {
+  // Events of a CQ are acknowledged once this many accumulate, and when the
+  // CQ is removed.
+  uint32_t ack_batch = 16;
+  // The most channels one epoll_wait reports.
+  int max_ready_channels = 64;
+};
+
+// Dispatches completion events of many CQs from a single thread, the way
+// event driven servers do: the fds of the completion channels of all CQs go
+// into one epoll instance, and Poll() waits on it, reads the events of every
+// ready channel, rearms each CQ with an event and calls its callback. CQs
+// may have channels of their own or share them. Event acknowledgements are
+// batched per CQ, since ibv_ack_cq_events takes a lock.
+//
+// CQs are rearmed before their callback runs, so a callback must drain its
+// CQ; completions left behind raise no further event. Channel fds are
+// switched to non-blocking. The multiplexer is not thread safe. Anything
+// unexpected is a CHECK failure.
+class CompletionMultiplexer {
+ public:
+  using Callback = std::function<void(ibv_cq* cq)>;
+
+  explicit CompletionMultiplexer(
+      const CompletionMultiplexerOptions& options =
+          CompletionMultiplexerOptions());
+  // Neither movable nor copyable.
+  CompletionMultiplexer(CompletionMultiplexer&& multiplexer) = delete;
+  CompletionMultiplexer& operator=(CompletionMultiplexer&& multiplexer) =
+      delete;
+  CompletionMultiplexer(const CompletionMultiplexer& multiplexer) = delete;
+  CompletionMultiplexer& operator=(const CompletionMultiplexer& multiplexer) =
+      delete;
+  // Acknowledges the outstanding events of all CQs still registered.
+  ~CompletionMultiplexer();
+
+  // Registers and arms |cq|, which must have a completion channel. |callback|
+  // runs on every event of |cq|.
+  void Add(ibv_cq* cq, Callback callback);
+  // Unregisters |cq| and acknowledges its events, including those still
+  // queued on its channel, so that none is left to read once |cq| is
+  // destroyed. Events of other CQs read off a shared channel on the way are
+  // dispatched by the next Poll(). Call before destroying |cq|.
+  void Remove(ibv_cq* cq);
+
+  // Waits up to |timeout| for a channel to become ready and dispatches every
+  // CQ with an event. Does not wait if Remove() left events to dispatch.
+  // Returns the number of callbacks run.
+  int Poll(absl::Duration timeout);
+
+  // The number of epoll_wait calls which returned ready channels.
+  uint64_t wakeups() const { return wakeups_; }
+
+ private:
+  struct Cq {
+    Callback callback;
+    uint32_t unacked_events = 0;
+  };
+
+  struct Channel {
+    // The number of registered CQs using the channel.
+    int cqs = 0;
+  };
+
+  // Reads every queued event of |channel|. Events of registered CQs are
+  // counted for acknowledgement, their CQ is rearmed and queued in |pending_|;
+  // events of other CQs are acknowledged.
+  void ReadEvents(ibv_comp_channel* channel);
+
+  const CompletionMultiplexerOptions options_;
+  const int epoll_fd_;
+  absl::flat_hash_map<ibv_cq*, Cq> cqs_;
+  absl::flat_hash_map<ibv_comp_channel*, Channel> channels_;
+  std::vector<epoll_event> ready_;
+  // CQs with an event read but no callback run yet, one entry per event.
+  std::vector<ibv_cq*> pending_;
+  uint64_t wakeups_ = 0;
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_COMPLETION_MULTIPLEXER_H_
@@ -53,8 +53,8 @@ const NicIntrospection& Introspection() {
             absl::GetFlag(FLAGS_device_name));
     CHECK_OK(context_or.status());  // Crash ok
     ibv_context* context = context_or.value();
-    ibv_device_attr attr;
-    int query_result = ibv_query_device(context, &attr);
+    ibv_device_attr_ex attr = {};
+    int query_result = ibv_query_device_ex(context, /*input=*/nullptr, &attr);
     CHECK_EQ(0, query_result);  // Crash ok
     std::string device_name = context->device->name;
     CHECK_EQ(0, ibv_close_device(context));  // Crash ok
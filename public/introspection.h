@@ -32,7 +32,8 @@ class NicIntrospection {
  public:
   NicIntrospection() = delete;
   // Must use this constructor in order to use any of the other methods.
-  explicit NicIntrospection(const ibv_device_attr& attr) : attr_(attr) {}
+  explicit NicIntrospection(const ibv_device_attr_ex& attr)
+      : attr_(attr.orig_attr), cq_moderation_caps_(attr.cq_mod_caps) {}
   virtual ~NicIntrospection() = default;
 
   // Returns if the device supports target.
@@ -90,6 +91,17 @@ class NicIntrospection {
   // memory.
   virtual bool RequiresSharedMemory() const { return false; }
 
+  // Returns true if the NIC moderates completion events, see ibv_modify_cq.
+  virtual bool SupportsCqModeration() const {
+    return cq_moderation_caps_.max_cq_count > 0 &&
+           cq_moderation_caps_.max_cq_period > 0;
+  }
+
+  // Returns the limits of completion event moderation.
+  const ibv_cq_moderation_caps& cq_moderation_caps() const {
+    return cq_moderation_caps_;
+  }
+
   // Returns the device attributes.
   const ibv_device_attr& device_attr() const { return attr_; }
 
@@ -105,6 +117,7 @@ class NicIntrospection {
   }
 
   ibv_device_attr attr_;
+  ibv_cq_moderation_caps cq_moderation_caps_;
 };
 
 // Returns an introspection object which can be queried for device capabilities.
@@ -15,6 +15,8 @@
 #ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_MAP_UTIL_H_
 #define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_MAP_UTIL_H_
 
+#include <utility>
+
 #include "glog/logging.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
@@ -61,6 +63,12 @@ void InsertOrDie(absl::flat_hash_map<K, V>& map, const K& k, const V& v) {
   CHECK(result.second);  // Crash ok
 }
 
+template <typename K, typename V>
+void InsertOrDie(absl::flat_hash_map<K, V>& map, const K& k, V&& v) {
+  auto result = map.emplace(k, std::move(v));
+  CHECK(result.second);  // Crash ok
+}
+
 template <typename T>
 void InsertOrDie(absl::flat_hash_set<T>& set, const T& t) {
   auto result = set.emplace(t);
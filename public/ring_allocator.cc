@@ -0,0 +1,116 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/ring_allocator.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "glog/logging.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+
+namespace rdma_unit_test {
+
+RingAllocator::RingAllocator(absl::Span<uint8_t> buffer, ibv_mr* mr, Mode mode)
+    : buffer_(buffer), lkey_(mr->lkey), mode_(mode) {
+  CHECK_GT(buffer.size(), 0ul);  // Crash ok
+  DCHECK_GE(buffer.data(), static_cast<uint8_t*>(mr->addr));
+  DCHECK_LE(buffer.data() + buffer.size(),
+            static_cast<uint8_t*>(mr->addr) + mr->length);
+}
+
+absl::optional<RingAllocator::Reservation> RingAllocator::Reserve(
+    uint64_t length) {
+  Reservation reservation;
+  if (!ReserveBulk(length, absl::MakeSpan(&reservation, 1))) {
+    return absl::nullopt;
+  }
+  return reservation;
+}
+
+bool RingAllocator::ReserveBulk(uint64_t length,
+                                absl::Span<Reservation> reservations) {
+  uint64_t head = head_.load(std::memory_order_relaxed);
+  while (true) {
+    absl::optional<uint64_t> next =
+        Layout(head, tail_.load(std::memory_order_acquire), length,
+               reservations);
+    if (!next.has_value()) {
+      return false;
+    }
+    switch (mode_) {
+      case Mode::kSingleProducer:
+        head_.store(next.value(), std::memory_order_relaxed);
+        return true;
+      case Mode::kMultiProducer:
+        // On failure |head| is reloaded and the layout is redone.
+        if (head_.compare_exchange_weak(head, next.value(),
+                                        std::memory_order_relaxed)) {
+          return true;
+        }
+        break;
+    }
+  }
+}
+
+void RingAllocator::Release(const Reservation& reservation) {
+  uint64_t end = reservation.position + reservation.length;
+  DCHECK_LE(end, head_.load(std::memory_order_relaxed));
+  // Only the releaser moves the tail, so it cannot change under us.
+  if (end > tail_.load(std::memory_order_relaxed)) {
+    tail_.store(end, std::memory_order_release);
+  }
+}
+
+ibv_sge RingAllocator::Sge(const Reservation& reservation) const {
+  absl::Span<uint8_t> data = Data(reservation);
+  ibv_sge sge;
+  sge.addr = reinterpret_cast<uint64_t>(data.data());
+  sge.length = data.size();
+  sge.lkey = lkey_;
+  return sge;
+}
+
+uint64_t RingAllocator::used() const {
+  return head_.load(std::memory_order_relaxed) -
+         tail_.load(std::memory_order_relaxed);
+}
+
+absl::optional<uint64_t> RingAllocator::Layout(
+    uint64_t head, uint64_t tail, uint64_t length,
+    absl::Span<Reservation> reservations) const {
+  if (length > buffer_.size()) {
+    return absl::nullopt;
+  }
+  for (Reservation& reservation : reservations) {
+    // Skip to the start of the buffer rather than straddle its end.
+    uint64_t offset = head % buffer_.size();
+    if (offset + length > buffer_.size()) {
+      head += buffer_.size() - offset;
+    }
+    reservation = {.position = head, .length = length};
+    head += length;
+    if (head - tail > buffer_.size()) {
+      return absl::nullopt;
+    }
+  }
+  return head;
+}
+
+}  // namespace rdma_unit_test
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RING_ALLOCATOR_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RING_ALLOCATOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+
+namespace rdma_unit_test {
+
+// A lock-free FIFO allocator over a registered buffer, for message slots and
+// payload staging. Reservations are contiguous and are handed out in ring
+// order; a reservation which does not fit before the end of the buffer skips
+// to the start. Space is reclaimed by releasing reservations in the order
+// they were made.
+//
+// Reservations are identified by their position, which counts bytes from the
+// creation of the allocator and never wraps, so a reservation fits in the
+// wr_id of the work request using it and can be rebuilt from the completion.
+// The allocator keeps no per-reservation state.
+//
+// In kSingleProducer mode one thread at a time may reserve; in kMultiProducer
+// mode any number of threads may reserve concurrently. In both modes one
+// thread at a time may release, concurrently with the producers.
+class RingAllocator {
+ public:
+  enum class Mode { kSingleProducer, kMultiProducer };
+
+  struct Reservation {
+    // The position of the first byte.
+    uint64_t position;
+    uint64_t length;
+  };
+
+  // |buffer| must lie within |mr|. The allocator does not own either.
+  RingAllocator(absl::Span<uint8_t> buffer, ibv_mr* mr,
+                Mode mode = Mode::kSingleProducer);
+  // Neither movable nor copyable.
+  RingAllocator(RingAllocator&& allocator) = delete;
+  RingAllocator& operator=(RingAllocator&& allocator) = delete;
+  RingAllocator(const RingAllocator& allocator) = delete;
+  RingAllocator& operator=(const RingAllocator& allocator) = delete;
+  ~RingAllocator() = default;
+
+  // Reserves |length| contiguous bytes. Returns nullopt if there is no room.
+  absl::optional<Reservation> Reserve(uint64_t length);
+
+  // Reserves reservations.size() slots of |length| bytes each with a single
+  // update of the ring, filling |reservations| in order. Returns false,
+  // reserving nothing, if they do not all fit.
+  bool ReserveBulk(uint64_t length, absl::Span<Reservation> reservations);
+
+  // Releases |reservation| and every reservation made before it, so that a
+  // batch of completions is returned by releasing its newest reservation.
+  // Releasing a reservation which a newer release already retired does
+  // nothing.
+  void Release(const Reservation& reservation);
+
+  absl::Span<uint8_t> Data(const Reservation& reservation) const {
+    return buffer_.subspan(reservation.position % buffer_.size(),
+                           reservation.length);
+  }
+
+  ibv_sge Sge(const Reservation& reservation) const;
+
+  // The number of bytes reserved and not released, including the bytes
+  // skipped at the end of the buffer when wrapping.
+  uint64_t used() const;
+
+  uint64_t capacity() const { return buffer_.size(); }
+
+ private:
+  // Lays out |reservations| of |length| bytes from |head| and returns the new
+  // head, or nullopt if they do not fit in front of |tail|.
+  absl::optional<uint64_t> Layout(uint64_t head, uint64_t tail,
+                                  uint64_t length,
+                                  absl::Span<Reservation> reservations) const;
+
+  const absl::Span<uint8_t> buffer_;
+  const uint32_t lkey_;
+  const Mode mode_;
+  // Producers and the releaser advance separate cursors; keep them on
+  // separate cache lines so they do not bounce between cores.
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RING_ALLOCATOR_H_
@@ -0,0 +1,560 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/rpc_engine.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "glog/logging.h"
+#include "absl/base/attributes.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/buffer_pattern.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+
+namespace {
+
+// Local function to simplify initialization of const member attributes.
+template <typename T>
+T DieIfNull(T&& t) {
+  CHECK(t != nullptr);  // Crash ok
+  return std::forward<T>(t);
+}
+
+// The control message for an RPC request, followed by the payload of eager
+// writes.
+struct RpcRequest {
+  uint64_t id;
+  RpcOperation operation;
+  uint8_t eager;
+  uint32_t length;
+  // Rendezvous only: the window over the client buffer.
+  uint64_t addr;
+  uint32_t rkey;
+  uint64_t seed;
+} ABSL_ATTRIBUTE_PACKED;
+
+// The control message for an RPC response, followed by the payload of eager
+// reads.
+struct RpcResponse {
+  uint64_t id;
+  RpcResult result;
+  uint32_t length;
+} ABSL_ATTRIBUTE_PACKED;
+
+constexpr uint32_t kHeaderSize = std::max(sizeof(RpcRequest),
+                                          sizeof(RpcResponse));
+
+// Client data QP work request ids are the RPC id shifted left by one, with
+// the low bit set for the invalidations of CancelRpc().
+constexpr uint64_t kCancelBit = 1;
+
+// Every RPC takes at most one message each way. Responses can be consumed and
+// answered by a new request before their send completion is polled, so the
+// send side keeps twice the slots.
+uint32_t SendSlots(const RpcEngineOptions& options) {
+  return 2 * options.max_outstanding;
+}
+
+uint32_t RecvSlots(const RpcEngineOptions& options) {
+  return options.max_outstanding + options.recv_batch;
+}
+
+// A client RPC takes up to three data work requests: invalidating the previous
+// binding of its window, the bind and a cancellation.
+uint32_t DataSlots(const RpcEngineOptions& options) {
+  return 3 * options.max_outstanding;
+}
+
+void CheckPayload(absl::Span<const uint8_t> payload, uint64_t seed,
+                  absl::string_view what) {
+  absl::optional<size_t> mismatch = buffer_pattern::FindMismatch(payload, seed);
+  CHECK(!mismatch.has_value())  // Crash ok
+      << what << " data differs at offset " << mismatch.value();
+}
+
+}  // namespace
+
+RpcControl::RpcControl(VerbsHelperSuite& ibv, ibv_context* context, ibv_pd* pd,
+                       const RpcEngineOptions& options)
+    : message_size_(kHeaderSize + options.eager_threshold),
+      recv_batch_(options.recv_batch),
+      poll_batch_(options.poll_batch),
+      recv_slots_(RecvSlots(options)),
+      buffer_(ibv.AllocAlignedBufferByBytes(
+          message_size_ * (SendSlots(options) + RecvSlots(options)))),
+      send_cq_(DieIfNull(ibv.CreateCq(context, SendSlots(options)))),
+      recv_cq_(DieIfNull(ibv.CreateCq(context, RecvSlots(options)))),
+      qp_(DieIfNull(ibv.CreateQp(pd, send_cq_, recv_cq_, nullptr,
+                                 SendSlots(options), RecvSlots(options),
+                                 IBV_QPT_RC, /*sig_all=*/0))),
+      mr_(DieIfNull(ibv.RegMr(pd, buffer_))),
+      send_ring_(buffer_.subspan(0, message_size_ * SendSlots(options)), mr_),
+      recv_ring_(buffer_.subspan(message_size_ * SendSlots(options)), mr_),
+      recv_reservations_(recv_batch_),
+      recv_wrs_(recv_batch_),
+      recv_sges_(recv_batch_),
+      completions_(poll_batch_),
+      send_completions_(poll_batch_) {
+  CHECK_GT(recv_batch_, 0u);  // Crash ok
+  CHECK_GT(poll_batch_, 0u);  // Crash ok
+}
+
+void RpcControl::Connect(VerbsHelperSuite& ibv, const RpcControl& other) {
+  absl::Status status = ibv.SetUpRcQp(
+      qp_, ibv.GetLocalPortGid(qp_->context),
+      ibv.GetLocalPortGid(other.qp_->context).gid, other.qp_->qp_num);
+  CHECK(status.ok()) << status;  // Crash ok
+  // Recvs cannot be posted to a QP in the reset state.
+  for (uint32_t posted = 0; posted < recv_slots_; posted += recv_batch_) {
+    PostRecvs(std::min(recv_batch_, recv_slots_ - posted));
+  }
+}
+
+RpcControl::Message RpcControl::ReserveMessage() {
+  absl::optional<RingAllocator::Reservation> slot =
+      send_ring_.Reserve(message_size_);
+  absl::Time stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+  while (!slot.has_value()) {
+    CHECK(absl::Now() < stop)  // Crash ok
+        << "Timed out waiting for send completions.";
+    PollSends();
+    slot = send_ring_.Reserve(message_size_);
+  }
+  return {.reservation = slot.value(), .data = send_ring_.Data(slot.value())};
+}
+
+void RpcControl::SendMessage(const Message& message, uint32_t length) {
+  DCHECK_LE(length, message.data.size());
+  ibv_sge sge = send_ring_.Sge(message.reservation);
+  sge.length = length;
+  ibv_send_wr send{};
+  // The completion releases the slot.
+  send.wr_id = message.reservation.position;
+  send.sg_list = &sge;
+  send.num_sge = 1;
+  send.opcode = IBV_WR_SEND;
+  send.send_flags = IBV_SEND_SIGNALED;
+  ibv_send_wr* bad_wr;
+  CHECK_EQ(ibv_post_send(qp_, &send, &bad_wr), 0);  // Crash ok
+}
+
+int RpcControl::Poll(
+    absl::FunctionRef<void(absl::Span<const uint8_t>)> on_message) {
+  PollSends();
+  int count = ibv_poll_cq(recv_cq_, poll_batch_, completions_.data());
+  CHECK_GE(count, 0);  // Crash ok
+  for (int i = 0; i < count; ++i) {
+    const ibv_wc& completion = completions_[i];
+    CHECK_EQ(completion.status, IBV_WC_SUCCESS)  // Crash ok
+        << ibv_wc_status_str(completion.status);
+    on_message(recv_ring_.Data({.position = completion.wr_id,
+                                .length = completion.byte_len}));
+  }
+  if (count > 0) {
+    // Recvs complete in order, so this releases every slot consumed here.
+    // They are not reused until the reposts below.
+    recv_ring_.Release({.position = completions_[count - 1].wr_id,
+                        .length = message_size_});
+  }
+  consumed_recvs_ += count;
+  while (consumed_recvs_ >= recv_batch_) {
+    PostRecvs(recv_batch_);
+    consumed_recvs_ -= recv_batch_;
+  }
+  return count;
+}
+
+void RpcControl::PostRecvs(uint32_t count) {
+  DCHECK_LE(count, recv_batch_);
+  absl::Span<RingAllocator::Reservation> reservations =
+      absl::MakeSpan(recv_reservations_).subspan(0, count);
+  CHECK(recv_ring_.ReserveBulk(message_size_, reservations));  // Crash ok
+  for (uint32_t i = 0; i < count; ++i) {
+    recv_sges_[i] = recv_ring_.Sge(reservations[i]);
+    recv_wrs_[i].wr_id = reservations[i].position;
+    recv_wrs_[i].next = i + 1 < count ? &recv_wrs_[i + 1] : nullptr;
+    recv_wrs_[i].sg_list = &recv_sges_[i];
+    recv_wrs_[i].num_sge = 1;
+  }
+  ibv_recv_wr* bad_wr;
+  CHECK_EQ(ibv_post_recv(qp_, recv_wrs_.data(), &bad_wr), 0);  // Crash ok
+}
+
+void RpcControl::PollSends() {
+  int count = ibv_poll_cq(send_cq_, poll_batch_, send_completions_.data());
+  CHECK_GE(count, 0);  // Crash ok
+  for (int i = 0; i < count; ++i) {
+    CHECK_EQ(send_completions_[i].status, IBV_WC_SUCCESS)  // Crash ok
+        << ibv_wc_status_str(send_completions_[i].status);
+  }
+  if (count > 0) {
+    send_ring_.Release({.position = send_completions_[count - 1].wr_id,
+                        .length = message_size_});
+  }
+}
+
+RpcEndpoint::RpcEndpoint(VerbsHelperSuite& ibv,
+                         const RpcEngineOptions& options)
+    : options_(options),
+      // One more RPC of room than can be in flight covers the space skipped
+      // when the ring wraps.
+      data_buffer_(ibv.AllocAlignedBufferByBytes(
+          (options.max_outstanding + 1) * options.max_rpc_size)),
+      context_(DieIfNull(ibv.OpenDevice().value())),
+      pd_(DieIfNull(ibv.AllocPd(context_))),
+      data_cq_(DieIfNull(ibv.CreateCq(context_, DataSlots(options)))),
+      data_qp_(DieIfNull(ibv.CreateQp(pd_, data_cq_, data_cq_, nullptr,
+                                      DataSlots(options),
+                                      /*max_recv_wr=*/1, IBV_QPT_RC,
+                                      /*sig_all=*/0))),
+      data_mr_(DieIfNull(ibv.RegMr(pd_, data_buffer_))),
+      data_ring_(data_buffer_.span(), data_mr_),
+      control_(ibv, context_, pd_, options),
+      completions_(options.poll_batch) {}
+
+void RpcEndpoint::Connect(VerbsHelperSuite& ibv, const RpcEndpoint& other) {
+  absl::Status status = ibv.SetUpRcQp(
+      data_qp_, ibv.GetLocalPortGid(data_qp_->context),
+      ibv.GetLocalPortGid(other.data_qp_->context).gid,
+      other.data_qp_->qp_num);
+  CHECK(status.ok()) << status;  // Crash ok
+  control_.Connect(ibv, other.control_);
+}
+
+RpcClient::RpcClient(VerbsHelperSuite& ibv, const RpcEngineOptions& options)
+    : RpcEndpoint(ibv, options), windows_(options.max_outstanding) {
+  for (Window& window : windows_) {
+    window.mw = DieIfNull(ibv.AllocMw(pd_, IBV_MW_TYPE_2));
+    window.bound = false;
+    free_windows_.push_back(&window);
+  }
+}
+
+absl::optional<uint64_t> RpcClient::StartRpc(RpcOperation operation,
+                                             uint32_t length, uint64_t seed) {
+  CHECK_LE(length, options_.max_rpc_size);  // Crash ok
+  if (rpcs_.size() >= options_.max_outstanding) {
+    return absl::nullopt;
+  }
+  uint64_t id = next_id_++;
+  Rpc rpc = {.operation = operation,
+             .length = length,
+             .eager = length <= options_.eager_threshold,
+             .seed = seed,
+             .start = absl::Now(),
+             .reservation = {},
+             .buffer = nullptr,
+             .window = nullptr,
+             .rkey = 0};
+  if (rpc.eager) {
+    SendRequest(id, rpc);
+    rpcs_.emplace(id, rpc);
+    return id;
+  }
+
+  absl::optional<RingAllocator::Reservation> reservation =
+      data_ring_.Reserve(length);
+  if (!reservation.has_value()) {
+    return absl::nullopt;
+  }
+  data_reservations_.emplace_back(reservation.value(), false);
+  rpc.reservation = reservation.value();
+  rpc.buffer = data_ring_.Data(rpc.reservation).data();
+  rpc.window = free_windows_.back();
+  free_windows_.pop_back();
+  rpc.rkey = ibv_inc_rkey(rpc.window->mw->rkey);
+  if (options_.validate) {
+    absl::Span<uint8_t> payload = absl::MakeSpan(rpc.buffer, length);
+    switch (operation) {
+      case RpcOperation::kRead:
+        memset(payload.data(), 0, payload.size());
+        break;
+      case RpcOperation::kWrite:
+        buffer_pattern::Fill(payload, seed);
+        break;
+    }
+  }
+
+  // The request goes out when the bind completes, so that the server RMA
+  // cannot race the bind. A window still bound by an earlier RPC is
+  // invalidated first.
+  ibv_send_wr invalidate{};
+  invalidate.opcode = IBV_WR_LOCAL_INV;
+  invalidate.invalidate_rkey = rpc.window->mw->rkey;
+  ibv_send_wr bind{};
+  bind.wr_id = id << 1;
+  bind.opcode = IBV_WR_BIND_MW;
+  bind.send_flags = IBV_SEND_SIGNALED;
+  bind.bind_mw.mw = rpc.window->mw;
+  bind.bind_mw.rkey = rpc.rkey;
+  bind.bind_mw.bind_info.mr = data_mr_;
+  bind.bind_mw.bind_info.addr = reinterpret_cast<uint64_t>(rpc.buffer);
+  bind.bind_mw.bind_info.length = length;
+  bind.bind_mw.bind_info.mw_access_flags =
+      operation == RpcOperation::kRead ? IBV_ACCESS_REMOTE_WRITE
+                                       : IBV_ACCESS_REMOTE_READ;
+  ibv_send_wr* first = &bind;
+  if (rpc.window->bound) {
+    invalidate.next = &bind;
+    first = &invalidate;
+    rpc.window->bound = false;
+  }
+  ibv_send_wr* bad_wr;
+  CHECK_EQ(ibv_post_send(data_qp_, first, &bad_wr), 0);  // Crash ok
+  rpcs_.emplace(id, rpc);
+  return id;
+}
+
+void RpcClient::CancelRpc(uint64_t id) {
+  auto iter = rpcs_.find(id);
+  CHECK(iter != rpcs_.end()) << "Unknown RPC " << id;  // Crash ok
+  CHECK(!iter->second.eager) << "Eager RPCs cannot be cancelled.";  // Crash ok
+  ibv_send_wr invalidate{};
+  invalidate.wr_id = id << 1 | kCancelBit;
+  invalidate.opcode = IBV_WR_LOCAL_INV;
+  invalidate.send_flags = IBV_SEND_SIGNALED;
+  invalidate.invalidate_rkey = iter->second.rkey;
+  ibv_send_wr* bad_wr;
+  CHECK_EQ(ibv_post_send(data_qp_, &invalidate, &bad_wr), 0);  // Crash ok
+
+  cancel_done_ = false;
+  absl::Time stop = absl::Now() + verbs_util::kDefaultCompletionTimeout;
+  while (!cancel_done_) {
+    CHECK(absl::Now() < stop)  // Crash ok
+        << "Timed out waiting for invalidation.";
+    int count =
+        ibv_poll_cq(data_cq_, completions_.size(), completions_.data());
+    CHECK_GE(count, 0);  // Crash ok
+    for (int i = 0; i < count; ++i) {
+      ProcessDataCompletion(completions_[i]);
+    }
+  }
+  rpcs_.at(id).window->bound = false;
+}
+
+int RpcClient::Poll() {
+  int count = ibv_poll_cq(data_cq_, completions_.size(), completions_.data());
+  CHECK_GE(count, 0);  // Crash ok
+  for (int i = 0; i < count; ++i) {
+    ProcessDataCompletion(completions_[i]);
+  }
+  return count + control_.Poll([this](absl::Span<const uint8_t> message) {
+           HandleResponse(message);
+         });
+}
+
+absl::optional<RpcCompletion> RpcClient::NextCompletion() {
+  if (finished_.empty()) {
+    return absl::nullopt;
+  }
+  RpcCompletion completion = finished_.front();
+  finished_.pop_front();
+  return completion;
+}
+
+void RpcClient::ProcessDataCompletion(const ibv_wc& completion) {
+  CHECK_EQ(completion.status, IBV_WC_SUCCESS)  // Crash ok
+      << ibv_wc_status_str(completion.status);
+  if (completion.wr_id & kCancelBit) {
+    cancel_done_ = true;
+    return;
+  }
+  CHECK_EQ(completion.opcode, IBV_WC_BIND_MW);  // Crash ok
+  uint64_t id = completion.wr_id >> 1;
+  Rpc& rpc = rpcs_.at(id);
+  rpc.window->mw->rkey = rpc.rkey;
+  rpc.window->bound = true;
+  SendRequest(id, rpc);
+}
+
+void RpcClient::SendRequest(uint64_t id, const Rpc& rpc) {
+  RpcRequest request = {
+      .id = id,
+      .operation = rpc.operation,
+      .eager = rpc.eager,
+      .length = rpc.length,
+      .addr = reinterpret_cast<uint64_t>(rpc.buffer),
+      .rkey = rpc.rkey,
+      .seed = rpc.seed,
+  };
+  RpcControl::Message message = control_.ReserveMessage();
+  memcpy(message.data.data(), &request, sizeof(request));
+  uint32_t size = sizeof(request);
+  if (rpc.eager && rpc.operation == RpcOperation::kWrite) {
+    if (options_.validate) {
+      buffer_pattern::Fill(message.data.subspan(size, rpc.length), rpc.seed);
+    }
+    size += rpc.length;
+  }
+  control_.SendMessage(message, size);
+}
+
+void RpcClient::HandleResponse(absl::Span<const uint8_t> message) {
+  RpcResponse response;
+  CHECK_GE(message.size(), sizeof(response));  // Crash ok
+  memcpy(&response, message.data(), sizeof(response));
+  auto iter = rpcs_.find(response.id);
+  CHECK(iter != rpcs_.end()) << "Unknown RPC " << response.id;  // Crash ok
+  const Rpc& rpc = iter->second;
+  CHECK_EQ(response.length, rpc.length);  // Crash ok
+  if (options_.validate && rpc.operation == RpcOperation::kRead &&
+      response.result == RpcResult::kSuccess) {
+    if (rpc.eager) {
+      CHECK_EQ(message.size(), sizeof(response) + rpc.length);  // Crash ok
+      CheckPayload(message.subspan(sizeof(response)), rpc.seed, "Read");
+    } else {
+      CheckPayload(absl::MakeConstSpan(rpc.buffer, rpc.length), rpc.seed,
+                   "Read");
+    }
+  }
+  if (!rpc.eager) {
+    ReturnData(rpc.reservation);
+    free_windows_.push_back(rpc.window);
+  }
+  finished_.push_back({.id = response.id,
+                       .operation = rpc.operation,
+                       .length = rpc.length,
+                       .eager = rpc.eager,
+                       .result = response.result,
+                       .latency = absl::Now() - rpc.start});
+  rpcs_.erase(iter);
+}
+
+void RpcClient::ReturnData(const RingAllocator::Reservation& reservation) {
+  auto iter = data_reservations_.begin();
+  while (iter->first.position != reservation.position || iter->second) {
+    ++iter;
+    CHECK(iter != data_reservations_.end());  // Crash ok
+  }
+  iter->second = true;
+  absl::optional<RingAllocator::Reservation> release;
+  while (!data_reservations_.empty() && data_reservations_.front().second) {
+    release = data_reservations_.front().first;
+    data_reservations_.pop_front();
+  }
+  if (release.has_value()) {
+    data_ring_.Release(release.value());
+  }
+}
+
+RpcServer::RpcServer(VerbsHelperSuite& ibv, const RpcEngineOptions& options)
+    : RpcEndpoint(ibv, options) {}
+
+int RpcServer::Poll() {
+  int count = ibv_poll_cq(data_cq_, completions_.size(), completions_.data());
+  CHECK_GE(count, 0);  // Crash ok
+  for (int i = 0; i < count; ++i) {
+    const ibv_wc& completion = completions_[i];
+    CHECK(!pending_rmas_.empty());  // Crash ok
+    PendingRma rma = pending_rmas_.front();
+    pending_rmas_.pop_front();
+    RpcResult result = RpcResult::kSuccess;
+    if (completion.status != IBV_WC_SUCCESS) {
+      VLOG(1) << "RMA for RPC " << rma.id
+              << " failed: " << ibv_wc_status_str(completion.status);
+      result = RpcResult::kInvalidWindow;
+      ++failed_rmas_;
+    } else if (options_.validate && rma.operation == RpcOperation::kWrite) {
+      CheckPayload(data_ring_.Data(rma.reservation), rma.seed, "Written");
+    }
+    data_ring_.Release(rma.reservation);
+    SendResponse(rma.id, result, rma.length);
+  }
+  return count + control_.Poll([this](absl::Span<const uint8_t> message) {
+           HandleRequest(message);
+         });
+}
+
+void RpcServer::HandleRequest(absl::Span<const uint8_t> message) {
+  RpcRequest request;
+  CHECK_GE(message.size(), sizeof(request));  // Crash ok
+  memcpy(&request, message.data(), sizeof(request));
+  ++requests_;
+  if (request.eager) {
+    absl::Span<const uint8_t> payload = message.subspan(sizeof(request));
+    absl::optional<uint64_t> eager_seed;
+    switch (request.operation) {
+      case RpcOperation::kRead:
+        eager_seed = static_cast<uint64_t>(request.seed);
+        break;
+      case RpcOperation::kWrite:
+        CHECK_EQ(payload.size(), request.length);  // Crash ok
+        if (options_.validate) {
+          CheckPayload(payload, request.seed, "Written");
+        }
+        break;
+    }
+    SendResponse(request.id, RpcResult::kSuccess, request.length, eager_seed);
+    return;
+  }
+
+  absl::optional<RingAllocator::Reservation> reservation =
+      data_ring_.Reserve(request.length);
+  CHECK(reservation.has_value())  // Crash ok
+      << "No room for RPC " << request.id << " of " << request.length
+      << " bytes.";
+  if (options_.validate && request.operation == RpcOperation::kRead) {
+    buffer_pattern::Fill(data_ring_.Data(reservation.value()), request.seed);
+  }
+  ibv_sge sge = data_ring_.Sge(reservation.value());
+  ibv_send_wr rma{};
+  rma.sg_list = &sge;
+  rma.num_sge = 1;
+  rma.opcode = request.operation == RpcOperation::kRead ? IBV_WR_RDMA_WRITE
+                                                        : IBV_WR_RDMA_READ;
+  rma.send_flags = IBV_SEND_SIGNALED;
+  rma.wr.rdma.remote_addr = request.addr;
+  rma.wr.rdma.rkey = request.rkey;
+  ibv_send_wr* bad_wr;
+  CHECK_EQ(ibv_post_send(data_qp_, &rma, &bad_wr), 0);  // Crash ok
+  pending_rmas_.push_back({.id = request.id,
+                           .operation = request.operation,
+                           .length = request.length,
+                           .seed = request.seed,
+                           .reservation = reservation.value()});
+}
+
+void RpcServer::SendResponse(uint64_t id, RpcResult result, uint32_t length,
+                             absl::optional<uint64_t> eager_seed) {
+  RpcResponse response = {.id = id, .result = result, .length = length};
+  RpcControl::Message message = control_.ReserveMessage();
+  memcpy(message.data.data(), &response, sizeof(response));
+  uint32_t size = sizeof(response);
+  if (eager_seed.has_value()) {
+    if (options_.validate) {
+      buffer_pattern::Fill(message.data.subspan(size, length),
+                           eager_seed.value());
+    }
+    size += length;
+  }
+  control_.SendMessage(message, size);
+}
+
+}  // namespace rdma_unit_test
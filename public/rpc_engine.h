@@ -0,0 +1,284 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RPC_ENGINE_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RPC_ENGINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+#include "public/ring_allocator.h"
+#include "public/verbs_helper_suite.h"
+
+namespace rdma_unit_test {
+
+// A pipelined RPC engine modeled on the rendezvous protocol of storage
+// services. A client sends a small control message per RPC. Payloads up to
+// the eager threshold travel inside the control messages. Larger payloads stay
+// in client memory behind a type 2 memory window which the server accesses
+// with RDMA READ (client writes) or RDMA WRITE (client reads) before it
+// responds.
+//
+// All progress is completion driven: Poll() drains CQs in batches and never
+// sleeps, so a client and a server can share a thread or each own one.
+// Payloads are filled and checked with buffer_pattern when validation is on.
+// Like the rest of the test helpers, anything unexpected is a CHECK failure.
+
+struct RpcEngineOptions {
+  // The maximum number of RPCs in flight at once.
+  uint32_t max_outstanding = 32;
+  // The largest payload of a single RPC.
+  uint32_t max_rpc_size = 64 * 1024;
+  // Payloads of at most this many bytes are sent eagerly inside the control
+  // messages. The default sends every non-empty payload by rendezvous.
+  uint32_t eager_threshold = 0;
+  // Control recv buffers are reposted in chains of this many.
+  uint32_t recv_batch = 16;
+  // The maximum number of completions drained by one ibv_poll_cq.
+  uint32_t poll_batch = 16;
+  // Fill payloads with a seeded pattern and check them on arrival. Turning
+  // this off measures the transport alone.
+  bool validate = true;
+};
+
+enum class RpcOperation : uint8_t {
+  // The client reads |length| bytes from the server.
+  kRead,
+  // The client writes |length| bytes to the server.
+  kWrite,
+};
+
+enum class RpcResult : uint8_t { kSuccess, kInvalidWindow };
+
+struct RpcCompletion {
+  uint64_t id;
+  RpcOperation operation;
+  uint32_t length;
+  bool eager;
+  RpcResult result;
+  // From StartRpc() to processing the response.
+  absl::Duration latency;
+};
+
+// The control path of one side of an RPC pair: a dedicated RC QP with
+// separate send and recv CQs and a buffer carved into fixed size message
+// slots. Recv slots are reposted in batches as messages are consumed.
+class RpcControl {
+ public:
+  RpcControl(VerbsHelperSuite& ibv, ibv_context* context, ibv_pd* pd,
+             const RpcEngineOptions& options);
+  // Neither movable nor copyable.
+  RpcControl(RpcControl&& control) = delete;
+  RpcControl& operator=(RpcControl&& control) = delete;
+  RpcControl(const RpcControl& control) = delete;
+  RpcControl& operator=(const RpcControl& control) = delete;
+  ~RpcControl() = default;
+
+  void Connect(VerbsHelperSuite& ibv, const RpcControl& other);
+
+  // A message slot of message_size() bytes.
+  struct Message {
+    RingAllocator::Reservation reservation;
+    absl::Span<uint8_t> data;
+  };
+
+  // Returns a free message slot, reclaiming send slots from completed sends as
+  // needed.
+  Message ReserveMessage();
+  // Sends the first |length| bytes of |message|. Messages are sent in the
+  // order they were reserved.
+  void SendMessage(const Message& message, uint32_t length);
+
+  // Processes up to poll_batch incoming messages, calling |on_message| on each
+  // in arrival order. The message is only valid during the call. Returns the
+  // number of messages processed.
+  int Poll(absl::FunctionRef<void(absl::Span<const uint8_t>)> on_message);
+
+  uint32_t message_size() const { return message_size_; }
+
+ private:
+  // Posts |count| recvs as a single chain.
+  void PostRecvs(uint32_t count);
+  // Reclaims the slots of completed sends.
+  void PollSends();
+
+  const uint32_t message_size_;
+  const uint32_t recv_batch_;
+  const uint32_t poll_batch_;
+  const uint32_t recv_slots_;
+  RdmaMemBlock buffer_;
+  ibv_cq* const send_cq_;
+  ibv_cq* const recv_cq_;
+  ibv_qp* const qp_;
+  ibv_mr* const mr_;
+  RingAllocator send_ring_;
+  RingAllocator recv_ring_;
+  // Recvs consumed since the last repost.
+  uint32_t consumed_recvs_ = 0;
+  std::vector<RingAllocator::Reservation> recv_reservations_;
+  std::vector<ibv_recv_wr> recv_wrs_;
+  std::vector<ibv_sge> recv_sges_;
+  std::vector<ibv_wc> completions_;
+  // Separate, since sends are reclaimed from within message callbacks.
+  std::vector<ibv_wc> send_completions_;
+};
+
+// Shared functionality between client and server: a device context of its
+// own, a data buffer and the data QP, plus the control path.
+class RpcEndpoint {
+ public:
+  RpcEndpoint(VerbsHelperSuite& ibv, const RpcEngineOptions& options);
+  // Neither movable nor copyable.
+  RpcEndpoint(RpcEndpoint&& endpoint) = delete;
+  RpcEndpoint& operator=(RpcEndpoint&& endpoint) = delete;
+  RpcEndpoint(const RpcEndpoint& endpoint) = delete;
+  RpcEndpoint& operator=(const RpcEndpoint& endpoint) = delete;
+  virtual ~RpcEndpoint() = default;
+
+  // Connects both QPs to those of |other|. Both sides must connect before the
+  // first RPC.
+  void Connect(VerbsHelperSuite& ibv, const RpcEndpoint& other);
+
+  const RpcEngineOptions& options() const { return options_; }
+
+ protected:
+  const RpcEngineOptions options_;
+  RdmaMemBlock data_buffer_;
+  ibv_context* const context_;
+  ibv_pd* const pd_;
+  ibv_cq* const data_cq_;
+  ibv_qp* const data_qp_;
+  ibv_mr* const data_mr_;
+  RingAllocator data_ring_;
+  RpcControl control_;
+  std::vector<ibv_wc> completions_;
+};
+
+// The client half of a client/server pair.
+class RpcClient : public RpcEndpoint {
+ public:
+  explicit RpcClient(VerbsHelperSuite& ibv,
+                     const RpcEngineOptions& options = RpcEngineOptions());
+
+  // Starts an RPC moving |length| bytes. |seed| generates the payload of
+  // writes and checks the payload of reads. Returns the RPC id, or nullopt if
+  // max_outstanding RPCs are in flight or the data buffer has no room.
+  // Rendezvous requests are sent once their window bind completes, by Poll().
+  absl::optional<uint64_t> StartRpc(RpcOperation operation, uint32_t length,
+                                    uint64_t seed);
+
+  // Invalidates the window of the outstanding rendezvous RPC |id| and waits
+  // for the invalidation. Depending on the race with the server this stops
+  // the transfer, possibly part way, and the RPC completes with
+  // kInvalidWindow. A failed RMA moves the server data QP to the error state,
+  // so every later rendezvous RPC completes with kInvalidWindow too.
+  void CancelRpc(uint64_t id);
+
+  // Processes available completions without blocking. Returns the number of
+  // completions processed.
+  int Poll();
+
+  // Returns the oldest finished RPC, if any.
+  absl::optional<RpcCompletion> NextCompletion();
+
+  // The number of started RPCs which have not finished.
+  size_t outstanding() const { return rpcs_.size(); }
+
+ private:
+  struct Window {
+    ibv_mw* mw;
+    bool bound;
+  };
+
+  struct Rpc {
+    RpcOperation operation;
+    uint32_t length;
+    bool eager;
+    uint64_t seed;
+    absl::Time start;
+    // Rendezvous only.
+    RingAllocator::Reservation reservation;
+    uint8_t* buffer;
+    Window* window;
+    uint32_t rkey;
+  };
+
+  void ProcessDataCompletion(const ibv_wc& completion);
+  // Returns the data buffer space of |reservation|. RPCs finish in any order,
+  // so space goes back to the ring once all older reservations are returned.
+  void ReturnData(const RingAllocator::Reservation& reservation);
+  void SendRequest(uint64_t id, const Rpc& rpc);
+  void HandleResponse(absl::Span<const uint8_t> message);
+
+  uint64_t next_id_ = 0;
+  std::vector<Window> windows_;
+  std::vector<Window*> free_windows_;
+  absl::flat_hash_map<uint64_t, Rpc> rpcs_;
+  // Data buffer reservations in ring order, and whether each was returned.
+  std::deque<std::pair<RingAllocator::Reservation, bool>> data_reservations_;
+  std::deque<RpcCompletion> finished_;
+  // Set by ProcessDataCompletion() when the invalidation of CancelRpc() lands.
+  bool cancel_done_ = false;
+};
+
+// The server half of a client/server pair.
+class RpcServer : public RpcEndpoint {
+ public:
+  explicit RpcServer(VerbsHelperSuite& ibv,
+                     const RpcEngineOptions& options = RpcEngineOptions());
+
+  // Processes available requests and data completions without blocking,
+  // starting RMAs and sending responses. Returns the number of completions
+  // processed.
+  int Poll();
+
+  uint64_t requests() const { return requests_; }
+  uint64_t failed_rmas() const { return failed_rmas_; }
+
+ private:
+  struct PendingRma {
+    uint64_t id;
+    RpcOperation operation;
+    uint32_t length;
+    uint64_t seed;
+    RingAllocator::Reservation reservation;
+  };
+
+  void HandleRequest(absl::Span<const uint8_t> message);
+  // Sends the response to RPC |id|. Eager reads pass the seed of the payload
+  // to send along.
+  void SendResponse(uint64_t id, RpcResult result, uint32_t length,
+                    absl::optional<uint64_t> eager_seed = absl::nullopt);
+
+  // RMAs complete in post order.
+  std::deque<PendingRma> pending_rmas_;
+  uint64_t requests_ = 0;
+  uint64_t failed_rmas_ = 0;
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_RPC_ENGINE_H_
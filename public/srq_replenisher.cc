@@ -0,0 +1,158 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/srq_replenisher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+
+#include "glog/logging.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+
+namespace {
+
+// Local function to simplify initialization of const member attributes.
+template <typename T>
+T DieIfNull(T&& t) {
+  CHECK(t != nullptr);  // Crash ok
+  return std::forward<T>(t);
+}
+
+ibv_srq* CreateSrq(VerbsHelperSuite& ibv, ibv_pd* pd,
+                   const SrqReplenisherOptions& options) {
+  ibv_srq_init_attr init_attr = {};
+  init_attr.attr = verbs_util::DefaultSrqAttr();
+  init_attr.attr.max_wr = options.buffers;
+  init_attr.attr.max_sge = 1;
+  return ibv.CreateSrq(pd, init_attr);
+}
+
+}  // namespace
+
+SrqReplenisher::SrqReplenisher(VerbsHelperSuite& ibv, ibv_context* context,
+                               ibv_pd* pd,
+                               const SrqReplenisherOptions& options)
+    : options_(options),
+      context_(context),
+      buffers_(ibv.AllocAlignedBufferByBytes(
+          options.buffers * options.buffer_size, /*alignment=*/64)),
+      mr_(DieIfNull(ibv.RegMr(pd, buffers_))),
+      srq_(DieIfNull(CreateSrq(ibv, pd, options))),
+      recv_wrs_(options.batch),
+      recv_sges_(options.batch) {
+  CHECK_GT(options_.buffers, 0u);  // Crash ok
+  CHECK_GT(options_.buffer_size, 0u);  // Crash ok
+  CHECK_GT(options_.batch, 0u);  // Crash ok
+  free_.reserve(options_.buffers);
+  for (uint32_t i = 0; i < options_.buffers; ++i) {
+    free_.push_back(i);
+  }
+  PostFree();
+  if (options_.mode == SrqRefillMode::kLimitEvent) {
+    CHECK_GT(options_.limit, 0u);  // Crash ok
+    CHECK_LT(options_.limit, options_.buffers);  // Crash ok
+    int flags = fcntl(context_->async_fd, F_GETFL);
+    CHECK_GE(flags, 0);  // Crash ok
+    CHECK_EQ(fcntl(context_->async_fd, F_SETFL, flags | O_NONBLOCK),
+             0);  // Crash ok
+    ArmLimit();
+  }
+}
+
+void SrqReplenisher::Release(uint64_t wr_id) {
+  DCHECK_LT(wr_id, options_.buffers);
+  free_.push_back(wr_id);
+}
+
+int SrqReplenisher::Replenish() {
+  switch (options_.mode) {
+    case SrqRefillMode::kPolling:
+      if (free_.size() < options_.batch) {
+        return 0;
+      }
+      return PostFree();
+    case SrqRefillMode::kLimitEvent: {
+      if (DrainAsyncEvents()) {
+        ++limit_events_;
+        refill_pending_ = true;
+      }
+      // The limit disarms itself when it fires, so an event which finds no
+      // free buffer is remembered until some are released.
+      if (!refill_pending_ || free_.empty()) {
+        return 0;
+      }
+      refill_pending_ = false;
+      int posted = PostFree();
+      ArmLimit();
+      return posted;
+    }
+  }
+  return 0;
+}
+
+int SrqReplenisher::PostFree() {
+  int posted = 0;
+  while (!free_.empty()) {
+    size_t count = std::min<size_t>(free_.size(), options_.batch);
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t index = free_[free_.size() - count + i];
+      recv_sges_[i] = verbs_util::CreateSge(buffer(index), mr_);
+      recv_wrs_[i] =
+          verbs_util::CreateRecvWr(index, &recv_sges_[i], /*num_sge=*/1);
+      recv_wrs_[i].next = i + 1 < count ? &recv_wrs_[i + 1] : nullptr;
+    }
+    ibv_recv_wr* bad_wr;
+    CHECK_EQ(ibv_post_srq_recv(srq_, recv_wrs_.data(), &bad_wr),
+             0);  // Crash ok
+    free_.resize(free_.size() - count);
+    posted += count;
+  }
+  return posted;
+}
+
+bool SrqReplenisher::DrainAsyncEvents() {
+  bool limit_reached = false;
+  ibv_async_event event;
+  while (ibv_get_async_event(context_, &event) == 0) {
+    if (event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED &&
+        event.element.srq == srq_) {
+      limit_reached = true;
+    } else {
+      LOG(WARNING) << "Dropping async event: "
+                   << ibv_event_type_str(event.event_type);
+    }
+    ibv_ack_async_event(&event);
+  }
+  CHECK(errno == EAGAIN || errno == EWOULDBLOCK);  // Crash ok
+  return limit_reached;
+}
+
+void SrqReplenisher::ArmLimit() {
+  ibv_srq_attr attr = {};
+  attr.srq_limit = options_.limit;
+  CHECK_EQ(ibv_modify_srq(srq_, &attr, IBV_SRQ_LIMIT), 0);  // Crash ok
+}
+
+}  // namespace rdma_unit_test
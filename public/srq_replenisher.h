@@ -0,0 +1,122 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_SRQ_REPLENISHER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_SRQ_REPLENISHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+#include "public/verbs_helper_suite.h"
+
+namespace rdma_unit_test {
+
+enum class SrqRefillMode {
+  // Released buffers are reposted when the SRQ raises
+  // IBV_EVENT_SRQ_LIMIT_REACHED, and the limit is rearmed after each refill.
+  kLimitEvent,
+  // Released buffers are reposted as soon as a batch of them accumulates.
+  kPolling,
+};
+
+struct SrqReplenisherOptions {
+  // The number of receive buffers. All of them are posted up front, so this
+  // is also the depth of the SRQ.
+  uint32_t buffers = 256;
+  // The size of each receive buffer.
+  uint32_t buffer_size = 64;
+  // Receives are posted in chains of at most this many.
+  uint32_t batch = 32;
+  SrqRefillMode mode = SrqRefillMode::kLimitEvent;
+  // kLimitEvent only. The SRQ raises the event once fewer receives than this
+  // remain posted. Less than |buffers|.
+  uint32_t limit = 64;
+};
+
+// Keeps an SRQ topped up with receives from a pool of fixed size buffers. The
+// consumer polls the CQs of the QPs on srq() itself, hands each consumed
+// buffer back with Release() and calls Replenish() regularly, typically once
+// per poll of its CQ. Replenish() reposts released buffers in chains, either
+// in reaction to the SRQ limit event or whenever a batch is ready.
+//
+// In kLimitEvent mode the replenisher consumes the async events of |context|
+// and switches its async fd to non-blocking. Events for anything other than
+// its SRQ are logged, acknowledged and dropped. A limit event which arrives
+// while no buffer is free is served by the first Replenish() after a
+// Release(). The replenisher is not thread safe.
+// Anything unexpected is a CHECK failure.
+class SrqReplenisher {
+ public:
+  // |pd| must belong to |context|.
+  SrqReplenisher(
+      VerbsHelperSuite& ibv, ibv_context* context, ibv_pd* pd,
+      const SrqReplenisherOptions& options = SrqReplenisherOptions());
+  // Neither movable nor copyable.
+  SrqReplenisher(SrqReplenisher&& replenisher) = delete;
+  SrqReplenisher& operator=(SrqReplenisher&& replenisher) = delete;
+  SrqReplenisher(const SrqReplenisher& replenisher) = delete;
+  SrqReplenisher& operator=(const SrqReplenisher& replenisher) = delete;
+  ~SrqReplenisher() = default;
+
+  ibv_srq* srq() const { return srq_; }
+
+  // The buffer a receive completion with |wr_id| landed in.
+  absl::Span<uint8_t> buffer(uint64_t wr_id) const {
+    return buffers_.subspan(wr_id * options_.buffer_size,
+                            options_.buffer_size);
+  }
+
+  // Returns the buffer of the consumed receive |wr_id| to the pool.
+  void Release(uint64_t wr_id);
+
+  // Reposts released buffers as the mode dictates. Never blocks. Returns the
+  // number of receives posted.
+  int Replenish();
+
+  // Released buffers which are not posted yet.
+  size_t free_buffers() const { return free_.size(); }
+  // The number of SRQ limit events handled.
+  uint64_t limit_events() const { return limit_events_; }
+
+ private:
+  // Posts all free buffers, in chains of at most |batch|.
+  int PostFree();
+  // Acknowledges all pending async events. Returns whether the SRQ limit was
+  // reached.
+  bool DrainAsyncEvents();
+  void ArmLimit();
+
+  const SrqReplenisherOptions options_;
+  ibv_context* const context_;
+  RdmaMemBlock buffers_;
+  ibv_mr* const mr_;
+  ibv_srq* const srq_;
+  // Buffer indices, which double as wr_ids.
+  std::vector<uint32_t> free_;
+  std::vector<ibv_recv_wr> recv_wrs_;
+  std::vector<ibv_sge> recv_sges_;
+  uint64_t limit_events_ = 0;
+  // kLimitEvent only. The limit fired and free buffers were not posted yet.
+  bool refill_pending_ = false;
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_SRQ_REPLENISHER_H_
@@ -48,21 +48,22 @@ VerbsHelperSuite::VerbsHelperSuite() {
   CHECK(extension_);  // Crash ok
 }
 
-absl::Status VerbsHelperSuite::SetUpRcQp(ibv_qp* local_qp,
-                                         const verbs_util::PortGid& local,
-                                         ibv_gid remote_gid,
-                                         uint32_t remote_qpn) {
-  return backend_->SetUpRcQp(local_qp, local, remote_gid, remote_qpn);
+absl::Status VerbsHelperSuite::SetUpRcQp(
+    ibv_qp* local_qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+    uint32_t remote_qpn, const verbs_util::RcConnectionParams& params) {
+  return backend_->SetUpRcQp(local_qp, local, remote_gid, remote_qpn, params);
 }
 
 void VerbsHelperSuite::SetUpSelfConnectedRcQp(
-    ibv_qp* qp, const verbs_util::PortGid& local) {
-  backend_->SetUpSelfConnectedRcQp(qp, local);
+    ibv_qp* qp, const verbs_util::PortGid& local,
+    const verbs_util::RcConnectionParams& params) {
+  backend_->SetUpSelfConnectedRcQp(qp, local, params);
 }
 
-void VerbsHelperSuite::SetUpLoopbackRcQps(ibv_qp* qp1, ibv_qp* qp2,
-                                          const verbs_util::PortGid& local) {
-  backend_->SetUpLoopbackRcQps(qp1, qp2, local);
+void VerbsHelperSuite::SetUpLoopbackRcQps(
+    ibv_qp* qp1, ibv_qp* qp2, const verbs_util::PortGid& local,
+    const verbs_util::RcConnectionParams& params) {
+  backend_->SetUpLoopbackRcQps(qp1, qp2, local, params);
 }
 
 absl::Status VerbsHelperSuite::SetUpUdQp(ibv_qp* qp,
@@ -75,11 +76,10 @@ absl::Status VerbsHelperSuite::SetQpInit(ibv_qp* qp, uint8_t port) {
   return backend_->SetQpInit(qp, port);
 }
 
-absl::Status VerbsHelperSuite::SetQpRtr(ibv_qp* qp,
-                                        const verbs_util::PortGid& local,
-                                        ibv_gid remote_gid,
-                                        uint32_t remote_qpn) {
-  return backend_->SetQpRtr(qp, local, remote_gid, remote_qpn);
+absl::Status VerbsHelperSuite::SetQpRtr(
+    ibv_qp* qp, const verbs_util::PortGid& local, ibv_gid remote_gid,
+    uint32_t remote_qpn, const verbs_util::RcConnectionParams& params) {
+  return backend_->SetQpRtr(qp, local, remote_gid, remote_qpn, params);
 }
 
 absl::Status VerbsHelperSuite::SetQpRts(ibv_qp* qp, ibv_qp_attr custom_attr,
@@ -176,10 +176,34 @@ ibv_ah* VerbsHelperSuite::CreateAh(ibv_pd* pd, ibv_gid remote_gid) {
   return ah;
 }
 
+ibv_ah* VerbsHelperSuite::GetOrCreateAh(ibv_pd* pd, ibv_gid remote_gid) {
+  verbs_util::PortGid local = GetLocalPortGid(pd->context);
+  AhCacheKey key(pd, remote_gid.global.subnet_prefix,
+                 remote_gid.global.interface_id, local.port);
+  absl::MutexLock guard(&mtx_ah_cache_);
+  auto iter = ah_cache_.find(key);
+  if (iter != ah_cache_.end()) {
+    return iter->second;
+  }
+  ibv_ah* ah = extension_->CreateAh(pd, local, remote_gid);
+  if (ah) {
+    cleanup_.AddCleanup(ah);
+    ah_cache_.emplace(key, ah);
+  }
+  return ah;
+}
+
 int VerbsHelperSuite::DestroyAh(ibv_ah* ah) {
   int result = ibv_destroy_ah(ah);
   if (result == 0) {
     cleanup_.ReleaseCleanup(ah);
+    absl::MutexLock guard(&mtx_ah_cache_);
+    for (auto iter = ah_cache_.begin(); iter != ah_cache_.end(); ++iter) {
+      if (iter->second == ah) {
+        ah_cache_.erase(iter);
+        break;
+      }
+    }
   }
   return result;
 }
@@ -259,6 +283,17 @@ ibv_cq* VerbsHelperSuite::CreateCq(ibv_context* context, int cqe,
   return cq;
 }
 
+ibv_cq* VerbsHelperSuite::CreateCq(ibv_context* context, int cqe,
+                                   ibv_comp_channel* channel,
+                                   const ibv_moderate_cq& moderation) {
+  ibv_cq* cq = CreateCq(context, cqe, channel);
+  if (cq && ModerateCq(cq, moderation) != 0) {
+    DestroyCq(cq);
+    return nullptr;
+  }
+  return cq;
+}
+
 int VerbsHelperSuite::DestroyCq(ibv_cq* cq) {
   int result = ibv_destroy_cq(cq);
   if (result == 0) {
@@ -282,6 +317,24 @@ ibv_cq_ex* VerbsHelperSuite::CreateCqEx(ibv_context* context,
   return CreateCqEx(context, attr);
 }
 
+ibv_cq_ex* VerbsHelperSuite::CreateCqEx(ibv_context* context,
+                                        ibv_cq_init_attr_ex& cq_attr,
+                                        const ibv_moderate_cq& moderation) {
+  ibv_cq_ex* cq = CreateCqEx(context, cq_attr);
+  if (cq && ModerateCq(ibv_cq_ex_to_cq(cq), moderation) != 0) {
+    DestroyCqEx(cq);
+    return nullptr;
+  }
+  return cq;
+}
+
+int VerbsHelperSuite::ModerateCq(ibv_cq* cq,
+                                 const ibv_moderate_cq& moderation) {
+  ibv_modify_cq_attr attr = {.attr_mask = IBV_CQ_ATTR_MODERATE,
+                             .moderate = moderation};
+  return ibv_modify_cq(cq, &attr);
+}
+
 int VerbsHelperSuite::DestroyCqEx(ibv_cq_ex* cq_ex) {
   ibv_cq* cq = ibv_cq_ex_to_cq(cq_ex);
   int result = ibv_destroy_cq(cq);
@@ -19,6 +19,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <tuple>
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
@@ -59,15 +60,20 @@ class VerbsHelperSuite {
 
   // See VerbsBackend.
   absl::Status SetUpRcQp(ibv_qp* local_qp, const verbs_util::PortGid& local,
-                         ibv_gid remote_gid, uint32_t remote_qpn);
-  void SetUpSelfConnectedRcQp(ibv_qp* qp, const verbs_util::PortGid& local);
+                         ibv_gid remote_gid, uint32_t remote_qpn,
+                         const verbs_util::RcConnectionParams& params = {});
+  void SetUpSelfConnectedRcQp(
+      ibv_qp* qp, const verbs_util::PortGid& local,
+      const verbs_util::RcConnectionParams& params = {});
   void SetUpLoopbackRcQps(ibv_qp* qp1, ibv_qp* qp2,
-                          const verbs_util::PortGid& local);
+                          const verbs_util::PortGid& local,
+                          const verbs_util::RcConnectionParams& params = {});
   absl::Status SetUpUdQp(ibv_qp* qp, const verbs_util::PortGid& local,
                          uint32_t qkey);
   absl::Status SetQpInit(ibv_qp* qp, uint8_t port);
   absl::Status SetQpRtr(ibv_qp* qp, const verbs_util::PortGid& local,
-                        ibv_gid remote_gid, uint32_t remote_qpn);
+                        ibv_gid remote_gid, uint32_t remote_qpn,
+                        const verbs_util::RcConnectionParams& params = {});
   absl::Status SetQpRts(ibv_qp* qp, ibv_qp_attr custom_attr = {}, int mask = 0);
   absl::Status SetQpError(ibv_qp* qp);
 
@@ -81,6 +87,10 @@ class VerbsHelperSuite {
       bool huge_page = false);
   absl::StatusOr<ibv_context*> OpenDevice(bool no_ipv6_for_gid = false);
   ibv_ah* CreateAh(ibv_pd* pd, ibv_gid remote_gid);
+  // Returns the AH towards |remote_gid| from the local port of |pd|, creating
+  // it on first use. Later calls with the same pd, remote GID and port share
+  // the AH until it is destroyed with DestroyAh().
+  ibv_ah* GetOrCreateAh(ibv_pd* pd, ibv_gid remote_gid);
   int DestroyAh(ibv_ah* ah);
   ibv_pd* AllocPd(ibv_context* context);
   int DeallocPd(ibv_pd* pd);
@@ -95,10 +105,21 @@ class VerbsHelperSuite {
   int DestroyChannel(ibv_comp_channel* channel);
   ibv_cq* CreateCq(ibv_context* context, int cqe = verbs_util::kDefaultMaxWr,
                    ibv_comp_channel* channel = nullptr);
+  // Creates a CQ which generates a completion event once |moderation|.cq_count
+  // completions arrive or |moderation|.cq_period microseconds pass after the
+  // first one. Returns nullptr if the moderation cannot be applied, see
+  // NicIntrospection::SupportsCqModeration.
+  ibv_cq* CreateCq(ibv_context* context, int cqe, ibv_comp_channel* channel,
+                   const ibv_moderate_cq& moderation);
   int DestroyCq(ibv_cq* cq);
   ibv_cq_ex* CreateCqEx(ibv_context* context, ibv_cq_init_attr_ex& cq_attr);
   ibv_cq_ex* CreateCqEx(ibv_context* context,
                         uint32_t cqe = verbs_util::kDefaultMaxWr);
+  ibv_cq_ex* CreateCqEx(ibv_context* context, ibv_cq_init_attr_ex& cq_attr,
+                        const ibv_moderate_cq& moderation);
+  // Changes the completion event moderation of |cq|. Returns the result of
+  // ibv_modify_cq.
+  int ModerateCq(ibv_cq* cq, const ibv_moderate_cq& moderation);
   int DestroyCqEx(ibv_cq_ex* cq_ex);
   ibv_srq* CreateSrq(ibv_pd* pd, uint32_t max_wr = verbs_util::kDefaultMaxWr);
   ibv_srq* CreateSrq(ibv_pd* pd, ibv_srq_init_attr& attr);
@@ -126,9 +147,16 @@ class VerbsHelperSuite {
   absl::flat_hash_map<ibv_context*, std::vector<verbs_util::PortGid>> port_gids_
       ABSL_GUARDED_BY(mtx_port_gids_);
 
+  // AHs of GetOrCreateAh(), keyed by pd, remote GID (subnet prefix and
+  // interface id) and local port.
+  using AhCacheKey = std::tuple<ibv_pd*, uint64_t, uint64_t, uint8_t>;
+  absl::flat_hash_map<AhCacheKey, ibv_ah*> ah_cache_
+      ABSL_GUARDED_BY(mtx_ah_cache_);
+
   // locks for containers above.
   absl::Mutex mtx_memblocks_;
   mutable absl::Mutex mtx_port_gids_;
+  absl::Mutex mtx_ah_cache_;
 
   std::unique_ptr<VerbsExtensionInterface> extension_;
   std::unique_ptr<VerbsBackend> backend_;
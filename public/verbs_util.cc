@@ -15,11 +15,16 @@
 #include "public/verbs_util.h"
 
 #include <arpa/inet.h>
+#include <mntent.h>
+#include <paths.h>
 #include <resolv.h>
+#include <stdio.h>
 #include <sys/socket.h>
 
 #include <array>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <utility>
 #include <vector>
@@ -206,6 +211,24 @@ ibv_srq_attr DefaultSrqAttr() {
   return attr;
 }
 
+bool HugepageEnabled() {
+  FILE* mounts = setmntent(_PATH_MOUNTED, "r");
+  if (!mounts) {
+    LOG(WARNING) << "Cannot read " << _PATH_MOUNTED << ": "
+                 << std::strerror(errno);
+    return false;
+  }
+  bool hugetlbfs_mounted = false;
+  while (struct mntent* mnt = getmntent(mounts)) {
+    if (!strcmp(mnt->mnt_type, "hugetlbfs")) {
+      hugetlbfs_mounted = true;
+      break;
+    }
+  }
+  endmntent(mounts);
+  return hugetlbfs_mounted;
+}
+
 ibv_qp_state GetQpState(ibv_qp* qp) {
   ibv_qp_attr attr;
   ibv_qp_init_attr init_attr;
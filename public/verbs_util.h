@@ -45,6 +45,21 @@ struct PortGid {
   uint8_t gid_index;
 };
 
+// RcConnectionParams holds the connection attributes which bound the
+// performance of an RC QP. Connecting clamps the RDMA READ and atomic depths
+// to the device limits.
+struct RcConnectionParams {
+  // RDMA READs and atomics the QP keeps outstanding as the requester, up to
+  // max_qp_init_rd_atom.
+  uint8_t max_rd_atomic = 5;
+  // RDMA READs and atomics the QP serves at once as the responder, up to
+  // max_qp_rd_atom.
+  uint8_t max_dest_rd_atomic = 10;
+  // How many times the requester retries after an RNR NAK before failing
+  // the WR. 7 retries forever.
+  uint8_t rnr_retry = 5;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 //                          Constants
 //////////////////////////////////////////////////////////////////////////////
@@ -93,6 +108,10 @@ ibv_qp_cap DefaultQpCap();
 // Returns the defaulted ibv_srq_attr value.
 ibv_srq_attr DefaultSrqAttr();
 
+// Returns whether a hugetlbfs file system is mounted, which hugepage buffers
+// need. Returns false if the mount table cannot be read.
+bool HugepageEnabled();
+
 ///////////////////////////////////////////////////////////////////////////////
 //                           Verbs Utilities
 // Useful helper functions to eliminate the tediousness of filling repetitive
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "public/write_ring_channel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "glog/logging.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+#include "public/verbs_helper_suite.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+
+namespace {
+
+// Local function to simplify initialization of const member attributes.
+template <typename T>
+T DieIfNull(T&& t) {
+  CHECK(t != nullptr);  // Crash ok
+  return std::forward<T>(t);
+}
+
+constexpr int kPollBatch = 16;
+
+}  // namespace
+
+WriteRingChannel::WriteRingChannel(VerbsHelperSuite& ibv,
+                                   const WriteRingChannelOptions& options)
+    : options_(options),
+      // Up to |slots| writes are posted ahead of the consumer, plus the
+      // unsignaled writes which wait on the next signaled one.
+      send_queue_depth_(options.slots + options.signal_interval),
+      context_(DieIfNull(ibv.OpenDevice().value())),
+      pd_(DieIfNull(ibv.AllocPd(context_))),
+      staging_(ibv.AllocAlignedBufferByBytes(
+          options.slots * options.slot_size, /*alignment=*/64)),
+      credit_(ibv.AllocAlignedBufferByBytes(sizeof(uint64_t),
+                                            /*alignment=*/64)),
+      ring_(ibv.AllocAlignedBufferByBytes(options.slots * options.slot_size,
+                                          /*alignment=*/64)),
+      staging_mr_(DieIfNull(ibv.RegMr(pd_, staging_))),
+      credit_mr_(DieIfNull(ibv.RegMr(pd_, credit_))),
+      ring_mr_(DieIfNull(ibv.RegMr(pd_, ring_))),
+      producer_cq_(DieIfNull(ibv.CreateCq(context_, send_queue_depth_))),
+      consumer_cq_(DieIfNull(ibv.CreateCq(context_, send_queue_depth_))),
+      producer_qp_(DieIfNull(ibv.CreateQp(pd_, producer_cq_, producer_cq_,
+                                          nullptr, send_queue_depth_,
+                                          /*max_recv_wr=*/1, IBV_QPT_RC,
+                                          /*sig_all=*/0))),
+      consumer_qp_(DieIfNull(ibv.CreateQp(pd_, consumer_cq_, consumer_cq_,
+                                          nullptr, send_queue_depth_,
+                                          /*max_recv_wr=*/1, IBV_QPT_RC,
+                                          /*sig_all=*/0))) {
+  CHECK_GT(options_.slots, 0u);  // Crash ok
+  // Trailers must be naturally aligned to be read atomically.
+  CHECK_GT(options_.slot_size, kTrailerSize);  // Crash ok
+  CHECK_EQ(options_.slot_size % kTrailerSize, 0u);  // Crash ok
+  CHECK_GT(options_.signal_interval, 0u);  // Crash ok
+  CHECK_LE(options_.signal_interval, options_.slots);  // Crash ok
+  CHECK_GT(options_.credit_interval, 0u);  // Crash ok
+  CHECK_LE(options_.credit_interval, options_.slots);  // Crash ok
+  // A zeroed trailer never matches a sequence number.
+  std::fill(ring_.data(), ring_.data() + ring_.size(), 0);
+  std::fill(credit_.data(), credit_.data() + credit_.size(), 0);
+  ibv.SetUpLoopbackRcQps(producer_qp_, consumer_qp_,
+                         ibv.GetLocalPortGid(context_));
+}
+
+bool WriteRingChannel::TrySend(absl::Span<const uint8_t> payload) {
+  CHECK_LE(payload.size(), max_payload());  // Crash ok
+  uint64_t consumed = __atomic_load_n(
+      reinterpret_cast<uint64_t*>(credit_.data()), __ATOMIC_ACQUIRE);
+  if (sent_ - consumed >= options_.slots) {
+    return false;
+  }
+  uint32_t length = payload.size() + kTrailerSize;
+  uint8_t* end = SlotEnd(staging_, sent_);
+  uint8_t* message = end - length;
+  std::memcpy(message, payload.data(), payload.size());
+  uint64_t sequence = static_cast<uint32_t>(sent_ + 1);
+  uint64_t trailer = sequence << 32 | payload.size();
+  std::memcpy(end - kTrailerSize, &trailer, kTrailerSize);
+  PostWrite(producer_qp_, producer_cq_, message, staging_mr_->lkey, length,
+            SlotEnd(ring_, sent_) - length, ring_mr_->rkey, sent_,
+            sends_completed_);
+  return true;
+}
+
+absl::optional<absl::Span<const uint8_t>> WriteRingChannel::TryReceive() {
+  // Messages returned by earlier calls are consumed now.
+  if (received_ - credited_ >= options_.credit_interval) {
+    credited_ = received_;
+    // Small enough to always go inline, so the source needs no MR.
+    PostWrite(consumer_qp_, consumer_cq_,
+              reinterpret_cast<const uint8_t*>(&credited_), /*lkey=*/0,
+              sizeof(credited_), credit_.data(), credit_mr_->rkey,
+              credit_writes_, credit_writes_completed_);
+  }
+  uint8_t* end = SlotEnd(ring_, received_);
+  uint64_t trailer = __atomic_load_n(
+      reinterpret_cast<uint64_t*>(end - kTrailerSize), __ATOMIC_ACQUIRE);
+  if (static_cast<uint32_t>(trailer >> 32) !=
+      static_cast<uint32_t>(received_ + 1)) {
+    return absl::nullopt;
+  }
+  uint32_t length = static_cast<uint32_t>(trailer);
+  CHECK_LE(length, max_payload());  // Crash ok
+  ++received_;
+  return absl::Span<const uint8_t>(end - kTrailerSize - length, length);
+}
+
+void WriteRingChannel::PostWrite(ibv_qp* qp, ibv_cq* cq, const uint8_t* local,
+                                 uint32_t lkey, uint32_t length,
+                                 uint8_t* remote, uint32_t rkey,
+                                 uint64_t& posted, uint64_t& completed) {
+  ibv_wc completions[kPollBatch];
+  while (posted - completed >= send_queue_depth_) {
+    int count = ibv_poll_cq(cq, kPollBatch, completions);
+    CHECK_GE(count, 0);  // Crash ok
+    for (int i = 0; i < count; ++i) {
+      CHECK_EQ(completions[i].status, IBV_WC_SUCCESS)  // Crash ok
+          << ibv_wc_status_str(completions[i].status);
+      // Unsignaled writes before a signaled one have completed too.
+      completed = std::max(completed, completions[i].wr_id);
+    }
+  }
+  ++posted;
+  ibv_sge sge = {.addr = reinterpret_cast<uint64_t>(local),
+                 .length = length,
+                 .lkey = lkey};
+  ibv_send_wr wr = {};
+  wr.wr_id = posted;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  if (length <= verbs_util::kDefaultMaxInlineSize) {
+    wr.send_flags |= IBV_SEND_INLINE;
+  }
+  if (posted % options_.signal_interval == 0) {
+    wr.send_flags |= IBV_SEND_SIGNALED;
+  }
+  wr.wr.rdma.remote_addr = reinterpret_cast<uint64_t>(remote);
+  wr.wr.rdma.rkey = rkey;
+  ibv_send_wr* bad_wr = nullptr;
+  int result = ibv_post_send(qp, &wr, &bad_wr);
+  CHECK_EQ(result, 0);  // Crash ok
+}
+
+}  // namespace rdma_unit_test
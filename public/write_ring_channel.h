@@ -0,0 +1,128 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_WRITE_RING_CHANNEL_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_WRITE_RING_CHANNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+#include "public/verbs_helper_suite.h"
+
+namespace rdma_unit_test {
+
+struct WriteRingChannelOptions {
+  // The number of slots in the ring.
+  uint32_t slots = 64;
+  // The size of a slot, including its 8 byte trailer. Slots which fit the
+  // default max_inline_data are written inline.
+  uint32_t slot_size = 32;
+  // Every this many writes of either side are signaled. At most |slots|.
+  uint32_t signal_interval = 16;
+  // The consumer returns credits after consuming this many messages. At most
+  // |slots|.
+  uint32_t credit_interval = 16;
+};
+
+// A one way message channel in the style of the lowest latency RDMA
+// messaging: the producer RDMA WRITEs each message, followed by a trailer
+// holding its length and sequence number, into the next slot of a ring in
+// consumer memory. The consumer spins on the trailer of its next slot and
+// never touches a CQ or posts a recv. Credits flow back by the consumer RDMA
+// WRITing its head into producer memory every credit_interval messages.
+// Writes are selectively signaled on both sides.
+//
+// Like production users of the pattern, the channel relies on the NIC placing
+// the trailer, the last bytes of each write, no earlier than the payload.
+//
+// The channel runs over a pair of loopback RC QPs on a device context of its
+// own. One thread may produce while another consumes. Anything unexpected is
+// a CHECK failure.
+class WriteRingChannel {
+ public:
+  explicit WriteRingChannel(
+      VerbsHelperSuite& ibv,
+      const WriteRingChannelOptions& options = WriteRingChannelOptions());
+  // Neither movable nor copyable.
+  WriteRingChannel(WriteRingChannel&& channel) = delete;
+  WriteRingChannel& operator=(WriteRingChannel&& channel) = delete;
+  WriteRingChannel(const WriteRingChannel& channel) = delete;
+  WriteRingChannel& operator=(const WriteRingChannel& channel) = delete;
+  ~WriteRingChannel() = default;
+
+  // Producer side. Sends |payload|, of at most max_payload() bytes. Returns
+  // false if the ring has no free slot.
+  bool TrySend(absl::Span<const uint8_t> payload);
+
+  // Consumer side. Returns the next message, or nullopt if none arrived. The
+  // message is valid until the next call.
+  absl::optional<absl::Span<const uint8_t>> TryReceive();
+
+  uint32_t max_payload() const { return options_.slot_size - kTrailerSize; }
+
+ private:
+  // The trailer ending every slot: the message length in the low half and the
+  // sequence number, the message index plus one, in the high half. Payloads
+  // are placed right before it, so a message is one contiguous write.
+  static constexpr uint32_t kTrailerSize = sizeof(uint64_t);
+
+  // Posts an RDMA WRITE of |length| bytes at |local| to |remote|, signaling
+  // every signal_interval writes. Reaps completions of |cq| first if the send
+  // queue is full. The wr_id of a write is its count of writes posted so far.
+  void PostWrite(ibv_qp* qp, ibv_cq* cq, const uint8_t* local, uint32_t lkey,
+                 uint32_t length, uint8_t* remote, uint32_t rkey,
+                 uint64_t& posted, uint64_t& completed);
+
+  // The end of slot |index| of |buffer|, where its trailer ends.
+  uint8_t* SlotEnd(const RdmaMemBlock& buffer, uint64_t index) const {
+    return buffer.data() + (index % options_.slots + 1) * options_.slot_size;
+  }
+
+  const WriteRingChannelOptions options_;
+  const uint32_t send_queue_depth_;
+  ibv_context* const context_;
+  ibv_pd* const pd_;
+  // Producer memory: messages are staged in slots mirroring the ring, and the
+  // consumer writes the count of messages it consumed into |credit_|.
+  RdmaMemBlock staging_;
+  RdmaMemBlock credit_;
+  // Consumer memory.
+  RdmaMemBlock ring_;
+  ibv_mr* const staging_mr_;
+  ibv_mr* const credit_mr_;
+  ibv_mr* const ring_mr_;
+  ibv_cq* const producer_cq_;
+  ibv_cq* const consumer_cq_;
+  ibv_qp* const producer_qp_;
+  ibv_qp* const consumer_qp_;
+
+  // Producer state.
+  uint64_t sent_ = 0;
+  uint64_t sends_completed_ = 0;
+  // Consumer state.
+  uint64_t received_ = 0;
+  uint64_t credited_ = 0;
+  uint64_t credit_writes_ = 0;
+  uint64_t credit_writes_completed_ = 0;
+};
+
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_PUBLIC_WRITE_RING_CHANNEL_H_
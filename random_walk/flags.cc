@@ -14,13 +14,50 @@
 
 #include "random_walk/flags.h"
 
+#include <string>
+
 #include "absl/flags/flag.h"
 
-ABSL_FLAG(int, duration, 20,
-          "Duration of the random walk test measured in seconds.");
+ABSL_FLAG(std::string, config, "",
+          "Path to a RandomWalkConfig textproto, e.g. one of the profiles in "
+          "random_walk/profiles. Defaults apply to anything it leaves unset.");
+
+ABSL_FLAG(int, duration, -1,
+          "Duration of the random walk test measured in seconds. Overrides the "
+          "config's duration_seconds, 20 by default, when set.");
 
-ABSL_FLAG(int, clients, 2, "The number of random walk clients in the test.");
+ABSL_FLAG(int, clients, -1,
+          "The number of random walk clients in the test. Overrides the "
+          "config's clients, 2 by default, when set.");
 
 ABSL_FLAG(bool, multinode, false,
           "If enabled, run the random walk test in multinode mode where "
           "out-of-band communication will be done using gRPC.");
+
+ABSL_FLAG(bool, shm_transport, false,
+          "If enabled in multinode mode, out-of-band communication will be "
+          "done through shared memory rings instead of gRPC.");
+
+ABSL_FLAG(int, processes, 0,
+          "In multinode mode, the number of worker processes to spread the "
+          "clients over. 0 runs every client in the main process.");
+
+ABSL_FLAG(std::string, cpu_sets, "",
+          "Semicolon separated CPU lists, one per worker process, e.g. "
+          "\"0-3,8;4-7\". Worker i is pinned to list i modulo the number of "
+          "lists.");
+
+ABSL_FLAG(std::string, numa_nodes, "",
+          "Comma separated NUMA nodes, e.g. \"0,1\". Worker i binds its memory "
+          "to node i modulo the number of nodes.");
+
+ABSL_FLAG(int, report_interval, -1,
+          "Interval in seconds at which live throughput, latency and "
+          "completion status metrics are logged during the walk. 0 disables "
+          "reporting. Overrides the config's report_interval_seconds, 10 by "
+          "default, when set.");
+
+ABSL_FLAG(bool, verify_payloads, false,
+          "Checks the payloads of a sample of sends, reads, writes and atomics "
+          "against seeded patterns and CRC32C checksums, failing the walk on "
+          "corruption. Enables the config's verify_payloads when set.");
@@ -19,8 +19,15 @@
 
 #include "absl/flags/declare.h"
 
+ABSL_DECLARE_FLAG(std::string, config);
 ABSL_DECLARE_FLAG(int, duration);
 ABSL_DECLARE_FLAG(int, clients);
 ABSL_DECLARE_FLAG(bool, multinode);
+ABSL_DECLARE_FLAG(bool, shm_transport);
+ABSL_DECLARE_FLAG(int, processes);
+ABSL_DECLARE_FLAG(std::string, cpu_sets);
+ABSL_DECLARE_FLAG(std::string, numa_nodes);
+ABSL_DECLARE_FLAG(int, report_interval);
+ABSL_DECLARE_FLAG(bool, verify_payloads);
 
 #endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_FLAGS_H_
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_BOUNDED_MPSC_QUEUE_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_BOUNDED_MPSC_QUEUE_H_
+
+#include <sched.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "glog/logging.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// A bounded, lock-free, multi-producer/single-consumer FIFO queue. Each slot
+// carries a sequence number which tells producers and the consumer whether
+// the slot is free or holds a value for the current lap around the ring, so
+// neither side ever takes a lock. Any number of threads may call TryPush() or
+// Push() concurrently, but only one thread at a time may call TryPop() or
+// Drain().
+template <typename T>
+class BoundedMpscQueue {
+ public:
+  BoundedMpscQueue() = delete;
+  // Creates a queue holding at most |capacity| elements. |capacity| must be a
+  // power of two.
+  explicit BoundedMpscQueue(size_t capacity)
+      : mask_(capacity - 1), cells_(new Cell[capacity]) {
+    CHECK_GT(capacity, 0ul);                   // Crash ok
+    CHECK_EQ(capacity & (capacity - 1), 0ul);  // Crash ok
+    for (size_t i = 0; i < capacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  // Neither movable nor copyable.
+  BoundedMpscQueue(BoundedMpscQueue&& queue) = delete;
+  BoundedMpscQueue& operator=(BoundedMpscQueue&& queue) = delete;
+  BoundedMpscQueue(const BoundedMpscQueue& queue) = delete;
+  BoundedMpscQueue& operator=(const BoundedMpscQueue& queue) = delete;
+  ~BoundedMpscQueue() = default;
+
+  // Moves |value| into the queue. Returns false, leaving |value| untouched, if
+  // the queue is full.
+  bool TryPush(T& value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Moves |value| into the queue, waiting for the consumer to free up a slot
+  // if the queue is full. Returns false if no slot became available within
+  // |timeout|.
+  bool Push(T value, absl::Duration timeout) {
+    if (TryPush(value)) {
+      return true;
+    }
+    absl::Time deadline = absl::Now() + timeout;
+    while (absl::Now() < deadline) {
+      sched_yield();
+      if (TryPush(value)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Moves the oldest element into |value|. Returns false if the queue is
+  // empty. Must only be called by the consumer thread.
+  bool TryPop(T& value) {
+    Cell& cell = cells_[dequeue_pos_ & mask_];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (sequence != dequeue_pos_ + 1) {
+      return false;
+    }
+    value = std::move(cell.value);
+    cell.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    return true;
+  }
+
+  // Pops up to |max_elements| elements in FIFO order and hands each of them to
+  // |fn|. Each slot is released before |fn| is invoked, so |fn| may itself push
+  // into the queue. Returns the number of elements drained. Must only be called
+  // by the consumer thread.
+  template <typename Fn>
+  size_t Drain(Fn&& fn, size_t max_elements) {
+    size_t count = 0;
+    T value;
+    while (count < max_elements && TryPop(value)) {
+      fn(std::move(value));
+      ++count;
+    }
+    return count;
+  }
+
+  // Returns the maximum number of elements the queue can hold.
+  size_t capacity() const { return mask_ + 1; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  const size_t mask_;
+  const std::unique_ptr<Cell[]> cells_;
+  // Producers and the consumer advance separate cursors; keep them on separate
+  // cache lines so they do not bounce between cores.
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) size_t dequeue_pos_ = 0;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_BOUNDED_MPSC_QUEUE_H_
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/bounded_mpsc_queue.h"
+
+#include <memory>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+namespace {
+
+using ::testing::ElementsAre;
+
+TEST(BoundedMpscQueueTest, PopsInFifoOrder) {
+  BoundedMpscQueue<int> queue(4);
+  for (int i = 0; i < 3; ++i) {
+    int value = i;
+    EXPECT_TRUE(queue.TryPush(value));
+  }
+  int value;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(queue.TryPop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(BoundedMpscQueueTest, TryPushFailsWhenFull) {
+  BoundedMpscQueue<std::unique_ptr<int>> queue(2);
+  for (int i = 0; i < 2; ++i) {
+    auto value = std::make_unique<int>(i);
+    ASSERT_TRUE(queue.TryPush(value));
+    EXPECT_EQ(value, nullptr);
+  }
+  auto rejected = std::make_unique<int>(2);
+  EXPECT_FALSE(queue.TryPush(rejected));
+  // A rejected value is left untouched.
+  ASSERT_NE(rejected, nullptr);
+  EXPECT_EQ(*rejected, 2);
+
+  // Popping frees a slot, also across the wrap-around of the ring.
+  std::unique_ptr<int> popped;
+  ASSERT_TRUE(queue.TryPop(popped));
+  EXPECT_EQ(*popped, 0);
+  EXPECT_TRUE(queue.TryPush(rejected));
+  ASSERT_TRUE(queue.TryPop(popped));
+  EXPECT_EQ(*popped, 1);
+  ASSERT_TRUE(queue.TryPop(popped));
+  EXPECT_EQ(*popped, 2);
+}
+
+TEST(BoundedMpscQueueTest, PushTimesOutWhenFull) {
+  constexpr absl::Duration kTimeout = absl::Milliseconds(50);
+  BoundedMpscQueue<int> queue(1);
+  EXPECT_TRUE(queue.Push(0, kTimeout));
+  absl::Time start = absl::Now();
+  EXPECT_FALSE(queue.Push(1, kTimeout));
+  EXPECT_GE(absl::Now() - start, kTimeout);
+  int value;
+  ASSERT_TRUE(queue.TryPop(value));
+  EXPECT_EQ(value, 0);
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(BoundedMpscQueueTest, PushWaitsForConsumer) {
+  BoundedMpscQueue<int> queue(1);
+  ASSERT_TRUE(queue.Push(0, absl::ZeroDuration()));
+  bool pushed = false;
+  std::thread producer(
+      [&]() { pushed = queue.Push(1, absl::Seconds(10)); });
+  absl::SleepFor(absl::Milliseconds(20));
+  int value;
+  ASSERT_TRUE(queue.TryPop(value));
+  EXPECT_EQ(value, 0);
+  producer.join();
+  EXPECT_TRUE(pushed);
+  ASSERT_TRUE(queue.TryPop(value));
+  EXPECT_EQ(value, 1);
+}
+
+TEST(BoundedMpscQueueTest, DrainIsBoundedAndMayPush) {
+  BoundedMpscQueue<int> queue(4);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue.Push(i, absl::ZeroDuration()));
+  }
+  std::vector<int> drained;
+  EXPECT_EQ(queue.Drain(
+                [&](int value) {
+                  drained.push_back(value);
+                  // Each slot is released before the callback runs.
+                  EXPECT_TRUE(queue.Push(value + 10, absl::ZeroDuration()));
+                },
+                /*max_elements=*/2),
+            2u);
+  EXPECT_THAT(drained, ElementsAre(0, 1));
+  drained.clear();
+  EXPECT_EQ(queue.Drain([&](int value) { drained.push_back(value); },
+                        queue.capacity()),
+            4u);
+  EXPECT_THAT(drained, ElementsAre(2, 3, 10, 11));
+}
+
+TEST(BoundedMpscQueueTest, ConcurrentProducers) {
+  constexpr int kProducers = 4;
+  constexpr int kPerProducer = 10000;
+  BoundedMpscQueue<int> queue(64);
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < kProducers; ++producer) {
+    producers.emplace_back([&queue, producer]() {
+      for (int i = 0; i < kPerProducer; ++i) {
+        CHECK(queue.Push(producer * kPerProducer + i,  // Crash ok
+                         absl::Seconds(10)));
+      }
+    });
+  }
+  // Every element arrives once, in the order its producer pushed it.
+  std::vector<int> next(kProducers, 0);
+  int received = 0;
+  absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while (received < kProducers * kPerProducer && absl::Now() < deadline) {
+    received += queue.Drain(
+        [&](int value) {
+          int producer = value / kPerProducer;
+          EXPECT_EQ(value % kPerProducer, next[producer]++);
+        },
+        queue.capacity());
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  EXPECT_EQ(received, kProducers * kPerProducer);
+  int value;
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+}  // namespace
+}  // namespace random_walk
+}  // namespace rdma_unit_test
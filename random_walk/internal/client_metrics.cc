@@ -0,0 +1,163 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/client_metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/numeric/bits.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+size_t LatencyHistogram::BucketIndex(int64_t nanos) {
+  if (nanos <= 0) {
+    return 0;
+  }
+  return std::min<size_t>(absl::bit_width(static_cast<uint64_t>(nanos)),
+                          kNumBuckets - 1);
+}
+
+uint64_t LatencyHistogram::TotalCount() const {
+  uint64_t total = 0;
+  for (uint64_t count : buckets_) {
+    total += count;
+  }
+  return total;
+}
+
+absl::Duration LatencyHistogram::Percentile(double percentile) const {
+  uint64_t total = TotalCount();
+  if (total == 0) {
+    return absl::ZeroDuration();
+  }
+  uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(total * percentile / 100.0)));
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+    seen += buckets_[bucket];
+    if (seen >= rank) {
+      return absl::Nanoseconds(uint64_t{1} << bucket);
+    }
+  }
+  return absl::InfiniteDuration();
+}
+
+LatencyHistogram& LatencyHistogram::operator+=(const LatencyHistogram& other) {
+  for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+    buckets_[bucket] += other.buckets_[bucket];
+  }
+  return *this;
+}
+
+LatencyHistogram& LatencyHistogram::operator-=(const LatencyHistogram& other) {
+  for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+    buckets_[bucket] -= other.buckets_[bucket];
+  }
+  return *this;
+}
+
+MetricsSnapshot& MetricsSnapshot::operator+=(const MetricsSnapshot& other) {
+  for (size_t i = 0; i < actions.size(); ++i) {
+    actions[i].count += other.actions[i].count;
+    actions[i].issue_latency += other.actions[i].issue_latency;
+    actions[i].completion_latency += other.actions[i].completion_latency;
+  }
+  for (size_t i = 0; i < completion_statuses.size(); ++i) {
+    completion_statuses[i] += other.completion_statuses[i];
+  }
+  return *this;
+}
+
+MetricsSnapshot& MetricsSnapshot::operator-=(const MetricsSnapshot& other) {
+  for (size_t i = 0; i < actions.size(); ++i) {
+    actions[i].count -= other.actions[i].count;
+    actions[i].issue_latency -= other.actions[i].issue_latency;
+    actions[i].completion_latency -= other.actions[i].completion_latency;
+  }
+  for (size_t i = 0; i < completion_statuses.size(); ++i) {
+    completion_statuses[i] -= other.completion_statuses[i];
+  }
+  return *this;
+}
+
+uint64_t MetricsSnapshot::TotalActions() const {
+  uint64_t total = 0;
+  for (const ActionMetrics& action : actions) {
+    total += action.count;
+  }
+  return total;
+}
+
+void ClientMetrics::RecordAction(Action action, absl::Time start,
+                                 absl::Duration latency, uint64_t first_wr_id,
+                                 uint64_t end_wr_id) {
+  ActionCounters& counters = actions_[static_cast<size_t>(action)];
+  Increment(counters.count);
+  Record(counters.issue_latency, latency);
+  for (uint64_t wr_id = first_wr_id; wr_id < end_wr_id; ++wr_id) {
+    posted_wrs_[wr_id % kPostedWrSlots] = {wr_id, action, start};
+  }
+}
+
+void ClientMetrics::RecordCompletion(const ibv_wc& completion,
+                                     absl::Time now) {
+  Increment(completion_statuses_[std::min<size_t>(
+      completion.status, MetricsSnapshot::kOtherStatus)]);
+  PostedWr& posted = posted_wrs_[completion.wr_id % kPostedWrSlots];
+  if (posted.wr_id != completion.wr_id) {
+    return;
+  }
+  posted.wr_id = UINT64_MAX;
+  Record(actions_[static_cast<size_t>(posted.action)].completion_latency,
+         now - posted.posted);
+}
+
+void ClientMetrics::Snapshot(MetricsSnapshot& snapshot) const {
+  for (size_t i = 0; i < actions_.size(); ++i) {
+    const ActionCounters& counters = actions_[i];
+    MetricsSnapshot::ActionMetrics& metrics = snapshot.actions[i];
+    metrics.count += counters.count.load(std::memory_order_relaxed);
+    const auto& issue = counters.issue_latency.buckets;
+    const auto& completion = counters.completion_latency.buckets;
+    for (size_t bucket = 0; bucket < LatencyHistogram::kNumBuckets; ++bucket) {
+      metrics.issue_latency.Add(bucket,
+                                issue[bucket].load(std::memory_order_relaxed));
+      metrics.completion_latency.Add(
+          bucket, completion[bucket].load(std::memory_order_relaxed));
+    }
+  }
+  for (size_t i = 0; i < completion_statuses_.size(); ++i) {
+    snapshot.completion_statuses[i] +=
+        completion_statuses_[i].load(std::memory_order_relaxed);
+  }
+}
+
+void ClientMetrics::Record(AtomicHistogram& histogram,
+                           absl::Duration latency) {
+  Increment(histogram.buckets[LatencyHistogram::BucketIndex(
+      absl::ToInt64Nanoseconds(latency))]);
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CLIENT_METRICS_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CLIENT_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// A histogram of latencies with power-of-two buckets. Bucket i counts
+// latencies in [2^(i-1), 2^i) nanoseconds; the last bucket is open ended.
+class LatencyHistogram {
+ public:
+  static constexpr size_t kNumBuckets = 40;
+
+  static size_t BucketIndex(int64_t nanos);
+
+  void Add(size_t bucket, uint64_t count) { buckets_[bucket] += count; }
+  uint64_t TotalCount() const;
+  // Returns the upper bound of the bucket holding the |percentile|-th
+  // latency, or zero if the histogram is empty.
+  absl::Duration Percentile(double percentile) const;
+
+  LatencyHistogram& operator+=(const LatencyHistogram& other);
+  LatencyHistogram& operator-=(const LatencyHistogram& other);
+
+ private:
+  std::array<uint64_t, kNumBuckets> buckets_ = {0};
+};
+
+// A point-in-time copy of one or more clients' ClientMetrics. Snapshots of
+// different clients, or of the same client at different times, can be summed
+// and subtracted.
+struct MetricsSnapshot {
+  struct ActionMetrics {
+    // Number of successfully issued actions.
+    uint64_t count = 0;
+    // Time spent issuing the action, dominated by the verbs call(s).
+    LatencyHistogram issue_latency;
+    // Time from posting a work request to polling its completion. Only
+    // populated for actions which post work requests.
+    LatencyHistogram completion_latency;
+  };
+
+  // Index of completion_statuses counting the statuses past
+  // IBV_WC_GENERAL_ERR, which vary with the rdma-core version.
+  static constexpr size_t kOtherStatus = IBV_WC_GENERAL_ERR + 1;
+
+  std::array<ActionMetrics, kActions.size()> actions;
+  // Indexed by ibv_wc_status, up to kOtherStatus.
+  std::array<uint64_t, kOtherStatus + 1> completion_statuses = {0};
+
+  MetricsSnapshot& operator+=(const MetricsSnapshot& other);
+  MetricsSnapshot& operator-=(const MetricsSnapshot& other);
+  uint64_t TotalActions() const;
+};
+
+// Live counters and latency histograms of one RandomWalkClient. Only the
+// client's thread records into a ClientMetrics, while any other thread may
+// take a Snapshot() at any time. Every counter has a single writer, so
+// recording is a relaxed load and store with no read-modify-write or lock.
+class ClientMetrics {
+ public:
+  ClientMetrics() = default;
+  // Neither movable nor copyable.
+  ClientMetrics(ClientMetrics&& metrics) = delete;
+  ClientMetrics& operator=(ClientMetrics&& metrics) = delete;
+  ClientMetrics(const ClientMetrics& metrics) = delete;
+  ClientMetrics& operator=(const ClientMetrics& metrics) = delete;
+  ~ClientMetrics() = default;
+
+  // Records an |action| issued at |start| which took |latency|. The work
+  // requests with ids in [first_wr_id, end_wr_id) were posted by the action.
+  void RecordAction(Action action, absl::Time start, absl::Duration latency,
+                    uint64_t first_wr_id, uint64_t end_wr_id);
+  // Records a completion polled at |now|.
+  void RecordCompletion(const ibv_wc& completion, absl::Time now);
+
+  // Adds the current values of every counter to |snapshot|. Thread-safe.
+  void Snapshot(MetricsSnapshot& snapshot) const;
+
+ private:
+  // Size of the table remembering when outstanding work requests were posted.
+  // Work requests outstanding for longer than this many later posts lose
+  // their completion latency sample.
+  static constexpr size_t kPostedWrSlots = 4096;
+
+  struct AtomicHistogram {
+    std::array<std::atomic<uint64_t>, LatencyHistogram::kNumBuckets> buckets{};
+  };
+  struct ActionCounters {
+    std::atomic<uint64_t> count{0};
+    AtomicHistogram issue_latency;
+    AtomicHistogram completion_latency;
+  };
+  struct PostedWr {
+    uint64_t wr_id = UINT64_MAX;
+    Action action;
+    absl::Time posted;
+  };
+
+  static void Increment(std::atomic<uint64_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  }
+  static void Record(AtomicHistogram& histogram, absl::Duration latency);
+
+  std::array<ActionCounters, kActions.size()> actions_;
+  std::array<std::atomic<uint64_t>, MetricsSnapshot::kOtherStatus + 1>
+      completion_statuses_{};
+  // Only touched by the writer.
+  std::array<PostedWr, kPostedWrSlots> posted_wrs_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CLIENT_METRICS_H_
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/client_metrics.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+namespace {
+
+TEST(LatencyHistogramTest, BucketIndex) {
+  EXPECT_EQ(LatencyHistogram::BucketIndex(-5), 0);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(0), 0);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(1), 1);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(2), 2);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(3), 2);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(1023), 10);
+  EXPECT_EQ(LatencyHistogram::BucketIndex(1024), 11);
+  // The last bucket is open ended.
+  EXPECT_EQ(LatencyHistogram::BucketIndex(INT64_MAX),
+            LatencyHistogram::kNumBuckets - 1);
+}
+
+TEST(LatencyHistogramTest, Percentile) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.Percentile(50), absl::ZeroDuration());
+  // 90 latencies in [512ns, 1024ns) and 10 in [8us, 16us).
+  histogram.Add(LatencyHistogram::BucketIndex(600), 90);
+  histogram.Add(LatencyHistogram::BucketIndex(10000), 10);
+  EXPECT_EQ(histogram.TotalCount(), 100);
+  EXPECT_EQ(histogram.Percentile(0), absl::Nanoseconds(1024));
+  EXPECT_EQ(histogram.Percentile(50), absl::Nanoseconds(1024));
+  EXPECT_EQ(histogram.Percentile(90), absl::Nanoseconds(1024));
+  EXPECT_EQ(histogram.Percentile(91), absl::Nanoseconds(16384));
+  EXPECT_EQ(histogram.Percentile(100), absl::Nanoseconds(16384));
+}
+
+TEST(LatencyHistogramTest, AddAndSubtract) {
+  LatencyHistogram first;
+  first.Add(1, 3);
+  LatencyHistogram second;
+  second.Add(1, 2);
+  second.Add(5, 4);
+  first += second;
+  EXPECT_EQ(first.TotalCount(), 9);
+  first -= second;
+  EXPECT_EQ(first.TotalCount(), 3);
+  EXPECT_EQ(first.Percentile(100), absl::Nanoseconds(2));
+}
+
+TEST(ClientMetricsTest, RecordsActionsAndCompletions) {
+  ClientMetrics metrics;
+  absl::Time start = absl::Now();
+  metrics.RecordAction(Action::SEND, start, absl::Nanoseconds(100),
+                       /*first_wr_id=*/7, /*end_wr_id=*/9);
+  metrics.RecordAction(Action::CREATE_CQ, start, absl::Microseconds(5),
+                       /*first_wr_id=*/0, /*end_wr_id=*/0);
+  ibv_wc completion = {};
+  completion.wr_id = 7;
+  completion.status = IBV_WC_SUCCESS;
+  metrics.RecordCompletion(completion, start + absl::Microseconds(3));
+  completion.wr_id = 8;
+  completion.status = IBV_WC_REM_ACCESS_ERR;
+  metrics.RecordCompletion(completion, start + absl::Microseconds(3));
+  // Not posted by a recorded action, so there is no latency sample.
+  completion.wr_id = 100;
+  completion.status = IBV_WC_SUCCESS;
+  metrics.RecordCompletion(completion, start + absl::Microseconds(3));
+
+  MetricsSnapshot snapshot;
+  metrics.Snapshot(snapshot);
+  EXPECT_EQ(snapshot.TotalActions(), 2);
+  const MetricsSnapshot::ActionMetrics& send =
+      snapshot.actions[static_cast<size_t>(Action::SEND)];
+  EXPECT_EQ(send.count, 1);
+  EXPECT_EQ(send.issue_latency.Percentile(100), absl::Nanoseconds(128));
+  EXPECT_EQ(send.completion_latency.TotalCount(), 2);
+  EXPECT_EQ(send.completion_latency.Percentile(100), absl::Nanoseconds(4096));
+  const MetricsSnapshot::ActionMetrics& create_cq =
+      snapshot.actions[static_cast<size_t>(Action::CREATE_CQ)];
+  EXPECT_EQ(create_cq.count, 1);
+  EXPECT_EQ(create_cq.completion_latency.TotalCount(), 0);
+  EXPECT_EQ(snapshot.completion_statuses[IBV_WC_SUCCESS], 2);
+  EXPECT_EQ(snapshot.completion_statuses[IBV_WC_REM_ACCESS_ERR], 1);
+}
+
+TEST(ClientMetricsTest, CountsUnknownStatusesAsOther) {
+  ClientMetrics metrics;
+  ibv_wc completion = {};
+  completion.status = static_cast<ibv_wc_status>(IBV_WC_GENERAL_ERR + 1);
+  metrics.RecordCompletion(completion, absl::Now());
+  completion.status = static_cast<ibv_wc_status>(IBV_WC_GENERAL_ERR + 10);
+  metrics.RecordCompletion(completion, absl::Now());
+  completion.status = IBV_WC_GENERAL_ERR;
+  metrics.RecordCompletion(completion, absl::Now());
+  MetricsSnapshot snapshot;
+  metrics.Snapshot(snapshot);
+  EXPECT_EQ(snapshot.completion_statuses[MetricsSnapshot::kOtherStatus], 2);
+  EXPECT_EQ(snapshot.completion_statuses[IBV_WC_GENERAL_ERR], 1);
+}
+
+TEST(ClientMetricsTest, SnapshotsSumAndSubtract) {
+  ClientMetrics metrics;
+  absl::Time start = absl::Now();
+  metrics.RecordAction(Action::WRITE, start, absl::Nanoseconds(10),
+                       /*first_wr_id=*/0, /*end_wr_id=*/0);
+  MetricsSnapshot before;
+  metrics.Snapshot(before);
+  metrics.RecordAction(Action::WRITE, start, absl::Nanoseconds(10),
+                       /*first_wr_id=*/0, /*end_wr_id=*/0);
+  metrics.RecordAction(Action::READ, start, absl::Nanoseconds(10),
+                       /*first_wr_id=*/0, /*end_wr_id=*/0);
+  MetricsSnapshot after;
+  metrics.Snapshot(after);
+  // Snapshot() adds to what the snapshot already holds.
+  metrics.Snapshot(after);
+  EXPECT_EQ(after.TotalActions(), 6);
+
+  after -= before;
+  after -= before;
+  EXPECT_EQ(after.TotalActions(), 4);
+  EXPECT_EQ(after.actions[static_cast<size_t>(Action::WRITE)].count, 2);
+  EXPECT_EQ(after.actions[static_cast<size_t>(Action::READ)].count, 2);
+  after += before;
+  EXPECT_EQ(after.actions[static_cast<size_t>(Action::WRITE)]
+                .issue_latency.TotalCount(),
+            3);
+}
+
+}  // namespace
+}  // namespace random_walk
+}  // namespace rdma_unit_test
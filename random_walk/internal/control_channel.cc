@@ -0,0 +1,96 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/control_channel.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "glog/logging.h"
+#include "random_walk/internal/worker_control.pb.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+ControlChannel::ControlChannel(int fd) : fd_(fd) {}
+
+ControlChannel::~ControlChannel() { close(fd_); }
+
+void ControlChannel::Send(const ControlMessage& message) {
+  std::string buffer;
+  CHECK(message.SerializeToString(&buffer));  // Crash ok
+  uint32_t length = buffer.size();
+  WriteFully(&length, sizeof(length));
+  WriteFully(buffer.data(), buffer.size());
+}
+
+void ControlChannel::SendSignal(ControlMessage::Signal signal) {
+  ControlMessage message;
+  message.set_signal(signal);
+  Send(message);
+}
+
+ControlMessage ControlChannel::Receive() {
+  uint32_t length;
+  ReadFully(&length, sizeof(length));
+  std::string buffer(length, '\0');
+  ReadFully(buffer.data(), buffer.size());
+  ControlMessage message;
+  CHECK(message.ParseFromString(buffer));  // Crash ok
+  return message;
+}
+
+void ControlChannel::ExpectSignal(ControlMessage::Signal signal) {
+  ControlMessage message = Receive();
+  CHECK(message.has_signal() && message.signal() == signal)  // Crash ok
+      << "Expected " << ControlMessage::Signal_Name(signal) << ", got "
+      << message.DebugString();
+}
+
+void ControlChannel::WriteFully(const void* data, size_t length) {
+  const char* cursor = static_cast<const char*>(data);
+  while (length > 0) {
+    ssize_t written = write(fd_, cursor, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    CHECK_GT(written, 0) << "Control channel write failed (" << errno  // Crash ok
+                         << ").";
+    cursor += written;
+    length -= written;
+  }
+}
+
+void ControlChannel::ReadFully(void* data, size_t length) {
+  char* cursor = static_cast<char*>(data);
+  while (length > 0) {
+    ssize_t bytes = read(fd_, cursor, length);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    CHECK_GT(bytes, 0) << "Control channel closed (" << errno  // Crash ok
+                       << ").";
+    cursor += bytes;
+    length -= bytes;
+  }
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
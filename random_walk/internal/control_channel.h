@@ -0,0 +1,60 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CONTROL_CHANNEL_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CONTROL_CHANNEL_H_
+
+#include <cstddef>
+
+#include "random_walk/internal/worker_control.pb.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// A blocking channel carrying length-framed ControlMessages over a connected
+// stream socket, used between MultiNodeOrchestrator and its worker processes.
+// Any I/O failure, including the peer exiting, is fatal.
+class ControlChannel {
+ public:
+  ControlChannel() = delete;
+  // Takes ownership of |fd|.
+  explicit ControlChannel(int fd);
+  // Neither movable nor copyable.
+  ControlChannel(ControlChannel&& channel) = delete;
+  ControlChannel& operator=(ControlChannel&& channel) = delete;
+  ControlChannel(const ControlChannel& channel) = delete;
+  ControlChannel& operator=(const ControlChannel& channel) = delete;
+  ~ControlChannel();
+
+  void Send(const ControlMessage& message);
+  void SendSignal(ControlMessage::Signal signal);
+
+  // Blocks until the next message arrives.
+  ControlMessage Receive();
+  // Receives the next message and checks that it is |signal|.
+  void ExpectSignal(ControlMessage::Signal signal);
+
+ private:
+  void WriteFully(const void* data, size_t length);
+  void ReadFully(void* data, size_t length);
+
+  const int fd_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_CONTROL_CHANNEL_H_
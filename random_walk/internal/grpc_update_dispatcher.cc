@@ -17,21 +17,25 @@
 #include "random_walk/internal/grpc_update_dispatcher.h"
 
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "glog/logging.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
-#include "absl/types/optional.h"
 #include "grpcpp/client_context.h"
 #include "grpcpp/create_channel.h"
 #include "grpcpp/grpcpp.h"
 #include "grpcpp/security/credentials.h"
+#include "grpcpp/support/client_callback.h"
 #include "grpcpp/support/status.h"
 #include "public/map_util.h"
-#include "public/status_matchers.h"
 #include "random_walk/internal/client_update_service.grpc.pb.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/rpc_server.h"
@@ -40,8 +44,145 @@
 namespace rdma_unit_test {
 namespace random_walk {
 
+// A client-side reactor for one StreamUpdates call. Updates are appended to a
+// pending batch; flushed batches are queued and written one at a time, since
+// gRPC allows only a single outstanding write per stream.
+class GrpcUpdateDispatcher::UpdateStream
+    : public ::grpc::ClientBidiReactor<OrderedUpdateBatch, UpdateResponse> {
+ public:
+  UpdateStream(ClientId owner_id, ClientUpdateService::Stub* stub)
+      : owner_id_(owner_id) {
+    stub->async()->StreamUpdates(&context_, this);
+    StartCall();
+  }
+
+  // Appends |update| to the pending batch, flushing the batch if it is full.
+  void Append(ClientUpdate update) {
+    OrderedUpdateBatch* to_write = nullptr;
+    {
+      absl::MutexLock guard(&mutex_);
+      CHECK(!closing_) << "Dispatching on a shut down stream.";  // Crash ok
+      if (pending_.updates().empty()) {
+        pending_.set_source_id(owner_id_);
+        pending_.set_first_sequence_number(next_sequence_number_);
+        pending_since_ = absl::Now();
+      }
+      *pending_.add_updates() = std::move(update);
+      ++next_sequence_number_;
+      if (pending_.updates_size() >= kMaxBatchSize) {
+        to_write = FlushLocked();
+      }
+    }
+    MaybeStartWrite(to_write);
+  }
+
+  // Flushes the pending batch if its oldest update was appended at or before
+  // |cutoff|.
+  void FlushIfOlderThan(absl::Time cutoff) {
+    OrderedUpdateBatch* to_write = nullptr;
+    {
+      absl::MutexLock guard(&mutex_);
+      if (!pending_.updates().empty() && pending_since_ <= cutoff) {
+        to_write = FlushLocked();
+      }
+    }
+    MaybeStartWrite(to_write);
+  }
+
+  // Flushes the pending batch, half-closes the stream once every batch has
+  // been written and blocks until the server finishes the call.
+  void Finish() {
+    OrderedUpdateBatch* to_write = nullptr;
+    bool writes_done = false;
+    {
+      absl::MutexLock guard(&mutex_);
+      if (closing_) {
+        return;
+      }
+      closing_ = true;
+      to_write = FlushLocked();
+      writes_done = !write_in_flight_;
+    }
+    MaybeStartWrite(to_write);
+    if (writes_done) {
+      StartWritesDone();
+    }
+    done_.WaitForNotification();
+  }
+
+  void OnWriteDone(bool ok) override {
+    CHECK(ok) << "Failed to write update batch.";  // Crash ok
+    OrderedUpdateBatch* to_write = nullptr;
+    bool writes_done = false;
+    {
+      absl::MutexLock guard(&mutex_);
+      write_queue_.pop_front();
+      write_in_flight_ = false;
+      if (!write_queue_.empty()) {
+        write_in_flight_ = true;
+        to_write = &write_queue_.front();
+      } else {
+        writes_done = closing_;
+      }
+    }
+    if (to_write) {
+      StartWrite(to_write);
+    } else if (writes_done) {
+      StartWritesDone();
+    }
+  }
+
+  void OnDone(const ::grpc::Status& status) override {
+    if (!status.ok()) {
+      LOG(FATAL) << status.error_message();  // Crash ok
+    }
+    done_.Notify();
+  }
+
+ private:
+  // Moves the pending batch to the write queue. Returns the batch to write if
+  // no write is in flight, in which case the caller must pass it to
+  // MaybeStartWrite() after releasing mutex_.
+  OrderedUpdateBatch* FlushLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    if (pending_.updates().empty()) {
+      return nullptr;
+    }
+    write_queue_.push_back(std::move(pending_));
+    pending_.Clear();
+    if (write_in_flight_) {
+      return nullptr;
+    }
+    write_in_flight_ = true;
+    return &write_queue_.front();
+  }
+
+  // Starts writing |batch| unless it is nullptr. Called without holding
+  // mutex_ since gRPC may run OnWriteDone() inline.
+  void MaybeStartWrite(OrderedUpdateBatch* batch)
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    if (batch) {
+      StartWrite(batch);
+    }
+  }
+
+  const ClientId owner_id_;
+  ::grpc::ClientContext context_;
+  absl::Mutex mutex_;
+  OrderedUpdateBatch pending_ ABSL_GUARDED_BY(mutex_);
+  absl::Time pending_since_ ABSL_GUARDED_BY(mutex_);
+  uint32_t next_sequence_number_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Batches waiting to be written. The front batch is being written when
+  // write_in_flight_ is set; std::deque keeps it at a stable address.
+  std::deque<OrderedUpdateBatch> write_queue_ ABSL_GUARDED_BY(mutex_);
+  bool write_in_flight_ ABSL_GUARDED_BY(mutex_) = false;
+  bool closing_ ABSL_GUARDED_BY(mutex_) = false;
+  absl::Notification done_;
+};
+
 GrpcUpdateDispatcher::GrpcUpdateDispatcher(ClientId owner_id)
-    : owner_id_(owner_id) {}
+    : owner_id_(owner_id), flusher_([this]() { FlushLoop(); }) {}
+
+GrpcUpdateDispatcher::~GrpcUpdateDispatcher() { Shutdown(); }
 
 void GrpcUpdateDispatcher::RegisterRemoteUpdateHandler(
     ClientId client_id, const std::string& grpc_server_addr) {
@@ -51,42 +192,47 @@ void GrpcUpdateDispatcher::RegisterRemoteUpdateHandler(
   ::grpc::InsecureChannelCredentials();
   handler.channel = grpc::CreateChannel(grpc_server_addr, creds);
   handler.stub = ClientUpdateService::NewStub(handler.channel);
-  map_util::InsertOrDie(rpc_infos_, client_id, handler);
+  handler.stream =
+      std::make_unique<UpdateStream>(owner_id_, handler.stub.get());
+  absl::MutexLock guard(&mutex_);
+  map_util::InsertOrDie(rpc_infos_, client_id, std::move(handler));
 }
 
-void GrpcUpdateDispatcher::DispatchUpdate(const ClientUpdate& update) {
+void GrpcUpdateDispatcher::DispatchUpdate(ClientUpdate update) {
+  absl::ReaderMutexLock guard(&mutex_);
   if (update.has_destination_id()) {
-    SendUpdate(update.destination_id(), update);
+    DCHECK(rpc_infos_.find(update.destination_id()) != rpc_infos_.end());
+    rpc_infos_.at(update.destination_id()).stream->Append(std::move(update));
   } else {
-    for (const auto& [client_id, remote_handler] : rpc_infos_) {
-      SendUpdate(client_id, update);
+    for (auto& [client_id, remote_handler] : rpc_infos_) {
+      // The sender applies its own broadcasts.
+      if (client_id != owner_id_) {
+        remote_handler.stream->Append(update);
+      }
     }
   }
 }
 
-void GrpcUpdateDispatcher::SendUpdate(ClientId client_id,
-                                      const ClientUpdate& update) {
-  struct RpcArgs {
-    ::grpc::ClientContext context;
-    OrderedUpdateRequest request;
-    UpdateResponse response;
-  };
-  DCHECK(rpc_infos_.find(client_id) != rpc_infos_.end());
-  RemoteHandler& info = rpc_infos_.at(client_id);
-  RpcArgs* args = new RpcArgs;
-  args->context.set_deadline(
-      absl::ToChronoTime(absl::Now() + absl::Seconds(20)));
-  *args->request.mutable_update() = update;
-  args->request.set_source_id(owner_id_);
-  args->request.set_sequence_number(++info.next_sequence_number);
-
-  info.stub->async()->Update(&args->context, &args->request, &args->response,
-                             [args](::grpc::Status s) {
-                               if (!s.ok()) {
-                                 LOG(FATAL) << s.error_message();  // Crash ok
-                               }
-                               delete args;
-                             });
+void GrpcUpdateDispatcher::Shutdown() {
+  if (shutdown_.HasBeenNotified()) {
+    return;
+  }
+  shutdown_.Notify();
+  flusher_.join();
+  absl::ReaderMutexLock guard(&mutex_);
+  for (auto& [client_id, remote_handler] : rpc_infos_) {
+    remote_handler.stream->Finish();
+  }
+}
+
+void GrpcUpdateDispatcher::FlushLoop() {
+  while (!shutdown_.WaitForNotificationWithTimeout(kMaxBatchDelay)) {
+    absl::Time cutoff = absl::Now() - kMaxBatchDelay;
+    absl::ReaderMutexLock guard(&mutex_);
+    for (auto& [client_id, remote_handler] : rpc_infos_) {
+      remote_handler.stream->FlushIfOlderThan(cutoff);
+    }
+  }
 }
 
 }  // namespace random_walk
@@ -20,8 +20,13 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT
 
+#include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
 #include "grpcpp/channel.h"
 #include "random_walk/internal/client_update_service.grpc.pb.h"
 #include "random_walk/internal/client_update_service.pb.h"
@@ -32,17 +37,26 @@ namespace rdma_unit_test {
 namespace random_walk {
 
 // The class responsible for dispatching ClientUpdates from a RandomWalkClient
-// to other RandomWalkClients via gRPC.
+// to other RandomWalkClients via gRPC. The dispatcher keeps a single
+// long-lived StreamUpdates stream open per remote client and coalesces
+// ClientUpdates into OrderedUpdateBatches. A batch is flushed when it reaches
+// kMaxBatchSize updates or when its oldest update has waited for
+// kMaxBatchDelay, whichever comes first.
 class GrpcUpdateDispatcher : public UpdateDispatcherInterface {
  public:
+  // The maximum number of ClientUpdates carried in a single batch.
+  static constexpr int kMaxBatchSize = 32;
+  // The maximum time a ClientUpdate waits in a partially filled batch.
+  static constexpr absl::Duration kMaxBatchDelay = absl::Milliseconds(1);
+
   GrpcUpdateDispatcher() = delete;
-  GrpcUpdateDispatcher(ClientId owner_id);
-  // Movable but not copable.
-  GrpcUpdateDispatcher(GrpcUpdateDispatcher&& handler) = default;
-  GrpcUpdateDispatcher& operator=(GrpcUpdateDispatcher&& handler) = default;
+  explicit GrpcUpdateDispatcher(ClientId owner_id);
+  // Neither movable nor copyable.
+  GrpcUpdateDispatcher(GrpcUpdateDispatcher&& handler) = delete;
+  GrpcUpdateDispatcher& operator=(GrpcUpdateDispatcher&& handler) = delete;
   GrpcUpdateDispatcher(const GrpcUpdateDispatcher& handler) = delete;
   GrpcUpdateDispatcher& operator=(const GrpcUpdateDispatcher& handler) = delete;
-  ~GrpcUpdateDispatcher() = default;
+  ~GrpcUpdateDispatcher() override;
 
   // Registers the gRPC server address for a remote UpdateHandler. All
   // ClientUpdate targetting this specific [client_id] will be dispatched to
@@ -51,24 +65,37 @@ class GrpcUpdateDispatcher : public UpdateDispatcherInterface {
                                    const std::string& grpc_server_addr);
 
   // Implements UpdateDispatcherInterface.
-  void DispatchUpdate(const ClientUpdate& update) override;
+  void DispatchUpdate(ClientUpdate update) override;
+
+  // Flushes all pending ClientUpdates, half-closes every stream and waits for
+  // the remote UpdateHandlers to finish them. Must be called while the remote
+  // UpdateHandlers are still running. No ClientUpdate may be dispatched
+  // afterwards. Idempotent; also called by the destructor.
+  void Shutdown();
 
  private:
+  class UpdateStream;
+
   struct RemoteHandler {
     ClientId client_id;
     std::string server_addr;
     std::shared_ptr<::grpc::Channel> channel;
-    std::shared_ptr<ClientUpdateService::Stub> stub;
-    uint32_t next_sequence_number = 0;
+    std::unique_ptr<ClientUpdateService::Stub> stub;
+    std::unique_ptr<UpdateStream> stream;
   };
 
-  // Sends an ClientUpdate to the RandomWalkClient specified by [client_id].
-  void SendUpdate(ClientId client_id, const ClientUpdate& update);
+  // Periodically flushes partially filled batches until Shutdown().
+  void FlushLoop();
 
-  // Maps remote RandomWalkClient's Id to the RemoteHandler struct.
-  absl::flat_hash_map<uint32_t, RemoteHandler> rpc_infos_;
   // The Id of the RandomWalkClient owning the dispatcher.
   const ClientId owner_id_;
+  // Guards the structure of rpc_infos_. Each UpdateStream synchronizes itself.
+  absl::Mutex mutex_;
+  // Maps remote RandomWalkClient's Id to the RemoteHandler struct.
+  absl::flat_hash_map<uint32_t, RemoteHandler> rpc_infos_
+      ABSL_GUARDED_BY(mutex_);
+  absl::Notification shutdown_;
+  std::thread flusher_;
 };
 
 }  // namespace random_walk
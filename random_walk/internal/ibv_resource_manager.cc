@@ -28,6 +28,7 @@
 #include "infiniband/verbs.h"
 #include "public/map_util.h"
 #include "public/verbs_util.h"
+#include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/sampling.h"
 #include "random_walk/internal/types.h"
 
@@ -54,6 +55,49 @@ bool IbvResourceManager::RemoteUdQpInfo::operator==(
   return client_id == key.client_id && qp_num == key.qp_num;
 }
 
+ActionMask IbvResourceManager::ViableActions(
+    const MinimumObjects& minimum_objects) const {
+  bool has_pd = !pds_.empty();
+  bool has_cq = !cqs_.empty();
+  bool has_mr = !mrs_.empty();
+  bool has_rc_qp = !rc_qps_.empty();
+  bool has_qp = has_rc_qp || !ud_qps_.empty();
+  bool has_remote_memory = !rdma_memories_.empty();
+  ActionMask viable = ActionBit(Action::CREATE_CQ);
+  auto set = [&viable](Action action, bool condition) {
+    if (condition) {
+      viable |= ActionBit(action);
+    }
+  };
+  set(Action::DESTROY_CQ, cqs_.size() > minimum_objects.cq());
+  set(Action::ALLOC_PD, true);
+  set(Action::DEALLOC_PD, pds_.size() > minimum_objects.pd());
+  set(Action::REG_MR, has_pd);
+  set(Action::DEREG_MR, mrs_.size() > minimum_objects.mr());
+  set(Action::ALLOC_TYPE_1_MW, has_pd);
+  set(Action::ALLOC_TYPE_2_MW, has_pd);
+  set(Action::DEALLOC_TYPE_1_MW, Type1MwCount() > minimum_objects.type_1_mw());
+  set(Action::DEALLOC_TYPE_2_MW, Type2MwCount() > minimum_objects.type_2_mw());
+  set(Action::BIND_TYPE_1_MW,
+      !type_1_mws_unbound_.empty() && has_rc_qp && has_mr);
+  set(Action::BIND_TYPE_2_MW,
+      !type_2_mws_unbound_.empty() && has_rc_qp && has_mr);
+  set(Action::CREATE_RC_QP_PAIR, has_pd && has_cq);
+  set(Action::CREATE_UD_QP, has_pd && has_cq);
+  set(Action::MODIFY_QP_ERROR, has_qp);
+  set(Action::DESTROY_QP, has_qp);
+  set(Action::CREATE_AH, has_pd);
+  set(Action::DESTROY_AH, !ahs_.empty());
+  set(Action::SEND, has_mr && has_qp);
+  set(Action::SEND_WITH_INV, has_remote_memory && has_rc_qp);
+  set(Action::RECV, has_mr && has_qp);
+  set(Action::READ, has_remote_memory && has_mr && has_rc_qp);
+  set(Action::WRITE, has_remote_memory && has_mr && has_rc_qp);
+  set(Action::FETCH_ADD, has_remote_memory && has_mr && has_rc_qp);
+  set(Action::COMP_SWAP, has_remote_memory && has_mr && has_rc_qp);
+  return viable;
+}
+
 void IbvResourceManager::InsertCq(ibv_cq* cq) {
   map_util::InsertOrDie(cqs_, cq, CqInfo());
 }
@@ -465,6 +509,19 @@ absl::optional<ibv_qp*> IbvResourceManager::GetRandomQpForRdma(
   return stream_sampler.ExtractSample();
 }
 
+absl::optional<ibv_qp*> IbvResourceManager::GetRandomQpForRdma(
+    ClientId client_id) const {
+  StreamSampler<ibv_qp*> stream_sampler;
+  for (const auto& [qp_num, qp_info] : rc_qps_) {
+    if (qp_info.qp->qp_type == IBV_QPT_RC &&
+        verbs_util::GetQpState(qp_info.qp) == IBV_QPS_RTS &&
+        qp_info.remote_qp.ready && qp_info.remote_qp.client_id == client_id) {
+      stream_sampler.UpdateSample(qp_info.qp);
+    }
+  }
+  return stream_sampler.ExtractSample();
+}
+
 absl::optional<ibv_qp*> IbvResourceManager::GetRandomErrorQp() const {
   StreamSampler<ibv_qp*> stream_sampler;
   for (const auto& [qp_num, qp_info] : rc_qps_) {
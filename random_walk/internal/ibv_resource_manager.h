@@ -26,6 +26,7 @@
 #include "absl/container/flat_hash_set.h"
 #include "absl/types/optional.h"
 #include "infiniband/verbs.h"
+#include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/sampling.h"
 #include "random_walk/internal/types.h"
 
@@ -155,6 +156,13 @@ class IbvResourceManager {
   IbvResourceManager& operator=(const IbvResourceManager& manager) = delete;
   ~IbvResourceManager() = default;
 
+  // Returns the actions which may succeed given the objects in the pool.
+  // Only uses object counts, so it is cheap enough to call before every random
+  // action. An action outside the mask is certain to fail with
+  // kFailedPrecondition. An action inside the mask may still fail, e.g. if no
+  // QP is in RTS state. Actions may not go below |minimum_objects|.
+  ActionMask ViableActions(const MinimumObjects& minimum_objects) const;
+
   // Inserts a CQ into the sampling pool.
   void InsertCq(ibv_cq* cq);
   // Returns a pointer to the CqInfo object for a CQ.
@@ -314,6 +322,8 @@ class IbvResourceManager {
   // 4. The PD handle of the remote QP must match with the provided pd_handle.
   absl::optional<ibv_qp*> GetRandomQpForRdma(ClientId client_id,
                                              uint32_t pd_handle) const;
+  // Same as above, but the remote QP may be in any PD.
+  absl::optional<ibv_qp*> GetRandomQpForRdma(ClientId client_id) const;
   // Gets a random QP in ERROR state.
   absl::optional<ibv_qp*> GetRandomErrorQp() const;
   // Gets a random QP in ERROR state with no Type 2 MW bound to it.
@@ -28,8 +28,14 @@ class InboundUpdateInterface {
  public:
   virtual ~InboundUpdateInterface() = default;
 
-  // Pushes a remote ClientUpdate to a RandomWalkClient.
-  virtual void PushInboundUpdate(const ClientUpdate& update) = 0;
+  // Pushes a remote ClientUpdate to a RandomWalkClient. The update is moved
+  // into the client's inbound queue, so callers should std::move() it in when
+  // they no longer need it.
+  virtual void PushInboundUpdate(ClientUpdate update) = 0;
+
+  // Like PushInboundUpdate() but never waits. Returns false, leaving |update|
+  // untouched, if the client's inbound queue is full.
+  virtual bool TryPushInboundUpdate(ClientUpdate& update) = 0;
 };
 
 }  // namespace random_walk
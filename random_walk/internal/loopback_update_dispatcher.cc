@@ -16,12 +16,17 @@
 
 #include "random_walk/internal/loopback_update_dispatcher.h"
 
+#include <sched.h>
+
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <utility>
 
 #include "glog/logging.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "public/map_util.h"
 #include "random_walk/internal/client_update_service.pb.h"
@@ -30,24 +35,48 @@
 namespace rdma_unit_test {
 namespace random_walk {
 
+LoopbackUpdateDispatcher::LoopbackUpdateDispatcher(
+    uint32_t owner_id, std::function<void()> flush_owner)
+    : owner_id_(owner_id), flush_owner_(std::move(flush_owner)) {}
+
 void LoopbackUpdateDispatcher::RegisterRemote(
     uint32_t client_id, std::weak_ptr<InboundUpdateInterface> client) {
   map_util::InsertOrDie(remotes_, client_id, client);
 }
 
-void LoopbackUpdateDispatcher::DispatchUpdate(const ClientUpdate& update) {
+void LoopbackUpdateDispatcher::DispatchUpdate(ClientUpdate update) {
   if (update.has_destination_id()) {
     auto maybe_remote = remotes_.at(update.destination_id()).lock();
     CHECK(maybe_remote) << "Remote client destroyed.";  // Crash ok
-    maybe_remote->PushInboundUpdate(update);
+    Deliver(*maybe_remote, update);
   } else {
     for (const auto& remote : remotes_) {
+      // The sender applies its own broadcasts.
+      if (remote.first == owner_id_) {
+        continue;
+      }
       auto maybe_remote = remote.second.lock();
       CHECK(maybe_remote) << "Remote client destroyed.";  // Crash ok
-      maybe_remote->PushInboundUpdate(update);
+      ClientUpdate copy = update;
+      Deliver(*maybe_remote, copy);
     }
   }
 }
 
+void LoopbackUpdateDispatcher::Deliver(InboundUpdateInterface& remote,
+                                       ClientUpdate& update) {
+  if (remote.TryPushInboundUpdate(update)) {
+    return;
+  }
+  absl::Time deadline = absl::Now() + kQueueFullTimeout;
+  do {
+    // The remote may be blocked delivering into our own full queue.
+    flush_owner_();
+    sched_yield();
+    CHECK(absl::Now() < deadline)  // Crash ok
+        << "Timed out waiting for space in an inbound queue.";
+  } while (!remote.TryPushInboundUpdate(update));
+}
+
 }  // namespace random_walk
 }  // namespace rdma_unit_test
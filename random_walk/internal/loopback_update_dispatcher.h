@@ -18,9 +18,11 @@
 #define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_LOOPBACK_UPDATE_DISPATCHER_H_
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/inbound_update_interface.h"
@@ -31,9 +33,21 @@ namespace random_walk {
 
 // The class handles the dispatching of ClientUpdate generated by
 // a RandomWalkClient when all RandomWalkClients are run on shared memory.
+// Updates are pushed straight into the inbound queues of the remote clients
+// from the walker thread of the owner. While a remote queue is full the owner
+// keeps flushing its own inbound queue, since the remote may in turn be
+// waiting on it.
 class LoopbackUpdateDispatcher : public UpdateDispatcherInterface {
  public:
-  LoopbackUpdateDispatcher() = default;
+  // How long DispatchUpdate() waits for space in a full inbound queue before
+  // aborting.
+  static constexpr absl::Duration kQueueFullTimeout = absl::Seconds(10);
+
+  // |flush_owner| flushes the inbound queue of the client |owner_id|. It runs
+  // on the thread calling DispatchUpdate(), which must be the thread
+  // consuming that queue.
+  LoopbackUpdateDispatcher(uint32_t owner_id,
+                           std::function<void()> flush_owner);
   // Movable but not copyable..
   LoopbackUpdateDispatcher(LoopbackUpdateDispatcher&& handler) = default;
   LoopbackUpdateDispatcher& operator=(LoopbackUpdateDispatcher&& handler) =
@@ -48,9 +62,13 @@ class LoopbackUpdateDispatcher : public UpdateDispatcherInterface {
                       std::weak_ptr<InboundUpdateInterface> client);
 
   // Implements UpdateDispatcherInterface.
-  void DispatchUpdate(const ClientUpdate& update) override;
+  void DispatchUpdate(ClientUpdate update) override;
 
  private:
+  void Deliver(InboundUpdateInterface& remote, ClientUpdate& update);
+
+  uint32_t owner_id_;
+  std::function<void()> flush_owner_;
   absl::flat_hash_map<uint32_t, std::weak_ptr<InboundUpdateInterface>> remotes_;
 };
 
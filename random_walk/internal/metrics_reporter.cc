@@ -0,0 +1,132 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/metrics_reporter.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "infiniband/verbs.h"
+#include "random_walk/internal/client_metrics.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+namespace {
+
+double Rate(uint64_t count, absl::Duration elapsed) {
+  double seconds = absl::ToDoubleSeconds(elapsed);
+  return seconds > 0 ? count / seconds : 0;
+}
+
+}  // namespace
+
+MetricsReporter::MetricsReporter(std::vector<const ClientMetrics*> metrics,
+                                 absl::Duration interval)
+    : metrics_(std::move(metrics)), interval_(interval) {
+  history_.emplace_back(absl::Now(), TakeSnapshot());
+  thread_ = std::thread([this]() { ReportLoop(); });
+}
+
+MetricsReporter::~MetricsReporter() {
+  stop_.Notify();
+  thread_.join();
+  Report();
+}
+
+MetricsSnapshot MetricsReporter::TakeSnapshot() const {
+  MetricsSnapshot snapshot;
+  for (const ClientMetrics* metrics : metrics_) {
+    metrics->Snapshot(snapshot);
+  }
+  return snapshot;
+}
+
+void MetricsReporter::ReportLoop() {
+  while (!stop_.WaitForNotificationWithTimeout(interval_)) {
+    Report();
+  }
+}
+
+void MetricsReporter::Report() {
+  absl::Time now = absl::Now();
+  MetricsSnapshot current = TakeSnapshot();
+  const auto& [interval_start, interval_snapshot] = history_.back();
+  const auto& [window_start, window_snapshot] = history_.front();
+  MetricsSnapshot interval = current;
+  interval -= interval_snapshot;
+  MetricsSnapshot window = current;
+  window -= window_snapshot;
+  absl::Duration interval_length = now - interval_start;
+
+  LOG(INFO) << "Random walk metrics over the last " << interval_length << ": "
+            << Rate(interval.TotalActions(), interval_length)
+            << " actions/s (" << Rate(window.TotalActions(), now - window_start)
+            << " actions/s over the last " << now - window_start << ").";
+  for (Action action : kActions) {
+    const MetricsSnapshot::ActionMetrics& metrics =
+        interval.actions[static_cast<size_t>(action)];
+    const LatencyHistogram& issue = metrics.issue_latency;
+    const LatencyHistogram& completion = metrics.completion_latency;
+    if (metrics.count == 0 && completion.TotalCount() == 0) {
+      continue;
+    }
+    std::string line =
+        absl::StrCat("  ", ActionToString(action), ": ",
+                     Rate(metrics.count, interval_length), "/s, issue p50 ",
+                     absl::FormatDuration(issue.Percentile(50)), " p99 ",
+                     absl::FormatDuration(issue.Percentile(99)));
+    if (completion.TotalCount() > 0) {
+      absl::StrAppend(&line, ", completion p50 ",
+                      absl::FormatDuration(completion.Percentile(50)), " p99 ",
+                      absl::FormatDuration(completion.Percentile(99)));
+    }
+    LOG(INFO) << line;
+  }
+  std::string statuses;
+  for (size_t status = 0; status < interval.completion_statuses.size();
+       ++status) {
+    if (interval.completion_statuses[status] > 0) {
+      absl::StrAppend(
+          &statuses, " ",
+          status == MetricsSnapshot::kOtherStatus
+              ? "other"
+              : ibv_wc_status_str(static_cast<ibv_wc_status>(status)),
+          "=", interval.completion_statuses[status]);
+    }
+  }
+  if (!statuses.empty()) {
+    LOG(INFO) << "  completions:" << statuses;
+  }
+
+  history_.emplace_back(now, std::move(current));
+  if (history_.size() > kWindowIntervals) {
+    history_.pop_front();
+  }
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_METRICS_REPORTER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_METRICS_REPORTER_H_
+
+#include <cstddef>
+#include <deque>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "random_walk/internal/client_metrics.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// How often orchestrators report live metrics unless told otherwise.
+inline constexpr absl::Duration kDefaultReportInterval = absl::Seconds(10);
+
+// Periodically sums the ClientMetrics of a set of clients and logs, for the
+// last interval:
+//   - total and per-action throughput, plus the throughput over a rolling
+//     window of the last kWindowIntervals intervals,
+//   - p50/p99 issue and post-to-completion latency of each action,
+//   - the number of completions per status, which forms a timeline of
+//     completion errors over the run.
+// The reporter only reads the metrics, so clients never wait on it.
+class MetricsReporter {
+ public:
+  static constexpr size_t kWindowIntervals = 6;
+
+  // Starts reporting on |metrics| every |interval|. The ClientMetrics must
+  // outlive the reporter.
+  MetricsReporter(std::vector<const ClientMetrics*> metrics,
+                  absl::Duration interval);
+  // Neither movable nor copyable.
+  MetricsReporter(MetricsReporter&& reporter) = delete;
+  MetricsReporter& operator=(MetricsReporter&& reporter) = delete;
+  MetricsReporter(const MetricsReporter& reporter) = delete;
+  MetricsReporter& operator=(const MetricsReporter& reporter) = delete;
+  // Logs a last report covering the time since the previous one.
+  ~MetricsReporter();
+
+ private:
+  MetricsSnapshot TakeSnapshot() const;
+  void Report();
+  void ReportLoop();
+
+  const std::vector<const ClientMetrics*> metrics_;
+  const absl::Duration interval_;
+  // The oldest entry is the start of the rolling window, the newest one the
+  // start of the current interval.
+  std::deque<std::pair<absl::Time, MetricsSnapshot>> history_;
+  absl::Notification stop_;
+  std::thread thread_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_METRICS_REPORTER_H_
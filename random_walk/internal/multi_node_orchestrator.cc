@@ -16,69 +16,364 @@
 
 #include "random_walk/internal/multi_node_orchestrator.h"
 
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <memory>
+#include <string>
 #include <thread>  // NOLINT
+#include <utility>
 #include <vector>
 
+#include "glog/logging.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "absl/time/time.h"
 #include "grpcpp/grpcpp.h"
 #include "infiniband/verbs.h"
 #include "public/verbs_helper_suite.h"
 #include "public/verbs_util.h"
+#include "random_walk/internal/client_metrics.h"
+#include "random_walk/internal/control_channel.h"
 #include "random_walk/internal/grpc_update_dispatcher.h"
 #include "random_walk/internal/grpc_update_handler.h"
+#include "random_walk/internal/metrics_reporter.h"
 #include "random_walk/internal/random_walk_client.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/rpc_server.h"
+#include "random_walk/internal/shm_update_dispatcher.h"
+#include "random_walk/internal/shm_update_handler.h"
 #include "random_walk/internal/types.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
 
-MultiNodeOrchestrator::MultiNodeOrchestrator(size_t num_clients,
-                                             const ActionWeights& weights) {
-  clients_.resize(num_clients);
-  handlers_.resize(num_clients);
-  std::vector<std::shared_ptr<GrpcUpdateDispatcher>> dispatchers(num_clients,
-                                                                 nullptr);
-
-  for (ClientId id = 0; id < num_clients; ++id) {
-    clients_[id] = std::make_shared<RandomWalkClient>(id, weights);
-    dispatchers[id] = std::make_shared<GrpcUpdateDispatcher>(id);
-    clients_[id]->RegisterUpdateDispatcher(dispatchers[id]);
-    handlers_[id] = std::make_unique<GrpcUpdateHandler>(clients_[id]);
-  }
-
-  for (ClientId local_id = 0; local_id < num_clients; ++local_id) {
-    for (ClientId remote_id = 0; remote_id < num_clients; ++remote_id) {
-      clients_[local_id]->AddRemoteClient(remote_id,
-                                          clients_[remote_id]->GetGid());
-      dispatchers[local_id]->RegisterRemoteUpdateHandler(
-          remote_id, handlers_[remote_id]->GetServerAddress());
+namespace {
+
+void PinToCpus(const std::vector<int>& cpus) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  CHECK_EQ(sched_setaffinity(0, sizeof(cpu_set), &cpu_set), 0)  // Crash ok
+      << "sched_setaffinity failed (" << errno << ").";
+}
+
+void BindToNumaNode(int node) {
+  CHECK_GE(node, 0);                                            // Crash ok
+  CHECK_LT(node, static_cast<int>(8 * sizeof(unsigned long)));  // Crash ok
+  unsigned long node_mask = 1ul << node;
+  CHECK_EQ(syscall(SYS_set_mempolicy, MPOL_BIND, &node_mask,  // Crash ok
+                   8 * sizeof(node_mask) + 1),
+           0)
+      << "set_mempolicy failed (" << errno << ").";
+}
+
+// Returns the number of threads of the calling process.
+int CountThreads() {
+  constexpr absl::string_view kThreads = "Threads:";
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    absl::string_view field = line;
+    if (absl::ConsumePrefix(&field, kThreads)) {
+      int threads;
+      CHECK(absl::SimpleAtoi(field, &threads));  // Crash ok
+      return threads;
     }
   }
+  LOG(FATAL) << "No thread count in /proc/self/status.";  // Crash ok
+  return 0;
 }
 
-void MultiNodeOrchestrator::RunClients(absl::Duration duration) {
-  std::vector<std::thread> client_threads;
-  for (const auto& client : clients_) {
-    client_threads.emplace_back([&]() { return client->Run(duration); });
+void PrintAggregatedStats(const ClientStats& stats) {
+  std::vector<std::pair<std::string, uint64_t>> counters(
+      stats.counters().begin(), stats.counters().end());
+  std::sort(counters.begin(), counters.end());
+  LOG(INFO) << "Statistics summed over all processes:";
+  for (const auto& [name, value] : counters) {
+    LOG(INFO) << name << " = " << value;
   }
-  for (auto& client : client_threads) {
-    client.join();
+}
+
+}  // namespace
+
+MultiNodeOrchestrator::MultiNodeOrchestrator(
+    size_t num_clients, const RandomWalkConfig& config, Transport transport,
+    const WorkerProcessOptions& process_options)
+    : transport_(transport) {
+  size_t num_processes = process_options.num_processes;
+  if (num_processes == 0) {
+    std::vector<ClientId> ids(num_clients);
+    for (ClientId id = 0; id < num_clients; ++id) {
+      ids[id] = id;
+    }
+    ConnectLocalClients(CreateLocalClients(ids, num_clients, config));
+    return;
   }
+
+  CHECK_LE(num_processes, num_clients);  // Crash ok
+  // Workers keep running the forked image without exec. Any other thread of
+  // this process, e.g. of a gRPC server or an earlier test, could hold a lock
+  // which then stays locked forever in the workers.
+  CHECK_EQ(CountThreads(), 1)  // Crash ok
+      << "Worker processes must be forked from a single threaded process.";
+  for (size_t index = 0; index < num_processes; ++index) {
+    int fds[2];
+    CHECK_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,  // Crash ok
+                        fds),
+             0)
+        << "socketpair failed (" << errno << ").";
+    pid_t pid = fork();
+    CHECK_GE(pid, 0) << "fork failed (" << errno << ").";  // Crash ok
+    if (pid == 0) {
+      close(fds[0]);
+      RunWorker(index, num_clients, config, process_options,
+                std::make_unique<ControlChannel>(fds[1]));
+    }
+    close(fds[1]);
+    workers_.push_back({pid, std::make_unique<ControlChannel>(fds[0])});
+  }
+
+  ControlMessage directory;
+  for (auto& worker : workers_) {
+    ControlMessage endpoints = worker.channel->Receive();
+    CHECK(endpoints.has_endpoints());  // Crash ok
+    directory.mutable_directory()->MergeFrom(endpoints.endpoints());
+  }
+  CHECK_EQ(directory.directory().endpoints_size(),  // Crash ok
+           static_cast<int>(num_clients));
+  for (auto& worker : workers_) {
+    worker.channel->Send(directory);
+  }
+  for (auto& worker : workers_) {
+    worker.channel->ExpectSignal(ControlMessage::READY);
+  }
+}
+
+MultiNodeOrchestrator::~MultiNodeOrchestrator() {
+  if (workers_.empty()) {
+    ShutdownDispatchers();
+    return;
+  }
+  // Every worker closes its streams before any worker tears down the servers
+  // those streams point at.
+  for (auto& worker : workers_) {
+    worker.channel->SendSignal(ControlMessage::SHUTDOWN_DISPATCHERS);
+  }
+  for (auto& worker : workers_) {
+    worker.channel->ExpectSignal(ControlMessage::DISPATCHERS_SHUT_DOWN);
+  }
+  for (auto& worker : workers_) {
+    worker.channel->SendSignal(ControlMessage::EXIT);
+  }
+  for (auto& worker : workers_) {
+    int status;
+    CHECK_EQ(waitpid(worker.pid, &status, 0), worker.pid);  // Crash ok
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0)    // Crash ok
+        << "Worker " << worker.pid << " failed with status " << status << ".";
+  }
+}
+
+void MultiNodeOrchestrator::RunClients(absl::Duration duration) {
+  RunCommand command;
+  command.set_duration_ms(absl::ToInt64Milliseconds(duration));
+  command.set_report_interval_ms(absl::ToInt64Milliseconds(report_interval_));
+  Run(command);
 }
 
 void MultiNodeOrchestrator::RunClients(size_t num_steps) {
+  RunCommand command;
+  command.set_steps(num_steps);
+  command.set_report_interval_ms(absl::ToInt64Milliseconds(report_interval_));
+  Run(command);
+}
+
+ClientDirectory MultiNodeOrchestrator::CreateLocalClients(
+    const std::vector<ClientId>& ids, size_t num_clients,
+    const RandomWalkConfig& config) {
+  ClientDirectory directory;
+  for (ClientId id : ids) {
+    auto client = std::make_shared<RandomWalkClient>(id, config, num_clients);
+    ClientEndpoint* endpoint = directory.add_endpoints();
+    endpoint->set_client_id(id);
+    ibv_gid gid = client->GetGid();
+    endpoint->set_gid(&gid, sizeof(gid));
+    switch (transport_) {
+      case Transport::kGrpc:
+        handlers_.push_back(std::make_unique<GrpcUpdateHandler>(client));
+        endpoint->set_handler_address(handlers_.back()->GetServerAddress());
+        break;
+      case Transport::kSharedMemory:
+        shm_handlers_.push_back(
+            std::make_unique<ShmUpdateHandler>(client, num_clients));
+        endpoint->set_handler_address(shm_handlers_.back()->GetAddress());
+        break;
+    }
+    clients_.push_back(std::move(client));
+  }
+  return directory;
+}
+
+void MultiNodeOrchestrator::ConnectLocalClients(
+    const ClientDirectory& directory) {
+  for (auto& client : clients_) {
+    for (const ClientEndpoint& endpoint : directory.endpoints()) {
+      ibv_gid gid;
+      CHECK_EQ(endpoint.gid().size(), sizeof(gid));  // Crash ok
+      memcpy(&gid, endpoint.gid().data(), sizeof(gid));
+      client->AddRemoteClient(endpoint.client_id(), gid);
+    }
+  }
+  for (auto& client : clients_) {
+    switch (transport_) {
+      case Transport::kGrpc: {
+        auto dispatcher = std::make_shared<GrpcUpdateDispatcher>(client->id());
+        for (const ClientEndpoint& endpoint : directory.endpoints()) {
+          dispatcher->RegisterRemoteUpdateHandler(endpoint.client_id(),
+                                                  endpoint.handler_address());
+        }
+        client->RegisterUpdateDispatcher(dispatcher);
+        dispatchers_.push_back(std::move(dispatcher));
+        break;
+      }
+      case Transport::kSharedMemory: {
+        auto dispatcher = std::make_shared<ShmUpdateDispatcher>(client->id());
+        for (const ClientEndpoint& endpoint : directory.endpoints()) {
+          dispatcher->RegisterRemoteUpdateHandler(endpoint.client_id(),
+                                                  endpoint.handler_address());
+        }
+        client->RegisterUpdateDispatcher(dispatcher);
+        break;
+      }
+    }
+  }
+}
+
+void MultiNodeOrchestrator::RunLocalClients(const RunCommand& command) {
+  std::unique_ptr<MetricsReporter> reporter;
+  if (command.report_interval_ms() > 0) {
+    std::vector<const ClientMetrics*> metrics;
+    for (const auto& client : clients_) {
+      metrics.push_back(&client->metrics());
+    }
+    reporter = std::make_unique<MetricsReporter>(
+        metrics, absl::Milliseconds(command.report_interval_ms()));
+  }
   std::vector<std::thread> client_threads;
   for (const auto& client : clients_) {
-    client_threads.emplace_back([&]() { return client->Run(num_steps); });
+    client_threads.emplace_back([&]() {
+      if (command.has_steps()) {
+        client->Run(command.steps());
+      } else {
+        client->Run(absl::Milliseconds(command.duration_ms()));
+      }
+    });
   }
   for (auto& client : client_threads) {
     client.join();
   }
 }
 
+void MultiNodeOrchestrator::Run(const RunCommand& command) {
+  if (workers_.empty()) {
+    RunLocalClients(command);
+    return;
+  }
+  ControlMessage message;
+  *message.mutable_run() = command;
+  for (auto& worker : workers_) {
+    worker.channel->Send(message);
+  }
+  ClientStats stats;
+  for (auto& worker : workers_) {
+    ControlMessage reply = worker.channel->Receive();
+    CHECK(reply.has_stats());  // Crash ok
+    for (const auto& [name, value] : reply.stats().counters()) {
+      (*stats.mutable_counters())[name] += value;
+    }
+  }
+  PrintAggregatedStats(stats);
+}
+
+void MultiNodeOrchestrator::ShutdownDispatchers() {
+  for (auto& dispatcher : dispatchers_) {
+    dispatcher->Shutdown();
+  }
+}
+
+void MultiNodeOrchestrator::RunWorker(
+    size_t index, size_t num_clients, const RandomWalkConfig& config,
+    const WorkerProcessOptions& process_options,
+    std::unique_ptr<ControlChannel> channel) {
+  // Drop the channels to the workers forked before this one.
+  workers_.clear();
+  if (!process_options.cpu_sets.empty()) {
+    PinToCpus(
+        process_options.cpu_sets[index % process_options.cpu_sets.size()]);
+  }
+  if (!process_options.numa_nodes.empty()) {
+    BindToNumaNode(
+        process_options.numa_nodes[index % process_options.numa_nodes.size()]);
+  }
+
+  std::vector<ClientId> ids;
+  for (ClientId id = index; id < num_clients;
+       id += process_options.num_processes) {
+    ids.push_back(id);
+  }
+  ControlMessage endpoints;
+  *endpoints.mutable_endpoints() =
+      CreateLocalClients(ids, num_clients, config);
+  channel->Send(endpoints);
+  ControlMessage directory = channel->Receive();
+  CHECK(directory.has_directory());  // Crash ok
+  ConnectLocalClients(directory.directory());
+  channel->SendSignal(ControlMessage::READY);
+
+  while (true) {
+    ControlMessage message = channel->Receive();
+    if (message.has_run()) {
+      RunLocalClients(message.run());
+      ControlMessage stats;
+      for (const auto& client : clients_) {
+        client->ExportStats(*stats.mutable_stats());
+      }
+      channel->Send(stats);
+      continue;
+    }
+    CHECK(message.has_signal()) << message.DebugString();  // Crash ok
+    if (message.signal() == ControlMessage::SHUTDOWN_DISPATCHERS) {
+      ShutdownDispatchers();
+      channel->SendSignal(ControlMessage::DISPATCHERS_SHUT_DOWN);
+    } else {
+      CHECK_EQ(message.signal(), ControlMessage::EXIT);  // Crash ok
+      break;
+    }
+  }
+  dispatchers_.clear();
+  clients_.clear();
+  handlers_.clear();
+  shm_handlers_.clear();
+  google::FlushLogFiles(google::INFO);
+  // Skip the static destructors and atexit handlers inherited from the
+  // parent.
+  _exit(0);
+}
+
 }  // namespace random_walk
 }  // namespace rdma_unit_test
@@ -17,35 +17,84 @@
 #ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_MULTI_NODE_ORCHESTRATOR_H_
 #define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_MULTI_NODE_ORCHESTRATOR_H_
 
+#include <sys/types.h>
+
 #include <cstddef>
 #include <memory>
 #include <vector>
 
 #include "absl/time/time.h"
 #include "infiniband/verbs.h"
+#include "random_walk/internal/control_channel.h"
 #include "random_walk/internal/grpc_update_dispatcher.h"
 #include "random_walk/internal/grpc_update_handler.h"
+#include "random_walk/internal/metrics_reporter.h"
 #include "random_walk/internal/random_walk_client.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/rpc_server.h"
+#include "random_walk/internal/shm_update_handler.h"
+#include "random_walk/internal/types.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
 
+// How MultiNodeOrchestrator spreads clients over worker processes.
+struct WorkerProcessOptions {
+  // Number of worker processes. 0 runs every client in the calling process.
+  size_t num_processes = 0;
+  // CPUs worker i is pinned to, as cpu_sets[i % cpu_sets.size()]. No pinning
+  // if empty.
+  std::vector<std::vector<int>> cpu_sets;
+  // NUMA node worker i binds its memory to, as
+  // numa_nodes[i % numa_nodes.size()]. No binding if empty.
+  std::vector<int> numa_nodes;
+};
+
 // The class creates and coordinates multiple RandomWalkClients on multiple
 // nodes, one per client, to perform RDMA random walk. This process entails.
 //   1. Create the TestOrchestrator object.
 //   2. Call RunClients.
+//
+// By default every client lives in the calling process. With
+// WorkerProcessOptions::num_processes set, the orchestrator instead forks that
+// many worker processes, each hosting the clients whose id modulo
+// num_processes is its index. Workers open their own verbs devices, publish
+// the gid and update handler address of each of their clients, and receive the
+// full directory back before any client runs. The calling process only
+// coordinates over a ControlChannel per worker and sums the workers'
+// statistics. Workers are forked without exec, so the calling process must
+// still be single threaded when the orchestrator is constructed; tests using
+// worker processes need a binary of their own.
 
 class MultiNodeOrchestrator {
  public:
-  MultiNodeOrchestrator(size_t num_clients, const ActionWeights& weights);
+  // The out-of-band channel carrying ClientUpdates between clients.
+  enum class Transport {
+    // gRPC streams over localhost, see GrpcUpdateDispatcher.
+    kGrpc,
+    // memfd-backed shared memory rings, see ShmUpdateDispatcher.
+    kSharedMemory,
+  };
+
+  MultiNodeOrchestrator(size_t num_clients, const RandomWalkConfig& config,
+                        Transport transport = Transport::kGrpc,
+                        const WorkerProcessOptions& process_options = {});
   // Movable but not copyable.
   MultiNodeOrchestrator(MultiNodeOrchestrator&& orch) = default;
   MultiNodeOrchestrator& operator=(MultiNodeOrchestrator&& orch) = default;
   MultiNodeOrchestrator(const MultiNodeOrchestrator& orch) = delete;
   MultiNodeOrchestrator& operator=(const MultiNodeOrchestrator& orch) = delete;
-  ~MultiNodeOrchestrator() = default;
+  // Closes the update streams between clients before tearing down the gRPC
+  // servers they point at, then reaps the worker processes, if any.
+  ~MultiNodeOrchestrator();
+
+  // Sets how often live metrics of the clients are logged while they run, see
+  // MetricsReporter. Each worker process reports on its own clients. A zero
+  // |interval| disables reporting.
+  void set_report_interval(absl::Duration interval) {
+    report_interval_ = interval;
+  }
 
   // Creates and Runs a Network of RandomWalkClients for a fixed duration.
   void RunClients(absl::Duration duration);
@@ -54,8 +103,39 @@ class MultiNodeOrchestrator {
   void RunClients(size_t num_steps);
 
  private:
+  struct Worker {
+    pid_t pid;
+    std::unique_ptr<ControlChannel> channel;
+  };
+
+  // Creates the clients in |ids| and their update handlers. Returns how the
+  // other clients reach them.
+  ClientDirectory CreateLocalClients(const std::vector<ClientId>& ids,
+                                     size_t num_clients,
+                                     const RandomWalkConfig& config);
+  // Introduces every client in |directory| to the local clients and connects
+  // their update dispatchers.
+  void ConnectLocalClients(const ClientDirectory& directory);
+  void RunLocalClients(const RunCommand& command);
+  // Runs |command| locally or on every worker and prints the statistics.
+  void Run(const RunCommand& command);
+  void ShutdownDispatchers();
+  // The body of a worker process: pins itself, hosts its share of the clients
+  // and serves commands from |channel| until told to exit.
+  [[noreturn]] void RunWorker(size_t index, size_t num_clients,
+                              const RandomWalkConfig& config,
+                              const WorkerProcessOptions& process_options,
+                              std::unique_ptr<ControlChannel> channel);
+
+  Transport transport_;
+  absl::Duration report_interval_ = kDefaultReportInterval;
+  std::vector<Worker> workers_;
+  // The clients hosted by this process.
   std::vector<std::shared_ptr<RandomWalkClient>> clients_;
+  // Only one of each pair is populated, depending on the transport.
+  std::vector<std::shared_ptr<GrpcUpdateDispatcher>> dispatchers_;
   std::vector<std::unique_ptr<GrpcUpdateHandler>> handlers_;
+  std::vector<std::unique_ptr<ShmUpdateHandler>> shm_handlers_;
 };
 
 }  // namespace random_walk
@@ -0,0 +1,427 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/payload_verifier.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "glog/logging.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/random/distributions.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/buffer_pattern.h"
+#include "public/map_util.h"
+#include "public/rdma_memblock.h"
+#include "public/verbs_util.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+namespace {
+
+// Slots are cache line aligned so atomics targets are 8-byte aligned.
+constexpr size_t kSlotAlignment = 64;
+
+std::array<uint32_t, 256> MakeCrc32cTable() {
+  // Bit-reversed Castagnoli polynomial.
+  constexpr uint32_t kPolynomial = 0x82f63b78;
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < table.size(); ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t Crc32cScalar(uint32_t crc, const uint8_t* data, size_t size) {
+  static const std::array<uint32_t, 256> kTable = MakeCrc32cTable();
+  for (size_t i = 0; i < size; ++i) {
+    crc = kTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t Crc32cSse42(uint32_t crc,
+                                                        const uint8_t* data,
+                                                        size_t size) {
+  uint64_t crc64 = crc;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += sizeof(word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; size > 0; --size) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+uint64_t LoadWord(const uint8_t* addr) {
+  uint64_t word;
+  memcpy(&word, addr, sizeof(word));
+  return word;
+}
+
+void StoreWord(uint8_t* addr, uint64_t word) {
+  memcpy(addr, &word, sizeof(word));
+}
+
+}  // namespace
+
+uint32_t Crc32c(absl::Span<const uint8_t> data) {
+  uint32_t crc = ~uint32_t{0};
+#if defined(__x86_64__)
+  static const bool kHasSse42 = __builtin_cpu_supports("sse4.2");
+  if (kHasSse42) {
+    return ~Crc32cSse42(crc, data.data(), data.size());
+  }
+#endif
+  return ~Crc32cScalar(crc, data.data(), data.size());
+}
+
+PayloadVerifier::PayloadVerifier(RdmaMemBlock arena, size_t max_payload)
+    : arena_(std::move(arena)), slot_size_(SlotSize(max_payload)) {
+  CHECK_GE(arena_.size(), kSlots * slot_size_);  // Crash ok
+  for (int slot = kSlots - 1; slot >= 0; --slot) {
+    free_slots_.push_back(slot);
+  }
+}
+
+size_t PayloadVerifier::SlotSize(size_t max_payload) {
+  size_t size = std::max(max_payload, sizeof(uint64_t));
+  return (size + kSlotAlignment - 1) / kSlotAlignment * kSlotAlignment;
+}
+
+void PayloadVerifier::AddArenaMr(ibv_mr* mr) {
+  map_util::InsertOrDie(arena_mrs_, mr->pd, mr);
+}
+
+ibv_mr* PayloadVerifier::RemoveArenaMr(ibv_pd* pd) {
+  ibv_mr* mr = map_util::FindOrDie(arena_mrs_, pd);
+  arena_mrs_.erase(pd);
+  return mr;
+}
+
+absl::optional<uint32_t> PayloadVerifier::StampSend(
+    ibv_qp* qp, uint64_t wr_id, size_t length, uint32_t max_sge,
+    std::vector<ibv_sge>& sges) {
+  DCHECK_LE(length, slot_size_);
+  ibv_mr* mr = ArenaMr(qp->pd);
+  if (!mr) {
+    return absl::nullopt;
+  }
+  absl::optional<int> slot = AllocateSlot();
+  if (!slot.has_value()) {
+    return absl::nullopt;
+  }
+  PendingOp op;
+  op.opcode = IBV_WR_SEND_WITH_IMM;
+  op.qp_nums[op.num_qps++] = qp->qp_num;
+  op.local_slot = slot.value();
+  op.length = length;
+  op.seed = absl::Uniform<uint64_t>(bitgen_);
+  absl::Span<uint8_t> payload =
+      absl::MakeSpan(SlotAddress(op.local_slot), length);
+  buffer_pattern::Fill(payload, op.seed);
+  op.checksum = Crc32c(payload);
+  sges = SlotSges(op.local_slot, length, max_sge, mr);
+  map_util::InsertOrDie(pending_, wr_id, op);
+  return htonl(op.checksum);
+}
+
+bool PayloadVerifier::PrepareRecv(ibv_qp* qp, uint64_t wr_id, size_t length,
+                                  uint32_t max_sge,
+                                  std::vector<ibv_sge>& sges) {
+  DCHECK_LE(length, slot_size_);
+  ibv_mr* mr = ArenaMr(qp->pd);
+  if (!mr || recv_slots_ >= kMaxRecvSlots) {
+    return false;
+  }
+  absl::optional<int> slot = AllocateSlot();
+  if (!slot.has_value()) {
+    return false;
+  }
+  PendingOp op;
+  op.is_recv = true;
+  op.qp_nums[op.num_qps++] = qp->qp_num;
+  op.local_slot = slot.value();
+  op.length = length;
+  ++recv_slots_;
+  sges = SlotSges(op.local_slot, length, max_sge, mr);
+  map_util::InsertOrDie(pending_, wr_id, op);
+  return true;
+}
+
+bool PayloadVerifier::PrepareRdma(ibv_wr_opcode opcode, ibv_qp* qp,
+                                  ibv_qp* responder, uint64_t wr_id,
+                                  size_t length, uint32_t max_sge,
+                                  ibv_send_wr& wr, std::vector<ibv_sge>& sges) {
+  DCHECK_LE(length, slot_size_);
+  ibv_mr* local_mr = ArenaMr(qp->pd);
+  ibv_mr* remote_mr = ArenaMr(responder->pd);
+  if (!local_mr || !remote_mr || free_slots_.size() < 2) {
+    return false;
+  }
+  PendingOp op;
+  op.opcode = opcode;
+  op.qp_nums[op.num_qps++] = qp->qp_num;
+  op.qp_nums[op.num_qps++] = responder->qp_num;
+  op.local_slot = AllocateSlot().value();
+  op.remote_slot = AllocateSlot().value();
+  uint8_t* local = SlotAddress(op.local_slot);
+  uint8_t* remote = SlotAddress(op.remote_slot);
+  op.seed = absl::Uniform<uint64_t>(bitgen_);
+  switch (opcode) {
+    case IBV_WR_RDMA_READ:
+    case IBV_WR_RDMA_WRITE: {
+      op.length = length;
+      absl::Span<uint8_t> source = absl::MakeSpan(
+          opcode == IBV_WR_RDMA_READ ? remote : local, op.length);
+      buffer_pattern::Fill(source, op.seed);
+      op.checksum = Crc32c(source);
+      sges = SlotSges(op.local_slot, op.length, max_sge, local_mr);
+      wr = opcode == IBV_WR_RDMA_READ
+               ? verbs_util::CreateReadWr(wr_id, sges.data(), sges.size(),
+                                          remote, remote_mr->rkey)
+               : verbs_util::CreateWriteWr(wr_id, sges.data(), sges.size(),
+                                           remote, remote_mr->rkey);
+      break;
+    }
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+    case IBV_WR_ATOMIC_CMP_AND_SWP: {
+      op.length = sizeof(uint64_t);
+      op.original = op.seed;
+      StoreWord(remote, op.original);
+      // Anything but the original value, so an unwritten result shows.
+      StoreWord(local, ~op.original);
+      sges = {verbs_util::CreateAtomicSge(local, local_mr)};
+      if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        uint64_t add = absl::Uniform<uint64_t>(bitgen_);
+        op.expected = op.original + add;
+        wr = verbs_util::CreateFetchAddWr(wr_id, sges.data(), sges.size(),
+                                          remote, remote_mr->rkey, add);
+      } else {
+        uint64_t compare = absl::Bernoulli(bitgen_, 0.5)
+                               ? op.original
+                               : absl::Uniform<uint64_t>(bitgen_);
+        uint64_t swap = absl::Uniform<uint64_t>(bitgen_);
+        op.expected = compare == op.original ? swap : op.original;
+        wr = verbs_util::CreateCompSwapWr(wr_id, sges.data(), sges.size(),
+                                          remote, remote_mr->rkey, compare,
+                                          swap);
+      }
+      break;
+    }
+    default: {
+      LOG(FATAL) << "Cannot verify opcode " << opcode;  // Crash ok
+    }
+  }
+  map_util::InsertOrDie(pending_, wr_id, op);
+  return true;
+}
+
+void PayloadVerifier::Cancel(uint64_t wr_id) {
+  auto iter = pending_.find(wr_id);
+  if (iter == pending_.end()) {
+    return;
+  }
+  FreeSlots(iter->second);
+  pending_.erase(iter);
+}
+
+bool PayloadVerifier::OnCompletion(const ibv_wc& completion) {
+  auto iter = pending_.find(completion.wr_id);
+  if (iter == pending_.end()) {
+    return true;
+  }
+  PendingOp& op = iter->second;
+  bool ok = true;
+  if (completion.status == IBV_WC_SUCCESS) {
+    ok = Verify(completion.wr_id, op, completion);
+    op.num_qps = 0;
+  } else {
+    // The requester is done with the slots, but for reads, writes and atomics
+    // the responder may still be accessing them.
+    auto end = op.qp_nums.begin() + op.num_qps;
+    op.num_qps = std::remove(op.qp_nums.begin(), end, completion.qp_num) -
+                 op.qp_nums.begin();
+  }
+  if (op.num_qps == 0) {
+    FreeSlots(op);
+    pending_.erase(iter);
+  }
+  return ok;
+}
+
+void PayloadVerifier::ReleaseQp(uint32_t qp_num) {
+  for (auto iter = pending_.begin(); iter != pending_.end();) {
+    PendingOp& op = iter->second;
+    auto end = op.qp_nums.begin() + op.num_qps;
+    op.num_qps =
+        std::remove(op.qp_nums.begin(), end, qp_num) - op.qp_nums.begin();
+    if (op.num_qps == 0) {
+      FreeSlots(op);
+      pending_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+absl::optional<int> PayloadVerifier::AllocateSlot() {
+  if (free_slots_.empty()) {
+    return absl::nullopt;
+  }
+  int slot = free_slots_.back();
+  free_slots_.pop_back();
+  return slot;
+}
+
+uint8_t* PayloadVerifier::SlotAddress(int slot) const {
+  return arena_.data() + slot * slot_size_;
+}
+
+ibv_mr* PayloadVerifier::ArenaMr(ibv_pd* pd) const {
+  auto iter = arena_mrs_.find(pd);
+  return iter == arena_mrs_.end() ? nullptr : iter->second;
+}
+
+std::vector<ibv_sge> PayloadVerifier::SlotSges(int slot, size_t length,
+                                               uint32_t max_sge, ibv_mr* mr) {
+  size_t num_sges = 1;
+  if (max_sge > 1 && length > 1 && absl::Bernoulli(bitgen_, 0.5)) {
+    num_sges = absl::Uniform<size_t>(absl::IntervalClosed, bitgen_, 2,
+                                     std::min<size_t>(max_sge, length));
+  }
+  std::vector<size_t> boundaries = {0, length};
+  for (size_t i = 1; i < num_sges; ++i) {
+    boundaries.push_back(absl::Uniform<size_t>(bitgen_, 1, length));
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+  uint8_t* base = SlotAddress(slot);
+  std::vector<ibv_sge> sges;
+  for (size_t i = 0; i + 1 < boundaries.size(); ++i) {
+    sges.push_back(verbs_util::CreateSge(
+        absl::MakeSpan(base + boundaries[i], boundaries[i + 1] - boundaries[i]),
+        mr));
+  }
+  return sges;
+}
+
+bool PayloadVerifier::Verify(uint64_t wr_id, const PendingOp& op,
+                             const ibv_wc& completion) {
+  if (op.is_recv) {
+    // Only verified sends carry immediate data.
+    if (!(completion.wc_flags & IBV_WC_WITH_IMM)) {
+      return true;
+    }
+    ++verified_;
+    uint32_t expected = ntohl(completion.imm_data);
+    uint32_t actual = Crc32c(
+        absl::MakeConstSpan(SlotAddress(op.local_slot), completion.byte_len));
+    if (actual != expected) {
+      LOG(DFATAL) << "Corrupted recv payload (wr_id = " << wr_id
+                  << ", qp_num = " << completion.qp_num
+                  << ", byte_len = " << completion.byte_len
+                  << "): CRC32C is " << actual << ", the sender sent "
+                  << expected << ".";
+      return false;
+    }
+    return true;
+  }
+  uint8_t* local = SlotAddress(op.local_slot);
+  ++verified_;
+  switch (op.opcode) {
+    case IBV_WR_SEND_WITH_IMM:
+    case IBV_WR_RDMA_READ:
+    case IBV_WR_RDMA_WRITE: {
+      // A send's source must be left intact by the NIC.
+      uint8_t* checked =
+          op.opcode == IBV_WR_RDMA_WRITE ? SlotAddress(op.remote_slot) : local;
+      absl::Span<const uint8_t> payload =
+          absl::MakeConstSpan(checked, op.length);
+      uint32_t actual = Crc32c(payload);
+      if (actual != op.checksum) {
+        LOG(DFATAL) << "Corrupted payload (wr_id = " << wr_id
+                    << ", opcode = " << op.opcode
+                    << ", qp_num = " << completion.qp_num
+                    << ", length = " << op.length << "): CRC32C is " << actual
+                    << ", expected " << op.checksum
+                    << ". First corrupted byte at offset "
+                    << buffer_pattern::FindMismatch(payload, op.seed)
+                           .value_or(op.length)
+                    << ".";
+        return false;
+      }
+      return true;
+    }
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+    case IBV_WR_ATOMIC_CMP_AND_SWP: {
+      uint64_t result = LoadWord(local);
+      uint64_t target = LoadWord(SlotAddress(op.remote_slot));
+      if (result != op.original || target != op.expected) {
+        LOG(DFATAL) << "Corrupted atomic (wr_id = " << wr_id
+                    << ", opcode = " << op.opcode
+                    << ", qp_num = " << completion.qp_num << "): returned "
+                    << result << " and left " << target << ", expected "
+                    << op.original << " and " << op.expected << ".";
+        return false;
+      }
+      return true;
+    }
+    default: {
+      LOG(FATAL) << "Cannot verify opcode " << op.opcode;  // Crash ok
+    }
+  }
+  return false;
+}
+
+void PayloadVerifier::FreeSlots(const PendingOp& op) {
+  for (int slot : {op.local_slot, op.remote_slot}) {
+    if (slot != kNoSlot) {
+      free_slots_.push_back(slot);
+    }
+  }
+  if (op.is_recv) {
+    --recv_slots_;
+  }
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_PAYLOAD_VERIFIER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_PAYLOAD_VERIFIER_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/random/random.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "infiniband/verbs.h"
+#include "public/rdma_memblock.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// Returns the CRC32C (Castagnoli) of |data|. Uses the SSE4.2 crc32
+// instruction when the CPU has it.
+uint32_t Crc32c(absl::Span<const uint8_t> data);
+
+// PayloadVerifier checks that the bytes moved by sends, reads, writes and
+// atomics are the bytes that were meant to move.
+//
+// Most of the random walk deliberately races: MRs and MWs overlap in the
+// ground memory and any client may write any of them, so their contents carry
+// no meaning. Verified operations instead use slots of a private arena which
+// is registered in every PD of the client but whose rkeys are never published,
+// so the only writer of a slot is the operation that owns it:
+//   - Verified RC sends gather a seeded pattern from a slot and carry its
+//     CRC32C as immediate data. A verified recv scatters into a slot and
+//     checks the CRC32C of whatever it received against the immediate data.
+//     Unverified RC sends never carry immediate data in this mode.
+//   - Verified reads, writes and atomics run on RC QPs connected back to the
+//     same client, moving data between two slots whose expected contents are
+//     known.
+// A slot is reused only once no QP can still DMA to or from it: after the
+// successful completion of its operation, or once every QP involved was
+// destroyed. Operations go unverified while the arena is exhausted.
+class PayloadVerifier {
+ public:
+  // The number of slots in the arena.
+  static constexpr size_t kSlots = 16;
+  // At most this many slots are held by posted recvs, which can be
+  // outstanding for a long time.
+  static constexpr size_t kMaxRecvSlots = kSlots / 2;
+
+  // |arena| must be at least kSlots * SlotSize(max_payload) bytes.
+  explicit PayloadVerifier(RdmaMemBlock arena, size_t max_payload);
+  // Movable but not copyable.
+  PayloadVerifier(PayloadVerifier&& verifier) = default;
+  PayloadVerifier& operator=(PayloadVerifier&& verifier) = default;
+  PayloadVerifier(const PayloadVerifier& verifier) = delete;
+  PayloadVerifier& operator=(const PayloadVerifier& verifier) = delete;
+  ~PayloadVerifier() = default;
+
+  // The size of one slot for payloads of up to |max_payload| bytes.
+  static size_t SlotSize(size_t max_payload);
+
+  const RdmaMemBlock& arena() const { return arena_; }
+
+  // Records the arena MR registered in |mr->pd|. The PD must not be
+  // deallocated before RemoveArenaMr.
+  void AddArenaMr(ibv_mr* mr);
+  // Forgets and returns the arena MR of |pd|, to be deregistered.
+  ibv_mr* RemoveArenaMr(ibv_pd* pd);
+
+  // Stamps a |length| byte payload into a free slot and replaces |sges| with
+  // up to |max_sge| SGEs gathering it. Returns the immediate data to send, or
+  // nullopt, leaving |sges| untouched, if no slot is free.
+  absl::optional<uint32_t> StampSend(ibv_qp* qp, uint64_t wr_id, size_t length,
+                                     uint32_t max_sge,
+                                     std::vector<ibv_sge>& sges);
+  // Replaces |sges| with up to |max_sge| SGEs scattering a |length| byte
+  // payload into a free slot. Returns false, leaving |sges| untouched, if no
+  // slot is free.
+  bool PrepareRecv(ibv_qp* qp, uint64_t wr_id, size_t length, uint32_t max_sge,
+                   std::vector<ibv_sge>& sges);
+  // Builds a verified |opcode| work request from |qp| to |responder|, a QP of
+  // this client connected to |qp|. Reads and writes move |length| bytes
+  // through up to |max_sge| SGEs, which are stored in |sges|. Returns false if
+  // two slots are not free.
+  bool PrepareRdma(ibv_wr_opcode opcode, ibv_qp* qp, ibv_qp* responder,
+                   uint64_t wr_id, size_t length, uint32_t max_sge,
+                   ibv_send_wr& wr, std::vector<ibv_sge>& sges);
+  // Drops the operation of |wr_id| which failed to post.
+  void Cancel(uint64_t wr_id);
+
+  // Checks the payload of |completion| if it completes a verified operation,
+  // and frees the operation's slots when no QP can touch them anymore.
+  // Returns false if the payload is corrupted.
+  bool OnCompletion(const ibv_wc& completion);
+  // Must be called when a QP is destroyed. Frees the slots of operations whose
+  // QPs are all gone.
+  void ReleaseQp(uint32_t qp_num);
+
+  // The number of payloads checked so far.
+  uint64_t verified() const { return verified_; }
+
+ private:
+  static constexpr int kNoSlot = -1;
+
+  struct PendingOp {
+    // Unused for recvs.
+    ibv_wr_opcode opcode;
+    bool is_recv = false;
+    // The QPs which may still access the slots: the requester and, for
+    // reads, writes and atomics, the responder.
+    std::array<uint32_t, 2> qp_nums;
+    size_t num_qps = 0;
+    // The slots accessed through the requester and through the responder.
+    int local_slot = kNoSlot;
+    int remote_slot = kNoSlot;
+    uint32_t length = 0;
+    // The seed of the stamped pattern, and its checksum.
+    uint64_t seed = 0;
+    uint32_t checksum = 0;
+    // For atomics, the value of the target before and after the operation.
+    uint64_t original = 0;
+    uint64_t expected = 0;
+  };
+
+  absl::optional<int> AllocateSlot();
+  uint8_t* SlotAddress(int slot) const;
+  ibv_mr* ArenaMr(ibv_pd* pd) const;
+  // Splits the |length| bytes at the start of |slot| into up to |max_sge|
+  // adjacent SGEs.
+  std::vector<ibv_sge> SlotSges(int slot, size_t length, uint32_t max_sge,
+                                ibv_mr* mr);
+  bool Verify(uint64_t wr_id, const PendingOp& op, const ibv_wc& completion);
+  void FreeSlots(const PendingOp& op);
+
+  RdmaMemBlock arena_;
+  size_t slot_size_;
+  std::vector<int> free_slots_;
+  size_t recv_slots_ = 0;
+  absl::flat_hash_map<ibv_pd*, ibv_mr*> arena_mrs_;
+  absl::flat_hash_map<uint64_t, PendingOp> pending_;
+  uint64_t verified_ = 0;
+  absl::BitGen bitgen_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_PAYLOAD_VERIFIER_H_
@@ -18,24 +18,24 @@
 
 #include <sched.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cstddef>
 #include <cstdint>
-#include <cstring>
-#include <deque>
 #include <memory>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "glog/logging.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/numeric/bits.h"
 #include "absl/random/distributions.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
-#include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
@@ -43,28 +43,54 @@
 #include "infiniband/verbs.h"
 #include "public/introspection.h"
 #include "public/map_util.h"
+#include "public/page_size.h"
 #include "public/rdma_memblock.h"
 #include "public/status_matchers.h"
 #include "public/verbs_helper_suite.h"
 #include "public/verbs_util.h"
 #include "random_walk/internal/bind_ops_tracker.h"
+#include "random_walk/internal/bounded_mpsc_queue.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/ibv_resource_manager.h"
 #include "random_walk/internal/invalidate_ops_tracker.h"
 #include "random_walk/internal/logging.h"
+#include "random_walk/internal/payload_verifier.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/sampling.h"
 #include "random_walk/internal/types.h"
 #include "random_walk/internal/update_dispatcher_interface.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
 
+namespace {
+
+// While bootstrapping, every client broadcasts an AddRKey for each of its
+// minimum MRs, all at once and before its peers start to walk. Leaves room
+// for twice that from every peer so the burst never waits on a full queue.
+size_t InboundQueueCapacity(const MinimumObjects& minimum_objects,
+                            size_t num_clients) {
+  size_t peers = num_clients > 0 ? num_clients - 1 : 0;
+  return absl::bit_ceil(std::max<size_t>(
+      RandomWalkClient::kMaxOustandingUpdates,
+      2 * peers * minimum_objects.mr()));
+}
+
+}  // namespace
+
 RandomWalkClient::RandomWalkClient(ClientId client_id,
-                                   const ActionWeights& action_weights)
+                                   const RandomWalkConfig& config,
+                                   size_t num_clients)
     : log_(kLogSize),
       id_(client_id),
-      action_sampler_([action_weights]() -> ActionWeights {
+      inbound_updates_(
+          InboundQueueCapacity(config.minimum_objects(), num_clients)),
+      action_weights_(config.action_weights()),
+      minimum_objects_(config.minimum_objects()),
+      step_interval_(absl::Microseconds(config.step_interval_us())),
+      sampler_(config.memory_envelope()),
+      action_sampler_([&action_weights = config.action_weights()]() {
         if (Introspection().SupportsType2()) {
           return action_weights;
         } else {
@@ -77,8 +103,23 @@ RandomWalkClient::RandomWalkClient(ClientId client_id,
           return new_weights;
         }
       }()) {
-  memory_ = ibv_.AllocBuffer(RandomWalkSampler::kGroundMemoryPages);
-  memset(memory_.data(), '-', memory_.size());
+  // The buffer comes back filled with '-', so a multi-GiB ground memory is
+  // only touched once.
+  if (config.memory_envelope().use_hugepages()) {
+    memory_ = ibv_.AllocAlignedBufferByBytes(sampler_.ground_memory_size(),
+                                             kHugepageSize,
+                                             /*huge_page=*/true);
+  } else {
+    memory_ = ibv_.AllocAlignedBufferByBytes(sampler_.ground_memory_size());
+  }
+  if (config.verify_payloads()) {
+    size_t max_payload = std::max(sampler_.max_op_size(),
+                                  sampler_.rc_send_recv_buffer_size());
+    verifier_ = std::make_unique<PayloadVerifier>(
+        ibv_.AllocAlignedBufferByBytes(PayloadVerifier::kSlots *
+                                       PayloadVerifier::SlotSize(max_payload)),
+        max_payload);
+  }
   context_ = ibv_.OpenDevice().value();
   CHECK(context_);  // Crash ok
   port_gid_ = ibv_.GetLocalPortGid(context_);
@@ -97,20 +138,20 @@ void RandomWalkClient::RegisterUpdateDispatcher(
   dispatcher_ = dispatcher;
 }
 
-void RandomWalkClient::PushInboundUpdate(const ClientUpdate& update) {
-  absl::MutexLock guard(&mtx_in_updates_);
-  CHECK_LT(inbound_updates_.size(), kMaxOustandingUpdates)  // Crash ok
-      << "Too many outstanding inbound updates.";
-  inbound_updates_.push_back(update);
+void RandomWalkClient::PushInboundUpdate(ClientUpdate update) {
+  bool pushed = inbound_updates_.Push(std::move(update), kInboundUpdateTimeout);
+  CHECK(pushed) << "Too many outstanding inbound updates.";  // Crash ok
+}
+
+bool RandomWalkClient::TryPushInboundUpdate(ClientUpdate& update) {
+  return inbound_updates_.TryPush(update);
 }
 
 void RandomWalkClient::Run(absl::Duration duration) {
   size_t step_count = 0;
-  absl::Time start = absl::Now();
-  absl::Time finish = start + duration;
-
   BootstrapRandomWalk();
   absl::SleepFor(absl::Milliseconds(10));
+  absl::Time finish = absl::Now() + duration;
   while (absl::Now() < finish) {
     absl::Status result = RandomWalk();
     if (!result.ok()) {
@@ -146,6 +187,10 @@ void RandomWalkClient::Run(size_t steps) {
 }
 
 void RandomWalkClient::BootstrapRandomWalk() {
+  if (bootstrapped_) {
+    return;
+  }
+  bootstrapped_ = true;
   for (size_t i = 0; i < minimum_objects_.cq(); ++i) {
     CHECK_OK(DoAction(Action::CREATE_CQ));  // Crash ok
   }
@@ -169,7 +214,7 @@ absl::Status RandomWalkClient::RandomWalk() {
   FlushInboundUpdateQueue();
   RETURN_IF_ERROR(DoRandomAction());
   sched_yield();
-  absl::SleepFor(absl::Milliseconds(2));
+  absl::SleepFor(step_interval_);
   FlushAllCompletionQueues();
   return absl::OkStatus();
 }
@@ -266,7 +311,7 @@ absl::Status RandomWalkClient::DoAction(Action action) {
   }
 
   sched_yield();
-  absl::SleepFor(absl::Milliseconds(2));
+  absl::SleepFor(step_interval_);
 
   FlushAllCompletionQueues();
 
@@ -277,75 +322,75 @@ void RandomWalkClient::PrintLogs() const { log_.PrintLogs(); }
 
 void RandomWalkClient::PrintStats() const {
   LOG(INFO) << "Statistics:";
-  LOG(INFO) << "commands = " << stats_.commands;
-  LOG(INFO) << "create_cq = " << stats_.create_cq;
-  LOG(INFO) << "destroy_cq = " << stats_.destroy_cq;
-  LOG(INFO) << "alloc_pd = " << stats_.alloc_pd;
-  LOG(INFO) << "dealloc_pd = " << stats_.dealloc_pd;
-  LOG(INFO) << "reg_mr = " << stats_.reg_mr;
-  LOG(INFO) << "dererg_mr = " << stats_.dereg_mr;
-  LOG(INFO) << "alloc_type_1_mw = " << stats_.alloc_type_1_mw;
-  LOG(INFO) << "alloc_type_2_mw = " << stats_.alloc_type_2_mw;
-  LOG(INFO) << "dealloc_type_1_mw = " << stats_.dealloc_type_1_mw;
-  LOG(INFO) << "dealloc_type_2_mw = " << stats_.dealloc_type_2_mw;
-  LOG(INFO) << "create_qp_pair = " << stats_.create_rc_qp_pair;
-  LOG(INFO) << "create_ud_qp = " << stats_.create_ud_qp;
-  LOG(INFO) << "modify_qp_error = " << stats_.modify_qp_error;
-  LOG(INFO) << "destroy_qp = " << stats_.destroy_qp;
-  LOG(INFO) << "create_ah = " << stats_.create_ah;
-  LOG(INFO) << "destroy_ah = " << stats_.destroy_ah;
-  LOG(INFO) << "send = " << stats_.send;
-  LOG(INFO) << "recv = " << stats_.recv;
-  LOG(INFO) << "read = " << stats_.read;
-  LOG(INFO) << "write = " << stats_.write;
-  LOG(INFO) << "fetch_add = " << stats_.fetch_add;
-  LOG(INFO) << "comp_swap = " << stats_.comp_swap;
-  LOG(INFO) << "completion_statuses: ";
-  LOG(INFO) << "total completions = " << stats_.completions;
-  LOG(INFO) << "IBV_WC_SUCCESS = "
-            << stats_.completion_statuses[IBV_WC_SUCCESS];
-  LOG(INFO) << "IBV_WC_LOC_LEN_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_LEN_ERR];
-  LOG(INFO) << "IBV_WC_LOC_QP_OP_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_QP_OP_ERR];
-  LOG(INFO) << "IBV_WC_LOC_EEC_OP_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_EEC_OP_ERR];
-  LOG(INFO) << "IBV_WC_LOC_PROT_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_PROT_ERR];
-  LOG(INFO) << "IBV_WC_WR_FLUSH_ERR = "
-            << stats_.completion_statuses[IBV_WC_WR_FLUSH_ERR];
-  LOG(INFO) << "IBV_WC_MW_BIND_ERR = "
-            << stats_.completion_statuses[IBV_WC_MW_BIND_ERR];
-  LOG(INFO) << "IBV_WC_BAD_RESP_ERR = "
-            << stats_.completion_statuses[IBV_WC_BAD_RESP_ERR];
-  LOG(INFO) << "IBV_WC_LOC_ACCESS_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_ACCESS_ERR];
-  LOG(INFO) << "IBV_WC_REM_INV_REQ_ERR = "
-            << stats_.completion_statuses[IBV_WC_REM_INV_REQ_ERR];
-  LOG(INFO) << "IBV_WC_REM_ACCESS_ERR = "
-            << stats_.completion_statuses[IBV_WC_REM_ACCESS_ERR];
-  LOG(INFO) << "IBV_WC_REM_OP_ERR = "
-            << stats_.completion_statuses[IBV_WC_REM_OP_ERR];
-  LOG(INFO) << "IBV_WC_RETRY_EXC_ERR = "
-            << stats_.completion_statuses[IBV_WC_RETRY_EXC_ERR];
-  LOG(INFO) << "IBV_WC_RNR_RETRY_EXC_ERR = "
-            << stats_.completion_statuses[IBV_WC_RNR_RETRY_EXC_ERR];
-  LOG(INFO) << "IBV_WC_LOC_RDD_VIOL_ERR = "
-            << stats_.completion_statuses[IBV_WC_LOC_RDD_VIOL_ERR];
-  LOG(INFO) << "IBV_WC_REM_INV_RD_REQ_ERR = "
-            << stats_.completion_statuses[IBV_WC_REM_INV_RD_REQ_ERR];
-  LOG(INFO) << "IBV_WC_REM_ABORT_ERR = "
-            << stats_.completion_statuses[IBV_WC_REM_ABORT_ERR];
-  LOG(INFO) << "IBV_WC_INV_EECN_ERR = "
-            << stats_.completion_statuses[IBV_WC_INV_EECN_ERR];
-  LOG(INFO) << "IBV_WC_INV_EEC_STATE_ERR = "
-            << stats_.completion_statuses[IBV_WC_INV_EEC_STATE_ERR];
-  LOG(INFO) << "IBV_WC_FATAL_ERR = "
-            << stats_.completion_statuses[IBV_WC_FATAL_ERR];
-  LOG(INFO) << "IBV_WC_RESP_TIMEOUT_ERR = "
-            << stats_.completion_statuses[IBV_WC_RESP_TIMEOUT_ERR];
-  LOG(INFO) << "IBV_WC_GENERAL_ERR = "
-            << stats_.completion_statuses[IBV_WC_GENERAL_ERR];
+  for (const auto& [name, value] : StatsEntries()) {
+    LOG(INFO) << name << " = " << value;
+  }
+}
+
+std::vector<std::pair<std::string, size_t>> RandomWalkClient::StatsEntries()
+    const {
+  // Indexed by ibv_wc_status.
+  static constexpr std::array<const char*, 22> kCompletionStatusNames = {
+      "IBV_WC_SUCCESS",
+      "IBV_WC_LOC_LEN_ERR",
+      "IBV_WC_LOC_QP_OP_ERR",
+      "IBV_WC_LOC_EEC_OP_ERR",
+      "IBV_WC_LOC_PROT_ERR",
+      "IBV_WC_WR_FLUSH_ERR",
+      "IBV_WC_MW_BIND_ERR",
+      "IBV_WC_BAD_RESP_ERR",
+      "IBV_WC_LOC_ACCESS_ERR",
+      "IBV_WC_REM_INV_REQ_ERR",
+      "IBV_WC_REM_ACCESS_ERR",
+      "IBV_WC_REM_OP_ERR",
+      "IBV_WC_RETRY_EXC_ERR",
+      "IBV_WC_RNR_RETRY_EXC_ERR",
+      "IBV_WC_LOC_RDD_VIOL_ERR",
+      "IBV_WC_REM_INV_RD_REQ_ERR",
+      "IBV_WC_REM_ABORT_ERR",
+      "IBV_WC_INV_EECN_ERR",
+      "IBV_WC_INV_EEC_STATE_ERR",
+      "IBV_WC_FATAL_ERR",
+      "IBV_WC_RESP_TIMEOUT_ERR",
+      "IBV_WC_GENERAL_ERR"};
+  std::vector<std::pair<std::string, size_t>> entries = {
+      {"commands", stats_.commands},
+      {"create_cq", stats_.create_cq},
+      {"destroy_cq", stats_.destroy_cq},
+      {"alloc_pd", stats_.alloc_pd},
+      {"dealloc_pd", stats_.dealloc_pd},
+      {"reg_mr", stats_.reg_mr},
+      {"dereg_mr", stats_.dereg_mr},
+      {"alloc_type_1_mw", stats_.alloc_type_1_mw},
+      {"alloc_type_2_mw", stats_.alloc_type_2_mw},
+      {"dealloc_type_1_mw", stats_.dealloc_type_1_mw},
+      {"dealloc_type_2_mw", stats_.dealloc_type_2_mw},
+      {"create_qp_pair", stats_.create_rc_qp_pair},
+      {"create_ud_qp", stats_.create_ud_qp},
+      {"modify_qp_error", stats_.modify_qp_error},
+      {"destroy_qp", stats_.destroy_qp},
+      {"create_ah", stats_.create_ah},
+      {"destroy_ah", stats_.destroy_ah},
+      {"send", stats_.send},
+      {"recv", stats_.recv},
+      {"read", stats_.read},
+      {"write", stats_.write},
+      {"fetch_add", stats_.fetch_add},
+      {"comp_swap", stats_.comp_swap},
+      {"verified_payloads", verifier_ ? verifier_->verified() : 0},
+      {"payload_mismatches", stats_.payload_mismatches},
+      {"total completions", stats_.completions}};
+  for (size_t status = 0; status < kCompletionStatusNames.size(); ++status) {
+    entries.emplace_back(kCompletionStatusNames[status],
+                         stats_.completion_statuses[status]);
+  }
+  return entries;
+}
+
+void RandomWalkClient::ExportStats(ClientStats& stats) const {
+  for (const auto& [name, value] : StatsEntries()) {
+    (*stats.mutable_counters())[name] += value;
+  }
 }
 
 // ---------------------------- Private -----------------------------------//
@@ -536,6 +581,9 @@ absl::StatusCode RandomWalkClient::DestroyQp(ibv_qp* qp) {
   }
   resource_manager_.EraseQp(qp_num, qp_type);
   ++stats_.destroy_qp;
+  if (verifier_) {
+    verifier_->ReleaseQp(qp_num);
+  }
   PdInfo* pd_info = resource_manager_.GetMutablePdInfo(pd);
   DCHECK(pd_info);
   map_util::CheckPresentAndErase(pd_info->rc_qps, qp);
@@ -557,7 +605,10 @@ absl::StatusCode RandomWalkClient::DestroyQp(ibv_qp* qp) {
 }
 
 absl::StatusCode RandomWalkClient::TryDoRandomAction() {
-  Action action = action_sampler_.RandomAction();
+  Action action = action_sampler_.RandomAction(
+      resource_manager_.ViableActions(minimum_objects_));
+  absl::Time start = absl::Now();
+  uint64_t first_wr_id = next_wr_id_;
   absl::StatusCode result;
   switch (action) {
     case Action::CREATE_CQ: {
@@ -665,6 +716,10 @@ absl::StatusCode RandomWalkClient::TryDoRandomAction() {
       result = absl::StatusCode::kInternal;
     }
   }
+  if (result == absl::StatusCode::kOk) {
+    metrics_.RecordAction(action, start, absl::Now() - start, first_wr_id,
+                          next_wr_id_);
+  }
   return result;
 }
 
@@ -716,6 +771,18 @@ absl::StatusCode RandomWalkClient::TryAllocPd() {
   }
   ++stats_.alloc_pd;
   resource_manager_.InsertPd(pd);
+  if (verifier_) {
+    // No MW is ever bound to the arena.
+    ibv_mr* arena_mr = ibv_.RegMr(
+        pd, verifier_->arena(),
+        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+            IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC);
+    if (!arena_mr) {
+      LOG(DFATAL) << "Failed to register the payload verification arena.";
+      return absl::StatusCode::kInternal;
+    }
+    verifier_->AddArenaMr(arena_mr);
+  }
 
   return absl::StatusCode::kOk;
 }
@@ -732,6 +799,14 @@ absl::StatusCode RandomWalkClient::TryDeallocPd() {
   ibv_pd* pd = pd_sample.value();
   DCHECK(pd);
 
+  if (verifier_) {
+    int result = ibv_.DeregMr(verifier_->RemoveArenaMr(pd));
+    if (result) {
+      LOG(DFATAL) << "Failed to deregister the payload verification arena ("
+                  << result << ").";
+      return absl::StatusCode::kInternal;
+    }
+  }
   int result = ibv_.DeallocPd(pd);
   log_.PushDeallocPd(pd);
   if (result) {
@@ -778,7 +853,7 @@ absl::StatusCode RandomWalkClient::TryRegMr() {
 }
 
 absl::StatusCode RandomWalkClient::TryDeregMr() {
-  if (resource_manager_.MrCount() << minimum_objects_.mr()) {
+  if (resource_manager_.MrCount() <= minimum_objects_.mr()) {
     return absl::StatusCode::kFailedPrecondition;
   }
   auto mr_sample = resource_manager_.GetRandomMrNoReference();
@@ -1192,8 +1267,15 @@ absl::StatusCode RandomWalkClient::TrySend() {
   for (const auto& buffer : buffers) {
     sges.push_back(verbs_util::CreateSge(buffer, mr));
   }
-  ibv_send_wr send =
-      verbs_util::CreateSendWr(next_wr_id_++, sges.data(), sges.size());
+  uint64_t wr_id = next_wr_id_++;
+  absl::optional<uint32_t> checksum_imm;
+  if (verifier_ && qp_type == IBV_QPT_RC &&
+      absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    checksum_imm =
+        verifier_->StampSend(qp, wr_id, sampler_.rc_send_recv_buffer_size(),
+                             max_send_sge, sges);
+  }
+  ibv_send_wr send = verbs_util::CreateSendWr(wr_id, sges.data(), sges.size());
   if (qp_type == IBV_QPT_UD) {
     auto ah_sample = resource_manager_.GetRandomAh(qp->pd);
     if (!ah_sample.has_value()) {
@@ -1212,7 +1294,13 @@ absl::StatusCode RandomWalkClient::TrySend() {
     send.wr.ud.remote_qpn = remote_ud.qp_num;
     send.wr.ud.remote_qkey = remote_ud.q_key;
   }
-  if (absl::Bernoulli(bitgen_, kSendImmProbability)) {
+  if (checksum_imm.has_value()) {
+    send.opcode = IBV_WR_SEND_WITH_IMM;
+    send.imm_data = checksum_imm.value();
+  } else if ((!verifier_ || qp_type == IBV_QPT_UD) &&
+             absl::Bernoulli(bitgen_, kSendImmProbability)) {
+    // With verification on, immediate data on RC QPs is reserved for
+    // checksums.
     send.opcode = IBV_WR_SEND_WITH_IMM;
     send.imm_data = absl::Uniform<uint32_t>(bitgen_);
   }
@@ -1220,6 +1308,9 @@ absl::StatusCode RandomWalkClient::TrySend() {
   int result = ibv_post_send(qp, &send, &bad_wr);
   log_.PushSend(send);
   if (result) {
+    if (verifier_) {
+      verifier_->Cancel(wr_id);
+    }
     LOG(DFATAL) << "Failed to post to send queue (" << result << ").";
     return absl::StatusCode::kInternal;
   }
@@ -1310,12 +1401,23 @@ absl::StatusCode RandomWalkClient::TryRecv() {
 
   std::vector<ibv_sge> sges;
   sges.reserve(buffers.size());
-  ibv_recv_wr recv =
-      verbs_util::CreateRecvWr(next_wr_id_++, sges.data(), sges.size());
+  for (const auto& buffer : buffers) {
+    sges.push_back(verbs_util::CreateSge(buffer, mr));
+  }
+  uint64_t wr_id = next_wr_id_++;
+  if (verifier_ && qp_type == IBV_QPT_RC &&
+      absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    verifier_->PrepareRecv(qp, wr_id, sampler_.rc_send_recv_buffer_size(),
+                           max_recv_sge, sges);
+  }
+  ibv_recv_wr recv = verbs_util::CreateRecvWr(wr_id, sges.data(), sges.size());
   ibv_recv_wr* bad_wr = nullptr;
   int result = ibv_post_recv(qp, &recv, &bad_wr);
   log_.PushRecv(recv);
   if (result) {
+    if (verifier_) {
+      verifier_->Cancel(wr_id);
+    }
     LOG(DFATAL) << "Failed to post to send queue (" << result << ").";
     return absl::StatusCode::kInternal;
   }
@@ -1325,6 +1427,12 @@ absl::StatusCode RandomWalkClient::TryRecv() {
 }
 
 absl::StatusCode RandomWalkClient::TryRead() {
+  if (verifier_ && absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    absl::StatusCode result = TryVerifiedRdma(IBV_WR_RDMA_READ);
+    if (result != absl::StatusCode::kFailedPrecondition) {
+      return result;
+    }
+  }
   auto memory_opt = resource_manager_.GetRandomRdmaMemory();
   if (!memory_opt) {
     return absl::StatusCode::kFailedPrecondition;
@@ -1374,6 +1482,12 @@ absl::StatusCode RandomWalkClient::TryRead() {
 }
 
 absl::StatusCode RandomWalkClient::TryWrite() {
+  if (verifier_ && absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    absl::StatusCode result = TryVerifiedRdma(IBV_WR_RDMA_WRITE);
+    if (result != absl::StatusCode::kFailedPrecondition) {
+      return result;
+    }
+  }
   auto memory_opt = resource_manager_.GetRandomRdmaMemory();
   if (!memory_opt) {
     return absl::StatusCode::kFailedPrecondition;
@@ -1423,6 +1537,12 @@ absl::StatusCode RandomWalkClient::TryWrite() {
 }
 
 absl::StatusCode RandomWalkClient::TryFetchAdd() {
+  if (verifier_ && absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    absl::StatusCode result = TryVerifiedRdma(IBV_WR_ATOMIC_FETCH_AND_ADD);
+    if (result != absl::StatusCode::kFailedPrecondition) {
+      return result;
+    }
+  }
   auto memory_opt = resource_manager_.GetRandomRdmaMemory();
   if (!memory_opt) {
     return absl::StatusCode::kFailedPrecondition;
@@ -1468,6 +1588,12 @@ absl::StatusCode RandomWalkClient::TryFetchAdd() {
 }
 
 absl::StatusCode RandomWalkClient::TryCompSwap() {
+  if (verifier_ && absl::Bernoulli(bitgen_, kVerifiedOpProbability)) {
+    absl::StatusCode result = TryVerifiedRdma(IBV_WR_ATOMIC_CMP_AND_SWP);
+    if (result != absl::StatusCode::kFailedPrecondition) {
+      return result;
+    }
+  }
   auto memory_opt = resource_manager_.GetRandomRdmaMemory();
   if (!memory_opt) {
     return absl::StatusCode::kFailedPrecondition;
@@ -1513,25 +1639,94 @@ absl::StatusCode RandomWalkClient::TryCompSwap() {
   return absl::StatusCode::kOk;
 }
 
-void RandomWalkClient::PushOutboundUpdate(ClientUpdate& update) {
-  dispatcher_->DispatchUpdate(update);
+absl::StatusCode RandomWalkClient::TryVerifiedRdma(ibv_wr_opcode opcode) {
+  auto qp_sample = resource_manager_.GetRandomQpForRdma(id_);
+  if (!qp_sample.has_value()) {
+    return absl::StatusCode::kFailedPrecondition;
+  }
+  ibv_qp* qp = qp_sample.value();
+  DCHECK(qp);
+  RcQpInfo qp_info = resource_manager_.GetRcQpInfo(qp);
+  RcQpInfo* responder_info =
+      resource_manager_.GetMutableRcQpInfo(qp_info.remote_qp.qp_num);
+  if (!responder_info) {
+    return absl::StatusCode::kFailedPrecondition;
+  }
+  uint64_t wr_id = next_wr_id_++;
+  ibv_send_wr wr;
+  std::vector<ibv_sge> sges;
+  if (!verifier_->PrepareRdma(opcode, qp, responder_info->qp, wr_id,
+                              sampler_.RandomOpSize(),
+                              qp_info.cap.max_send_sge, wr, sges)) {
+    return absl::StatusCode::kFailedPrecondition;
+  }
+  ibv_send_wr* bad_wr = nullptr;
+  int result = ibv_post_send(qp, &wr, &bad_wr);
+  switch (opcode) {
+    case IBV_WR_RDMA_READ: {
+      log_.PushRead(wr);
+      break;
+    }
+    case IBV_WR_RDMA_WRITE: {
+      log_.PushWrite(wr);
+      break;
+    }
+    case IBV_WR_ATOMIC_FETCH_AND_ADD: {
+      log_.PushFetchAdd(wr);
+      break;
+    }
+    default: {
+      log_.PushCompSwap(wr);
+      break;
+    }
+  }
+  if (result) {
+    verifier_->Cancel(wr_id);
+    LOG(DFATAL) << "Failed to post to send queue (" << result << ").";
+    return absl::StatusCode::kInternal;
+  }
+  switch (opcode) {
+    case IBV_WR_RDMA_READ: {
+      ++stats_.read;
+      break;
+    }
+    case IBV_WR_RDMA_WRITE: {
+      ++stats_.write;
+      break;
+    }
+    case IBV_WR_ATOMIC_FETCH_AND_ADD: {
+      ++stats_.fetch_add;
+      break;
+    }
+    default: {
+      ++stats_.comp_swap;
+      break;
+    }
+  }
+
+  return absl::StatusCode::kOk;
 }
 
-absl::optional<ClientUpdate> RandomWalkClient::PullInboundUpdate() {
-  absl::MutexLock guard(&mtx_in_updates_);
-  if (inbound_updates_.empty()) {
-    return absl::nullopt;
+void RandomWalkClient::PushOutboundUpdate(ClientUpdate& update) {
+  // Updates for ourselves are applied right away rather than queued: the
+  // walker thread is the only consumer of its inbound queue, so pushing into
+  // it while it is full would wait on itself. Dispatchers skip the sender of
+  // a broadcast.
+  if (!update.has_destination_id() || update.destination_id() == id_) {
+    ProcessUpdate(update);
+    if (update.has_destination_id()) {
+      return;
+    }
   }
-  ClientUpdate update = inbound_updates_.front();
-  inbound_updates_.pop_front();
-  return update;
+  dispatcher_->DispatchUpdate(std::move(update));
 }
 
 void RandomWalkClient::FlushInboundUpdateQueue() {
-  for (auto maybe_update = PullInboundUpdate(); maybe_update.has_value();
-       maybe_update = PullInboundUpdate()) {
-    ProcessUpdate(maybe_update.value());
-  }
+  // Only drain what is queued right now. Processing an update can queue new
+  // updates from other clients, which are picked up by the next flush.
+  inbound_updates_.Drain(
+      [this](ClientUpdate update) { ProcessUpdate(update); },
+      inbound_updates_.capacity());
 }
 
 void RandomWalkClient::ProcessUpdate(const ClientUpdate& update) {
@@ -1654,6 +1849,10 @@ void RandomWalkClient::ProcessCompletion(ibv_wc completion) {
   CHECK_LT(completion.status, stats_.completion_statuses.size());  // Crash ok
   ++stats_.completions;
   ++stats_.completion_statuses[completion.status];
+  metrics_.RecordCompletion(completion, absl::Now());
+  if (verifier_ && !verifier_->OnCompletion(completion)) {
+    ++stats_.payload_mismatches;
+  }
   if (completion.status != IBV_WC_SUCCESS) {
     return;
   }
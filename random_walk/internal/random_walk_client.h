@@ -20,14 +20,14 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
-#include <deque>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
-#include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/random/random.h"
 #include "absl/status/status.h"
-#include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "infiniband/verbs.h"
@@ -36,16 +36,20 @@
 #include "public/verbs_helper_suite.h"
 #include "public/verbs_util.h"
 #include "random_walk/internal/bind_ops_tracker.h"
+#include "random_walk/internal/bounded_mpsc_queue.h"
 #include "random_walk/internal/client_update_service.grpc.pb.h"
+#include "random_walk/internal/client_metrics.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/ibv_resource_manager.h"
 #include "random_walk/internal/inbound_update_interface.h"
 #include "random_walk/internal/invalidate_ops_tracker.h"
 #include "random_walk/internal/logging.h"
+#include "random_walk/internal/payload_verifier.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/sampling.h"
 #include "random_walk/internal/types.h"
 #include "random_walk/internal/update_dispatcher_interface.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
@@ -64,8 +68,16 @@ class RandomWalkClient : public InboundUpdateInterface {
   static constexpr double kMessagingUdProbability = 0.3;
   // Controls the probability that a send op will carry immediate data.
   static constexpr double kSendImmProbability = 0.2;
-  // The capacity of the queues storing oustanding inbound/outbound updates.
-  static constexpr size_t kMaxOustandingUpdates = 50;
+  // Controls the probability that a RC send/recv, read, write or atomic is
+  // verified when payload verification is on.
+  static constexpr double kVerifiedOpProbability = 0.5;
+  // The least capacity of the queues storing oustanding inbound/outbound
+  // updates. Must be a power of two. The inbound queue grows with the updates
+  // its peers broadcast while bootstrapping, see BootstrapRandomWalk().
+  static constexpr size_t kMaxOustandingUpdates = 64;
+  // How long a remote client pushing an inbound update waits for space in a
+  // full inbound queue before the walk is aborted.
+  static constexpr absl::Duration kInboundUpdateTimeout = absl::Seconds(10);
   // The minimum WR capacity of a QP.
   static constexpr int kMinQpWr = 20;
   // The minimum CQE capacity of a CQ.
@@ -75,8 +87,12 @@ class RandomWalkClient : public InboundUpdateInterface {
 
   // Initializes the client with necessary attributes.
   // - client_id: the id of client, assigned by the test orchestrator.
-  // - action_weights: weight for each action in random walk.
-  RandomWalkClient(ClientId client_id, const ActionWeights& action_weights);
+  // - config: action weights, minimum objects, memory envelope and pacing of
+  //   the random walk.
+  // - num_clients: the number of clients in the random walk, this one
+  //   included.
+  RandomWalkClient(ClientId client_id, const RandomWalkConfig& config,
+                   size_t num_clients);
   // Movable but not copyable.
   RandomWalkClient(RandomWalkClient&& client) = default;
   RandomWalkClient& operator=(RandomWalkClient&& client) = default;
@@ -91,6 +107,9 @@ class RandomWalkClient : public InboundUpdateInterface {
   // will be able to (randomly) interact with the new client in its random walk.
   void AddRemoteClient(ClientId client_id, const ibv_gid& gid);
 
+  // Returns the id of the RandomWalkClient.
+  ClientId id() const { return id_; }
+
   // Returns the gid the RandomWalkClient is running on.
   ibv_gid GetGid() const;
 
@@ -99,8 +118,20 @@ class RandomWalkClient : public InboundUpdateInterface {
   void RegisterUpdateDispatcher(
       std::shared_ptr<UpdateDispatcherInterface> dispatcher);
 
-  // Implements InboundUpdateInterface.
-  void PushInboundUpdate(const ClientUpdate& update) override;
+  // Implements InboundUpdateInterface. Blocks while the inbound queue is full.
+  void PushInboundUpdate(ClientUpdate update) override;
+  bool TryPushInboundUpdate(ClientUpdate& update) override;
+
+  // Performs some initial commands to bootstrap the random walk. This mostly
+  // includes creating the minimum number of MRs, MWs, PDs to start the
+  // random walk. Only the first call has any effect. Run() calls it, so callers
+  // only need it to keep the bootstrap out of the measured run window.
+  void BootstrapRandomWalk();
+
+  // Flushes the inbound_updates_ queue, process all ClientUpdate flushed. A
+  // bootstrapped client waiting to Run() calls it so its peers' updates do not
+  // back up.
+  void FlushInboundUpdateQueue();
 
   // Run the client for a fixed amount of time.
   void Run(absl::Duration duration);
@@ -108,6 +139,14 @@ class RandomWalkClient : public InboundUpdateInterface {
   // Run the client for a fixed amount of random walk steps.
   void Run(size_t steps);
 
+  // Returns the live metrics of the client. Safe to read from any thread while
+  // the client runs.
+  const ClientMetrics& metrics() const { return metrics_; }
+
+  // Adds the client's running statistics to |stats|, keyed by the names
+  // PrintStats() uses, so that statistics of many clients can be summed.
+  void ExportStats(ClientStats& stats) const;
+
  private:
   using CqInfo = IbvResourceManager::CqInfo;
   using PdInfo = IbvResourceManager::PdInfo;
@@ -149,16 +188,13 @@ class RandomWalkClient : public InboundUpdateInterface {
     size_t write = 0;
     size_t fetch_add = 0;
     size_t comp_swap = 0;
+    size_t payload_mismatches = 0;
     size_t completions = 0;
     std::array<size_t, 22> completion_statuses = {
         0};  // There are a total of 22 completion
              // statuses in ibverbs, from 0 to 21.
   };
 
-  // Performs some initial commands to bootstrap the random walk. This mostly
-  // includes creating the minimum number of MRs, MWs, PDs to start the
-  // random walk.
-  void BootstrapRandomWalk();
   // Does one step of random walk. This includes:
   // 1. Fetch inbound ClientUpdate from any remote clients.
   // 2. Carry out one random but via Action (see type.h). See each corresponding
@@ -177,6 +213,8 @@ class RandomWalkClient : public InboundUpdateInterface {
   // Prints via LOG(INFO) the running statistics of the client, such as number
   // of (each type of) commands issued.
   void PrintStats() const;
+  // Returns the running statistics as (name, value) pairs in print order.
+  std::vector<std::pair<std::string, size_t>> StatsEntries() const;
 
   // Helper function to create a RC QP.
   ibv_qp* CreateLocalRcQp(ClientId peer_id, ibv_pd* pd);
@@ -240,14 +278,14 @@ class RandomWalkClient : public InboundUpdateInterface {
   absl::StatusCode TryWrite();
   absl::StatusCode TryFetchAdd();
   absl::StatusCode TryCompSwap();
+  // Tries a verified read, write or atomic on a RC QP connected back to this
+  // client. See PayloadVerifier.
+  absl::StatusCode TryVerifiedRdma(ibv_wr_opcode opcode);
 
-  // Pushes an ClientUpdate to outbound_updates queue.
+  // Pushes an ClientUpdate to outbound_updates queue. |update| is moved out.
+  // Updates for this client, including its own broadcasts, are processed
+  // right away.
   void PushOutboundUpdate(ClientUpdate& update);
-  // Pulls an inbound ClientUpdate from the inbound_updates_ queue. Returns
-  // nullopt if the queue is empty.
-  absl::optional<ClientUpdate> PullInboundUpdate();
-  // Flushes the inbound_updates_ queue, process all ClientUpdate flushed.
-  void FlushInboundUpdateQueue();
   // Processes a connection update request from remote.
   void ProcessUpdate(const ClientUpdate& update);
   // Polls completion entries and process them from all completion queue until
@@ -272,6 +310,7 @@ class RandomWalkClient : public InboundUpdateInterface {
   ibv_context* context_;
   verbs_util::PortGid port_gid_;
   uint64_t next_wr_id_ = 0;
+  bool bootstrapped_ = false;
 
   // Resource manager for MW, MR, and QP.
   IbvResourceManager resource_manager_;
@@ -284,19 +323,21 @@ class RandomWalkClient : public InboundUpdateInterface {
   std::shared_ptr<UpdateDispatcherInterface> dispatcher_ = nullptr;
 
   // Remote updates received from other clients.
-  std::deque<ClientUpdate> inbound_updates_ ABSL_GUARDED_BY(mtx_in_updates_);
+  BoundedMpscQueue<ClientUpdate> inbound_updates_;
 
   // Related to sampling (actions and its parameters) in the random walker.
   const ActionWeights action_weights_;
   const MinimumObjects minimum_objects_;
+  // Time slept after each step.
+  const absl::Duration step_interval_;
   RandomWalkSampler sampler_;
   ActionSampler action_sampler_;
+  // Null unless payload verification is on.
+  std::unique_ptr<PayloadVerifier> verifier_;
 
   // Statistics.
   Stats stats_;
-
-  // Mutexes.
-  mutable absl::Mutex mtx_in_updates_;
+  ClientMetrics metrics_;
 
   // absl::BitGen for random number generators.
   mutable absl::BitGen bitgen_;
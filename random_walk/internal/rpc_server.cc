@@ -19,12 +19,14 @@
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <utility>
 
 #include "glog/logging.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/synchronization/mutex.h"
 #include "grpcpp/server_context.h"
 #include "grpcpp/support/status.h"
+#include "grpcpp/support/sync_stream.h"
 #include "random_walk/internal/client_update_service.grpc.pb.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/inbound_update_interface.h"
@@ -40,16 +42,44 @@ RpcServer::RpcServer(std::shared_ptr<InboundUpdateInterface> client)
 grpc::Status RpcServer::Update(grpc::ServerContext* context,
                                const OrderedUpdateRequest* request,
                                UpdateResponse* response) {
-  absl::MutexLock guard(&mutex_);
   DCHECK(client_);
-  UpdateReorderQueue& reorder_queue = reorder_queues_[request->source_id()];
-  reorder_queue.Push(request->sequence_number(), request->update());
-  for (auto maybe_update = reorder_queue.Pull(); maybe_update.has_value();
-       maybe_update = reorder_queue.Pull()) {
-    client_->PushInboundUpdate(maybe_update.value());
+  Source& source = GetSource(request->source_id());
+  absl::MutexLock guard(&source.mutex);
+  source.reorder_queue.Push(request->sequence_number(), request->update());
+  Deliver(source);
+  return ::grpc::Status::OK;
+}
+
+grpc::Status RpcServer::StreamUpdates(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<UpdateResponse, OrderedUpdateBatch>* stream) {
+  DCHECK(client_);
+  OrderedUpdateBatch batch;
+  while (stream->Read(&batch)) {
+    Source& source = GetSource(batch.source_id());
+    absl::MutexLock guard(&source.mutex);
+    source.reorder_queue.PushBatch(batch.first_sequence_number(),
+                                   *batch.mutable_updates());
+    Deliver(source);
   }
   return ::grpc::Status::OK;
 }
 
+RpcServer::Source& RpcServer::GetSource(ClientId source_id) {
+  absl::MutexLock guard(&mutex_);
+  std::unique_ptr<Source>& source = sources_[source_id];
+  if (!source) {
+    source = std::make_unique<Source>();
+  }
+  return *source;
+}
+
+void RpcServer::Deliver(Source& source) {
+  for (auto maybe_update = source.reorder_queue.Pull();
+       maybe_update.has_value(); maybe_update = source.reorder_queue.Pull()) {
+    client_->PushInboundUpdate(std::move(maybe_update).value());
+  }
+}
+
 }  // namespace random_walk
 }  // namespace rdma_unit_test
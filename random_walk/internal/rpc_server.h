@@ -24,6 +24,7 @@
 #include "absl/synchronization/mutex.h"
 #include "grpcpp/server_context.h"
 #include "grpcpp/support/status.h"
+#include "grpcpp/support/sync_stream.h"
 #include "random_walk/internal/client_update_service.grpc.pb.h"
 #include "random_walk/internal/client_update_service.pb.h"
 #include "random_walk/internal/inbound_update_interface.h"
@@ -33,7 +34,10 @@
 namespace rdma_unit_test {
 namespace random_walk {
 
-// The gRPC server class for receiving ClientUpdate.
+// The gRPC server class for receiving ClientUpdate. Updates of each source
+// are put back in order and pushed to the client under a lock of that
+// source, so a full inbound queue of the client only holds up the source
+// waiting on it.
 class RpcServer final : public ClientUpdateService::Service {
  public:
   RpcServer() = delete;
@@ -46,11 +50,27 @@ class RpcServer final : public ClientUpdateService::Service {
   ::grpc::Status Update(::grpc::ServerContext* context,
                         const OrderedUpdateRequest* request,
                         UpdateResponse* response) override;
+  ::grpc::Status StreamUpdates(
+      ::grpc::ServerContext* context,
+      ::grpc::ServerReaderWriter<UpdateResponse, OrderedUpdateBatch>* stream)
+      override;
 
  private:
-  absl::Mutex mutex_;
+  struct Source {
+    // Held while updates of the source are pushed to the client, which keeps
+    // them in order.
+    absl::Mutex mutex;
+    UpdateReorderQueue reorder_queue ABSL_GUARDED_BY(mutex);
+  };
+
+  Source& GetSource(ClientId source_id) ABSL_LOCKS_EXCLUDED(mutex_);
+  // Pushes every update of |source| which is next in order to the client.
+  void Deliver(Source& source) ABSL_EXCLUSIVE_LOCKS_REQUIRED(source.mutex);
+
   const std::shared_ptr<InboundUpdateInterface> client_;
-  absl::flat_hash_map<ClientId, UpdateReorderQueue> reorder_queues_
+  absl::Mutex mutex_;
+  // Sources are never erased, so references handed out stay valid.
+  absl::flat_hash_map<ClientId, std::unique_ptr<Source>> sources_
       ABSL_GUARDED_BY(mutex_);
 };
 
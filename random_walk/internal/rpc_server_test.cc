@@ -0,0 +1,177 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/rpc_server.h"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/server.h"
+#include "grpcpp/server_builder.h"
+#include "grpcpp/support/channel_arguments.h"
+#include "random_walk/internal/client_update_service.grpc.pb.h"
+#include "random_walk/internal/client_update_service.pb.h"
+#include "random_walk/internal/inbound_update_interface.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+// Records the (source, sequence number) pairs carried by the AddRKey updates
+// it receives as (owner_id, rkey). Updates of |blocked_source| wait for
+// Unblock().
+class FakeClient : public InboundUpdateInterface {
+ public:
+  explicit FakeClient(uint32_t blocked_source = UINT32_MAX)
+      : blocked_source_(blocked_source) {}
+
+  void PushInboundUpdate(ClientUpdate update) override {
+    if (update.add_rkey().owner_id() == blocked_source_) {
+      unblock_.WaitForNotification();
+    }
+    absl::MutexLock guard(&mutex_);
+    received_.emplace_back(update.add_rkey().owner_id(),
+                           update.add_rkey().rkey());
+  }
+
+  bool TryPushInboundUpdate(ClientUpdate& update) override {
+    PushInboundUpdate(std::move(update));
+    return true;
+  }
+
+  void Unblock() { unblock_.Notify(); }
+
+  std::vector<std::pair<uint32_t, uint32_t>> received() {
+    absl::MutexLock guard(&mutex_);
+    return received_;
+  }
+
+  // Waits until |count| updates have been received.
+  bool WaitForReceived(size_t count, absl::Duration timeout) {
+    absl::Time deadline = absl::Now() + timeout;
+    while (received().size() < count) {
+      if (absl::Now() > deadline) {
+        return false;
+      }
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+    return true;
+  }
+
+ private:
+  const uint32_t blocked_source_;
+  absl::Notification unblock_;
+  absl::Mutex mutex_;
+  std::vector<std::pair<uint32_t, uint32_t>> received_ ABSL_GUARDED_BY(mutex_);
+};
+
+class RpcServerTest : public testing::Test {
+ protected:
+  using UpdateStream =
+      grpc::ClientReaderWriter<OrderedUpdateBatch, UpdateResponse>;
+
+  void StartServer(std::shared_ptr<FakeClient> client) {
+    service_ = std::make_unique<RpcServer>(client);
+    grpc::ServerBuilder builder;
+    builder.RegisterService(service_.get());
+    server_ = builder.BuildAndStart();
+    stub_ = ClientUpdateService::NewStub(
+        server_->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  void TearDown() override {
+    if (server_) {
+      server_->Shutdown(absl::ToChronoTime(absl::Now() + absl::Seconds(1)));
+      server_->Wait();
+    }
+  }
+
+  // A batch from |source| of updates with sequence numbers |first| onwards.
+  static OrderedUpdateBatch MakeBatch(uint32_t source, uint32_t first,
+                                      int count) {
+    OrderedUpdateBatch batch;
+    batch.set_source_id(source);
+    batch.set_first_sequence_number(first);
+    for (int i = 0; i < count; ++i) {
+      AddRKey* add_rkey = batch.add_updates()->mutable_add_rkey();
+      add_rkey->set_owner_id(source);
+      add_rkey->set_rkey(first + i);
+    }
+    return batch;
+  }
+
+  std::unique_ptr<RpcServer> service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<ClientUpdateService::Stub> stub_;
+};
+
+TEST_F(RpcServerTest, StreamReordersBatches) {
+  auto client = std::make_shared<FakeClient>();
+  StartServer(client);
+  grpc::ClientContext context;
+  std::unique_ptr<UpdateStream> stream = stub_->StreamUpdates(&context);
+  ASSERT_TRUE(stream->Write(MakeBatch(/*source=*/3, /*first=*/2, 2)));
+  ASSERT_TRUE(stream->Write(MakeBatch(/*source=*/3, /*first=*/5, 1)));
+  ASSERT_TRUE(stream->Write(MakeBatch(/*source=*/3, /*first=*/0, 2)));
+  ASSERT_TRUE(stream->Write(MakeBatch(/*source=*/3, /*first=*/4, 1)));
+  ASSERT_TRUE(stream->WritesDone());
+  ASSERT_TRUE(stream->Finish().ok());
+  EXPECT_THAT(client->received(),
+              ElementsAre(Pair(3, 0), Pair(3, 1), Pair(3, 2), Pair(3, 3),
+                          Pair(3, 4), Pair(3, 5)));
+}
+
+TEST_F(RpcServerTest, BlockedSourceDoesNotStallOtherSources) {
+  auto client = std::make_shared<FakeClient>(/*blocked_source=*/0);
+  StartServer(client);
+  grpc::ClientContext blocked_context;
+  std::unique_ptr<UpdateStream> blocked =
+      stub_->StreamUpdates(&blocked_context);
+  ASSERT_TRUE(blocked->Write(MakeBatch(/*source=*/0, /*first=*/0, 1)));
+
+  grpc::ClientContext context;
+  std::unique_ptr<UpdateStream> stream = stub_->StreamUpdates(&context);
+  ASSERT_TRUE(stream->Write(MakeBatch(/*source=*/1, /*first=*/0, 2)));
+  ASSERT_TRUE(stream->WritesDone());
+  ASSERT_TRUE(stream->Finish().ok());
+  // Source 1 is delivered while source 0 is still waiting on the client.
+  ASSERT_TRUE(client->WaitForReceived(2, absl::Seconds(10)));
+  EXPECT_THAT(client->received(), ElementsAre(Pair(1, 0), Pair(1, 1)));
+
+  client->Unblock();
+  ASSERT_TRUE(blocked->WritesDone());
+  ASSERT_TRUE(blocked->Finish().ok());
+  EXPECT_THAT(client->received(),
+              ElementsAre(Pair(1, 0), Pair(1, 1), Pair(0, 0)));
+}
+
+}  // namespace
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -25,9 +25,11 @@
 
 #include "glog/logging.h"
 #include "absl/random/discrete_distribution.h"
+#include "absl/random/distributions.h"
 #include "absl/random/random.h"
 #include "absl/types/span.h"
 #include "infiniband/verbs.h"
+#include "public/page_size.h"
 #include "public/rdma_memblock.h"
 #include "public/verbs_util.h"
 #include "random_walk/internal/random_walk_config.pb.h"
@@ -36,29 +38,75 @@
 namespace rdma_unit_test {
 namespace random_walk {
 
+RandomWalkSampler::RandomWalkSampler(const MemoryEnvelope& envelope)
+    : min_mr_size_(envelope.min_mr_bytes()),
+      min_mw_size_(envelope.min_mw_bytes()),
+      op_sizes_(envelope.op_bytes().begin(), envelope.op_bytes().end()),
+      rc_send_recv_buffer_size_(envelope.rc_send_recv_bytes()),
+      ud_send_recv_payload_size_(envelope.ud_send_recv_payload_bytes()) {
+  uint64_t page_size = envelope.use_hugepages() ? kHugepageSize : kPageSize;
+  ground_memory_size_ =
+      (envelope.ground_memory_bytes() + page_size - 1) / page_size * page_size;
+  max_mr_size_ = envelope.max_mr_bytes() == 0
+                     ? ground_memory_size_
+                     : std::min(envelope.max_mr_bytes(), ground_memory_size_);
+  if (op_sizes_.empty()) {
+    op_sizes_.assign(kDefaultOpSizes.begin(), kDefaultOpSizes.end());
+  }
+  std::vector<double> op_size_weights(envelope.op_size_weights().begin(),
+                                      envelope.op_size_weights().end());
+  if (op_size_weights.empty()) {
+    op_size_weights.assign(op_sizes_.size(), 1);
+  }
+  CHECK_EQ(op_size_weights.size(), op_sizes_.size());  // Crash ok
+  op_size_distribution_ = absl::discrete_distribution<size_t>(
+      op_size_weights.begin(), op_size_weights.end());
+
+  // Every MW is carved out of an MR and every MR out of the ground memory.
+  CHECK_LE(min_mr_size_, max_mr_size_);  // Crash ok
+  CHECK_LE(min_mw_size_, min_mr_size_);  // Crash ok
+  // Atomics need an aligned 8 byte word in any MR or MW.
+  CHECK_GE(min_mw_size_, 16ul);  // Crash ok
+  // Reads and writes target any MR or MW of the peer.
+  for (uint64_t op_size : op_sizes_) {
+    CHECK_GT(op_size, 0ul);           // Crash ok
+    CHECK_LE(op_size, min_mw_size_);  // Crash ok
+  }
+  CHECK_GT(rc_send_recv_buffer_size_, 0ul);           // Crash ok
+  CHECK_LE(rc_send_recv_buffer_size_, min_mr_size_);  // Crash ok
+  CHECK_GT(ud_send_recv_payload_size_, 0ul);          // Crash ok
+  CHECK_LE(ud_send_recv_payload_size_ + sizeof(ibv_grh),  // Crash ok
+           min_mr_size_);
+}
+
 RdmaMemBlock RandomWalkSampler::RandomMrRdmaMemblock(
     const RdmaMemBlock& memblock) const {
-  DCHECK_LE(kMinMrSize, memblock.size());
-  uint64_t size =
-      absl::Uniform(bitgen_, kMinMrSize, std::min(kMaxMrSize, memblock.size()));
+  DCHECK_LE(min_mr_size_, memblock.size());
+  uint64_t size = absl::Uniform(bitgen_, min_mr_size_,
+                                std::min(max_mr_size_, memblock.size()));
   uint64_t offset = absl::Uniform(bitgen_, 0ul, memblock.size() - size);
   return memblock.subblock(offset, size);
 }
 
 absl::Span<uint8_t> RandomWalkSampler::RandomMwSpan(ibv_mr* mr) const {
-  DCHECK_GE(mr->length, kMinMwSize);
-  uint64_t size = absl::Uniform(bitgen_, kMinMwSize, mr->length);
+  DCHECK_GE(mr->length, min_mw_size_);
+  uint64_t size = absl::Uniform(bitgen_, min_mw_size_, mr->length);
   uint64_t offset = absl::Uniform(bitgen_, 0ul, mr->length - size);
   uint8_t* addr = reinterpret_cast<uint8_t*>(mr->addr) + offset;
   return absl::MakeSpan(addr, size);
 }
 
+uint64_t RandomWalkSampler::RandomOpSize() const {
+  return op_sizes_[op_size_distribution_(bitgen_)];
+}
+
 std::pair<std::vector<absl::Span<uint8_t>>, uint8_t*>
 RandomWalkSampler::RandomRdmaBuffersPair(ibv_mr* local_mr,
                                          uint64_t remote_memory_addr,
                                          uint64_t remote_memory_length,
                                          size_t max_buffers) const {
-  uint64_t length = kOpSizes[absl::Uniform(bitgen_, 0ul, kOpSizes.size())];
+  uint64_t length = RandomOpSize();
+  DCHECK_LE(length, remote_memory_length);
   std::vector<absl::Span<uint8_t>> buffers =
       CreateLocalBuffers(local_mr, length, max_buffers);
   uint64_t remote_offset =
@@ -85,20 +133,20 @@ uint8_t* RandomWalkSampler::RandomAtomicAddr(void* addr,
 
 std::vector<absl::Span<uint8_t>> RandomWalkSampler::RandomRcSendRecvSpans(
     ibv_mr* mr, size_t max_buffers) {
-  DCHECK_GE(mr->length, kRcSendRecvBufferSize);
-  return CreateLocalBuffers(mr, kRcSendRecvBufferSize, max_buffers);
+  DCHECK_GE(mr->length, rc_send_recv_buffer_size_);
+  return CreateLocalBuffers(mr, rc_send_recv_buffer_size_, max_buffers);
 }
 
 std::vector<absl::Span<uint8_t>> RandomWalkSampler::RandomUdSendSpans(
     ibv_mr* mr, size_t max_buffers) {
-  DCHECK_GE(mr->length, kUdSendRecvPayloadSize);
-  return CreateLocalBuffers(mr, kUdSendRecvPayloadSize, max_buffers);
+  DCHECK_GE(mr->length, ud_send_recv_payload_size_);
+  return CreateLocalBuffers(mr, ud_send_recv_payload_size_, max_buffers);
 }
 
 std::vector<absl::Span<uint8_t>> RandomWalkSampler::RandomUdRecvSpans(
     ibv_mr* mr, size_t max_buffers) {
-  DCHECK_GE(mr->length, kUdSendRecvPayloadSize + sizeof(ibv_grh));
-  return CreateLocalBuffers(mr, kUdSendRecvPayloadSize + sizeof(ibv_grh),
+  DCHECK_GE(mr->length, ud_send_recv_payload_size_ + sizeof(ibv_grh));
+  return CreateLocalBuffers(mr, ud_send_recv_payload_size_ + sizeof(ibv_grh),
                             max_buffers);
 }
 
@@ -130,23 +178,84 @@ std::vector<absl::Span<uint8_t>> RandomWalkSampler::CreateLocalBuffers(
   return buffers;
 }
 
-ActionSampler::ActionSampler(const ActionWeights& weights)
-    : action_weights_(weights) {}
-
-Action ActionSampler::RandomAction() const {
-  std::vector<double> weight_vector;
-  std::vector<Action> label_vector;
+ActionSampler::ActionSampler(const ActionWeights& weights) {
+  SetWeights(weights);
+}
 
-  for (auto action : kActions) {
-    weight_vector.push_back(GetActionWeight(action));
-    label_vector.push_back(action);
+void ActionSampler::SetWeights(const ActionWeights& weights) {
+  action_weights_ = weights;
+  for (Action action : kActions) {
+    weights_[static_cast<size_t>(action)] = GetActionWeight(action);
   }
+  table_mask_ = kNoTable;
+}
 
-  absl::discrete_distribution<int> dist(weight_vector.begin(),
-                                        weight_vector.end());
-  int result = dist(bitgen_);
+Action ActionSampler::RandomAction() { return RandomAction(kAllActions); }
 
-  return label_vector[result];
+Action ActionSampler::RandomAction(ActionMask viable) {
+  if (viable != table_mask_) {
+    if (!BuildAliasTable(viable)) {
+      CHECK(BuildAliasTable(kAllActions))  // Crash ok
+          << "All action weights are zero.";
+    }
+    table_mask_ = viable;
+  }
+  size_t column = absl::Uniform<size_t>(bitgen_, 0, kActions.size());
+  if (absl::Uniform<double>(bitgen_, 0, 1) < probability_[column]) {
+    return static_cast<Action>(column);
+  }
+  return static_cast<Action>(alias_[column]);
+}
+
+bool ActionSampler::BuildAliasTable(ActionMask mask) {
+  constexpr size_t kNumActions = kActions.size();
+  double total = 0;
+  for (size_t i = 0; i < kNumActions; ++i) {
+    if (mask & (ActionMask{1} << i)) {
+      total += weights_[i];
+    }
+  }
+  if (total <= 0) {
+    return false;
+  }
+  // Scale the weights so they average 1, then pair each column below 1 with
+  // one above 1 which tops it up.
+  std::array<double, kNumActions> scaled;
+  std::array<uint8_t, kNumActions> small, large;
+  size_t num_small = 0, num_large = 0;
+  for (size_t i = 0; i < kNumActions; ++i) {
+    scaled[i] =
+        (mask & (ActionMask{1} << i)) ? weights_[i] * kNumActions / total : 0;
+    if (scaled[i] < 1) {
+      small[num_small++] = i;
+    } else {
+      large[num_large++] = i;
+    }
+  }
+  while (num_small > 0 && num_large > 0) {
+    uint8_t less = small[--num_small];
+    uint8_t more = large[--num_large];
+    probability_[less] = scaled[less];
+    alias_[less] = more;
+    scaled[more] -= 1 - scaled[less];
+    if (scaled[more] < 1) {
+      small[num_small++] = more;
+    } else {
+      large[num_large++] = more;
+    }
+  }
+  // Whatever is left is 1 up to rounding error.
+  while (num_large > 0) {
+    uint8_t column = large[--num_large];
+    probability_[column] = 1;
+    alias_[column] = column;
+  }
+  while (num_small > 0) {
+    uint8_t column = small[--num_small];
+    probability_[column] = 1;
+    alias_[column] = column;
+  }
+  return true;
 }
 
 double ActionSampler::GetActionWeight(Action action) const {
@@ -17,6 +17,7 @@
 #ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SAMPLING_H_
 #define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SAMPLING_H_
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
@@ -28,11 +29,11 @@
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/container/internal/hash_function_defaults.h"
+#include "absl/random/discrete_distribution.h"
 #include "absl/random/random.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "infiniband/verbs.h"
-#include "public/page_size.h"
 #include "public/rdma_memblock.h"
 #include "public/verbs_util.h"
 #include "random_walk/internal/random_walk_config.pb.h"
@@ -47,28 +48,29 @@ namespace random_walk {
 // The class provides helper functions for sampling random command parameters.
 class RandomWalkSampler {
  public:
-  // The size of the ground memory, i.e. the memory from which MR are allcoated
-  // and register, in pages and bytes.
-  static constexpr uint64_t kGroundMemoryPages = 4 * 1024;
-  static constexpr uint64_t kGroundMemorySize =
-      kGroundMemoryPages * kPageSize;  // 16MB
-  static constexpr uint64_t kRcSendRecvBufferSize = 16 * 1024;
-  static constexpr uint64_t kUdSendRecvPayloadSize = 1000;  // sub-MTU for UD.
-  // Mr sizes is uniformly random in [kMinMrSize, kMaxMrSize].
-  static constexpr uint64_t kMinMrSize = 1024 * 1024;
-  static constexpr uint64_t kMaxMrSize = kGroundMemorySize;
-  // Mw sizes is uniformly random in [kMinMwSize, Size of MR it is in].
-  static constexpr uint64_t kMinMwSize = 1024 * 1024;
-  // RDMA op size is chosen randomly from the elements in the list kOpSizes.
-  static constexpr std::array<uint64_t, 4> kOpSizes = {32 * 1024, 64 * 1024,
-                                                       128 * 1024, 1024 * 1024};
-
-  RandomWalkSampler() = default;
+  // RDMA op sizes used when MemoryEnvelope::op_bytes is empty.
+  static constexpr std::array<uint64_t, 4> kDefaultOpSizes = {
+      32 * 1024, 64 * 1024, 128 * 1024, 1024 * 1024};
+
+  // Crashes if the sizes in |envelope| are inconsistent, e.g. an op size
+  // which does not fit in the smallest MW.
+  explicit RandomWalkSampler(const MemoryEnvelope& envelope = {});
   // Copyable.
   RandomWalkSampler(const RandomWalkSampler& sampler) = default;
   RandomWalkSampler& operator=(const RandomWalkSampler& sampler) = default;
   ~RandomWalkSampler() = default;
 
+  // The size of the ground memory, rounded up to whole (huge)pages.
+  uint64_t ground_memory_size() const { return ground_memory_size_; }
+  // The largest RDMA op size.
+  uint64_t max_op_size() const {
+    return *std::max_element(op_sizes_.begin(), op_sizes_.end());
+  }
+  // The total length of a RC send/recv.
+  uint64_t rc_send_recv_buffer_size() const {
+    return rc_send_recv_buffer_size_;
+  }
+
   // Returns a uniformly random element from an absl::flat_hash_set.
   template <class Type,
             class Hash = absl::container_internal::hash_default_hash<Type>,
@@ -141,6 +143,9 @@ class RandomWalkSampler {
   // Returns a randomly generated absl::Span inside the range of a Mr.
   absl::Span<uint8_t> RandomMwSpan(ibv_mr* mr) const;
 
+  // Returns the length of a RDMA op, drawn from the op size distribution.
+  uint64_t RandomOpSize() const;
+
   // Returns a pair consisting of a vector of local buffers and a remote pointer
   // for RDMA.
   std::pair<std::vector<absl::Span<uint8_t>>, uint8_t*> RandomRdmaBuffersPair(
@@ -174,6 +179,14 @@ class RandomWalkSampler {
                                                       size_t total_length,
                                                       size_t max_buffers) const;
 
+  uint64_t ground_memory_size_;
+  uint64_t min_mr_size_;
+  uint64_t max_mr_size_;
+  uint64_t min_mw_size_;
+  std::vector<uint64_t> op_sizes_;
+  uint64_t rc_send_recv_buffer_size_;
+  uint64_t ud_send_recv_payload_size_;
+  mutable absl::discrete_distribution<size_t> op_size_distribution_;
   mutable absl::BitGen bitgen_;
 };
 
@@ -188,14 +201,34 @@ class ActionSampler {
   ActionSampler& operator=(const ActionSampler& sampler) = default;
   ~ActionSampler() = default;
 
+  // Replaces the weights of all actions, effective from the next draw.
+  void SetWeights(const ActionWeights& action_weights);
+
   // Returns a random action.
-  Action RandomAction() const;
+  Action RandomAction();
+  // Returns a random action out of |viable|, with probabilities proportional
+  // to the actions' weights. Falls back to all actions if no action in
+  // |viable| has a positive weight.
+  Action RandomAction(ActionMask viable);
 
  private:
   double GetActionWeight(Action action) const;
+  // Builds the alias table over the actions in |mask| (Vose's method).
+  // Returns false, leaving the table untouched, if their weights sum to 0.
+  bool BuildAliasTable(ActionMask mask);
 
-  mutable absl::BitGen bitgen_;
-  const ActionWeights action_weights_;
+  absl::BitGen bitgen_;
+  ActionWeights action_weights_;
+  // Indexed by Action.
+  std::array<double, kActions.size()> weights_;
+  // An alias table for the weights masked by |table_mask_|. Draw a uniform
+  // column i and keep it with probability probability_[i], otherwise take
+  // alias_[i]. The table is rebuilt, in O(number of actions), only when the
+  // mask of viable actions changes.
+  static constexpr ActionMask kNoTable = ~kAllActions;
+  ActionMask table_mask_ = kNoTable;
+  std::array<double, kActions.size()> probability_;
+  std::array<uint8_t, kActions.size()> alias_;
 };
 
 // StreamSampler performs Reservoir Sampling in a stream of objects to produce
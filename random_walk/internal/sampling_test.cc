@@ -0,0 +1,145 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/sampling.h"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+#include "gtest/gtest.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/message.h"
+#include "random_walk/internal/random_walk_config.pb.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+namespace {
+
+class ActionSamplerTest : public testing::Test {
+ protected:
+  static constexpr int kDraws = 200000;
+
+  // ActionWeights with every weight zero. The proto defaults are not.
+  static ActionWeights ZeroWeights() {
+    ActionWeights weights;
+    const google::protobuf::Descriptor* descriptor = weights.GetDescriptor();
+    const google::protobuf::Reflection* reflection = weights.GetReflection();
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+      reflection->SetFloat(&weights, descriptor->field(i), 0);
+    }
+    return weights;
+  }
+
+  // Draws kDraws actions out of |viable| and counts each action.
+  static std::array<int, kActions.size()> Draw(ActionSampler& sampler,
+                                               ActionMask viable) {
+    std::array<int, kActions.size()> counts = {};
+    for (int i = 0; i < kDraws; ++i) {
+      ++counts[static_cast<size_t>(sampler.RandomAction(viable))];
+    }
+    return counts;
+  }
+
+  // Expects |count| draws of an action with probability |p| out of kDraws,
+  // within five standard deviations.
+  static void ExpectFrequency(Action action, int count, double p) {
+    double expected = kDraws * p;
+    double tolerance = 5 * std::sqrt(kDraws * p * (1 - p)) + 1;
+    EXPECT_NEAR(count, expected, tolerance)
+        << "Action " << static_cast<int>(action);
+  }
+};
+
+TEST_F(ActionSamplerTest, FrequenciesFollowWeights) {
+  ActionWeights weights = ZeroWeights();
+  weights.set_send(1);
+  weights.set_recv(2);
+  weights.set_write(3);
+  weights.set_read(4);
+  weights.set_create_cq(0.5);
+  ActionSampler sampler(weights);
+  std::array<int, kActions.size()> counts = Draw(sampler, kAllActions);
+  constexpr double kTotal = 10.5;
+  ExpectFrequency(Action::SEND, counts[static_cast<size_t>(Action::SEND)],
+                  1 / kTotal);
+  ExpectFrequency(Action::RECV, counts[static_cast<size_t>(Action::RECV)],
+                  2 / kTotal);
+  ExpectFrequency(Action::WRITE, counts[static_cast<size_t>(Action::WRITE)],
+                  3 / kTotal);
+  ExpectFrequency(Action::READ, counts[static_cast<size_t>(Action::READ)],
+                  4 / kTotal);
+  ExpectFrequency(Action::CREATE_CQ,
+                  counts[static_cast<size_t>(Action::CREATE_CQ)],
+                  0.5 / kTotal);
+  // Zero-weight actions are never drawn.
+  for (Action action : kActions) {
+    if (action != Action::SEND && action != Action::RECV &&
+        action != Action::WRITE && action != Action::READ &&
+        action != Action::CREATE_CQ) {
+      EXPECT_EQ(counts[static_cast<size_t>(action)], 0)
+          << "Action " << static_cast<int>(action);
+    }
+  }
+}
+
+TEST_F(ActionSamplerTest, MaskRenormalizesWeights) {
+  ActionWeights weights = ZeroWeights();
+  weights.set_send(1);
+  weights.set_recv(1);
+  weights.set_write(2);
+  ActionSampler sampler(weights);
+  std::array<int, kActions.size()> counts =
+      Draw(sampler, ActionBit(Action::RECV) | ActionBit(Action::WRITE) |
+                        ActionBit(Action::DESTROY_QP));
+  EXPECT_EQ(counts[static_cast<size_t>(Action::SEND)], 0);
+  EXPECT_EQ(counts[static_cast<size_t>(Action::DESTROY_QP)], 0);
+  ExpectFrequency(Action::RECV, counts[static_cast<size_t>(Action::RECV)],
+                  1.0 / 3);
+  ExpectFrequency(Action::WRITE, counts[static_cast<size_t>(Action::WRITE)],
+                  2.0 / 3);
+}
+
+TEST_F(ActionSamplerTest, FallsBackToAllActionsWhenMaskHasNoWeight) {
+  ActionWeights weights = ZeroWeights();
+  weights.set_send(1);
+  weights.set_write(1);
+  ActionSampler sampler(weights);
+  std::array<int, kActions.size()> counts =
+      Draw(sampler, ActionBit(Action::READ));
+  EXPECT_EQ(counts[static_cast<size_t>(Action::READ)], 0);
+  ExpectFrequency(Action::SEND, counts[static_cast<size_t>(Action::SEND)],
+                  0.5);
+  ExpectFrequency(Action::WRITE, counts[static_cast<size_t>(Action::WRITE)],
+                  0.5);
+}
+
+TEST_F(ActionSamplerTest, SetWeightsRebuildsTable) {
+  ActionWeights weights = ZeroWeights();
+  weights.set_send(1);
+  ActionSampler sampler(weights);
+  EXPECT_EQ(sampler.RandomAction(), Action::SEND);
+  weights.set_send(0);
+  weights.set_fetch_add(1);
+  sampler.SetWeights(weights);
+  std::array<int, kActions.size()> counts = Draw(sampler, kAllActions);
+  EXPECT_EQ(counts[static_cast<size_t>(Action::FETCH_ADD)], kDraws);
+}
+
+}  // namespace
+}  // namespace random_walk
+}  // namespace rdma_unit_test
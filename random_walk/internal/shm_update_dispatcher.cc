@@ -0,0 +1,85 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/shm_update_dispatcher.h"
+
+#include <sched.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "glog/logging.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "public/map_util.h"
+#include "random_walk/internal/client_update_service.pb.h"
+#include "random_walk/internal/shm_update_region.h"
+#include "random_walk/internal/types.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+ShmUpdateDispatcher::ShmUpdateDispatcher(ClientId owner_id)
+    : owner_id_(owner_id) {}
+
+void ShmUpdateDispatcher::RegisterRemoteUpdateHandler(
+    ClientId client_id, const std::string& handler_addr) {
+  std::unique_ptr<ShmUpdateRegion> region =
+      ShmUpdateRegion::Attach(handler_addr);
+  CHECK_LT(owner_id_, region->num_rings())  // Crash ok
+      << "Remote handler has no ring reserved for client " << owner_id_;
+  map_util::InsertOrDie(remotes_, client_id, std::move(region));
+}
+
+void ShmUpdateDispatcher::DispatchUpdate(ClientUpdate update) {
+  CHECK(update.SerializeToString(&scratch_));  // Crash ok
+  if (update.has_destination_id()) {
+    auto iter = remotes_.find(update.destination_id());
+    DCHECK(iter != remotes_.end());
+    SendSerialized(*iter->second);
+  } else {
+    for (auto& [client_id, region] : remotes_) {
+      // The sender applies its own broadcasts.
+      if (client_id != owner_id_) {
+        SendSerialized(*region);
+      }
+    }
+  }
+}
+
+void ShmUpdateDispatcher::SendSerialized(ShmUpdateRegion& region) {
+  ShmRing ring = region.ring(owner_id_);
+  absl::Span<const uint8_t> record(
+      reinterpret_cast<const uint8_t*>(scratch_.data()), scratch_.size());
+  if (!ring.TryWrite(record)) {
+    absl::Time deadline = absl::Now() + kRingFullTimeout;
+    do {
+      // Make sure the consumer is awake to make room.
+      region.Ring();
+      sched_yield();
+      CHECK(absl::Now() < deadline)  // Crash ok
+          << "Timed out waiting for space in a shared memory ring.";
+    } while (!ring.TryWrite(record));
+  }
+  region.Ring();
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_DISPATCHER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_DISPATCHER_H_
+
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/time/time.h"
+#include "random_walk/internal/client_update_service.pb.h"
+#include "random_walk/internal/shm_update_region.h"
+#include "random_walk/internal/types.h"
+#include "random_walk/internal/update_dispatcher_interface.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// The class responsible for dispatching ClientUpdates from a RandomWalkClient
+// to other RandomWalkClients through the shared memory rings of their
+// ShmUpdateHandlers. The remote clients may live in other processes on the same
+// host. Each update is serialized once and copied into the ring reserved for
+// the owning client in every destination's region.
+class ShmUpdateDispatcher : public UpdateDispatcherInterface {
+ public:
+  // How long DispatchUpdate() waits for space in a full ring before aborting.
+  static constexpr absl::Duration kRingFullTimeout = absl::Seconds(10);
+
+  ShmUpdateDispatcher() = delete;
+  explicit ShmUpdateDispatcher(ClientId owner_id);
+  // Movable but not copyable.
+  ShmUpdateDispatcher(ShmUpdateDispatcher&& dispatcher) = default;
+  ShmUpdateDispatcher& operator=(ShmUpdateDispatcher&& dispatcher) = default;
+  ShmUpdateDispatcher(const ShmUpdateDispatcher& dispatcher) = delete;
+  ShmUpdateDispatcher& operator=(const ShmUpdateDispatcher& dispatcher) =
+      delete;
+  ~ShmUpdateDispatcher() override = default;
+
+  // Registers the address of a remote ShmUpdateHandler. All ClientUpdate
+  // targetting [client_id] will be written to the region at [handler_addr].
+  void RegisterRemoteUpdateHandler(ClientId client_id,
+                                   const std::string& handler_addr);
+
+  // Implements UpdateDispatcherInterface.
+  void DispatchUpdate(ClientUpdate update) override;
+
+ private:
+  // Writes the serialized update in scratch_ to |region|.
+  void SendSerialized(ShmUpdateRegion& region);
+
+  // The Id of the RandomWalkClient owning the dispatcher.
+  ClientId owner_id_;
+  // Maps remote RandomWalkClient's Id to its handler's region.
+  absl::flat_hash_map<ClientId, std::unique_ptr<ShmUpdateRegion>> remotes_;
+  // Reused serialization buffer.
+  std::string scratch_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_DISPATCHER_H_
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/shm_update_handler.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "glog/logging.h"
+#include "absl/types/span.h"
+#include "random_walk/internal/client_update_service.pb.h"
+#include "random_walk/internal/inbound_update_interface.h"
+#include "random_walk/internal/shm_update_region.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+ShmUpdateHandler::ShmUpdateHandler(
+    std::shared_ptr<InboundUpdateInterface> client, size_t num_senders)
+    : client_(client),
+      region_(ShmUpdateRegion::Create(num_senders, kRingBytes)),
+      poller_([this]() { PollLoop(); }) {}
+
+ShmUpdateHandler::~ShmUpdateHandler() {
+  stop_.store(true, std::memory_order_release);
+  region_->Ring();
+  poller_.join();
+}
+
+std::string ShmUpdateHandler::GetAddress() const { return region_->path(); }
+
+void ShmUpdateHandler::PollLoop() {
+  // Bounds the number of records taken from one ring per pass so a busy
+  // sender cannot starve the others.
+  constexpr size_t kMaxRecordsPerRing = 64;
+  ClientUpdate update;
+  auto deliver = [&](absl::Span<const uint8_t> record) {
+    CHECK(update.ParseFromArray(record.data(), record.size()))  // Crash ok
+        << "Corrupted ClientUpdate in shared memory ring.";
+    client_->PushInboundUpdate(std::move(update));
+  };
+  while (!stop_.load(std::memory_order_acquire)) {
+    uint32_t sequence = region_->DoorbellSequence();
+    size_t drained = 0;
+    for (size_t i = 0; i < region_->num_rings(); ++i) {
+      ShmRing ring = region_->ring(i);
+      for (size_t count = 0; count < kMaxRecordsPerRing; ++count) {
+        if (!ring.TryRead(deliver)) {
+          break;
+        }
+        ++drained;
+      }
+    }
+    if (drained == 0) {
+      region_->Wait(sequence, kPollTimeout);
+    }
+  }
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_HANDLER_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_HANDLER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+
+#include "absl/time/time.h"
+#include "random_walk/internal/inbound_update_interface.h"
+#include "random_walk/internal/shm_update_region.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// This is a RAII class that receives ClientUpdates through shared memory. It
+// owns a ShmUpdateRegion with one ring per remote ShmUpdateDispatcher and a
+// thread which drains the rings into the client, sleeping on the region's
+// futex doorbell while all rings are empty. Updates from each dispatcher are
+// delivered in the order they were dispatched.
+class ShmUpdateHandler {
+ public:
+  // The size of each per-sender ring.
+  static constexpr size_t kRingBytes = 256 * 1024;
+  // How long the polling thread sleeps before rechecking for shutdown.
+  static constexpr absl::Duration kPollTimeout = absl::Milliseconds(100);
+
+  ShmUpdateHandler() = delete;
+  // Creates a handler accepting updates from clients with ids in
+  // [0, num_senders).
+  ShmUpdateHandler(std::shared_ptr<InboundUpdateInterface> client,
+                   size_t num_senders);
+  // Neither movable nor copyable.
+  ShmUpdateHandler(ShmUpdateHandler&& handler) = delete;
+  ShmUpdateHandler& operator=(ShmUpdateHandler&& handler) = delete;
+  ShmUpdateHandler(const ShmUpdateHandler& handler) = delete;
+  ShmUpdateHandler& operator=(const ShmUpdateHandler& handler) = delete;
+  ~ShmUpdateHandler();
+
+  // Returns the path ShmUpdateDispatchers attach to, valid in any process on
+  // this host for the lifetime of the handler.
+  std::string GetAddress() const;
+
+ private:
+  // Drains all rings into client_ until stop_ is set.
+  void PollLoop();
+
+  const std::shared_ptr<InboundUpdateInterface> client_;
+  const std::unique_ptr<ShmUpdateRegion> region_;
+  std::atomic<bool> stop_{false};
+  std::thread poller_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_HANDLER_H_
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "random_walk/internal/shm_update_region.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include "glog/logging.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+namespace {
+
+constexpr uint64_t kRegionMagic = 0x524457414c4b5348;  // "RDWALKSH"
+
+}  // namespace
+
+// The control block at the start of the region, followed by |num_rings|
+// (ShmRing::Header, data) pairs.
+struct ShmUpdateRegion::RegionHeader {
+  uint64_t magic;
+  uint64_t num_rings;
+  uint64_t ring_bytes;
+  // Futex word bumped by producers on every Ring().
+  alignas(64) std::atomic<uint32_t> doorbell;
+  // Number of consumers sleeping in Wait(), so Ring() can skip the syscall.
+  std::atomic<uint32_t> waiters;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared memory rings need address-free atomics.");
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "Shared memory doorbell needs address-free atomics.");
+
+bool ShmRing::TryWrite(absl::Span<const uint8_t> record) {
+  CHECK_LE(record.size(), max_record_size());  // Crash ok
+  size_t record_size = RecordSize(record.size());
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  uint64_t head = header_->head.load(std::memory_order_acquire);
+  size_t offset = tail & (size_ - 1);
+  size_t to_end = size_ - offset;
+  bool wrap = record_size > to_end;
+  size_t needed = record_size + (wrap ? to_end : 0);
+  if (size_ - (tail - head) < needed) {
+    return false;
+  }
+  if (wrap) {
+    uint32_t marker = kWrapMarker;
+    memcpy(data_ + offset, &marker, sizeof(marker));
+    tail += to_end;
+    offset = 0;
+  }
+  uint32_t length = record.size();
+  memcpy(data_ + offset, &length, sizeof(length));
+  memcpy(data_ + offset + sizeof(length), record.data(), record.size());
+  header_->tail.store(tail + record_size, std::memory_order_release);
+  return true;
+}
+
+uint32_t ShmRing::LoadLength(size_t offset) const {
+  uint32_t length;
+  memcpy(&length, data_ + offset, sizeof(length));
+  return length;
+}
+
+std::unique_ptr<ShmUpdateRegion> ShmUpdateRegion::Create(size_t num_rings,
+                                                         size_t ring_bytes) {
+  CHECK_GT(num_rings, 0ul);                      // Crash ok
+  CHECK_EQ(ring_bytes & (ring_bytes - 1), 0ul);  // Crash ok
+  size_t stride = sizeof(ShmRing::Header) + ring_bytes;
+  size_t length = sizeof(RegionHeader) + num_rings * stride;
+  int fd = memfd_create("random_walk_updates", MFD_CLOEXEC);
+  CHECK_GE(fd, 0) << "memfd_create failed (" << errno << ").";  // Crash ok
+  CHECK_EQ(ftruncate(fd, length), 0)  // Crash ok
+      << "ftruncate failed (" << errno << ").";
+  void* base =
+      mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  CHECK(base != MAP_FAILED) << "mmap failed (" << errno << ").";  // Crash ok
+  // The memfd is zero filled, which is a valid initial state for every atomic
+  // in the region.
+  auto* header = static_cast<RegionHeader*>(base);
+  header->num_rings = num_rings;
+  header->ring_bytes = ring_bytes;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = kRegionMagic;
+  return std::unique_ptr<ShmUpdateRegion>(
+      new ShmUpdateRegion(fd, base, length));
+}
+
+std::unique_ptr<ShmUpdateRegion> ShmUpdateRegion::Attach(
+    const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  CHECK_GE(fd, 0) << "Cannot open " << path << " (" << errno  // Crash ok
+                  << ").";
+  struct stat stat_buf;
+  CHECK_EQ(fstat(fd, &stat_buf), 0);  // Crash ok
+  size_t length = stat_buf.st_size;
+  CHECK_GE(length, sizeof(RegionHeader));  // Crash ok
+  void* base =
+      mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  CHECK(base != MAP_FAILED) << "mmap failed (" << errno << ").";  // Crash ok
+  auto* header = static_cast<RegionHeader*>(base);
+  CHECK_EQ(header->magic, kRegionMagic);  // Crash ok
+  std::atomic_thread_fence(std::memory_order_acquire);
+  CHECK_EQ(length, sizeof(RegionHeader) +  // Crash ok
+                       header->num_rings *
+                           (sizeof(ShmRing::Header) + header->ring_bytes));
+  return std::unique_ptr<ShmUpdateRegion>(
+      new ShmUpdateRegion(fd, base, length));
+}
+
+ShmUpdateRegion::ShmUpdateRegion(int fd, void* base, size_t length)
+    : fd_(fd),
+      base_(base),
+      length_(length),
+      header_(static_cast<RegionHeader*>(base)) {}
+
+ShmUpdateRegion::~ShmUpdateRegion() {
+  munmap(base_, length_);
+  close(fd_);
+}
+
+std::string ShmUpdateRegion::path() const {
+  return absl::StrCat("/proc/", getpid(), "/fd/", fd_);
+}
+
+size_t ShmUpdateRegion::num_rings() const { return header_->num_rings; }
+
+ShmRing ShmUpdateRegion::ring(size_t index) {
+  CHECK_LT(index, header_->num_rings);  // Crash ok
+  uint8_t* ring_base = static_cast<uint8_t*>(base_) + sizeof(RegionHeader) +
+                       index * (sizeof(ShmRing::Header) + header_->ring_bytes);
+  return ShmRing(reinterpret_cast<ShmRing::Header*>(ring_base),
+                 ring_base + sizeof(ShmRing::Header), header_->ring_bytes);
+}
+
+uint32_t ShmUpdateRegion::DoorbellSequence() const {
+  return header_->doorbell.load(std::memory_order_acquire);
+}
+
+void ShmUpdateRegion::Ring() {
+  header_->doorbell.fetch_add(1, std::memory_order_seq_cst);
+  if (header_->waiters.load(std::memory_order_seq_cst) > 0) {
+    syscall(SYS_futex, &header_->doorbell, FUTEX_WAKE, INT32_MAX, nullptr,
+            nullptr, 0);
+  }
+}
+
+void ShmUpdateRegion::Wait(uint32_t sequence, absl::Duration timeout) {
+  timespec ts = absl::ToTimespec(timeout);
+  header_->waiters.fetch_add(1, std::memory_order_seq_cst);
+  // Returns immediately with EAGAIN if the doorbell moved past |sequence|.
+  syscall(SYS_futex, &header_->doorbell, FUTEX_WAIT, sequence, &ts, nullptr,
+          0);
+  header_->waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
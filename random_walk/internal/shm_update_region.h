@@ -0,0 +1,141 @@
+/*
+ * Copyright 2021 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_REGION_H_
+#define THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_REGION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+
+// A single-producer/single-consumer ring of variable length records living in
+// shared memory. ShmRing is a view; the memory is owned by ShmUpdateRegion.
+// Each record is a 4-byte length followed by the payload, padded to 8 bytes.
+// A record never straddles the end of the ring: when it does not fit in the
+// remaining space the producer writes a wrap marker and continues at offset 0.
+class ShmRing {
+ public:
+  // The control block at the start of each ring. Head and tail are monotonic
+  // byte counters and live on separate cache lines.
+  struct Header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+  };
+
+  ShmRing(Header* header, uint8_t* data, size_t size)
+      : header_(header), data_(data), size_(size) {}
+
+  // Copies |record| into the ring. Returns false if there is not enough free
+  // space. Must only be called by the producer.
+  bool TryWrite(absl::Span<const uint8_t> record);
+
+  // Hands the oldest record to |fn| and then releases its space. Returns false
+  // if the ring is empty. Must only be called by the consumer.
+  template <typename Fn>
+  bool TryRead(Fn&& fn) {
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    if (head == tail) {
+      return false;
+    }
+    size_t offset = head & (size_ - 1);
+    uint32_t length = LoadLength(offset);
+    if (length == kWrapMarker) {
+      head += size_ - offset;
+      offset = 0;
+      length = LoadLength(offset);
+    }
+    fn(absl::Span<const uint8_t>(data_ + offset + sizeof(uint32_t), length));
+    header_->head.store(head + RecordSize(length), std::memory_order_release);
+    return true;
+  }
+
+  // Returns the largest record the ring accepts.
+  size_t max_record_size() const { return size_ / 2 - sizeof(uint32_t); }
+
+ private:
+  static constexpr uint32_t kWrapMarker = UINT32_MAX;
+
+  static size_t RecordSize(size_t length) {
+    return (sizeof(uint32_t) + length + 7) & ~size_t{7};
+  }
+  uint32_t LoadLength(size_t offset) const;
+
+  Header* const header_;
+  uint8_t* const data_;
+  const size_t size_;
+};
+
+// A memfd-backed shared memory region holding one ShmRing per producer and a
+// futex doorbell the consumer sleeps on. The owner creates the region with
+// Create() and publishes path(); producers in this or any other process on the
+// same host map it with Attach(). Producer |i| must only ever write to ring(i).
+class ShmUpdateRegion {
+ public:
+  // Creates a region with |num_rings| rings of |ring_bytes| bytes each.
+  // |ring_bytes| must be a power of two.
+  static std::unique_ptr<ShmUpdateRegion> Create(size_t num_rings,
+                                                 size_t ring_bytes);
+  // Maps the region published at |path| by the creating process.
+  static std::unique_ptr<ShmUpdateRegion> Attach(const std::string& path);
+
+  // Neither movable nor copyable.
+  ShmUpdateRegion(ShmUpdateRegion&& region) = delete;
+  ShmUpdateRegion& operator=(ShmUpdateRegion&& region) = delete;
+  ShmUpdateRegion(const ShmUpdateRegion& region) = delete;
+  ShmUpdateRegion& operator=(const ShmUpdateRegion& region) = delete;
+  ~ShmUpdateRegion();
+
+  // Returns a path under which other processes can Attach() to the region for
+  // as long as this object is alive.
+  std::string path() const;
+
+  size_t num_rings() const;
+  ShmRing ring(size_t index);
+
+  // Returns the current doorbell sequence. A consumer reads it before checking
+  // the rings so a Ring() in between makes the following Wait() return
+  // immediately.
+  uint32_t DoorbellSequence() const;
+  // Notifies the consumer that new records are available.
+  void Ring();
+  // Sleeps until Ring() is called after |sequence| was read, or |timeout|
+  // elapses.
+  void Wait(uint32_t sequence, absl::Duration timeout);
+
+ private:
+  struct RegionHeader;
+
+  ShmUpdateRegion(int fd, void* base, size_t length);
+
+  const int fd_;
+  void* const base_;
+  const size_t length_;
+  RegionHeader* const header_;
+};
+
+}  // namespace random_walk
+}  // namespace rdma_unit_test
+
+#endif  // THIRD_PARTY_RDMA_UNIT_TEST_RANDOM_WALK_INTERNAL_SHM_UPDATE_REGION_H_
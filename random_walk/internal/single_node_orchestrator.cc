@@ -21,11 +21,17 @@
 #include <thread>  // NOLINT
 #include <vector>
 
+#include "glog/logging.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "infiniband/verbs.h"
 #include "public/verbs_helper_suite.h"
 #include "public/verbs_util.h"
+#include "random_walk/internal/client_metrics.h"
 #include "random_walk/internal/loopback_update_dispatcher.h"
+#include "random_walk/internal/metrics_reporter.h"
 #include "random_walk/internal/random_walk_client.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/types.h"
@@ -33,15 +39,34 @@
 namespace rdma_unit_test {
 namespace random_walk {
 
+namespace {
+
+constexpr absl::Duration kStartBarrierPollInterval = absl::Milliseconds(1);
+
+}  // namespace
+
 SingleNodeOrchestrator::SingleNodeOrchestrator(size_t num_clients,
-                                               const ActionWeights& weights) {
+                                               const RandomWalkConfig& config) {
+  absl::Time start = absl::Now();
   clients_.resize(num_clients);
   std::vector<std::shared_ptr<LoopbackUpdateDispatcher>> dispatchers(
       num_clients, nullptr);
+  // Each client opens its own device and pins its own ground memory, so
+  // creating them in parallel hides most of the setup latency.
+  std::vector<std::thread> threads;
   for (ClientId id = 0; id < num_clients; ++id) {
-    clients_[id] = std::make_shared<RandomWalkClient>(id, weights);
-    dispatchers[id] = std::make_shared<LoopbackUpdateDispatcher>();
-    clients_[id]->RegisterUpdateDispatcher(dispatchers[id]);
+    threads.emplace_back([&, id]() {
+      clients_[id] = std::make_shared<RandomWalkClient>(id, config,
+                                                         num_clients);
+      dispatchers[id] = std::make_shared<LoopbackUpdateDispatcher>(
+          id, [client = clients_[id].get()]() {
+            client->FlushInboundUpdateQueue();
+          });
+      clients_[id]->RegisterUpdateDispatcher(dispatchers[id]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
   }
 
   for (ClientId local_id = 0; local_id < num_clients; ++local_id) {
@@ -51,26 +76,65 @@ SingleNodeOrchestrator::SingleNodeOrchestrator(size_t num_clients,
       dispatchers[local_id]->RegisterRemote(remote_id, clients_[remote_id]);
     }
   }
+  construction_time_ = absl::Now() - start;
 }
 
 void SingleNodeOrchestrator::RunClients(absl::Duration duration) {
-  std::vector<std::thread> client_threads;
+  BootstrapAndRun([duration](RandomWalkClient& client) {
+    client.Run(duration);
+  });
+}
+
+void SingleNodeOrchestrator::RunClients(size_t steps) {
+  BootstrapAndRun([steps](RandomWalkClient& client) { client.Run(steps); });
+}
+
+ClientStats SingleNodeOrchestrator::AggregatedStats() const {
+  ClientStats stats;
   for (const auto& client : clients_) {
-    client_threads.emplace_back([&]() { return client->Run(duration); });
-  }
-  for (auto& client : client_threads) {
-    client.join();
+    client->ExportStats(stats);
   }
+  return stats;
 }
 
-void SingleNodeOrchestrator::RunClients(size_t steps) {
+template <typename RunFn>
+void SingleNodeOrchestrator::BootstrapAndRun(RunFn run) {
+  absl::Time start = absl::Now();
+  absl::BlockingCounter bootstrapped(clients_.size());
+  absl::Notification start_walk;
   std::vector<std::thread> client_threads;
   for (const auto& client : clients_) {
-    client_threads.emplace_back([&]() { return client->Run(steps); });
+    client_threads.emplace_back([&]() {
+      client->BootstrapRandomWalk();
+      bootstrapped.DecrementCount();
+      // Bootstrapping broadcasts updates, keep applying them until everyone is
+      // ready.
+      while (!start_walk.WaitForNotificationWithTimeout(
+          kStartBarrierPollInterval)) {
+        client->FlushInboundUpdateQueue();
+      }
+      run(*client);
+    });
+  }
+  bootstrapped.Wait();
+  absl::Time walk_start = absl::Now();
+  std::unique_ptr<MetricsReporter> reporter;
+  if (report_interval_ > absl::ZeroDuration()) {
+    std::vector<const ClientMetrics*> metrics;
+    for (const auto& client : clients_) {
+      metrics.push_back(&client->metrics());
+    }
+    reporter = std::make_unique<MetricsReporter>(metrics, report_interval_);
   }
+  start_walk.Notify();
   for (auto& client : client_threads) {
     client.join();
   }
+  reporter.reset();
+  LOG(INFO) << "Setup took " << construction_time_ + (walk_start - start)
+            << " (construction " << construction_time_ << ", bootstrap "
+            << walk_start - start << "), random walk took "
+            << absl::Now() - walk_start << ".";
 }
 
 }  // namespace random_walk
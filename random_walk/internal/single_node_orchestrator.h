@@ -23,17 +23,21 @@
 
 #include "absl/time/time.h"
 #include "infiniband/verbs.h"
+#include "random_walk/internal/metrics_reporter.h"
 #include "random_walk/internal/random_walk_client.h"
 #include "random_walk/internal/random_walk_config.pb.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
 
 // The class creates and coordinates multiple RandomWalkClients on multiple
-// nodes, one per client, to perform a RDMA random walk.
+// nodes, one per client, to perform a RDMA random walk. Clients are created
+// and bootstrapped concurrently, and all of them start walking at the same
+// time once every client is bootstrapped.
 class SingleNodeOrchestrator {
  public:
-  SingleNodeOrchestrator(size_t num_clients, const ActionWeights& weights);
+  SingleNodeOrchestrator(size_t num_clients, const RandomWalkConfig& config);
   // Movable but not copyable.
   SingleNodeOrchestrator(SingleNodeOrchestrator&& orch) = default;
   SingleNodeOrchestrator& operator=(SingleNodeOrchestrator&& orch) = default;
@@ -42,6 +46,12 @@ class SingleNodeOrchestrator {
       delete;
   ~SingleNodeOrchestrator() = default;
 
+  // Sets how often live metrics of the clients are logged while they run, see
+  // MetricsReporter. A zero |interval| disables reporting.
+  void set_report_interval(absl::Duration interval) {
+    report_interval_ = interval;
+  }
+
   // Runs a Network of RandomWalkClients for a fixed amount of time.
   void RunClients(absl::Duration duration);
 
@@ -49,8 +59,20 @@ class SingleNodeOrchestrator {
   // steps.
   void RunClients(size_t steps);
 
+  // Returns the statistics of every client summed by counter name, see
+  // RandomWalkClient::ExportStats(). Only valid once RunClients() returned.
+  ClientStats AggregatedStats() const;
+
  private:
+  // Bootstraps every client on its own thread, then runs |run| on each of them
+  // once all are bootstrapped.
+  template <typename RunFn>
+  void BootstrapAndRun(RunFn run);
+
   std::vector<std::shared_ptr<RandomWalkClient>> clients_;
+  // Time spent creating and connecting the clients.
+  absl::Duration construction_time_;
+  absl::Duration report_interval_ = kDefaultReportInterval;
 };
 
 }  // namespace random_walk
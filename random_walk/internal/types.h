@@ -91,6 +91,17 @@ constexpr std::array<Action, 25> kActions = {Action::CREATE_CQ,
                                              Action::FETCH_ADD,
                                              Action::COMP_SWAP};
 
+// A set of Actions, one bit per Action value.
+typedef uint32_t ActionMask;
+static_assert(kActions.size() <= 8 * sizeof(ActionMask),
+              "ActionMask too narrow for all actions.");
+
+constexpr ActionMask ActionBit(Action action) {
+  return ActionMask{1} << static_cast<int>(action);
+}
+
+constexpr ActionMask kAllActions = (ActionMask{1} << kActions.size()) - 1;
+
 // Returns a std::string which is the name of the Action.
 std::string ActionToString(const Action& action);
 
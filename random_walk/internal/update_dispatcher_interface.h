@@ -27,8 +27,9 @@ class UpdateDispatcherInterface {
  public:
   virtual ~UpdateDispatcherInterface() = default;
 
-  // Sends out a ClientUpdate to other RandomWalkClients.
-  virtual void DispatchUpdate(const ClientUpdate& update) = 0;
+  // Sends out a ClientUpdate to other RandomWalkClients. An update without a
+  // destination goes to every client but the one dispatching it.
+  virtual void DispatchUpdate(ClientUpdate update) = 0;
 };
 
 }  // namespace random_walk
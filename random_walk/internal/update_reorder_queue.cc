@@ -17,10 +17,12 @@
 #include "random_walk/internal/update_reorder_queue.h"
 
 #include <cstdint>
+#include <utility>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/meta/type_traits.h"
 #include "absl/types/optional.h"
+#include "google/protobuf/repeated_field.h"
 #include "public/map_util.h"
 #include "random_walk/internal/client_update_service.pb.h"
 
@@ -32,13 +34,23 @@ void UpdateReorderQueue::Push(uint32_t sequence_number,
   map_util::InsertOrDie(reorder_queue_, sequence_number, update);
 }
 
+void UpdateReorderQueue::PushBatch(
+    uint32_t first_sequence_number,
+    google::protobuf::RepeatedPtrField<ClientUpdate>& updates) {
+  reorder_queue_.reserve(reorder_queue_.size() + updates.size());
+  uint32_t sequence_number = first_sequence_number;
+  for (ClientUpdate& update : updates) {
+    map_util::InsertOrDie(reorder_queue_, sequence_number++, std::move(update));
+  }
+}
+
 absl::optional<ClientUpdate> UpdateReorderQueue::Pull() {
   auto iter = reorder_queue_.find(next_expected_sequence_number_);
   if (iter == reorder_queue_.end()) {
     return absl::nullopt;
   }
   ++next_expected_sequence_number_;
-  ClientUpdate update = iter->second;
+  ClientUpdate update = std::move(iter->second);
   reorder_queue_.erase(iter);
   return update;
 }
@@ -21,7 +21,9 @@
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/types/optional.h"
+#include "google/protobuf/repeated_field.h"
 #include "random_walk/internal/client_update_service.pb.h"
+
 namespace rdma_unit_test {
 namespace random_walk {
 
@@ -47,6 +49,11 @@ class UpdateReorderQueue {
   // Pushes a new ClientUpdate to the queue.
   void Push(uint32_t sequence_number, const ClientUpdate& update);
 
+  // Pushes a batch of ClientUpdates with consecutive sequence numbers starting
+  // at |first_sequence_number|. The updates are moved out of |updates|.
+  void PushBatch(uint32_t first_sequence_number,
+                 google::protobuf::RepeatedPtrField<ClientUpdate>& updates);
+
   // Pulles the next expected ClientUpdate from the queue. If the ClientUpdate
   // has not yet been Push()-ed yet, return absl::nullopt.
   // The first expected ClientUpdate has sequence_number() = 0.
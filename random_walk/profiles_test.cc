@@ -0,0 +1,53 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "google/protobuf/text_format.h"
+#include "random_walk/internal/random_walk_config.pb.h"
+
+namespace rdma_unit_test {
+namespace random_walk {
+namespace {
+
+// Relative to the runfiles root the test runs from.
+constexpr char kProfilesDir[] = "random_walk/profiles";
+
+TEST(ProfilesTest, EveryProfileParses) {
+  int profiles = 0;
+  for (const std::filesystem::directory_entry& entry :
+       std::filesystem::directory_iterator(kProfilesDir)) {
+    if (entry.path().extension() != ".textproto") {
+      continue;
+    }
+    SCOPED_TRACE(entry.path().string());
+    ++profiles;
+    std::ifstream file(entry.path());
+    ASSERT_TRUE(file.is_open());
+    std::stringstream text;
+    text << file.rdbuf();
+    RandomWalkConfig config;
+    EXPECT_TRUE(google::protobuf::TextFormat::ParseFromString(text.str(),
+                                                              &config));
+  }
+  EXPECT_GT(profiles, 0);
+}
+
+}  // namespace
+}  // namespace random_walk
+}  // namespace rdma_unit_test
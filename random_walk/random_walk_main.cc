@@ -14,13 +14,22 @@
 
 // Initialize absl::Flags before initializing/running unit tests.
 
+#include <cstddef>
 #include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "glog/logging.h"
+#include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
 #include "absl/debugging/failure_signal_handler.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "internal/introspection_mlx4.h"
 #include "internal/introspection_mlx5.h"
@@ -31,6 +40,67 @@
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/single_node_orchestrator.h"
 
+namespace {
+
+int ParseInt(absl::string_view text) {
+  int value;
+  CHECK(absl::SimpleAtoi(text, &value))  // Crash ok
+      << "Invalid number: " << text;
+  return value;
+}
+
+// Parses a CPU list such as "0-3,8" into {0, 1, 2, 3, 8}.
+std::vector<int> ParseCpuList(absl::string_view text) {
+  std::vector<int> cpus;
+  for (absl::string_view range : absl::StrSplit(text, ',', absl::SkipEmpty())) {
+    std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    CHECK_LE(bounds.size(), 2ul)  // Crash ok
+        << "Invalid CPU range: " << range;
+    int first = ParseInt(bounds.front());
+    int last = ParseInt(bounds.back());
+    CHECK_GE(first, 0) << "Invalid CPU range: " << range;  // Crash ok
+    CHECK_LE(first, last)                                   // Crash ok
+        << "Reversed CPU range: " << range;
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+rdma_unit_test::random_walk::WorkerProcessOptions GetWorkerProcessOptions() {
+  rdma_unit_test::random_walk::WorkerProcessOptions options;
+  options.num_processes = absl::GetFlag(FLAGS_processes);
+  for (absl::string_view cpu_list : absl::StrSplit(
+           absl::GetFlag(FLAGS_cpu_sets), ';', absl::SkipEmpty())) {
+    options.cpu_sets.push_back(ParseCpuList(cpu_list));
+  }
+  for (absl::string_view node : absl::StrSplit(
+           absl::GetFlag(FLAGS_numa_nodes), ',', absl::SkipEmpty())) {
+    options.numa_nodes.push_back(ParseInt(node));
+  }
+  return options;
+}
+
+// Loads the RandomWalkConfig named by --config, if any.
+rdma_unit_test::random_walk::RandomWalkConfig LoadConfig() {
+  rdma_unit_test::random_walk::RandomWalkConfig config;
+  std::string path = absl::GetFlag(FLAGS_config);
+  if (path.empty()) {
+    return config;
+  }
+  std::ifstream file(path);
+  CHECK(file.is_open()) << "Cannot open config " << path;  // Crash ok
+  std::stringstream text;
+  text << file.rdbuf();
+  CHECK(google::protobuf::TextFormat::ParseFromString(  // Crash ok
+      text.str(), &config))
+      << "Cannot parse config " << path;
+  return config;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   google::InitGoogleLogging(argv[0]);
   absl::ParseCommandLine(argc, argv);
@@ -42,22 +112,51 @@ int main(int argc, char* argv[]) {
   rdma_unit_test::IntrospectionMlx5::Register();
   rdma_unit_test::IntrospectionRxe::Register();
 
-  rdma_unit_test::random_walk::ActionWeights weights;
+  rdma_unit_test::random_walk::RandomWalkConfig config = LoadConfig();
   if (!rdma_unit_test::Introspection().SupportsType2()) {
+    rdma_unit_test::random_walk::ActionWeights& weights =
+        *config.mutable_action_weights();
     weights.set_allocate_type_2_mw(0);
     weights.set_bind_type_2_mw(0);
     weights.set_deallocate_type_2_mw(0);
   }
-  int clients = absl::GetFlag(FLAGS_clients);
-  int duration = absl::GetFlag(FLAGS_duration);
+  // Flags given on the command line take precedence over the config.
+  if (absl::GetFlag(FLAGS_clients) >= 0) {
+    config.set_clients(absl::GetFlag(FLAGS_clients));
+  }
+  if (absl::GetFlag(FLAGS_duration) >= 0) {
+    config.set_duration_seconds(absl::GetFlag(FLAGS_duration));
+  }
+  if (absl::GetFlag(FLAGS_report_interval) >= 0) {
+    config.set_report_interval_seconds(absl::GetFlag(FLAGS_report_interval));
+  }
+  if (absl::GetFlag(FLAGS_verify_payloads)) {
+    config.set_verify_payloads(true);
+  }
+  int clients = config.clients();
+  int duration = config.duration_seconds();
   bool multinode = absl::GetFlag(FLAGS_multinode);
+  // Worker processes only exist in multinode mode.
+  CHECK(multinode || (absl::GetFlag(FLAGS_processes) == 0 &&  // Crash ok
+                      absl::GetFlag(FLAGS_cpu_sets).empty() &&
+                      absl::GetFlag(FLAGS_numa_nodes).empty()))
+      << "--processes, --cpu_sets and --numa_nodes require --multinode.";
+  absl::Duration report_interval =
+      absl::Seconds(config.report_interval_seconds());
   if (multinode) {
-    rdma_unit_test::random_walk::MultiNodeOrchestrator orchestrator(clients,
-                                                                    weights);
+    using rdma_unit_test::random_walk::MultiNodeOrchestrator;
+    MultiNodeOrchestrator::Transport transport =
+        absl::GetFlag(FLAGS_shm_transport)
+            ? MultiNodeOrchestrator::Transport::kSharedMemory
+            : MultiNodeOrchestrator::Transport::kGrpc;
+    MultiNodeOrchestrator orchestrator(clients, config, transport,
+                                       GetWorkerProcessOptions());
+    orchestrator.set_report_interval(report_interval);
     orchestrator.RunClients(absl::Seconds(duration));
   } else {
     rdma_unit_test::random_walk::SingleNodeOrchestrator orchestrator(clients,
-                                                                     weights);
+                                                                     config);
+    orchestrator.set_report_interval(report_interval);
     orchestrator.RunClients(absl::Seconds(duration));
   }
 
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <cstdint>
+
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 #include "absl/time/time.h"
@@ -21,6 +23,7 @@
 #include "random_walk/internal/multi_node_orchestrator.h"
 #include "random_walk/internal/random_walk_config.pb.h"
 #include "random_walk/internal/single_node_orchestrator.h"
+#include "random_walk/internal/worker_control.pb.h"
 
 namespace rdma_unit_test {
 namespace random_walk {
@@ -36,24 +39,76 @@ class RandomWalkTest : public testing::Test {
 };
 
 TEST_F(RandomWalkTest, SingleNodeTwoClientRandomWalk20Second) {
-  ActionWeights weights;
+  RandomWalkConfig config;
+  ActionWeights& weights = *config.mutable_action_weights();
+  if (!Introspection().SupportsType2()) {
+    weights.set_allocate_type_2_mw(0);
+    weights.set_bind_type_2_mw(0);
+    weights.set_deallocate_type_2_mw(0);
+  }
+  SingleNodeOrchestrator orchestrator(2, config);
+  orchestrator.RunClients(absl::Seconds(20));
+}
+
+TEST_F(RandomWalkTest, SingleNodeTwoClientSmallMessageRandomWalk20Second) {
+  RandomWalkConfig config;
+  ActionWeights& weights = *config.mutable_action_weights();
+  if (!Introspection().SupportsType2()) {
+    weights.set_allocate_type_2_mw(0);
+    weights.set_bind_type_2_mw(0);
+    weights.set_deallocate_type_2_mw(0);
+  }
+  MemoryEnvelope& memory_envelope = *config.mutable_memory_envelope();
+  memory_envelope.set_min_mr_bytes(4096);
+  memory_envelope.set_min_mw_bytes(4096);
+  for (uint64_t op_bytes : {8, 64, 512, 4096}) {
+    memory_envelope.add_op_bytes(op_bytes);
+  }
+  memory_envelope.set_rc_send_recv_bytes(64);
+  memory_envelope.set_ud_send_recv_payload_bytes(64);
+  SingleNodeOrchestrator orchestrator(2, config);
+  orchestrator.RunClients(absl::Seconds(20));
+}
+
+TEST_F(RandomWalkTest, SingleNodeTwoClientVerifiedRandomWalk20Second) {
+  RandomWalkConfig config;
+  ActionWeights& weights = *config.mutable_action_weights();
   if (!Introspection().SupportsType2()) {
     weights.set_allocate_type_2_mw(0);
     weights.set_bind_type_2_mw(0);
     weights.set_deallocate_type_2_mw(0);
   }
-  SingleNodeOrchestrator orchestrator(2, weights);
+  config.set_verify_payloads(true);
+  SingleNodeOrchestrator orchestrator(2, config);
   orchestrator.RunClients(absl::Seconds(20));
+  // Mismatches are only LOG(DFATAL), which does not fail opt builds.
+  ClientStats stats = orchestrator.AggregatedStats();
+  EXPECT_EQ(stats.counters().at("payload_mismatches"), 0);
+  EXPECT_GT(stats.counters().at("verified_payloads"), 0);
 }
 
 TEST_F(RandomWalkTest, MultiNodeTwoClientRandomWalk20Second) {
-  ActionWeights weights;
+  RandomWalkConfig config;
+  ActionWeights& weights = *config.mutable_action_weights();
+  if (!Introspection().SupportsType2()) {
+    weights.set_allocate_type_2_mw(0);
+    weights.set_bind_type_2_mw(0);
+    weights.set_deallocate_type_2_mw(0);
+  }
+  MultiNodeOrchestrator orchestrator(2, config);
+  orchestrator.RunClients(absl::Seconds(20));
+}
+
+TEST_F(RandomWalkTest, MultiNodeSharedMemoryTwoClientRandomWalk20Second) {
+  RandomWalkConfig config;
+  ActionWeights& weights = *config.mutable_action_weights();
   if (!Introspection().SupportsType2()) {
     weights.set_allocate_type_2_mw(0);
     weights.set_bind_type_2_mw(0);
     weights.set_deallocate_type_2_mw(0);
   }
-  MultiNodeOrchestrator orchestrator(2, weights);
+  MultiNodeOrchestrator orchestrator(
+      2, config, MultiNodeOrchestrator::Transport::kSharedMemory);
   orchestrator.RunClients(absl::Seconds(20));
 }
 